@@ -0,0 +1,146 @@
+//! Random 4 KiB reads from one file: io_uring vs thread pool fallback vs blocking pread().
+//!
+//! Usage: cgull-io-throughput [file_size_mib = 64] [queue_depth = 32] [seconds = 2]
+
+#include <cgull/event_loop_handler.h>
+#include <cgull/io.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+namespace
+{
+    constexpr unsigned block_size = 4096;
+
+    using clock_type = std::chrono::steady_clock;
+
+
+    struct bench_config
+    {
+        int         fd;
+        uint64_t    blocks;
+        unsigned    depth;
+        double      seconds;
+    };
+
+
+    void report(const char* name, uint64_t ops, clock_type::duration elapsed)
+    {
+        const auto s = std::chrono::duration<double>(elapsed).count();
+
+        printf("%-12s %10.0f ops/s  %8.1f MiB/s\n", name, ops / s, ops * double(block_size) / s / (1 << 20));
+    }
+
+
+    void run_blocking(const bench_config& c)
+    {
+        std::vector<char> buffer(block_size);
+        std::mt19937_64 rng{ 1 };
+        uint64_t ops = 0;
+
+        const auto start = clock_type::now();
+        const auto until = start + std::chrono::duration<double>(c.seconds);
+
+        while(clock_type::now() < until)
+        {
+            for(int i = 0; i < 256; ++i, ++ops)
+                if(pread(c.fd, buffer.data(), block_size, off_t(rng() % c.blocks) * block_size) != block_size)
+                    abort();
+        };
+
+        report("blocking", ops, clock_type::now() - start);
+    }
+
+
+    //! Keeps \a depth reads in flight, every completion issues the next one.
+    void run_async(const char* name, const bench_config& c, bool fallback)
+    {
+        cgull::event_loop_handler loop;
+        cgull::io::context ctx{ loop, { .entries = 256, .force_fallback = fallback } };
+
+        std::vector<char> buffers(size_t(c.depth) * block_size);
+        std::mt19937_64 rng{ 1 };
+        uint64_t ops = 0;
+        unsigned in_flight = 0;
+        bool stopping = false;
+
+        const auto start = clock_type::now();
+        const auto until = start + std::chrono::duration<double>(c.seconds);
+
+        std::function<void(unsigned)> issue = [&](unsigned slot)
+        {
+            ++in_flight;
+
+            cgull::io::read(ctx, c.fd, buffers.data() + size_t(slot) * block_size, block_size, int64_t(rng() % c.blocks) * block_size)
+                .then([&, slot](int r)
+                {
+                    if(r != block_size)
+                        abort();
+
+                    --in_flight;
+                    ++ops;
+
+                    if(!stopping && (ops % 1024 || clock_type::now() < until))
+                        return issue(slot);
+
+                    stopping = true;
+
+                    if(!in_flight)
+                        loop.stop();
+                });
+        };
+
+        for(unsigned i = 0; i < c.depth; ++i)
+            issue(i);
+
+        loop.run();
+
+        report(name, ops, clock_type::now() - start);
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    const uint64_t size = (argc > 1 ? strtoull(argv[1], nullptr, 10) : 64) << 20;
+    const unsigned depth = argc > 2 ? unsigned(strtoul(argv[2], nullptr, 10)) : 32;
+    const double seconds = argc > 3 ? strtod(argv[3], nullptr) : 2;
+
+    char path[] = "/tmp/cgull_io_bench_XXXXXX";
+    const int fd = mkstemp(path);
+
+    if(fd < 0 || ftruncate(fd, off_t(size)) < 0)
+    {
+        perror("cgull-io-throughput");
+        return 1;
+    };
+
+    unlink(path);
+
+    // touch every page, so all methods read from page cache
+    std::vector<char> fill(1 << 20, 'c');
+
+    for(uint64_t off = 0; off < size; off += fill.size())
+        if(pwrite(fd, fill.data(), fill.size(), off_t(off)) < 0)
+            return 1;
+
+    const bench_config c{ fd, size / block_size, depth, seconds };
+
+    printf("file %llu MiB, depth %u, %.1f s each\n", (unsigned long long)(size >> 20), depth, seconds);
+
+    run_blocking(c);
+    run_async("thread pool", c, true);
+    run_async("io_uring", c, false);
+
+    close(fd);
+
+    return 0;
+}
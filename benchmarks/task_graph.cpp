@@ -0,0 +1,76 @@
+//! Random DAG of tiny tasks on thread pool: the first run (with compilation) vs reused runs.
+//!
+//! Usage: cgull-task-graph [nodes = 100000] [edges_per_node = 2] [runs = 10] [threads = hw]
+
+#include <cgull/task_graph.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+
+
+namespace
+{
+    using clock_type = std::chrono::steady_clock;
+
+
+    void report(const char* name, size_t tasks, clock_type::duration elapsed)
+    {
+        const auto s = std::chrono::duration<double>(elapsed).count();
+
+        printf("%-12s %10.0f tasks/s  %8.2f ms\n", name, tasks / s, s * 1000);
+    }
+
+
+    clock_type::duration run_once(cgull::task_graph& graph, cgull::thread_pool_handler& pool)
+    {
+        const auto start = clock_type::now();
+
+        if(graph.run(pool).wait() != cgull::resolved)
+            abort();
+
+        return clock_type::now() - start;
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    const size_t nodes = argc > 1 ? strtoull(argv[1], nullptr, 10) : 100000;
+    const size_t edges = argc > 2 ? strtoull(argv[2], nullptr, 10) : 2;
+    const int runs = argc > 3 ? atoi(argv[3]) : 10;
+    const size_t threads = argc > 4 ? strtoull(argv[4], nullptr, 10) : std::thread::hardware_concurrency();
+
+    cgull::thread_pool_handler pool{ threads };
+    cgull::task_graph graph;
+    std::atomic<uint64_t> sink = 0;
+    std::mt19937_64 rng{ 1 };
+
+    graph.reserve(nodes, nodes * edges);
+
+    for(size_t i = 0; i < nodes; ++i)
+        graph.add_node([&sink, i]{ sink.fetch_add(i, std::memory_order::relaxed); });
+
+    // edges go only forward, so graph is acyclic
+    for(size_t i = 1; i < nodes; ++i)
+        for(size_t e = 0; e < edges; ++e)
+            graph.add_edge(cgull::task_graph::node_id(rng() % i), cgull::task_graph::node_id(i));
+
+    printf("%zu nodes, %zu edges, %zu threads\n", graph.size(), graph.edge_count(), pool.size());
+
+    report("first", nodes, run_once(graph, pool));
+
+    clock_type::duration total{};
+
+    for(int r = 0; r < runs; ++r)
+        total += run_once(graph, pool);
+
+    report("reused", nodes, total / std::max(1, runs));
+
+    return 0;
+}
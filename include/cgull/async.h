@@ -1,6 +1,12 @@
 #pragma once
 
 #include "promise.h"
+#include "trace_log.h"
+#include "guts/function_traits.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <unordered_map>
 
 
 CGULL_NAMESPACE_START
@@ -79,9 +85,13 @@ struct async
 
         promise result;
 
+        CGULL_DEBUG_GUTS_PROBE(guts::private_of(result)->debug_note("cgull::async callback");)
+
         const wrapped_callback_type wrappedCallback =
             [r = result]< typename ... _CArgs >(_CArgs&&... args) mutable -> void
             {
+                CGULL_MEMORY_PROBE(guts::private_of(r)->account(memory_accounting::async_store, 0);)
+
                 //! \todo pass many args as tuple
                 r.resolve(std::any{guts::getArg<0>(args...)});
             };
@@ -100,6 +110,8 @@ struct async
 
                 assert(!callback.empty() && "Async callback not found");
 
+                CGULL_METRICS_PROBE(metrics::add(metrics::async_store_removed);)
+
                 try
                 {
                     callback.mapped()(args...);
@@ -119,20 +131,33 @@ struct async
 
         store[key] = wrappedCallback;
 
+        CGULL_METRICS_PROBE(metrics::add(metrics::async_store_added);)
+        CGULL_MEMORY_PROBE(guts::private_of(result)->account(memory_accounting::async_store, sizeof(typename store_type::value_type));)
+
         if constexpr(std::is_void_v< typename traits::result_type >)
         {
             _fn(std::forward<_Args>(args)..., nakedCallback);
 
             if(_fb && _fb(result, std::forward<_Args>(args)..., nullptr))
+            {
                 store.erase(key);
+
+                CGULL_METRICS_PROBE(metrics::add(metrics::async_store_removed);)
+                CGULL_MEMORY_PROBE(guts::private_of(result)->account(memory_accounting::async_store, 0);)
+            };
         }
         else
         {
             auto&& r = _fn(std::forward<_Args>(args)..., nakedCallback);
 
             if(_fb && _fb(result, std::forward<decltype(r)>(r), std::forward<_Args>(args)..., nullptr))
+            {
                 store.erase(key);
 
+                CGULL_METRICS_PROBE(metrics::add(metrics::async_store_removed);)
+                CGULL_MEMORY_PROBE(guts::private_of(result)->account(memory_accounting::async_store, 0);)
+            };
+
             if(_fn_result)
                 *_fn_result = r;
         };
@@ -147,7 +172,7 @@ struct async
 
         auto&& result = _call(guts::return_void_tag{}, &_fn_result, args...);
 
-        std::cout << "result_of_fn=" << _fn_result << '\n';
+        CGULL_LOG("async: result_of_fn={}", _fn_result);
 
         return when_all(result, promise{}.resolve(std::move(_fn_result)));
     };
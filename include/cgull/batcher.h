@@ -0,0 +1,236 @@
+#pragma once
+
+#include "config.h"
+
+#if defined(CGULL_OS_LINUX)
+
+#include "promise.h"
+#include "fulfill_scope.h"
+#include "event_loop_handler.h"
+#include "timer_service.h"
+
+#include <stdint.h>
+#include <any>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+
+CGULL_NAMESPACE_START
+
+
+struct batcher_options
+{
+    //! Batch is sent as soon as it has that many keys.
+    size_t                                  max_batch = 128;
+    //! If zero, batch collects keys requested during one loop iteration. Otherwise batch is
+    //! sent after this delay since its first key.
+    std::chrono::steady_clock::duration     max_delay = std::chrono::steady_clock::duration::zero();
+};
+
+
+//! Coalesces single-key loads into batched calls (DataLoader pattern).
+//!
+//! \a load() returns promise for one key right away. Keys are collected and passed to batch
+//! function at once, which must return promise resolved with \a std::vector<_Value> in the
+//! same order. Its values (or its rejection) are fanned out to per-key promises.
+//!
+//! Per-key promises of each batch are allocated in one block of \a max_batch promises and are
+//! owned by the loop, so continuations are called inside it.
+//!
+//! \note Context-local: must be used inside the loop's thread.
+template< typename _Key, typename _Value >
+class batcher
+{
+    CGULL_DISABLE_COPY(batcher);
+    CGULL_DISABLE_MOVE(batcher);
+
+public:
+    using batch_function = std::function<promise(std::vector<_Key> keys)>;
+
+
+    batcher(event_loop_handler& loop, batch_function fn, batcher_options options = {});
+    //! Sends pending keys.
+    ~batcher();
+
+    promise load(_Key key);
+    //! Sends pending keys right now.
+    void flush();
+
+    //! Keys waiting for the next batch.
+    [[nodiscard]]
+    size_t pending() const noexcept;
+    //! Batches sent so far.
+    [[nodiscard]]
+    uint64_t batches() const noexcept;
+
+
+private:
+    struct _batch
+    {
+        std::vector<_Key>                   keys;
+        std::vector<promise_private::type>  targets;
+    };
+
+    event_loop_handler&     _loop;
+    batch_function          _fn;
+    batcher_options         _options;
+    size_t                  _hook = 0;
+    _batch                  _current;
+    uint64_t                _sent = 0;
+    //! Lets delayed flush know that batcher is still alive.
+    std::shared_ptr<batcher*> _self;
+
+
+    static void _fan_out(_batch& b, std::any&& values) noexcept;
+    static void _fail(_batch& b, const std::any& error) noexcept;
+
+};
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+template< typename _Key, typename _Value > inline
+batcher<_Key, _Value>::batcher(event_loop_handler& loop, batch_function fn, batcher_options options)
+    : _loop(loop)
+    , _fn(std::move(fn))
+    , _options(options)
+    , _self(std::make_shared<batcher*>(this))
+{
+    if(!_options.max_batch)
+        _options.max_batch = 1;
+
+    if(_options.max_delay == _options.max_delay.zero())
+        _hook = _loop.before_wait([this]{ flush(); });
+}
+
+
+template< typename _Key, typename _Value > inline
+batcher<_Key, _Value>::~batcher()
+{
+    if(_hook)
+        _loop.remove_hook(_hook);
+
+    flush();
+}
+
+
+template< typename _Key, typename _Value > inline
+promise batcher<_Key, _Value>::load(_Key key)
+{
+    if(_current.keys.empty())
+    {
+        _current.keys.reserve(_options.max_batch);
+        _current.targets = promise_private::allocate_block(_options.max_batch, &_loop);
+
+        if(_options.max_delay != _options.max_delay.zero())
+        {
+            // timer is owned by the loop too, so it's fulfilled inside loop's thread
+            promise timer{ &_loop };
+
+            timer_service::instance().arm(guts::private_of(timer), timer_service::clock::now() + _options.max_delay, std::any{}, resolved);
+
+            timer.then(
+                [self = std::weak_ptr<batcher*>{_self}, sent = _sent]
+                {
+                    // flush only the batch this timer was started for
+                    if(const auto b = self.lock(); b && (*b)->_sent == sent)
+                        (*b)->flush();
+                }
+            );
+        };
+    };
+
+    promise result{ _current.targets[_current.keys.size()] };
+
+    _current.keys.push_back(std::move(key));
+
+    if(_current.keys.size() >= _options.max_batch)
+        flush();
+
+    return result;
+}
+
+
+template< typename _Key, typename _Value > inline
+void batcher<_Key, _Value>::flush()
+{
+    if(_current.keys.empty())
+        return;
+
+    auto b = std::make_shared<_batch>(std::move(_current));
+
+    _current = {};
+    ++_sent;
+
+    // unused promises of the block are released here
+    b->targets.resize(b->keys.size());
+
+    try
+    {
+        _fn(std::move(b->keys))
+            .then([b](std::any values) { _fan_out(*b, std::move(values)); })
+            .rescue([b](std::any error) { _fail(*b, error); });
+    }
+    catch(...)
+    {
+        _fail(*b, std::any{std::current_exception()});
+    };
+}
+
+
+template< typename _Key, typename _Value > inline
+size_t batcher<_Key, _Value>::pending() const noexcept
+{
+    return _current.keys.size();
+}
+
+
+template< typename _Key, typename _Value > inline
+uint64_t batcher<_Key, _Value>::batches() const noexcept
+{
+    return _sent;
+}
+
+
+template< typename _Key, typename _Value > inline
+void batcher<_Key, _Value>::_fan_out(_batch& b, std::any&& values) noexcept
+{
+    auto list = std::any_cast<std::vector<_Value>>(&values);
+
+    if(!list)
+        return _fail(b, std::any{std::make_exception_ptr(std::invalid_argument("cgull: batch function must resolve with std::vector<_Value>"))});
+
+    fulfill_scope scope;
+
+    for(size_t i = 0; i < b.targets.size(); ++i)
+    {
+        if(i < list->size())
+            b.targets[i]->fulfill(std::any{std::move((*list)[i])}, resolved);
+        else
+            b.targets[i]->fulfill(std::any{std::make_exception_ptr(std::out_of_range("cgull: batch function returned too few values"))}, rejected);
+    };
+}
+
+
+template< typename _Key, typename _Value > inline
+void batcher<_Key, _Value>::_fail(_batch& b, const std::any& error) noexcept
+{
+    fulfill_scope scope;
+
+    for(auto& t : b.targets)
+        t->fulfill(std::any{error}, rejected);
+}
+
+
+CGULL_NAMESPACE_END
+
+#endif
@@ -2,4 +2,28 @@
 
 #include "promise.h"
 #include "async.h"
+#include "fulfill_scope.h"
+#include "collections.h"
+#include "singleflight.h"
+#include "promise_cache.h"
+#include "timer_service.h"
+#include "retry.h"
+#include "hedge.h"
+#include "sync.h"
+#include "channel.h"
+#include "stream.h"
+#include "generator.h"
+#include "task_graph.h"
+#include "profiler.h"
+#include "trace.h"
+#include "registry.h"
+#include "metrics.h"
+#include "memory_accounting.h"
+#include "trace_log.h"
+#include "event_loop_handler.h"
+#include "thread_pool_handler.h"
+#include "strand.h"
+#include "numa_pool_handler.h"
+#include "io.h"
+#include "batcher.h"
 #include "guts/function_traits.h"
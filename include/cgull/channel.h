@@ -0,0 +1,496 @@
+#pragma once
+
+#include "config.h"
+#include "promise.h"
+#include "handler.h"
+#include "fulfill_scope.h"
+#include "guts/ring_buffer.h"
+#include "guts/waiter_queue.h"
+
+#include <algorithm>
+#include <any>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+
+CGULL_NAMESPACE_START
+
+
+//! Rejection value of \a channel operations after \a channel::close().
+class channel_closed : public std::runtime_error
+{
+public:
+    channel_closed()
+        : std::runtime_error("cgull: channel is closed")
+    { }
+};
+
+
+//! Bounded asynchronous channel.
+//!
+//! Values are kept in lock-free ring buffer of \a capacity, so as long as it's neither full
+//! nor empty \a send() and \a receive() don't take any lock. Sender pends when buffer is full
+//! and receiver when it's empty, both are served in FIFO order. Memory is bounded by
+//! capacity plus one value per pending sender, so overloaded producer is slowed down
+//! instead of piling continuations up.
+//!
+//! \code
+//! cgull::channel<int> ch{ 64 };
+//!
+//! ch.send(42).then([&]{ return ch.send(43); });
+//! ch.receive().then([](int v){ ... });
+//! \endcode
+//!
+//! Promises are owned by handler passed to the call or, if none, to constructor, so waiters
+//! are resumed inside their handler. Value handed to receiver whose abort was on its way
+//! is put back ahead of pending senders, so it's received after values already buffered.
+//!
+//! \note Thread-safe. Context-local promises are fulfilled by thread which released them.
+template< typename _T >
+class channel : private guts::waiter_owner
+{
+    CGULL_DISABLE_COPY(channel);
+    CGULL_DISABLE_MOVE(channel);
+
+public:
+    explicit
+    channel(size_t capacity, CGULL_NAMESPACE::handler* h = nullptr);
+    //! Aborts pending senders and receivers.
+    ~channel();
+
+    //! \return Promise resolved when \a value is put into buffer, or rejected with
+    //!         \a channel_closed if channel is closed before that.
+    promise send(_T value, CGULL_NAMESPACE::handler* h = nullptr);
+    //! \a value is moved from only on success.
+    bool    try_send(_T& value);
+
+    //! \return Promise resolved with \a _T, or rejected with \a channel_closed when channel
+    //!         is closed and drained.
+    promise receive(CGULL_NAMESPACE::handler* h = nullptr);
+    std::optional<_T> try_receive();
+    //! \return Promise resolved with \a std::vector<_T> of 1 to \a n values as soon as there
+    //!         is at least one.
+    promise receive_many(size_t n, CGULL_NAMESPACE::handler* h = nullptr);
+
+    //! Stops accepting values. Pending senders are rejected, values already in buffer can
+    //! still be received.
+    void    close();
+
+    [[nodiscard]]
+    bool    is_closed() const noexcept;
+    //! Values in buffer, approximate if channel is used concurrently.
+    [[nodiscard]]
+    size_t  size() const noexcept;
+    [[nodiscard]]
+    size_t  capacity() const noexcept;
+
+
+private:
+    struct _sender
+    {
+        _T          value;
+        promise     result;
+    };
+
+    struct _fulfillment
+    {
+        promise_private::type   target;
+        std::any                value;
+        fulfillment_state_t     state;
+    };
+
+    using _fulfillment_list = std::vector<_fulfillment>;
+
+    CGULL_NAMESPACE::handler*   _handler;
+    guts::ring_buffer<_T>       _buffer;
+    std::atomic<bool>           _closed = false;
+
+    //! Lock-free paths check these to know if the other side waits.
+    std::atomic<size_t>         _waiting_receivers = 0;
+    std::atomic<size_t>         _waiting_senders = 0;
+
+    std::mutex                  _mutex;
+    //! Weight 0 is \a receive(), \a n is \a receive_many(n).
+    guts::waiter_queue          _receivers;
+    std::deque<_sender>         _senders;
+    //! Values given back by receivers which missed them, they go to buffer first.
+    std::deque<_T>              _returned;
+
+
+    //! Serves waiters from buffer and buffer from pending senders. Must be called under lock.
+    void _balance(_fulfillment_list& ready);
+    //! Calls \a _balance() if counterpart of lock-free operation may wait.
+    void _notify(const std::atomic<size_t>& waiting);
+    //! Pops up to \a n values into vector. Empty if buffer is.
+    std::vector<_T> _pop_many(size_t n);
+
+    static void _fulfill(_fulfillment_list& ready) noexcept;
+
+    void    refund(std::any&& value, size_t weight) noexcept override;
+
+};
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+template< typename _T > inline
+channel<_T>::channel(size_t capacity, CGULL_NAMESPACE::handler* h)
+    : _handler(h)
+    , _buffer(capacity)
+{ }
+
+
+template< typename _T > inline
+channel<_T>::~channel()
+{
+    for(auto& s : _senders)
+        s.result.abort();
+}
+
+
+template< typename _T > inline
+promise channel<_T>::send(_T value, CGULL_NAMESPACE::handler* h)
+{
+    if(!h)
+        h = _handler;
+
+    if(_closed.load(std::memory_order::acquire))
+        return promise{ h }.reject(std::any{channel_closed{}});
+
+    // pending senders go first
+    if(!_waiting_senders.load(std::memory_order::relaxed) && _buffer.try_push(value))
+    {
+        _notify(_waiting_receivers);
+
+        return promise{ h }.resolve();
+    };
+
+    promise result{ h };
+    _fulfillment_list ready;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        _senders.push_back({ std::move(value), result });
+        _waiting_senders.store(_senders.size() + _returned.size(), std::memory_order::relaxed);
+
+        // pairs with fence in _notify(): either receiver sees this sender or sender sees
+        // the space freed by receiver
+        std::atomic_thread_fence(std::memory_order::seq_cst);
+
+        _balance(ready);
+    };
+
+    _fulfill(ready);
+
+    return result;
+}
+
+
+template< typename _T > inline
+bool channel<_T>::try_send(_T& value)
+{
+    if(_closed.load(std::memory_order::acquire) || _waiting_senders.load(std::memory_order::relaxed))
+        return false;
+
+    if(!_buffer.try_push(value))
+        return false;
+
+    _notify(_waiting_receivers);
+
+    return true;
+}
+
+
+template< typename _T > inline
+promise channel<_T>::receive(CGULL_NAMESPACE::handler* h)
+{
+    if(!h)
+        h = _handler;
+
+    if(!_waiting_receivers.load(std::memory_order::relaxed))
+    {
+        if(auto value = _buffer.try_pop())
+        {
+            _notify(_waiting_senders);
+
+            return promise{ h }.resolve(std::any{std::move(*value)});
+        };
+    };
+
+    promise result;
+    _fulfillment_list ready;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        result = _receivers.push(h, 0);
+        _waiting_receivers.store(_receivers.size(), std::memory_order::relaxed);
+
+        std::atomic_thread_fence(std::memory_order::seq_cst);
+
+        _balance(ready);
+    };
+
+    _fulfill(ready);
+
+    return result;
+}
+
+
+template< typename _T > inline
+std::optional<_T> channel<_T>::try_receive()
+{
+    if(_waiting_receivers.load(std::memory_order::relaxed))
+        return std::nullopt;
+
+    auto value = _buffer.try_pop();
+
+    if(value)
+        _notify(_waiting_senders);
+
+    return value;
+}
+
+
+template< typename _T > inline
+promise channel<_T>::receive_many(size_t n, CGULL_NAMESPACE::handler* h)
+{
+    if(!h)
+        h = _handler;
+
+    if(!n)
+        n = 1;
+
+    if(!_waiting_receivers.load(std::memory_order::relaxed))
+    {
+        if(auto values = _pop_many(n); !values.empty())
+        {
+            _notify(_waiting_senders);
+
+            return promise{ h }.resolve(std::any{std::move(values)});
+        };
+    };
+
+    promise result;
+    _fulfillment_list ready;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        result = _receivers.push(h, n);
+        _waiting_receivers.store(_receivers.size(), std::memory_order::relaxed);
+
+        std::atomic_thread_fence(std::memory_order::seq_cst);
+
+        _balance(ready);
+    };
+
+    _fulfill(ready);
+
+    return result;
+}
+
+
+template< typename _T > inline
+void channel<_T>::close()
+{
+    _fulfillment_list ready;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        if(_closed.exchange(true, std::memory_order::acq_rel))
+            return;
+
+        _balance(ready);
+    };
+
+    _fulfill(ready);
+}
+
+
+template< typename _T > inline
+bool channel<_T>::is_closed() const noexcept
+{
+    return _closed.load(std::memory_order::acquire);
+}
+
+
+template< typename _T > inline
+size_t channel<_T>::size() const noexcept
+{
+    return _buffer.size();
+}
+
+
+template< typename _T > inline
+size_t channel<_T>::capacity() const noexcept
+{
+    return _buffer.capacity();
+}
+
+
+template< typename _T > inline
+void channel<_T>::_balance(_fulfillment_list& ready)
+{
+    for(bool progress = true; progress; )
+    {
+        progress = false;
+
+        for(_receivers.prune(); !_receivers.empty(); _receivers.prune())
+        {
+            std::any value;
+
+            if(!_receivers.front_weight())
+            {
+                auto v = _buffer.try_pop();
+
+                if(!v)
+                    break;
+
+                value = std::move(*v);
+            }
+            else
+            {
+                auto v = _pop_many(_receivers.front_weight());
+
+                if(v.empty())
+                    break;
+
+                value = std::move(v);
+            };
+
+            ready.push_back({ _receivers.pop(this), std::move(value), resolved });
+            progress = true;
+        };
+
+        for(; !_returned.empty() && _buffer.try_push(_returned.front()); progress = true)
+            _returned.pop_front();
+
+        while(_returned.empty() && !_senders.empty())
+        {
+            auto& s = _senders.front();
+
+            // aborted by its owner, value is dropped
+            if(s.result.fulfillment())
+            {
+                _senders.pop_front();
+
+                continue;
+            };
+
+            if(!_buffer.try_push(s.value))
+                break;
+
+            ready.push_back({ guts::private_of(s.result), std::any{}, resolved });
+            _senders.pop_front();
+            progress = true;
+        };
+    };
+
+    if(_closed.load(std::memory_order::acquire))
+    {
+        for(auto& s : _senders)
+            ready.push_back({ guts::private_of(s.result), std::any{channel_closed{}}, rejected });
+
+        _senders.clear();
+
+        // receivers are rejected only when everything is drained
+        if(!_buffer.size() && _returned.empty())
+            while(!_receivers.empty())
+                ready.push_back({ _receivers.pop(), std::any{channel_closed{}}, rejected });
+    };
+
+    _waiting_receivers.store(_receivers.size(), std::memory_order::relaxed);
+    _waiting_senders.store(_senders.size() + _returned.size(), std::memory_order::relaxed);
+}
+
+
+template< typename _T > inline
+void channel<_T>::_notify(const std::atomic<size_t>& waiting)
+{
+    std::atomic_thread_fence(std::memory_order::seq_cst);
+
+    if(!waiting.load(std::memory_order::relaxed))
+        return;
+
+    _fulfillment_list ready;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        _balance(ready);
+    };
+
+    _fulfill(ready);
+}
+
+
+template< typename _T > inline
+std::vector<_T> channel<_T>::_pop_many(size_t n)
+{
+    std::vector<_T> result;
+
+    while(result.size() < n)
+    {
+        auto v = _buffer.try_pop();
+
+        if(!v)
+            break;
+
+        if(result.empty())
+            result.reserve(std::min(n, _buffer.size() + 1));
+
+        result.push_back(std::move(*v));
+    };
+
+    return result;
+}
+
+
+template< typename _T > inline
+void channel<_T>::_fulfill(_fulfillment_list& ready) noexcept
+{
+    if(ready.empty())
+        return;
+
+    fulfill_scope scope;
+
+    for(auto& f : ready)
+        f.target->fulfill(std::move(f.value), f.state);
+}
+
+
+template< typename _T > inline
+void channel<_T>::refund(std::any&& value, size_t weight) noexcept
+{
+    _fulfillment_list ready;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        // weight 0 is single value of receive(), receive_many() got vector
+        if(!weight)
+            _returned.push_back(std::move(*std::any_cast<_T>(&value)));
+        else
+            for(auto& v : *std::any_cast<std::vector<_T>>(&value))
+                _returned.push_back(std::move(v));
+
+        _balance(ready);
+    };
+
+    _fulfill(ready);
+}
+
+
+CGULL_NAMESPACE_END
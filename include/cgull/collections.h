@@ -0,0 +1,425 @@
+#pragma once
+
+#include "config.h"
+#include "promise.h"
+#include "handler.h"
+
+#include <stddef.h>
+#include <any>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <ranges>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+CGULL_NAMESPACE_START
+
+
+//! Options of bulk operations over ranges.
+struct bulk_options
+{
+    //! Max callbacks in flight, i.e. called and not fulfilled yet. 0 means no limit.
+    size_t      concurrency = 0;
+    //! Handler which runs callbacks. If not set, callbacks are called right in place: by caller
+    //! for the first ones and by whoever fulfills previous callback's promise for the rest.
+    CGULL_NAMESPACE::handler* executor = nullptr;
+    //! Handler which owns returned promise, \a executor if not set. Without both returned
+    //! promise is context-local, so \a fn mustn't return promises fulfilled on other threads.
+    CGULL_NAMESPACE::handler* handler = nullptr;
+};
+
+
+//! Calls \a fn for every element of \a range with at most \a options.concurrency calls in
+//! flight. \a fn may return value or \a promise.
+//!
+//! Returned promise is resolved with \a std::vector<_Result> in range order or rejected with
+//! the first rejection (value thrown by \a fn is passed as \a std::exception_ptr). Nothing is
+//! started after rejection. \a _Result is deduced from \a fn or is \a std::any for
+//! promise-returning \a fn.
+//!
+//! Only \a concurrency calls are kept in flight, so nothing is allocated per element up front
+//! and results are written right into their final places.
+//!
+//! \note \a range must stay alive until returned promise is fulfilled.
+//! \note \a _Result must be default constructible.
+template< typename _Result = void, std::ranges::forward_range _Range, typename _Fn >
+promise map(_Range& range, _Fn&& fn, bulk_options options = {});
+
+//! \a map() with concurrency 1.
+template< typename _Result = void, std::ranges::forward_range _Range, typename _Fn >
+promise map_series(_Range& range, _Fn&& fn, handler* executor = nullptr);
+
+//! Calls \a fn for every element of \a range for side effects only.
+//! Returned promise is resolved with nothing.
+//! \sa map()
+template< std::ranges::forward_range _Range, typename _Fn >
+promise each(_Range& range, _Fn&& fn, bulk_options options = {});
+
+//! Resolves with \a std::vector of copies of elements for which \a fn returned (or resolved
+//! with) true.
+//! \sa map()
+template< std::ranges::forward_range _Range, typename _Fn >
+promise filter(_Range& range, _Fn&& fn, bulk_options options = {});
+
+//! Folds \a range one element at a time: \a fn(acc, element) returns next \a acc or
+//! \a promise resolved with it. Resolves with final \a acc.
+//! \note \a options.concurrency is ignored.
+//! \sa map()
+template< std::ranges::forward_range _Range, typename _Fn, typename _Acc >
+promise reduce(_Range& range, _Fn&& fn, _Acc initial, bulk_options options = {});
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+CGULL_GUTS_NAMESPACE_START
+
+
+//! Calls \a call and passes its result to \a done (value or \a std::any for promise) or
+//! error to \a fail.
+template< typename _Call, typename _Done, typename _Fail > inline
+void bulk_invoke(_Call&& call, _Done done, _Fail fail) noexcept
+{
+    using result_type = std::decay_t<std::invoke_result_t<_Call>>;
+
+    try
+    {
+        if constexpr(std::is_same_v<result_type, promise>)
+        {
+            call()
+                .then([done](std::any value) mutable { done(std::move(value)); })
+                .rescue([fail](std::any error) mutable { fail(std::move(error)); });
+        }
+        else if constexpr(std::is_void_v<result_type>)
+        {
+            call();
+
+            done(std::any{});
+        }
+        else
+        {
+            done(call());
+        };
+    }
+    catch(...)
+    {
+        fail(std::any{std::current_exception()});
+    };
+}
+
+
+//! Converts callback's result to \a _T taking it out of \a std::any if needed.
+template< typename _T, typename _Value > inline
+_T bulk_take(_Value&& value)
+{
+    if constexpr(std::is_same_v<std::decay_t<_Value>, std::any> && !std::is_same_v<_T, std::any>)
+        return std::any_cast<_T>(std::move(value));
+    else
+        return static_cast<_T>(std::forward<_Value>(value));
+}
+
+
+template< typename _Result >
+struct map_sink
+{
+    std::vector<_Result> results;
+
+    void init(size_t count) { results.resize(count); }
+
+    template< typename _Fn, typename _Element >
+    decltype(auto) call(_Fn& fn, _Element&& element) { return std::invoke(fn, std::forward<_Element>(element)); }
+
+    template< typename _Value >
+    void store(size_t index, _Value&& value) { results[index] = bulk_take<_Result>(std::forward<_Value>(value)); }
+
+    template< typename _Iterator >
+    std::any finish(_Iterator) { return std::any{std::move(results)}; }
+};
+
+
+struct each_sink
+{
+    void init(size_t) { }
+
+    template< typename _Fn, typename _Element >
+    decltype(auto) call(_Fn& fn, _Element&& element) { return std::invoke(fn, std::forward<_Element>(element)); }
+
+    template< typename _Value >
+    void store(size_t, _Value&&) { }
+
+    template< typename _Iterator >
+    std::any finish(_Iterator) { return std::any{}; }
+};
+
+
+template< typename _Element >
+struct filter_sink
+{
+    std::vector<bool> passed;
+
+    void init(size_t count) { passed.resize(count); }
+
+    template< typename _Fn, typename _Arg >
+    decltype(auto) call(_Fn& fn, _Arg&& element) { return std::invoke(fn, std::forward<_Arg>(element)); }
+
+    template< typename _Value >
+    void store(size_t index, _Value&& value) { passed[index] = bulk_take<bool>(std::forward<_Value>(value)); }
+
+    template< typename _Iterator >
+    std::any finish(_Iterator it)
+    {
+        std::vector<_Element> results;
+
+        for(const bool p : passed)
+        {
+            if(p)
+                results.push_back(*it);
+
+            ++it;
+        };
+
+        return std::any{std::move(results)};
+    }
+};
+
+
+//! \note Called with concurrency 1 only, so accumulator isn't shared.
+template< typename _Acc >
+struct reduce_sink
+{
+    _Acc acc;
+
+    void init(size_t) { }
+
+    template< typename _Fn, typename _Element >
+    decltype(auto) call(_Fn& fn, _Element&& element) { return std::invoke(fn, std::move(acc), std::forward<_Element>(element)); }
+
+    template< typename _Value >
+    void store(size_t, _Value&& value) { acc = bulk_take<_Acc>(std::forward<_Value>(value)); }
+
+    template< typename _Iterator >
+    std::any finish(_Iterator) { return std::any{std::move(acc)}; }
+};
+
+
+//! Shared state of bulk operation. Keeps up to \a limit calls in flight and starts next one
+//! on every completion.
+template< typename _Iterator, typename _Fn, typename _Sink >
+class bulk_state : public std::enable_shared_from_this<bulk_state<_Iterator, _Fn, _Sink>>
+{
+public:
+    bulk_state(_Iterator first, size_t total, _Fn&& fn, _Sink&& sink, bulk_options options)
+        : _first(first)
+        , _next(first)
+        , _total(total)
+        , _limit(options.concurrency)
+        , _executor(options.executor)
+        , _fn(std::move(fn))
+        , _sink(std::move(sink))
+        , _result(options.handler ? options.handler : options.executor)
+    {
+        _sink.init(total);
+    }
+
+    promise start()
+    {
+        auto result = _result;
+
+        if(!_total)
+            _result.resolve(_sink.finish(_first));
+        else
+            _pump();
+
+        return result;
+    }
+
+
+private:
+    std::mutex      _mutex;
+    _Iterator       _first;
+    _Iterator       _next;
+    size_t          _next_index = 0;
+    size_t          _total;
+    size_t          _limit;
+    size_t          _in_flight = 0;
+    size_t          _completed = 0;
+    bool            _pumping = false;
+    bool            _failed = false;
+    handler*        _executor;
+    _Fn             _fn;
+    _Sink           _sink;
+    promise         _result;
+
+
+    //! Starts calls while there are free slots. Calls completed synchronously meanwhile are
+    //! picked up by the same loop, so there is no recursion.
+    void _pump()
+    {
+        std::unique_lock lock{ _mutex };
+
+        if(_pumping)
+            return;
+
+        _pumping = true;
+
+        while(!_failed && _next_index < _total && (!_limit || _in_flight < _limit))
+        {
+            const auto index = _next_index++;
+            const auto it = _next++;
+
+            ++_in_flight;
+
+            lock.unlock();
+
+            _start(index, it);
+
+            lock.lock();
+        };
+
+        _pumping = false;
+    }
+
+    void _start(size_t index, _Iterator it)
+    {
+        auto run = [self = this->shared_from_this(), index, it]()
+        {
+            bulk_invoke(
+                [&self, &it]() -> decltype(auto) { return self->_sink.call(self->_fn, *it); },
+                [self, index](auto&& value) { self->_complete(index, std::forward<decltype(value)>(value)); },
+                [self](std::any&& error) { self->_fail(std::move(error)); }
+            );
+        };
+
+        if(_executor)
+            _executor->post(std::move(run));
+        else
+            run();
+    }
+
+    template< typename _Value >
+    void _complete(size_t index, _Value&& value)
+    {
+        bool all_completed;
+
+        {
+            std::lock_guard lock{ _mutex };
+
+            if(_failed)
+                return;
+
+            _sink.store(index, std::forward<_Value>(value));
+
+            --_in_flight;
+
+            all_completed = ++_completed == _total;
+        };
+
+        if(all_completed)
+            _result.resolve(_sink.finish(_first));
+        else
+            _pump();
+    }
+
+    void _fail(std::any&& error)
+    {
+        {
+            std::lock_guard lock{ _mutex };
+
+            if(_failed)
+                return;
+
+            _failed = true;
+        };
+
+        _result.reject(std::move(error));
+    }
+
+};
+
+
+template< typename _Range, typename _Fn, typename _Sink > inline
+promise bulk_run(_Range& range, _Fn&& fn, _Sink&& sink, bulk_options options)
+{
+    using iterator = std::ranges::iterator_t<_Range>;
+    using state_type = bulk_state<iterator, std::decay_t<_Fn>, std::decay_t<_Sink>>;
+
+    const auto total = static_cast<size_t>(std::ranges::distance(range));
+
+    return std::make_shared<state_type>(
+        std::ranges::begin(range), total, std::decay_t<_Fn>{std::forward<_Fn>(fn)}, std::forward<_Sink>(sink), options
+    )->start();
+}
+
+
+template< typename _Result, typename _Range, typename _Fn >
+struct map_result
+{
+    using type = _Result;
+};
+
+template< typename _Range, typename _Fn >
+struct map_result<void, _Range, _Fn>
+{
+    using fn_result = std::decay_t<std::invoke_result_t<_Fn&, std::ranges::range_reference_t<_Range>>>;
+
+    using type = std::conditional_t<std::is_same_v<fn_result, promise>, std::any, fn_result>;
+};
+
+
+CGULL_GUTS_NAMESPACE_END
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+template< typename _Result, std::ranges::forward_range _Range, typename _Fn > inline
+promise map(_Range& range, _Fn&& fn, bulk_options options)
+{
+    using result_type = typename guts::map_result<_Result, _Range, std::decay_t<_Fn>>::type;
+
+    static_assert(!std::is_void_v<result_type>, "cgull: map() callback must return something, use each() instead");
+
+    return guts::bulk_run(range, std::forward<_Fn>(fn), guts::map_sink<result_type>{}, options);
+}
+
+
+template< typename _Result, std::ranges::forward_range _Range, typename _Fn > inline
+promise map_series(_Range& range, _Fn&& fn, handler* executor)
+{
+    return map<_Result>(range, std::forward<_Fn>(fn), { .concurrency = 1, .executor = executor });
+}
+
+
+template< std::ranges::forward_range _Range, typename _Fn > inline
+promise each(_Range& range, _Fn&& fn, bulk_options options)
+{
+    return guts::bulk_run(range, std::forward<_Fn>(fn), guts::each_sink{}, options);
+}
+
+
+template< std::ranges::forward_range _Range, typename _Fn > inline
+promise filter(_Range& range, _Fn&& fn, bulk_options options)
+{
+    using element_type = std::ranges::range_value_t<_Range>;
+
+    return guts::bulk_run(range, std::forward<_Fn>(fn), guts::filter_sink<element_type>{}, options);
+}
+
+
+template< std::ranges::forward_range _Range, typename _Fn, typename _Acc > inline
+promise reduce(_Range& range, _Fn&& fn, _Acc initial, bulk_options options)
+{
+    options.concurrency = 1;
+
+    return guts::bulk_run(range, std::forward<_Fn>(fn), guts::reduce_sink<_Acc>{ std::move(initial) }, options);
+}
+
+
+CGULL_NAMESPACE_END
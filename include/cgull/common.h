@@ -8,6 +8,10 @@
 #include <any>
 #include <vector>
 
+#if defined(CGULL_DEBUG_GUTS)
+#   include <source_location>
+#endif
+
 
 CGULL_NAMESPACE_START
 
@@ -41,6 +45,17 @@ enum wait_t : int8_t
     last_bound,
 };
 
+//! Scheduling priority of promise's operations. Handlers without priorities ignore it.
+enum priority_t : uint8_t
+{
+    low_priority = 0,
+    normal_priority,
+    high_priority,
+    critical_priority,
+};
+
+inline constexpr const size_t priority_count = critical_priority + 1;
+
 
 using atomic_fulfillment_state = std::atomic<fulfillment_state_t>;
 using atomic_finish_state = std::atomic<finish_state_t>;
@@ -58,4 +73,55 @@ using any_list = std::vector<std::any>;
 using finisher_t = void(bool is_abort, std::any&& inners_result);
 
 
+//! Priority of promises created and tasks posted by calling thread while scope lives.
+//!
+//! Continuations run inside scope of their promise's priority, so promises they create,
+//! including ones returned by \a cgull::async, carry priority of the chain.
+class priority_scope
+{
+    CGULL_DISABLE_COPY(priority_scope);
+    CGULL_DISABLE_MOVE(priority_scope);
+
+public:
+    explicit
+    priority_scope(priority_t p) noexcept : _previous(_local()) { _local() = p; }
+    ~priority_scope() { _local() = _previous; }
+
+    //! \a normal_priority outside of any scope.
+    static priority_t current() noexcept { return _local(); }
+
+
+private:
+    const priority_t _previous;
+
+
+    static priority_t& _local() noexcept
+    {
+        static thread_local priority_t p = normal_priority;
+
+        return p;
+    }
+
+};
+
+
+CGULL_GUTS_NAMESPACE_START
+
+
+//! Caller's location taken by default argument. Empty unless \a CGULL_DEBUG_GUTS is defined.
+struct creation_site
+{
+#if defined(CGULL_DEBUG_GUTS)
+    creation_site(std::source_location l = std::source_location::current()) noexcept
+        : location(l)
+    { }
+
+    std::source_location location;
+#endif
+};
+
+
+CGULL_GUTS_NAMESPACE_END
+
+
 CGULL_NAMESPACE_END
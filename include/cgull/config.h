@@ -4,7 +4,40 @@
 #include "cgull_export.h"
 
 
-#define CGULL_DEBUG_GUTS
+//! Statements compiled only with \a CGULL_PROFILE, see \a profiler.
+#if defined(CGULL_PROFILE)
+#   define CGULL_PROFILE_PROBE(...) __VA_ARGS__
+#else
+#   define CGULL_PROFILE_PROBE(...)
+#endif
+
+//! Statements compiled only with \a CGULL_METRICS, see \a metrics.
+#if defined(CGULL_METRICS)
+#   define CGULL_METRICS_PROBE(...) __VA_ARGS__
+#else
+#   define CGULL_METRICS_PROBE(...)
+#endif
+
+//! Statements compiled only with \a CGULL_MEMORY_ACCOUNTING, see \a memory_accounting.
+#if defined(CGULL_MEMORY_ACCOUNTING)
+#   define CGULL_MEMORY_PROBE(...) __VA_ARGS__
+#else
+#   define CGULL_MEMORY_PROBE(...)
+#endif
+
+//! Log site of \a trace_log, compiled only with \a CGULL_TRACE_LOG.
+#if defined(CGULL_TRACE_LOG)
+#   define CGULL_LOG(...) ::CGULL_NAMESPACE::trace_log::write(__VA_ARGS__)
+#else
+#   define CGULL_LOG(...) ((void)0)
+#endif
+
+//! Statements compiled only with \a CGULL_DEBUG_GUTS, see \a promise_registry.
+#if defined(CGULL_DEBUG_GUTS)
+#   define CGULL_DEBUG_GUTS_PROBE(...) __VA_ARGS__
+#else
+#   define CGULL_DEBUG_GUTS_PROBE(...)
+#endif
 
 
 #ifndef CGULL_NAMESPACE_START
@@ -20,6 +53,16 @@
 #endif
 
 
+//! Keeps call visible to compiler's new/delete pairing checks.
+#if defined(__GNUC__)
+#   define CGULL_NOINLINE [[gnu::noinline]]
+#elif defined(_MSC_VER)
+#   define CGULL_NOINLINE __declspec(noinline)
+#else
+#   define CGULL_NOINLINE
+#endif
+
+
 #define CGULL_DISABLE_COPY(c)              \
     private:                               \
         c(const c&) = delete;              \
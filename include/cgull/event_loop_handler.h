@@ -0,0 +1,398 @@
+#pragma once
+
+#include "config.h"
+
+#if defined(CGULL_OS_LINUX)
+
+#include "promise_private.h"
+#include "handler.h"
+#include "guts/mpsc_queue.h"
+#include "guts/handler_op.h"
+
+#include <stdint.h>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+CGULL_NAMESPACE_START
+
+
+//! Single-threaded reactor built on epoll + eventfd.
+//!
+//! Operations posted from any thread go to lock-free MPSC queue. Loop is woken up only by the
+//! first operation of each batch and then drains the whole queue, so cross-thread cost is one
+//! eventfd write per batch, not per fulfill. Operations posted from the loop thread itself
+//! don't touch eventfd at all.
+//!
+//! Context is the thread which calls \a run(), \a run_once() or \a poll().
+class event_loop_handler : public handler
+{
+    CGULL_DISABLE_COPY(event_loop_handler);
+    CGULL_DISABLE_MOVE(event_loop_handler);
+
+public:
+    //! Called with epoll events of watched fd.
+    using watch_callback = std::function<void(uint32_t events)>;
+
+
+    event_loop_handler();
+    ~event_loop_handler() override;
+
+    void fulfill(private_type target, std::any&& value, fulfillment_state_t state) override;
+    void try_finish(private_type target) override;
+    void post(task_type&& task) override;
+    void bind_outer(private_type target, private_type outer) override;
+    //! Enqueues all \a ops at once with at most one wakeup.
+    void dispatch(operation_list&& ops) override;
+
+    //! Runs loop until \a stop(). Returns after one iteration if \a stop() was called before, and
+    //! resets it on return, so loop can be run again.
+    //! \return Handled operations count.
+    size_t run();
+    //! Waits for at least one event and handles everything that is ready.
+    //! \return Handled operations count.
+    size_t run_once();
+    //! Handles everything that is ready without blocking.
+    //! \return Handled operations count.
+    size_t poll();
+    //! Makes \a run() return. Thread-safe.
+    void stop() noexcept;
+
+    //! Calls \a callback inside loop on \a events of \a fd.
+    //! \note Context-local.
+    void watch(int fd, uint32_t events, watch_callback&& callback);
+    //! \note Context-local.
+    void unwatch(int fd);
+    //! Calls \a hook in every loop iteration right before waiting for events. Lets batch
+    //! work issued during iteration (i.e. submit all I/O with a single syscall).
+    //! \return Hook id for \a remove_hook().
+    //! \note Context-local.
+    size_t before_wait(task_type&& hook);
+    //! \note Context-local.
+    void remove_hook(size_t id);
+
+    [[nodiscard]]
+    bool stopped() const noexcept;
+
+
+private:
+    using _op = guts::handler_op;
+
+    static constexpr int _max_events = 64;
+
+    int                             _epoll = -1;
+    int                             _event = -1;
+    std::atomic<bool>               _stop = false;
+    std::atomic<std::thread::id>    _owner;
+    guts::mpsc_queue<_op>           _queue;
+    std::unordered_map<int, watch_callback>
+                                    _watches;
+    std::vector<std::pair<size_t, task_type>>
+                                    _hooks;
+    size_t                          _last_hook = 0;
+
+
+    void   _enqueue(_op* op) noexcept;
+    void   _enqueue_list(_op* first) noexcept;
+    void   _wake() noexcept;
+    size_t _drain() noexcept;
+    size_t _run_once(int timeout);
+
+};
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+inline
+event_loop_handler::event_loop_handler()
+{
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    _event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if(_epoll < 0 || _event < 0)
+        throw std::runtime_error("cgull: event_loop_handler can't create epoll or eventfd");
+
+    epoll_event ev{};
+
+    ev.events = EPOLLIN;
+    ev.data.fd = _event;
+
+    epoll_ctl(_epoll, EPOLL_CTL_ADD, _event, &ev);
+}
+
+
+inline
+event_loop_handler::~event_loop_handler()
+{
+    // drop unhandled operations
+    for(auto op = _queue.pop_all(); op; )
+    {
+        auto next = op->next;
+
+        delete op;
+        op = next;
+    };
+
+    close(_event);
+    close(_epoll);
+}
+
+
+inline
+void event_loop_handler::fulfill(private_type target, std::any&& value, fulfillment_state_t state)
+{
+    _enqueue(new _op{ std::move(target), std::forward<decltype(value)>(value), state });
+}
+
+
+inline
+void event_loop_handler::try_finish(private_type target)
+{
+    _enqueue(new _op{ std::move(target) });
+}
+
+
+inline
+void event_loop_handler::post(task_type&& task)
+{
+    _enqueue(new _op{ std::forward<decltype(task)>(task) });
+}
+
+
+inline
+void event_loop_handler::bind_outer(private_type target, private_type outer)
+{
+    _enqueue(new _op{ std::move(target), std::move(outer) });
+}
+
+
+inline
+void event_loop_handler::dispatch(operation_list&& ops)
+{
+    _op* first = nullptr;
+    _op* last = nullptr;
+
+    for(auto& o : ops)
+    {
+        auto op = new _op{ std::move(o) };
+
+        (last ? last->next : first) = op;
+        last = op;
+    };
+
+    _enqueue_list(first);
+}
+
+
+inline
+size_t event_loop_handler::run()
+{
+    size_t result = 0;
+
+    // stop() made before run() must not be lost
+    do
+        result += run_once();
+    while(!_stop);
+
+    _stop = false;
+
+    return result;
+}
+
+
+inline
+size_t event_loop_handler::run_once()
+{
+    return _run_once(-1);
+}
+
+
+inline
+size_t event_loop_handler::poll()
+{
+    return _run_once(0);
+}
+
+
+inline
+void event_loop_handler::stop() noexcept
+{
+    _stop = true;
+
+    _wake();
+}
+
+
+inline
+void event_loop_handler::watch(int fd, uint32_t events, watch_callback&& callback)
+{
+    epoll_event ev{};
+
+    ev.events = events;
+    ev.data.fd = fd;
+
+    const bool exists = _watches.count(fd);
+
+    if(epoll_ctl(_epoll, exists ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0)
+        throw std::runtime_error("cgull: event_loop_handler can't watch fd");
+
+    _watches[fd] = std::forward<decltype(callback)>(callback);
+}
+
+
+inline
+void event_loop_handler::unwatch(int fd)
+{
+    if(!_watches.erase(fd))
+        return;
+
+    epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+
+inline
+size_t event_loop_handler::before_wait(task_type&& hook)
+{
+    _hooks.emplace_back(++_last_hook, std::forward<decltype(hook)>(hook));
+
+    return _last_hook;
+}
+
+
+inline
+void event_loop_handler::remove_hook(size_t id)
+{
+    std::erase_if(_hooks, [id](const auto& h) { return h.first == id; });
+}
+
+
+inline
+bool event_loop_handler::stopped() const noexcept
+{
+    return _stop;
+}
+
+
+inline
+void event_loop_handler::_enqueue(_op* op) noexcept
+{
+    CGULL_METRICS_PROBE(metrics::add(_metrics_slot, metrics::operations_enqueued);)
+
+    // loop thread will check queue before going to sleep
+    if(_queue.push(op) && _owner.load(std::memory_order::relaxed) != std::this_thread::get_id())
+        _wake();
+}
+
+
+inline
+void event_loop_handler::_enqueue_list(_op* first) noexcept
+{
+    CGULL_METRICS_PROBE(
+        for(auto op = first; op; op = op->next)
+            metrics::add(_metrics_slot, metrics::operations_enqueued);
+    )
+
+    if(_queue.push_list(first) && _owner.load(std::memory_order::relaxed) != std::this_thread::get_id())
+        _wake();
+}
+
+
+inline
+void event_loop_handler::_wake() noexcept
+{
+    const uint64_t one = 1;
+
+    [[maybe_unused]] const auto r = write(_event, &one, sizeof(one));
+}
+
+
+inline
+size_t event_loop_handler::_drain() noexcept
+{
+    size_t result = 0;
+
+    for(auto op = _queue.pop_all(); op; ++result)
+    {
+        CGULL_METRICS_PROBE(
+            metrics::observe_latency(metrics::now() - op->enqueued_at);
+            metrics::add(_metrics_slot, metrics::operations_run);
+        )
+
+        op->run();
+
+        auto next = op->next;
+
+        delete op;
+        op = next;
+    };
+
+    return result;
+}
+
+
+inline
+size_t event_loop_handler::_run_once(int timeout)
+{
+    _owner.store(std::this_thread::get_id(), std::memory_order::relaxed);
+
+    size_t result = _drain();
+
+    for(const auto& [id, hook] : _hooks)
+        hook();
+
+    std::array<epoll_event, _max_events> events;
+
+    // don't sleep if something was posted while draining
+    const auto count = epoll_wait(_epoll, events.data(), _max_events, result || !_queue.empty() || _stop ? 0 : timeout);
+
+    for(int i = 0; i < count; ++i)
+    {
+        const auto fd = events[i].data.fd;
+
+        if(fd == _event)
+        {
+            uint64_t value;
+
+            [[maybe_unused]] const auto r = read(_event, &value, sizeof(value));
+
+            continue;
+        };
+
+        const auto it = _watches.find(fd);
+
+        if(it == _watches.end())
+            continue;
+
+        // callback may unwatch itself
+        const auto callback = it->second;
+
+        callback(events[i].events);
+
+        ++result;
+    };
+
+    result += _drain();
+
+    _owner.store(std::thread::id{}, std::memory_order::relaxed);
+
+    return result;
+}
+
+
+CGULL_NAMESPACE_END
+
+#endif
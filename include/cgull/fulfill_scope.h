@@ -0,0 +1,152 @@
+#pragma once
+
+#include "config.h"
+#include "handler.h"
+
+#include <assert.h>
+#include <utility>
+#include <vector>
+
+
+CGULL_NAMESPACE_START
+
+
+//! Collects operations on handler-owned promises made by current thread and delivers them
+//! on destruction grouped per handler: one \a handler::dispatch() (so one queue push and one
+//! wakeup) per handler instead of one per operation.
+//!
+//! Covers \a promise::resolve(), \a promise::reject() and continuations of context-local
+//! promises triggered inside scope. Context-local promises are still fulfilled immediately.
+//!
+//! \code
+//! {
+//!     cgull::fulfill_scope scope;
+//!
+//!     for(auto& [p, v] : ready)
+//!         p.resolve(v);
+//! } // everything is sent here
+//! \endcode
+//!
+//! \note Scopes may be nested, inner scope delivers its own operations.
+//! \sa resolve_batch()
+class fulfill_scope
+{
+    CGULL_DISABLE_COPY(fulfill_scope);
+    CGULL_DISABLE_MOVE(fulfill_scope);
+
+public:
+    fulfill_scope() noexcept;
+    ~fulfill_scope();
+
+    //! Delivers collected operations right now.
+    void flush();
+
+    //! Collected operations count.
+    [[nodiscard]]
+    size_t size() const noexcept;
+
+    //! Tells if current thread has active scope.
+    [[nodiscard]]
+    static bool active() noexcept;
+    //! Stores \a op for \a h in current thread's scope.
+    //! \note Scope must be active.
+    static void capture(handler* h, handler::operation&& op);
+
+
+private:
+    struct _group
+    {
+        handler*                    target;
+        handler::operation_list     ops;
+    };
+
+    fulfill_scope*          _parent;
+    std::vector<_group>     _groups;
+
+    static thread_local fulfill_scope* _current;
+
+};
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+inline thread_local fulfill_scope* fulfill_scope::_current = nullptr;
+
+
+inline
+fulfill_scope::fulfill_scope() noexcept
+    : _parent(_current)
+{
+    _current = this;
+}
+
+
+inline
+fulfill_scope::~fulfill_scope()
+{
+    // operations made by handlers during flush go to parent scope or straight to handlers
+    _current = _parent;
+
+    flush();
+}
+
+
+inline
+void fulfill_scope::flush()
+{
+    auto groups = std::move(_groups);
+
+    _groups.clear();
+
+    for(auto& g : groups)
+        g.target->dispatch(std::move(g.ops));
+}
+
+
+inline
+size_t fulfill_scope::size() const noexcept
+{
+    size_t result = 0;
+
+    for(const auto& g : _groups)
+        result += g.ops.size();
+
+    return result;
+}
+
+
+inline
+bool fulfill_scope::active() noexcept
+{
+    return _current;
+}
+
+
+inline
+void fulfill_scope::capture(handler* h, handler::operation&& op)
+{
+    assert(_current && "cgull: no active fulfill_scope");
+
+    auto& groups = _current->_groups;
+
+    // there are few handlers per scope, so linear search is fine
+    for(auto& g : groups)
+    {
+        if(g.target == h)
+        {
+            g.ops.push_back(std::forward<decltype(op)>(op));
+
+            return;
+        };
+    };
+
+    groups.push_back({ h, {} });
+    groups.back().ops.push_back(std::forward<decltype(op)>(op));
+}
+
+
+CGULL_NAMESPACE_END
@@ -0,0 +1,430 @@
+#pragma once
+
+#include "config.h"
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include "promise.h"
+#include "stream.h"
+
+#include <any>
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+
+CGULL_NAMESPACE_START
+
+
+template< typename _T >
+class async_generator;
+
+
+CGULL_GUTS_NAMESPACE_START
+
+
+template< typename _T >
+class generator_owner;
+template< typename _T >
+class generator_awaiter;
+
+
+CGULL_GUTS_NAMESPACE_END
+
+
+//! Coroutine producing \a async_stream.
+//!
+//! Body may \a co_yield values and \a co_await \a promise (resumes with its value as
+//! \a std::any or throws its rejection). Generator is started by the first pull of its stream
+//! and runs until it yields a full chunk. Partial chunk is delivered before awaiting, so
+//! consumer doesn't wait for values which are ready already.
+//!
+//! \code
+//! cgull::async_generator<row> rows(cursor c)
+//! {
+//!     while(true)
+//!     {
+//!         auto page = std::any_cast<std::vector<row>>(co_await c.fetch());
+//!
+//!         if(page.empty())
+//!             co_return;
+//!
+//!         for(auto& r : page)
+//!             co_yield std::move(r);
+//!     };
+//! }
+//!
+//! rows(c).stream().take(100).for_each(...);
+//! \endcode
+//!
+//! \note Context-local. Awaited promises should be fulfilled in stream's context.
+//! \note Awaiting aborted promise suspends generator forever.
+template< typename _T >
+class async_generator
+{
+    CGULL_DISABLE_COPY(async_generator);
+
+public:
+    class promise_type;
+
+    using handle_type = std::coroutine_handle<promise_type>;
+
+
+    async_generator(async_generator&& other) noexcept;
+    ~async_generator();
+
+    //! Moves coroutine into stream.
+    async_stream<_T> stream(size_t chunk = async_stream<_T>::default_chunk, CGULL_NAMESPACE::handler* h = nullptr) &&;
+    operator async_stream<_T>() &&;
+
+
+private:
+    handle_type _handle;
+
+
+    explicit
+    async_generator(handle_type h) noexcept;
+
+};
+
+
+template< typename _T >
+class async_generator<_T>::promise_type
+{
+    friend class async_generator;
+    friend class guts::generator_owner<_T>;
+    friend class guts::generator_awaiter<_T>;
+
+public:
+    async_generator get_return_object() noexcept  { return async_generator{ handle_type::from_promise(*this) }; }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    auto final_suspend() noexcept;
+    auto yield_value(_T value);
+    auto await_transform(promise p);
+    void return_void() noexcept { }
+    void unhandled_exception() noexcept { _error = std::current_exception(); }
+
+
+private:
+    std::vector<_T>                     _chunk;
+    size_t                              _max = 0;
+    //! Pending pull of the stream.
+    std::optional<promise>              _pull;
+    //! Coroutine is executing, so pull mustn't resume it.
+    bool                                _running = false;
+    bool                                _at_yield = true;
+    bool                                _done = false;
+    std::exception_ptr                  _error;
+    std::weak_ptr<guts::generator_owner<_T>> _owner;
+
+
+    //! Resolves pending pull with collected chunk.
+    void _deliver();
+    //! Fulfills pending pull after coroutine is over.
+    void _finish();
+
+};
+
+
+CGULL_GUTS_NAMESPACE_START
+
+
+//! Owns generator's coroutine frame and feeds its stream.
+template< typename _T >
+class generator_owner
+{
+    CGULL_DISABLE_COPY(generator_owner);
+    CGULL_DISABLE_MOVE(generator_owner);
+
+public:
+    using handle_type = typename async_generator<_T>::handle_type;
+
+
+    explicit
+    generator_owner(handle_type h) noexcept : _handle(h) { }
+    ~generator_owner() { if(_handle) _handle.destroy(); }
+
+    //! Stream's source.
+    promise pull(size_t max);
+
+
+private:
+    handle_type _handle;
+
+};
+
+
+//! Awaiter of \a promise inside generator.
+template< typename _T >
+class generator_awaiter
+{
+public:
+    using promise_type = typename async_generator<_T>::promise_type;
+
+
+    generator_awaiter(promise_type& owner, promise&& p, std::shared_ptr<generator_owner<_T>> keep) noexcept
+        : _owner(owner)
+        , _promise(std::move(p))
+        , _keep(std::move(keep))
+    { }
+
+    bool await_ready() const noexcept;
+    bool await_suspend(std::coroutine_handle<> h);
+    std::any await_resume();
+
+
+private:
+    promise_type&                           _owner;
+    promise                                 _promise;
+    //! Keeps frame alive while coroutine waits.
+    std::shared_ptr<generator_owner<_T>>    _keep;
+
+    std::any                                _result;
+    bool                                    _rejected = false;
+    //! Coroutine was suspended, result is in \a _result then.
+    bool                                    _waited = false;
+    //! Set by the first of suspension and fulfillment, the second one goes on.
+    std::atomic<bool>                       _met = false;
+
+};
+
+
+CGULL_GUTS_NAMESPACE_END
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+template< typename _T > inline
+async_generator<_T>::async_generator(handle_type h) noexcept
+    : _handle(h)
+{ }
+
+
+template< typename _T > inline
+async_generator<_T>::async_generator(async_generator&& other) noexcept
+    : _handle(std::exchange(other._handle, {}))
+{ }
+
+
+template< typename _T > inline
+async_generator<_T>::~async_generator()
+{
+    if(_handle)
+        _handle.destroy();
+}
+
+
+template< typename _T > inline
+async_stream<_T> async_generator<_T>::stream(size_t chunk, CGULL_NAMESPACE::handler* h) &&
+{
+    auto& p = _handle.promise();
+    auto owner = std::make_shared<guts::generator_owner<_T>>(std::exchange(_handle, {}));
+
+    p._owner = owner;
+
+    return async_stream<_T>{ [owner](size_t max) { return owner->pull(max); }, chunk, h };
+}
+
+
+template< typename _T > inline
+async_generator<_T>::operator async_stream<_T>() &&
+{
+    return std::move(*this).stream();
+}
+
+
+template< typename _T > inline
+auto async_generator<_T>::promise_type::final_suspend() noexcept
+{
+    struct awaiter
+    {
+        promise_type& p;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<>) noexcept { p._finish(); }
+        void await_resume() const noexcept { }
+    };
+
+    return awaiter{ *this };
+}
+
+
+template< typename _T > inline
+auto async_generator<_T>::promise_type::yield_value(_T value)
+{
+    struct awaiter
+    {
+        promise_type& p;
+
+        //! Chunk isn't full yet: go on without suspension.
+        bool await_ready() const noexcept { return p._pull && p._chunk.size() < p._max; }
+
+        bool await_suspend(std::coroutine_handle<>)
+        {
+            p._deliver();
+
+            // consumer asked for more right inside delivery
+            if(p._pull)
+                return false;
+
+            p._running = false;
+            p._at_yield = true;
+
+            return true;
+        }
+
+        void await_resume() const noexcept { }
+    };
+
+    _chunk.push_back(std::move(value));
+
+    return awaiter{ *this };
+}
+
+
+template< typename _T > inline
+auto async_generator<_T>::promise_type::await_transform(promise p)
+{
+    return guts::generator_awaiter<_T>{ *this, std::move(p), _owner.lock() };
+}
+
+
+template< typename _T > inline
+void async_generator<_T>::promise_type::_deliver()
+{
+    if(!_pull || _chunk.empty())
+        return;
+
+    auto pull = std::move(*_pull);
+
+    _pull.reset();
+
+    pull.resolve(std::any{std::exchange(_chunk, {})});
+}
+
+
+template< typename _T > inline
+void async_generator<_T>::promise_type::_finish()
+{
+    _done = true;
+    _running = false;
+
+    if(!_pull)
+        return;
+
+    if(!_chunk.empty())
+        return _deliver();
+
+    auto pull = std::move(*_pull);
+
+    _pull.reset();
+
+    _error ? pull.reject(std::any{_error}) : pull.resolve();
+}
+
+
+CGULL_GUTS_NAMESPACE_START
+
+
+template< typename _T > inline
+promise generator_owner<_T>::pull(size_t max)
+{
+    auto& p = _handle.promise();
+
+    promise result;
+
+    p._pull = result;
+    p._max = max ? max : 1;
+
+    if(p._done)
+        p._finish();
+    else if(!p._running && p._at_yield)
+    {
+        p._running = true;
+        p._at_yield = false;
+
+        _handle.resume();
+    };
+
+    return result;
+}
+
+
+template< typename _T > inline
+bool generator_awaiter<_T>::await_ready() const noexcept
+{
+    return !_promise.handler() && _promise.fulfillment() != not_fulfilled && _promise.fulfillment() != aborted;
+}
+
+
+template< typename _T > inline
+bool generator_awaiter<_T>::await_suspend(std::coroutine_handle<> h)
+{
+    // values which are ready go to consumer before waiting
+    _owner._deliver();
+    _owner._running = false;
+
+    _waited = true;
+
+    // promise isn't kept by frame, so forgotten promise doesn't keep frame alive
+    auto p = std::move(_promise);
+
+    auto resume = [this, h]
+    {
+        if(!_met.exchange(true))
+            return;
+
+        _owner._running = true;
+
+        h.resume();
+    };
+
+    p
+        .then([this, resume, keep = _keep](std::any value) { _result = std::move(value); resume(); })
+        .rescue([this, resume, keep = _keep](std::any error) { _result = std::move(error); _rejected = true; resume(); });
+
+    if(!_met.exchange(true))
+        return true;
+
+    // fulfilled while binding
+    _owner._running = true;
+
+    return false;
+}
+
+
+template< typename _T > inline
+std::any generator_awaiter<_T>::await_resume()
+{
+    _keep.reset();
+
+    // ready before suspension
+    if(!_waited)
+    {
+        if(_promise.is_resolved())
+            return _promise.value();
+
+        _result = _promise.value();
+        _rejected = true;
+    };
+
+    if(!_rejected)
+        return std::move(_result);
+
+    if(const auto e = std::any_cast<std::exception_ptr>(&_result))
+        std::rethrow_exception(*e);
+
+    throw std::move(_result);
+}
+
+
+CGULL_GUTS_NAMESPACE_END
+CGULL_NAMESPACE_END
+
+#endif
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "../config.h"
+#include "../promise_private.h"
+#include "../handler.h"
+
+#include <stdint.h>
+#include <any>
+#include <utility>
+
+
+CGULL_NAMESPACE_START
+CGULL_GUTS_NAMESPACE_START
+
+
+//! Deferred call queued by handlers: \a handler::operation or posted task.
+//!
+//! \a next links operation into \a mpsc_queue, handlers keeping operations by value ignore it.
+//! Priority is taken from target or, for task, from \a priority_scope of posting thread.
+struct handler_op
+{
+    using private_type  = handler::private_type;
+    using task_type     = handler::task_type;
+
+    //! First kinds match \a handler::operation::kind_t.
+    enum kind_t : int8_t
+    {
+        fulfill_op = 0,
+        try_finish_op,
+        bind_outer_op,
+        task_op,
+    };
+
+    handler_op*             next = nullptr;
+    kind_t                  kind = task_op;
+    fulfillment_state_t     state = not_fulfilled;
+    private_type            target;
+    std::any                value;
+    task_type               task;
+    private_type            outer;
+    priority_t              priority = normal_priority;
+#if defined(CGULL_METRICS)
+    uint64_t                enqueued_at = metrics::now();
+#endif
+
+
+    handler_op() = default;
+    //! \a target->local_fulfill().
+    handler_op(private_type target, std::any&& value, fulfillment_state_t state);
+    //! \a target->local_try_finish().
+    explicit
+    handler_op(private_type target);
+    //! \a target->local_bind_outer().
+    handler_op(private_type target, private_type outer);
+    explicit
+    handler_op(task_type&& task);
+    explicit
+    handler_op(handler::operation&& op);
+
+    //! Makes the call. Must be called inside handler's context.
+    void run();
+
+};
+
+
+inline
+handler_op::handler_op(private_type t, std::any&& v, fulfillment_state_t s)
+    : kind(fulfill_op)
+    , state(s)
+    , target(std::move(t))
+    , value(std::move(v))
+    , priority(target->priority())
+{ }
+
+
+inline
+handler_op::handler_op(private_type t)
+    : kind(try_finish_op)
+    , target(std::move(t))
+    , priority(target->priority())
+{ }
+
+
+inline
+handler_op::handler_op(private_type t, private_type o)
+    : kind(bind_outer_op)
+    , target(std::move(t))
+    , outer(std::move(o))
+    , priority(target->priority())
+{ }
+
+
+inline
+handler_op::handler_op(task_type&& t)
+    : kind(task_op)
+    , task(std::move(t))
+    , priority(priority_scope::current())
+{ }
+
+
+inline
+handler_op::handler_op(handler::operation&& op)
+    : kind(static_cast<kind_t>(op.kind))
+    , state(op.state)
+    , target(std::move(op.target))
+    , value(std::move(op.value))
+    , outer(std::move(op.outer))
+    , priority(target->priority())
+{ }
+
+
+inline
+void handler_op::run()
+{
+    switch(kind)
+    {
+    case fulfill_op:
+        target->local_fulfill(std::move(value), state);
+        break;
+    case try_finish_op:
+        target->local_try_finish();
+        break;
+    case bind_outer_op:
+        target->local_bind_outer(outer);
+        break;
+    case task_op:
+        task();
+        break;
+    };
+}
+
+
+CGULL_GUTS_NAMESPACE_END
+CGULL_NAMESPACE_END
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "../config.h"
+
+#include <atomic>
+
+
+CGULL_NAMESPACE_START
+CGULL_GUTS_NAMESPACE_START
+
+
+//! Lock-free intrusive multi-producer single-consumer queue.
+//!
+//! Producers push nodes one by one, consumer takes all pushed nodes at once in FIFO order.
+//! \a push() tells if queue was empty, so producer knows when consumer must be woken up:
+//! only the first push of each batch needs to signal.
+//!
+//! \note \a _Node must have \a _Node* next member.
+template< typename _Node >
+class mpsc_queue
+{
+    CGULL_DISABLE_COPY(mpsc_queue);
+
+public:
+    mpsc_queue() = default;
+
+    //! \return true if queue was empty before push.
+    bool push(_Node* node) noexcept;
+    //! Pushes nullptr-terminated list of nodes linked in push order with a single CAS.
+    //! \return true if queue was empty before push.
+    bool push_list(_Node* first) noexcept;
+    //! Takes all nodes. Returned list is in push order and terminated with nullptr.
+    _Node* pop_all() noexcept;
+
+    [[nodiscard]]
+    bool empty() const noexcept { return !_head.load(std::memory_order::relaxed); }
+
+private:
+    //! Pushed nodes in reverse order.
+    std::atomic<_Node*> _head = nullptr;
+
+};
+
+
+template< typename _Node > inline
+bool mpsc_queue<_Node>::push(_Node* node) noexcept
+{
+    auto head = _head.load(std::memory_order::relaxed);
+
+    do
+        node->next = head;
+    while(!_head.compare_exchange_weak(head, node, std::memory_order::release, std::memory_order::relaxed));
+
+    return !head;
+}
+
+
+template< typename _Node > inline
+bool mpsc_queue<_Node>::push_list(_Node* first) noexcept
+{
+    if(!first)
+        return false;
+
+    // queue keeps nodes reversed, so reverse list before publishing it
+    _Node* last = nullptr;
+
+    for(auto node = first; node; )
+    {
+        auto next = node->next;
+
+        node->next = last;
+        last = node;
+        node = next;
+    };
+
+    auto head = _head.load(std::memory_order::relaxed);
+
+    do
+        first->next = head;
+    while(!_head.compare_exchange_weak(head, last, std::memory_order::release, std::memory_order::relaxed));
+
+    return !head;
+}
+
+
+template< typename _Node > inline
+_Node* mpsc_queue<_Node>::pop_all() noexcept
+{
+    auto head = _head.exchange(nullptr, std::memory_order::acquire);
+
+    // reverse to push order
+    _Node* result = nullptr;
+
+    while(head)
+    {
+        auto next = head->next;
+
+        head->next = result;
+        result = head;
+        head = next;
+    };
+
+    return result;
+}
+
+
+CGULL_GUTS_NAMESPACE_END
+CGULL_NAMESPACE_END
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "../config.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#if defined(CGULL_OS_LINUX)
+#   include <errno.h>
+#   include <time.h>
+#   include <linux/futex.h>
+#   include <sys/syscall.h>
+#   include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#   include <immintrin.h>
+#endif
+
+
+CGULL_NAMESPACE_START
+CGULL_GUTS_NAMESPACE_START
+
+
+//! Hint for spin loops: lets sibling hyper-thread run and saves power.
+inline
+void cpu_relax() noexcept
+{
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+
+//! Sleeps while \a word equals \a expected, until \a unpark_all() or \a deadline if given.
+//! Spurious returns are possible, so caller rechecks its condition.
+//!
+//! Futex on the word itself on Linux, \a std::atomic::wait() elsewhere. The latter has no
+//! timeout, so timed parking there sleeps in short steps.
+//!
+//! \return false if \a deadline passed.
+inline
+bool park(std::atomic<uint32_t>& word, uint32_t expected, const std::chrono::steady_clock::time_point* deadline = nullptr) noexcept
+{
+    using namespace std::chrono;
+
+    const auto left = deadline ? duration_cast<nanoseconds>(*deadline - steady_clock::now()).count() : 0;
+
+    if(deadline && left <= 0)
+        return false;
+
+#if defined(CGULL_OS_LINUX)
+    const timespec ts{ time_t(left / 1000000000), long(left % 1000000000) };
+
+    // returns right away with EAGAIN if word is already changed
+    if(syscall(SYS_futex, &word, FUTEX_WAIT_PRIVATE, expected, deadline ? &ts : nullptr, nullptr, 0) < 0 && errno == ETIMEDOUT)
+        return false;
+#else
+    if(!deadline)
+        word.wait(expected, std::memory_order::acquire);
+    else if(word.load(std::memory_order::acquire) == expected)
+        std::this_thread::sleep_for(std::min(nanoseconds{ left }, duration_cast<nanoseconds>(milliseconds{ 1 })));
+#endif
+
+    return true;
+}
+
+
+//! Wakes everyone parked on \a word.
+inline
+void unpark_all(std::atomic<uint32_t>& word) noexcept
+{
+#if defined(CGULL_OS_LINUX)
+    syscall(SYS_futex, &word, FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+#else
+    word.notify_all();
+#endif
+}
+
+
+CGULL_GUTS_NAMESPACE_END
+CGULL_NAMESPACE_END
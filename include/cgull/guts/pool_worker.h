@@ -0,0 +1,250 @@
+#pragma once
+
+#include "../config.h"
+#include "../handler.h"
+#include "handler_op.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+CGULL_NAMESPACE_START
+CGULL_GUTS_NAMESPACE_START
+
+
+//! Worker thread of pool handlers with its own queue of operations.
+//!
+//! Queue is kept per \a priority_t and the highest non-empty one is served first. Lower queue
+//! which had work while \a starvation_limit operations in a row were taken from higher ones is
+//! served next. When own queue is empty worker asks its pool for shared work, e.g. tasks of
+//! NUMA node, and sleeps only when pool has none either.
+struct pool_worker
+{
+    //! Operations taken from higher queues before waiting lower one is served.
+    static constexpr uint32_t starvation_limit = 32;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::deque<handler_op>  queues[priority_count];
+    size_t                  size = 0;
+    //! Operations taken from higher queues while this one was waiting.
+    uint32_t                skipped[priority_count] = {};
+    bool                    stop = false;
+    //! Set by poster which claimed idle worker for shared work.
+    bool                    wake = false;
+    //! Published before worker rechecks queues and sleeps.
+    std::atomic<bool>       idle = false;
+    std::thread             thread;
+
+
+    //! Must be called under lock.
+    void push(handler_op&& op);
+    //! Takes the next operation. Must be called under lock with non-empty worker.
+    handler_op pop();
+
+    //! Queues \a op and wakes worker up.
+    void enqueue(handler_op&& op);
+    //! Wakes idle worker for shared work. False if it's busy or claimed by other poster already.
+    bool claim();
+
+    //! Runs operations until stopped and nothing is left. \a take_shared(op) gets shared work
+    //! when own queue is empty, \a has_shared() tells whether it's worth waiting for.
+    template< typename _Take, typename _Has >
+    void run(const handler& owner, _Take&& take_shared, _Has&& has_shared);
+
+    //! Groups \a ops by worker, each touched worker is locked and woken up once.
+    template< typename _Worker, typename _Index >
+    static void dispatch(std::vector<std::unique_ptr<_Worker>>& workers, handler::operation_list&& ops, _Index&& index_of);
+    //! Runs everything posted before and joins \a workers.
+    template< typename _Worker >
+    static void join(std::vector<std::unique_ptr<_Worker>>& workers);
+};
+
+
+inline
+void pool_worker::push(handler_op&& op)
+{
+    queues[std::min<size_t>(op.priority, priority_count - 1)].push_back(std::forward<decltype(op)>(op));
+
+    ++size;
+}
+
+
+inline
+handler_op pool_worker::pop()
+{
+    size_t taken = priority_count;
+
+    for(size_t p = priority_count; p-- > 0; )
+    {
+        if(queues[p].empty())
+            continue;
+
+        if(taken == priority_count)
+            taken = p;
+        // starving queue preempts higher ones once
+        else if(skipped[p] >= starvation_limit)
+        {
+            taken = p;
+            break;
+        };
+    };
+
+    for(size_t p = 0; p < priority_count; ++p)
+        if(p != taken && !queues[p].empty())
+            ++skipped[p];
+
+    skipped[taken] = 0;
+
+    auto op = std::move(queues[taken].front());
+
+    queues[taken].pop_front();
+    --size;
+
+    return op;
+}
+
+
+inline
+void pool_worker::enqueue(handler_op&& op)
+{
+    {
+        std::lock_guard lock{ mutex };
+
+        push(std::forward<decltype(op)>(op));
+    }
+
+    cv.notify_one();
+}
+
+
+inline
+bool pool_worker::claim()
+{
+    // claim worker, so concurrent posters wake different ones
+    if(!idle.load(std::memory_order::seq_cst) || !idle.exchange(false, std::memory_order::seq_cst))
+        return false;
+
+    {
+        std::lock_guard lock{ mutex };
+
+        wake = true;
+    }
+
+    cv.notify_one();
+
+    return true;
+}
+
+
+template< typename _Take, typename _Has >
+void pool_worker::run([[maybe_unused]] const handler& owner, _Take&& take_shared, _Has&& has_shared)
+{
+    while(true)
+    {
+        // op must die outside of lock
+        handler_op op;
+        bool taken = false;
+
+        {
+            std::lock_guard lock{ mutex };
+
+            if(size)
+            {
+                op = pop();
+                taken = true;
+            };
+        }
+
+        if(!taken && !take_shared(op))
+        {
+            std::unique_lock lock{ mutex };
+
+            idle.store(true, std::memory_order::seq_cst);
+
+            // work shared before idle was published is seen here, after it poster sees idle
+            if(!stop && !wake && !size && !has_shared())
+                cv.wait(lock, [this]{ return stop || wake || size; });
+
+            idle.store(false, std::memory_order::relaxed);
+            wake = false;
+
+            // finish everything before stop
+            if(stop && !size && !has_shared())
+                return;
+
+            continue;
+        };
+
+        // tasks posted by operation inherit its priority
+        const priority_scope scope{ op.priority };
+
+        CGULL_METRICS_PROBE(
+            metrics::observe_latency(metrics::now() - op.enqueued_at);
+            metrics::add(owner.metrics_slot(), metrics::operations_run);
+        )
+
+        op.run();
+    };
+}
+
+
+template< typename _Worker, typename _Index >
+void pool_worker::dispatch(std::vector<std::unique_ptr<_Worker>>& workers, handler::operation_list&& ops, _Index&& index_of)
+{
+    std::vector<std::vector<handler_op>> batches(workers.size());
+
+    for(auto& o : ops)
+    {
+        const auto index = index_of(o.target.data());
+
+        batches[index].emplace_back(std::move(o));
+    };
+
+    for(size_t i = 0; i < batches.size(); ++i)
+    {
+        if(batches[i].empty())
+            continue;
+
+        auto& w = *workers[i];
+
+        {
+            std::lock_guard lock{ w.mutex };
+
+            for(auto& op : batches[i])
+                w.push(std::move(op));
+        }
+
+        w.cv.notify_one();
+    };
+}
+
+
+template< typename _Worker >
+void pool_worker::join(std::vector<std::unique_ptr<_Worker>>& workers)
+{
+    for(auto& w : workers)
+    {
+        {
+            std::lock_guard lock{ w->mutex };
+
+            w->stop = true;
+        }
+
+        w->cv.notify_one();
+    };
+
+    for(auto& w : workers)
+        w->thread.join();
+}
+
+
+CGULL_GUTS_NAMESPACE_END
+CGULL_NAMESPACE_END
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "../config.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <optional>
+#include <utility>
+
+
+CGULL_NAMESPACE_START
+CGULL_GUTS_NAMESPACE_START
+
+
+//! Lock-free bounded multi-producer multi-consumer queue.
+//!
+//! Each cell has a sequence number telling whose turn it is: producer at position \a pos may
+//! fill cell when its sequence is \a pos, consumer may take it when sequence is \a pos + 1.
+//! Producers and consumers contend only on their own position counter, so single producer
+//! and single consumer never touch the same cache line except for the cells themselves.
+//!
+//! \note Capacity needn't be a power of two.
+template< typename _T >
+class ring_buffer
+{
+    CGULL_DISABLE_COPY(ring_buffer);
+    CGULL_DISABLE_MOVE(ring_buffer);
+
+public:
+    explicit
+    ring_buffer(size_t capacity);
+    ~ring_buffer();
+
+    //! \a value is moved from only on success.
+    bool try_push(_T& value) noexcept;
+    std::optional<_T> try_pop() noexcept;
+
+    [[nodiscard]]
+    size_t capacity() const noexcept    { return _capacity; }
+    //! Approximate if queue is used concurrently.
+    [[nodiscard]]
+    size_t size() const noexcept;
+
+
+private:
+    static constexpr size_t _line = 64;
+
+    struct _cell
+    {
+        std::atomic<size_t>                     sequence;
+        alignas(_T) unsigned char               storage[sizeof(_T)];
+
+        _T* value() noexcept { return std::launder(reinterpret_cast<_T*>(storage)); }
+    };
+
+    const size_t                        _capacity;
+    std::unique_ptr<_cell[]>            _cells;
+
+    alignas(_line) std::atomic<size_t>  _push_pos = 0;
+    alignas(_line) std::atomic<size_t>  _pop_pos = 0;
+
+};
+
+
+template< typename _T > inline
+ring_buffer<_T>::ring_buffer(size_t capacity)
+    : _capacity(capacity ? capacity : 1)
+    , _cells(new _cell[_capacity])
+{
+    for(size_t i = 0; i < _capacity; ++i)
+        _cells[i].sequence.store(i, std::memory_order::relaxed);
+}
+
+
+template< typename _T > inline
+ring_buffer<_T>::~ring_buffer()
+{
+    for(auto pos = _pop_pos.load(); pos != _push_pos.load(); ++pos)
+        _cells[pos % _capacity].value()->~_T();
+}
+
+
+template< typename _T > inline
+bool ring_buffer<_T>::try_push(_T& value) noexcept
+{
+    auto pos = _push_pos.load(std::memory_order::relaxed);
+
+    for(;;)
+    {
+        auto& cell = _cells[pos % _capacity];
+        const auto seq = cell.sequence.load(std::memory_order::acquire);
+        const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+        if(!diff)
+        {
+            if(_push_pos.compare_exchange_weak(pos, pos + 1, std::memory_order::relaxed))
+            {
+                ::new(cell.storage) _T(std::move(value));
+
+                cell.sequence.store(pos + 1, std::memory_order::release);
+
+                return true;
+            };
+        }
+        // cell isn't consumed yet since previous lap: full
+        else if(diff < 0)
+            return false;
+        else
+            pos = _push_pos.load(std::memory_order::relaxed);
+    };
+}
+
+
+template< typename _T > inline
+std::optional<_T> ring_buffer<_T>::try_pop() noexcept
+{
+    auto pos = _pop_pos.load(std::memory_order::relaxed);
+
+    for(;;)
+    {
+        auto& cell = _cells[pos % _capacity];
+        const auto seq = cell.sequence.load(std::memory_order::acquire);
+        const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+
+        if(!diff)
+        {
+            if(_pop_pos.compare_exchange_weak(pos, pos + 1, std::memory_order::relaxed))
+            {
+                std::optional<_T> result{ std::move(*cell.value()) };
+
+                cell.value()->~_T();
+                cell.sequence.store(pos + _capacity, std::memory_order::release);
+
+                return result;
+            };
+        }
+        // cell isn't filled yet: empty
+        else if(diff < 0)
+            return std::nullopt;
+        else
+            pos = _pop_pos.load(std::memory_order::relaxed);
+    };
+}
+
+
+template< typename _T > inline
+size_t ring_buffer<_T>::size() const noexcept
+{
+    const auto pop = _pop_pos.load(std::memory_order::relaxed);
+    const auto push = _push_pos.load(std::memory_order::relaxed);
+
+    return push > pop ? push - pop : 0;
+}
+
+
+CGULL_GUTS_NAMESPACE_END
+CGULL_NAMESPACE_END
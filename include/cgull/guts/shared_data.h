@@ -3,6 +3,7 @@
 #include "../config.h"
 
 #include <atomic>
+#include <utility>
 
 
 CGULL_NAMESPACE_START
@@ -58,6 +59,11 @@ public:
 
     void detach() ;
     void reset();
+    //! Gives up ownership without dereferencing. \sa adopt()
+    [[nodiscard]]
+    _T*  take() noexcept;
+    //! Takes ownership of reference given up by \a take().
+    static shared_data_ptr<_T> adopt(_T* from) noexcept;
     void swap(shared_data_ptr &other) noexcept;
 
     _T*         data() const        { return d; }
@@ -200,6 +206,22 @@ void shared_data_ptr<_T>::reset()
     d = nullptr;
 }
 
+template<typename _T> inline
+_T* shared_data_ptr<_T>::take() noexcept
+{
+    return std::exchange(d, nullptr);
+}
+
+template<typename _T> inline
+shared_data_ptr<_T> shared_data_ptr<_T>::adopt(_T* from) noexcept
+{
+    shared_data_ptr<_T> result;
+
+    result.d = from;
+
+    return result;
+}
+
 template<typename _T> inline
 void shared_data_ptr<_T>::swap(shared_data_ptr &other) noexcept
 {
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "../config.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <type_traits>
+
+
+CGULL_NAMESPACE_START
+CGULL_GUTS_NAMESPACE_START
+
+
+//! Lock-free bounded single-producer single-consumer queue of trivially copyable values.
+//!
+//! Producer owns the tail and consumer owns the head, each keeps cached copy of the other's
+//! position, so in steady state push and pop touch only their own cache line and the slot.
+//!
+//! \note Capacity is rounded up to a power of two.
+template< typename _T >
+class spsc_ring
+{
+    CGULL_DISABLE_COPY(spsc_ring);
+    CGULL_DISABLE_MOVE(spsc_ring);
+
+    static_assert(std::is_trivially_copyable_v<_T>, "spsc_ring holds trivially copyable values only");
+
+public:
+    explicit
+    spsc_ring(size_t capacity);
+
+    //! Producer side. \return false if ring is full.
+    bool try_push(const _T& value) noexcept;
+    //! Consumer side. \return false if ring is empty.
+    bool try_pop(_T& value) noexcept;
+
+    [[nodiscard]]
+    size_t capacity() const noexcept    { return _mask + 1; }
+    //! Approximate if ring is used concurrently.
+    [[nodiscard]]
+    size_t size() const noexcept;
+
+
+private:
+    static constexpr size_t _line = 64;
+
+    const size_t                        _mask;
+    std::unique_ptr<_T[]>               _slots;
+
+    alignas(_line) std::atomic<size_t>  _tail = 0;
+    size_t                              _head_cache = 0;
+
+    alignas(_line) std::atomic<size_t>  _head = 0;
+    size_t                              _tail_cache = 0;
+
+
+    static size_t _round_up(size_t n) noexcept;
+
+};
+
+
+template< typename _T > inline
+spsc_ring<_T>::spsc_ring(size_t capacity)
+    : _mask(_round_up(capacity) - 1)
+    , _slots(new _T[_mask + 1])
+{ }
+
+
+template< typename _T > inline
+bool spsc_ring<_T>::try_push(const _T& value) noexcept
+{
+    const auto tail = _tail.load(std::memory_order::relaxed);
+
+    if(tail - _head_cache > _mask)
+    {
+        _head_cache = _head.load(std::memory_order::acquire);
+
+        if(tail - _head_cache > _mask)
+            return false;
+    };
+
+    _slots[tail & _mask] = value;
+    _tail.store(tail + 1, std::memory_order::release);
+
+    return true;
+}
+
+
+template< typename _T > inline
+bool spsc_ring<_T>::try_pop(_T& value) noexcept
+{
+    const auto head = _head.load(std::memory_order::relaxed);
+
+    if(head == _tail_cache)
+    {
+        _tail_cache = _tail.load(std::memory_order::acquire);
+
+        if(head == _tail_cache)
+            return false;
+    };
+
+    value = _slots[head & _mask];
+    _head.store(head + 1, std::memory_order::release);
+
+    return true;
+}
+
+
+template< typename _T > inline
+size_t spsc_ring<_T>::size() const noexcept
+{
+    const auto head = _head.load(std::memory_order::relaxed);
+    const auto tail = _tail.load(std::memory_order::relaxed);
+
+    return tail > head ? tail - head : 0;
+}
+
+
+template< typename _T > inline
+size_t spsc_ring<_T>::_round_up(size_t n) noexcept
+{
+    size_t result = 1;
+
+    while(result < n)
+        result <<= 1;
+
+    return result;
+}
+
+
+CGULL_GUTS_NAMESPACE_END
+CGULL_NAMESPACE_END
@@ -0,0 +1,218 @@
+#pragma once
+
+#include "../config.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+CGULL_NAMESPACE_START
+CGULL_GUTS_NAMESPACE_START
+
+
+//! Small number of calling thread, starting from 1. Shared by all diagnostics, so their
+//! records of one thread match.
+inline
+uint32_t thread_index() noexcept
+{
+    static std::atomic<uint32_t> next = 1;
+    static thread_local const uint32_t index = next.fetch_add(1, std::memory_order::relaxed);
+
+    return index;
+}
+
+
+//! Rings of records, one per writing thread, drained by any thread.
+//!
+//! Thread's ring is registered on its first record, after that writer never locks. Ring of
+//! exited thread is removed once it's drained.
+//!
+//! \note There is one ring per thread for each \a _Ring type, so owner must be a singleton.
+template< typename _Ring >
+class thread_rings
+{
+    CGULL_DISABLE_COPY(thread_rings);
+    CGULL_DISABLE_MOVE(thread_rings);
+
+public:
+    explicit
+    thread_rings(size_t capacity) noexcept : _capacity(capacity) { }
+
+    //! Ring of calling thread or nullptr if it can't be registered, e.g. out of memory.
+    [[nodiscard]]
+    _Ring*  local() noexcept;
+    //! Calls \a fn(ring) for each ring to pop its records.
+    template< typename _Fn >
+    void    drain(_Fn&& fn);
+
+
+private:
+    struct _entry
+    {
+        _Ring               records;
+        //! Reset when thread exits.
+        std::atomic<bool>   alive = true;
+
+        explicit _entry(size_t capacity) : records(capacity) { }
+    };
+
+    //! Thread's handle of its ring.
+    struct _local_entry
+    {
+        std::shared_ptr<_entry> entry;
+
+        ~_local_entry();
+    };
+
+    const size_t                            _capacity;
+    //! Guards rings list and their consumer side.
+    std::mutex                              _mutex;
+    std::vector<std::shared_ptr<_entry>>    _rings;
+
+};
+
+
+//! Thread calling function periodically, e.g. to drain \a thread_rings into output.
+class drain_thread
+{
+    CGULL_DISABLE_COPY(drain_thread);
+    CGULL_DISABLE_MOVE(drain_thread);
+
+public:
+    drain_thread() = default;
+    ~drain_thread() { stop(); }
+
+    //! Calls \a fn every \a interval. Does nothing if started already.
+    void    start(std::chrono::milliseconds interval, std::function<void()>&& fn);
+    //! Joins thread and calls function the last time, so nothing is left behind.
+    void    stop();
+
+
+private:
+    std::mutex              _mutex;
+    std::condition_variable _cv;
+    std::thread             _thread;
+    std::function<void()>   _fn;
+    bool                    _stopping = false;
+
+
+    void    _run(std::chrono::milliseconds interval);
+
+};
+
+
+template< typename _Ring > inline
+_Ring* thread_rings<_Ring>::local() noexcept
+{
+    static thread_local _local_entry local;
+
+    if(!local.entry) [[unlikely]]
+    {
+        // the only allocation of writer, its failure drops the record
+        try
+        {
+            auto entry = std::make_shared<_entry>(_capacity);
+
+            std::lock_guard lock{ _mutex };
+
+            _rings.push_back(entry);
+
+            local.entry = std::move(entry);
+        }
+        catch(...)
+        {
+            return nullptr;
+        };
+    };
+
+    return &local.entry->records;
+}
+
+
+template< typename _Ring > template< typename _Fn > inline
+void thread_rings<_Ring>::drain(_Fn&& fn)
+{
+    std::lock_guard lock{ _mutex };
+
+    for(auto it = _rings.begin(); it != _rings.end(); )
+    {
+        auto& entry = **it;
+        // check before draining, so records pushed right before exit aren't lost
+        const auto alive = entry.alive.load(std::memory_order::acquire);
+
+        fn(entry.records);
+
+        it = alive ? it + 1 : _rings.erase(it);
+    };
+}
+
+
+template< typename _Ring > inline
+thread_rings<_Ring>::_local_entry::~_local_entry()
+{
+    if(entry)
+        entry->alive.store(false, std::memory_order::release);
+}
+
+
+inline
+void drain_thread::start(std::chrono::milliseconds interval, std::function<void()>&& fn)
+{
+    std::lock_guard lock{ _mutex };
+
+    if(_thread.joinable())
+        return;
+
+    _stopping = false;
+    _fn = std::move(fn);
+    _thread = std::thread{ &drain_thread::_run, this, interval };
+}
+
+
+inline
+void drain_thread::stop()
+{
+    {
+        std::lock_guard lock{ _mutex };
+
+        if(!_thread.joinable())
+            return;
+
+        _stopping = true;
+    };
+
+    _cv.notify_one();
+    _thread.join();
+
+    _fn();
+    _fn = nullptr;
+}
+
+
+inline
+void drain_thread::_run(std::chrono::milliseconds interval)
+{
+    std::unique_lock lock{ _mutex };
+
+    while(!_stopping)
+    {
+        lock.unlock();
+
+        _fn();
+
+        lock.lock();
+
+        _cv.wait_for(lock, interval, [this]{ return _stopping; });
+    };
+}
+
+
+CGULL_GUTS_NAMESPACE_END
+CGULL_NAMESPACE_END
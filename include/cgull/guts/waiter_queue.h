@@ -0,0 +1,231 @@
+#pragma once
+
+#include "../config.h"
+#include "../promise.h"
+#include "../fulfill_scope.h"
+
+#include <any>
+#include <utility>
+
+
+CGULL_NAMESPACE_START
+CGULL_GUTS_NAMESPACE_START
+
+
+//! Intrusive FIFO of waiting promises.
+//!
+//! Promises are linked through their own \a promise_private, so queueing doesn't allocate.
+//! Queue holds a reference to every promise in it.
+//!
+//! \note Not thread-safe, owner must lock it.
+class waiter_queue
+{
+    CGULL_DISABLE_COPY(waiter_queue);
+
+public:
+    waiter_queue() = default;
+    waiter_queue(waiter_queue&& other) noexcept;
+    waiter_queue& operator=(waiter_queue&& other) noexcept;
+    //! Aborts waiters left in queue.
+    ~waiter_queue();
+
+    [[nodiscard]]
+    bool    empty() const noexcept  { return !_head; }
+    [[nodiscard]]
+    size_t  size() const noexcept   { return _size; }
+    //! Units the first waiter asked for.
+    [[nodiscard]]
+    size_t  front_weight() const noexcept;
+
+    //! Creates waiter owned by handler \a h and appends it.
+    promise push(CGULL_NAMESPACE::handler* h, size_t weight = 1);
+    //! Removes the first waiter. Queue must not be empty.
+    //! \param owner If given, gets \a waiter_owner::refund() if waiter misses its resolve.
+    promise_private::type pop(waiter_owner* owner = nullptr) noexcept;
+    //! Drops waiters at the front which are fulfilled already, e.g. aborted by their owners.
+    void    prune() noexcept;
+    //! Moves the first waiter to the end of \a to.
+    void    move_front(waiter_queue& to) noexcept;
+    //! Moves all waiters to the end of \a to.
+    void    splice(waiter_queue& to) noexcept;
+
+    //! Fulfills and removes all waiters. Waiters are fulfilled inside \a fulfill_scope, so
+    //! ones owned by the same handler are dispatched to it at once.
+    void    fulfill_all(const std::any& value, fulfillment_state_t state) noexcept;
+    //! Resolves and removes all waiters. Waiter which turns out to be fulfilled already when
+    //! resolve reaches it is passed to \a owner's \a waiter_owner::refund().
+    //! \note \a owner must outlive resolves sent to handlers.
+    void    grant_all(const std::any& value, waiter_owner* owner) noexcept;
+
+
+private:
+    promise_private*    _head = nullptr;
+    promise_private*    _tail = nullptr;
+    size_t              _size = 0;
+
+
+    void                        _push(promise_private* p) noexcept;
+    promise_private::type       _pop() noexcept;
+
+};
+
+
+inline
+waiter_queue::waiter_queue(waiter_queue&& other) noexcept
+    : _head(std::exchange(other._head, nullptr))
+    , _tail(std::exchange(other._tail, nullptr))
+    , _size(std::exchange(other._size, 0))
+{ }
+
+
+inline
+waiter_queue& waiter_queue::operator=(waiter_queue&& other) noexcept
+{
+    std::swap(_head, other._head);
+    std::swap(_tail, other._tail);
+    std::swap(_size, other._size);
+
+    return *this;
+}
+
+
+inline
+waiter_queue::~waiter_queue()
+{
+    fulfill_all(std::any{}, aborted);
+}
+
+
+inline
+size_t waiter_queue::front_weight() const noexcept
+{
+    return _head ? _head->_waiter_weight : 0;
+}
+
+
+inline
+promise waiter_queue::push(CGULL_NAMESPACE::handler* h, size_t weight)
+{
+    promise result{ h };
+
+    auto d = guts::private_of(result);
+
+    d->_waiter_weight = weight;
+
+    _push(d.take());
+
+    return result;
+}
+
+
+inline
+promise_private::type waiter_queue::pop(waiter_owner* owner) noexcept
+{
+    auto p = _pop();
+
+    if(owner)
+        p->_waiter_owner.store(owner, std::memory_order::release);
+
+    return p;
+}
+
+
+inline
+void waiter_queue::prune() noexcept
+{
+    while(_head && _head->fulfillment() != not_fulfilled)
+        _pop();
+}
+
+
+inline
+void waiter_queue::move_front(waiter_queue& to) noexcept
+{
+    if(_head)
+        to._push(_pop().take());
+}
+
+
+inline
+void waiter_queue::splice(waiter_queue& to) noexcept
+{
+    if(!_head)
+        return;
+
+    if(to._tail)
+        to._tail->_next_waiter = _head;
+    else
+        to._head = _head;
+
+    to._tail = _tail;
+    to._size += _size;
+
+    _head = _tail = nullptr;
+    _size = 0;
+}
+
+
+inline
+void waiter_queue::fulfill_all(const std::any& value, fulfillment_state_t state) noexcept
+{
+    if(!_head)
+        return;
+
+    fulfill_scope scope;
+
+    while(_head)
+        _pop()->fulfill(std::any{value}, state);
+}
+
+
+inline
+void waiter_queue::grant_all(const std::any& value, waiter_owner* owner) noexcept
+{
+    if(!_head)
+        return;
+
+    fulfill_scope scope;
+
+    while(_head)
+    {
+        const auto p = _pop();
+
+        p->_waiter_owner.store(owner, std::memory_order::release);
+        p->fulfill(std::any{value}, resolved);
+    };
+}
+
+
+inline
+void waiter_queue::_push(promise_private* p) noexcept
+{
+    p->_next_waiter = nullptr;
+
+    if(_tail)
+        _tail->_next_waiter = p;
+    else
+        _head = p;
+
+    _tail = p;
+    ++_size;
+}
+
+
+inline
+promise_private::type waiter_queue::_pop() noexcept
+{
+    const auto p = _head;
+
+    _head = std::exchange(p->_next_waiter, nullptr);
+
+    if(!_head)
+        _tail = nullptr;
+
+    --_size;
+
+    return promise_private::type::adopt(p);
+}
+
+
+CGULL_GUTS_NAMESPACE_END
+CGULL_NAMESPACE_END
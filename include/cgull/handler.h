@@ -1,24 +1,102 @@
-#pragma once
-
-#include "config.h"
-
-#include <any>
-
-
-CGULL_NAMESPACE_START
-
-class handler
-{
-    handler() = default;
-
-    virtual ~handler() = 0;
-
-public:
-
-    virtual void fulfill(std::any&& value, bool resolve) = 0;
-    virtual void try_finish() = 0;
-
-
-};
-
-CGULL_NAMESPACE_END
+#pragma once
+
+#include "config.h"
+#include "common.h"
+#include "guts/shared_data.h"
+
+#if defined(CGULL_METRICS)
+#   include "metrics.h"
+#endif
+
+#if defined(CGULL_MEMORY_ACCOUNTING)
+#   include "memory_accounting.h"
+#endif
+
+#include <stdint.h>
+#include <any>
+#include <functional>
+#include <vector>
+
+
+CGULL_NAMESPACE_START
+
+
+class promise_private;
+
+
+//! Context which owns promises bound to it. All \a promise_private::local_* calls
+//! for such promises must be made inside this context.
+class handler
+{
+    CGULL_DISABLE_COPY(handler);
+
+protected:
+    handler() = default;
+
+public:
+    using private_type = guts::shared_data_ptr<promise_private>;
+    using task_type = std::function<void()>;
+
+    //! Deferred \a fulfill(), \a try_finish() or \a bind_outer() call.
+    struct operation
+    {
+        enum kind_t : int8_t
+        {
+            fulfill_op = 0,
+            try_finish_op,
+            bind_outer_op,
+        };
+
+        kind_t                  kind = fulfill_op;
+        private_type            target = {};
+        std::any                value = {};
+        fulfillment_state_t     state = not_fulfilled;
+        private_type            outer = {};
+    };
+
+    using operation_list = std::vector<operation>;
+
+
+    virtual ~handler() = default;
+
+    //! Fulfills \a target inside handler's context.
+    //! \note Expected to end with \a target->local_fulfill().
+    virtual void fulfill(private_type target, std::any&& value, fulfillment_state_t state) = 0;
+    //! Tries to finish \a target inside handler's context.
+    //! \note Expected to end with \a target->local_try_finish().
+    virtual void try_finish(private_type target) = 0;
+    //! Runs \a task inside handler's context.
+    virtual void post(task_type&& task) = 0;
+    //! Binds \a outer to \a target inside handler's context.
+    //! \note Expected to end with \a target->local_bind_outer().
+    virtual void bind_outer(private_type target, private_type outer);
+    //! Delivers \a ops inside handler's context in given order.
+    //! \note Default implementation makes separate call per operation. Queue-based handlers
+    //!       should override it to enqueue everything at once with a single wakeup.
+    //! \sa fulfill_scope
+    virtual void dispatch(operation_list&& ops);
+
+#if defined(CGULL_METRICS)
+    //! Slot of handler's counters in \a metrics.
+    [[nodiscard]]
+    uint32_t metrics_slot() const noexcept { return _metrics_slot; }
+#endif
+#if defined(CGULL_MEMORY_ACCOUNTING)
+    //! Slot of handler's bytes in \a memory_accounting.
+    [[nodiscard]]
+    uint32_t memory_slot() const noexcept { return _memory_slot; }
+#endif
+
+
+protected:
+#if defined(CGULL_METRICS)
+    guts::metrics_slot      _metrics_slot;
+#endif
+#if defined(CGULL_MEMORY_ACCOUNTING)
+    guts::memory_slot       _memory_slot;
+#endif
+
+};
+
+
+CGULL_NAMESPACE_END
@@ -0,0 +1,386 @@
+#pragma once
+
+#include "config.h"
+#include "promise.h"
+#include "handler.h"
+#include "timer_service.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <algorithm>
+#include <any>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+CGULL_NAMESPACE_START
+
+
+struct hedge_options
+{
+    using duration = std::chrono::steady_clock::duration;
+
+    //! Time to wait for previous attempt before starting the next one.
+    duration    delay = std::chrono::milliseconds{10};
+    //! Extra attempts allowed in addition to the first one.
+    size_t      max_hedges = 1;
+    //! Use observed latency percentile instead of \a delay once there are enough samples.
+    //! \note Works with \a hedger only.
+    bool        adaptive = false;
+    double      percentile = 0.95;
+};
+
+
+//! Issues hedged calls and keeps their statistics.
+//!
+//! Each call starts \a fn and, if it isn't fulfilled within delay, duplicates it up to
+//! \a max_hedges times. The first resolution wins, all other attempts are aborted with
+//! \a promise::abort() (so producers can see \a is_aborted() and drop the work). Rejected
+//! attempt immediately starts the next hedge if there is one left; call is rejected with
+//! the last rejection when every attempt failed.
+//!
+//! With \a adaptive option delay is the \a percentile of latencies of recent winners.
+//!
+//! Promises of calls are owned by handler given to constructor and hedges are started
+//! inside it. Timers fire on service's own thread, so \a fn never runs there.
+//!
+//! \note Must outlive all its calls.
+class hedger
+{
+    CGULL_DISABLE_COPY(hedger);
+    CGULL_DISABLE_MOVE(hedger);
+
+public:
+    using clock     = std::chrono::steady_clock;
+    using duration  = clock::duration;
+
+    struct statistics
+    {
+        uint64_t    calls = 0;
+        //! Calls which started at least one hedge.
+        uint64_t    hedged = 0;
+        //! Extra attempts started.
+        uint64_t    hedges = 0;
+        //! Calls won by a hedge, not by the first attempt.
+        uint64_t    hedge_wins = 0;
+        //! Calls where every attempt failed.
+        uint64_t    failures = 0;
+    };
+
+
+    explicit
+    hedger(CGULL_NAMESPACE::handler* h, hedge_options options = {});
+
+    //! \a fn must return \a promise. Exception thrown by \a fn counts as rejection.
+    template< typename _Fn >
+    promise operator()(_Fn&& fn);
+
+    //! Delay used by the next call.
+    [[nodiscard]]
+    duration current_delay() const;
+    [[nodiscard]]
+    statistics stats() const;
+
+
+private:
+    static constexpr size_t _sample_count = 256;
+    //! Samples needed before adaptive delay is used.
+    static constexpr size_t _min_samples = 32;
+
+    CGULL_NAMESPACE::handler*
+                            _handler;
+    hedge_options           _options;
+
+    mutable std::mutex      _mutex;
+    std::array<duration, _sample_count>
+                            _samples{};
+    size_t                  _sampled = 0;
+    duration                _adaptive_delay;
+
+    std::atomic<uint64_t>   _calls = 0;
+    std::atomic<uint64_t>   _hedged = 0;
+    std::atomic<uint64_t>   _hedges = 0;
+    std::atomic<uint64_t>   _hedge_wins = 0;
+    std::atomic<uint64_t>   _failures = 0;
+
+
+    template< typename _Fn >
+    class _call;
+
+    void _record(duration latency);
+
+};
+
+
+//! Single hedged call of \a fn with no statistics kept.
+//! \sa hedger
+template< typename _Fn >
+promise hedge(_Fn&& fn, CGULL_NAMESPACE::handler* h, hedge_options options = {});
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+template< typename _Fn >
+class hedger::_call : public std::enable_shared_from_this<hedger::_call<_Fn>>
+{
+public:
+    _call(hedger* owner, _Fn&& fn, duration delay)
+        : _owner(owner)
+        , _fn(std::move(fn))
+        , _delay(delay)
+        , _result(owner->_handler)
+    { }
+
+    promise start()
+    {
+        _launch();
+
+        return _result;
+    }
+
+
+private:
+    hedger*                         _owner;
+    _Fn                             _fn;
+    duration                        _delay;
+    promise                         _result;
+
+    std::mutex                      _mutex;
+    std::vector<promise>            _attempts;
+    size_t                          _failed = 0;
+    bool                            _done = false;
+    guts::timer_call                _timer;
+
+
+    size_t _max_attempts() const noexcept { return _owner->_options.max_hedges + 1; }
+
+    //! Starts next attempt and arms timer for the one after it.
+    void _launch()
+    {
+        auto self = this->shared_from_this();
+        const auto started = clock::now();
+
+        size_t index;
+
+        {
+            std::lock_guard lock{ _mutex };
+
+            if(_done || _attempts.size() >= _max_attempts())
+                return;
+
+            index = _attempts.size();
+
+            // placeholder until fn returns
+            _attempts.emplace_back();
+        };
+
+        if(index == 1)
+            ++_owner->_hedged;
+
+        if(index)
+            ++_owner->_hedges;
+
+        promise attempt;
+
+        try
+        {
+            attempt = std::invoke(_fn);
+        }
+        catch(...)
+        {
+            attempt = promise{}.reject(std::any{std::current_exception()});
+        };
+
+        {
+            std::lock_guard lock{ _mutex };
+
+            _attempts[index] = attempt;
+
+            // the call is over already, drop this attempt right away
+            if(_done)
+            {
+                attempt.abort();
+
+                return;
+            };
+        };
+
+        attempt
+            .then([self, index, started](std::any value) { self->_won(index, started, std::move(value)); })
+            .rescue([self](std::any error) { self->_lost(std::move(error)); });
+
+        _arm();
+    }
+
+    void _arm()
+    {
+        std::lock_guard lock{ _mutex };
+
+        // hedge of rejected attempt is launched without waiting, so earlier timer may be armed still
+        if(_done || _attempts.size() >= _max_attempts())
+            return _timer.cancel();
+
+        _timer.arm(_owner->_handler, clock::now() + _delay, [self = this->shared_from_this()]{ self->_launch(); });
+    }
+
+    void _won(size_t index, clock::time_point started, std::any&& value)
+    {
+        std::vector<promise> losers;
+
+        {
+            std::lock_guard lock{ _mutex };
+
+            if(_done)
+                return;
+
+            _done = true;
+
+            _timer.cancel();
+
+            for(size_t i = 0; i < _attempts.size(); ++i)
+                if(i != index)
+                    losers.push_back(_attempts[i]);
+        };
+
+        _owner->_record(clock::now() - started);
+
+        if(index)
+            ++_owner->_hedge_wins;
+
+        for(auto& l : losers)
+            l.abort();
+
+        _result.resolve(std::move(value));
+    }
+
+    void _lost(std::any&& error)
+    {
+        bool next = false;
+        bool failed = false;
+
+        {
+            std::lock_guard lock{ _mutex };
+
+            if(_done)
+                return;
+
+            ++_failed;
+
+            if(_failed == _max_attempts())
+                _done = failed = true;
+            else if(_failed == _attempts.size())
+                next = true;
+        };
+
+        // nothing is in flight, don't wait for timer
+        if(next)
+            return _launch();
+
+        if(!failed)
+            return;
+
+        ++_owner->_failures;
+
+        _result.reject(std::move(error));
+    }
+
+};
+
+
+inline
+hedger::hedger(CGULL_NAMESPACE::handler* h, hedge_options options)
+    : _handler(h)
+    , _options(options)
+    , _adaptive_delay(options.delay)
+{
+    assert(h && "cgull: hedger needs handler, timer fires on its own thread");
+}
+
+
+template< typename _Fn > inline
+promise hedger::operator()(_Fn&& fn)
+{
+    static_assert(
+        std::is_same_v<std::decay_t<std::invoke_result_t<std::decay_t<_Fn>&>>, promise>,
+        "cgull: hedged function must return promise"
+    );
+
+    ++_calls;
+
+    return std::make_shared<_call<std::decay_t<_Fn>>>(this, std::decay_t<_Fn>{std::forward<_Fn>(fn)}, current_delay())->start();
+}
+
+
+inline
+hedger::duration hedger::current_delay() const
+{
+    if(!_options.adaptive)
+        return _options.delay;
+
+    std::lock_guard lock{ _mutex };
+
+    return _adaptive_delay;
+}
+
+
+inline
+hedger::statistics hedger::stats() const
+{
+    return { _calls, _hedged, _hedges, _hedge_wins, _failures };
+}
+
+
+inline
+void hedger::_record(duration latency)
+{
+    if(!_options.adaptive)
+        return;
+
+    std::lock_guard lock{ _mutex };
+
+    _samples[_sampled++ % _sample_count] = latency;
+
+    // recompute percentile every few samples only
+    if(_sampled < _min_samples || _sampled % 16)
+        return;
+
+    std::array<duration, _sample_count> sorted;
+
+    const auto count = std::min(_sampled, _sample_count);
+    const auto nth = std::min(count - 1, static_cast<size_t>(count * std::clamp(_options.percentile, 0.0, 1.0)));
+
+    std::copy_n(_samples.begin(), count, sorted.begin());
+    std::nth_element(sorted.begin(), sorted.begin() + nth, sorted.begin() + count);
+
+    _adaptive_delay = sorted[nth];
+}
+
+
+template< typename _Fn > inline
+promise hedge(_Fn&& fn, CGULL_NAMESPACE::handler* h, hedge_options options)
+{
+    options.adaptive = false;
+
+    // hedger must live until the call is over
+    auto owner = std::make_shared<hedger>(h, options);
+    auto result = (*owner)(std::forward<_Fn>(fn));
+
+    result.then([owner]{ }).rescue([owner]{ });
+
+    return result;
+}
+
+
+CGULL_NAMESPACE_END
@@ -0,0 +1,746 @@
+#pragma once
+
+#include "config.h"
+
+#if defined(CGULL_OS_LINUX)
+
+#include "promise.h"
+#include "event_loop_handler.h"
+#include "thread_pool_handler.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+CGULL_NAMESPACE_START
+
+
+//! Asynchronous file I/O.
+//!
+//! Every operation returns promise owned by context's event loop. It is resolved with
+//! non-negative result of syscall (bytes transferred, fd, 0) or rejected with negative errno,
+//! both as \a int.
+//! \note Buffers, paths and \a statx structs must stay alive until promise is fulfilled.
+namespace io
+{
+    struct context_options
+    {
+        //! Submission queue size.
+        unsigned    entries = 256;
+        //! Don't try io_uring, use thread pool only.
+        bool        force_fallback = false;
+        //! Thread pool size for kernels without io_uring.
+        size_t      fallback_threads = 4;
+    };
+
+
+    //! io_uring instance bound to event loop.
+    //!
+    //! Requests are only queued into submission ring. The whole batch goes to kernel with a single
+    //! \a io_uring_enter() right before loop waits for events (or earlier if ring is full).
+    //! Completions are reaped inside loop by ring's eventfd and CQE's user_data points straight
+    //! to promise. If kernel refuses the batch there, queued requests are rejected with its
+    //! negative error code, so loop isn't unwound.
+    //!
+    //! If io_uring isn't available, requests run as blocking syscalls on a thread pool and
+    //! promises are fulfilled through the loop.
+    class context
+    {
+        CGULL_DISABLE_COPY(context);
+        CGULL_DISABLE_MOVE(context);
+
+    public:
+        //! \note Must be created in loop's context.
+        explicit
+        context(event_loop_handler& loop, context_options options = {});
+        //! Cancels requests in flight and waits for kernel to give them back. Cancelled ones
+        //! are rejected with \a -ECANCELED, the rest are fulfilled as usual.
+        //! \note Must be destroyed in loop's context. Kernels before 5.19 can't cancel all
+        //!       at once, so destructor waits for requests to complete there.
+        ~context();
+
+        //! Fills submission entry. May leave buffer index and flags untouched.
+        using prepare_fn = void (*)(io_uring_sqe& sqe, const void* args);
+        //! Blocking implementation of the same request.
+        using fallback_fn = int (*)(const void* args);
+
+        //! Registers buffers for \a read_fixed() and \a write_fixed(). Kernel pins them, so
+        //! requests skip page mapping on every call.
+        //! \note Ignored by fallback.
+        void register_buffers(std::span<const iovec> buffers);
+        void unregister_buffers();
+
+        //! Queues request. \a args must be trivially copyable. Rejected with \a -EBUSY if ring is
+        //! full and kernel takes nothing from it.
+        template< typename _Args >
+        promise submit(const _Args& args, prepare_fn prepare, fallback_fn fallback);
+
+        //! Sends queued requests to kernel. Requests kernel didn't take stay queued.
+        //! \return Submitted requests count.
+        size_t flush();
+
+        [[nodiscard]]
+        bool uses_uring() const noexcept;
+        [[nodiscard]]
+        event_loop_handler& loop() const noexcept;
+
+
+    private:
+        event_loop_handler&     _loop;
+
+        int                     _ring = -1;
+        int                     _event = -1;
+
+        void*                   _sq_ptr = nullptr;
+        size_t                  _sq_size = 0;
+        void*                   _cq_ptr = nullptr;
+        size_t                  _cq_size = 0;
+        io_uring_sqe*           _sqes = nullptr;
+        size_t                  _sqes_size = 0;
+
+        unsigned*               _sq_head = nullptr;
+        unsigned*               _sq_tail = nullptr;
+        unsigned*               _sq_array = nullptr;
+        unsigned                _sq_mask = 0;
+        unsigned                _sq_entries = 0;
+        unsigned*               _cq_head = nullptr;
+        unsigned*               _cq_tail = nullptr;
+        io_uring_cqe*           _cqes = nullptr;
+        unsigned                _cq_mask = 0;
+
+        //! Local tail, published on flush.
+        unsigned                _tail = 0;
+        unsigned                _queued = 0;
+        //! Requests holding promise reference, queued or submitted.
+        size_t                  _in_flight = 0;
+        size_t                  _hook = 0;
+
+        std::unique_ptr<thread_pool_handler>
+                                _pool;
+
+
+        bool            _setup(unsigned entries) noexcept;
+        //! Gives back every request before ring is gone.
+        void            _drain() noexcept;
+        void            _teardown() noexcept;
+        //! \return Submitted requests count or negative error code.
+        long            _enter() noexcept;
+        //! Takes back requests kernel didn't take and rejects them with \a error.
+        void            _reject_queued(int error) noexcept;
+        //! \return nullptr if there is no room in ring.
+        io_uring_sqe*   _next_sqe() noexcept;
+        void            _reap() noexcept;
+
+    };
+
+
+    promise read(context& ctx, int fd, void* buf, unsigned size, int64_t offset);
+    promise write(context& ctx, int fd, const void* buf, unsigned size, int64_t offset);
+    //! \a buf must be inside buffer registered with \a index.
+    promise read_fixed(context& ctx, int fd, void* buf, unsigned size, int64_t offset, int index);
+    //! \a buf must be inside buffer registered with \a index.
+    promise write_fixed(context& ctx, int fd, const void* buf, unsigned size, int64_t offset, int index);
+    promise openat(context& ctx, int dirfd, const char* path, int flags, mode_t mode = 0);
+    promise fsync(context& ctx, int fd, bool data_only = false);
+    promise statx(context& ctx, int dirfd, const char* path, int flags, unsigned mask, struct ::statx* result);
+}
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+namespace io
+{
+    namespace _impl
+    {
+        //! Heap-allocated request for fallback path.
+        template< typename _Args >
+        struct request
+        {
+            promise_private::type   target;
+            _Args                   args;
+        };
+
+        inline
+        int check(long result) noexcept
+        {
+            return result < 0 ? -errno : static_cast<int>(result);
+        }
+
+        inline
+        std::atomic_ref<unsigned> ref(unsigned* v) noexcept
+        {
+            return std::atomic_ref<unsigned>{ *v };
+        }
+    }
+
+
+    inline
+    context::context(event_loop_handler& loop, context_options options)
+        : _loop(loop)
+    {
+        if(!options.force_fallback && _setup(options.entries))
+            return;
+
+        _teardown();
+
+        _pool = std::make_unique<thread_pool_handler>(options.fallback_threads);
+    }
+
+
+    inline
+    context::~context()
+    {
+        // fallback requests fulfill through the loop, so let them finish first
+        _pool.reset();
+
+        if(_ring >= 0)
+            _drain();
+
+        _teardown();
+    }
+
+
+    inline
+    void context::register_buffers(std::span<const iovec> buffers)
+    {
+        if(!uses_uring())
+            return;
+
+        if(syscall(__NR_io_uring_register, _ring, IORING_REGISTER_BUFFERS, buffers.data(), static_cast<unsigned>(buffers.size())) < 0)
+            throw std::system_error(errno, std::system_category(), "cgull: can't register io_uring buffers");
+    }
+
+
+    inline
+    void context::unregister_buffers()
+    {
+        if(uses_uring())
+            syscall(__NR_io_uring_register, _ring, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+    }
+
+
+    template< typename _Args > inline
+    promise context::submit(const _Args& args, prepare_fn prepare, fallback_fn fallback)
+    {
+        static_assert(std::is_trivially_copyable_v<_Args>, "cgull: io request args must be trivially copyable");
+
+        promise result{ &_loop };
+
+        if(!uses_uring())
+        {
+            auto request = std::make_shared<_impl::request<_Args>>(_impl::request<_Args>{ guts::private_of(result), args });
+
+            _pool->post(
+                [request, fallback]()
+                {
+                    const int r = fallback(&request->args);
+
+                    request->target->fulfill(std::any{r}, r < 0 ? rejected : resolved);
+                }
+            );
+
+            return result;
+        };
+
+        auto sqe = _next_sqe();
+
+        if(!sqe)
+            return result.reject(std::any{-EBUSY});
+
+        *sqe = io_uring_sqe{};
+
+        prepare(*sqe, &args);
+
+        // reference is released by _reap()
+        auto d = guts::private_of(result);
+
+        d->_ref.ref();
+        sqe->user_data = reinterpret_cast<uint64_t>(d.data());
+
+        ++_in_flight;
+
+        return result;
+    }
+
+
+    inline
+    size_t context::flush()
+    {
+        const auto r = _enter();
+
+        if(r < 0)
+            throw std::system_error(static_cast<int>(-r), std::system_category(), "cgull: io_uring_enter() failed");
+
+        return static_cast<size_t>(r);
+    }
+
+
+    inline
+    bool context::uses_uring() const noexcept
+    {
+        return !_pool;
+    }
+
+
+    inline
+    event_loop_handler& context::loop() const noexcept
+    {
+        return _loop;
+    }
+
+
+    inline
+    bool context::_setup(unsigned entries) noexcept
+    {
+        io_uring_params params{};
+
+        _ring = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+
+        if(_ring < 0)
+            return false;
+
+        _sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        _cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+        if(params.features & IORING_FEAT_SINGLE_MMAP)
+            _sq_size = _cq_size = std::max(_sq_size, _cq_size);
+
+        _sq_ptr = mmap(nullptr, _sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQ_RING);
+
+        if(_sq_ptr == MAP_FAILED)
+            return _sq_ptr = nullptr, false;
+
+        if(params.features & IORING_FEAT_SINGLE_MMAP)
+            _cq_ptr = _sq_ptr;
+        else
+        {
+            _cq_ptr = mmap(nullptr, _cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_CQ_RING);
+
+            if(_cq_ptr == MAP_FAILED)
+                return _cq_ptr = nullptr, false;
+        };
+
+        _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        _sqes = static_cast<io_uring_sqe*>(mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQES));
+
+        if(_sqes == MAP_FAILED)
+            return _sqes = nullptr, false;
+
+        const auto sq = static_cast<char*>(_sq_ptr);
+        const auto cq = static_cast<char*>(_cq_ptr);
+
+        _sq_head    = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        _sq_tail    = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        _sq_array   = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        _sq_mask    = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        _sq_entries = params.sq_entries;
+        _cq_head    = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        _cq_tail    = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        _cqes       = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        _cq_mask    = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+
+        _tail = *_sq_tail;
+
+        // completions wake the loop
+        _event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+        if(_event < 0 || syscall(__NR_io_uring_register, _ring, IORING_REGISTER_EVENTFD, &_event, 1) < 0)
+            return false;
+
+        _loop.watch(_event, EPOLLIN,
+            [this](uint32_t)
+            {
+                uint64_t value;
+
+                [[maybe_unused]] const auto r = ::read(_event, &value, sizeof(value));
+
+                _reap();
+            }
+        );
+
+        _hook = _loop.before_wait(
+            [this]
+            {
+                // i.e. EBUSY on CQ overflow, nothing was taken
+                if(const auto r = _enter(); r < 0)
+                    _reject_queued(static_cast<int>(r));
+            }
+        );
+
+        return true;
+    }
+
+
+    inline
+    void context::_drain() noexcept
+    {
+        _enter();
+        _reject_queued(-ECANCELED);
+
+        if(!_in_flight)
+            return;
+
+#if defined(IORING_ASYNC_CANCEL_ANY)
+        // its own completion has no promise and is skipped by _reap()
+        if(auto sqe = _next_sqe())
+        {
+            *sqe = io_uring_sqe{};
+
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+
+            _enter();
+            _reject_queued(-ECANCELED);
+        };
+#endif
+
+        while(_in_flight)
+        {
+            _reap();
+
+            if(!_in_flight)
+                break;
+
+            if(syscall(__NR_io_uring_enter, _ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR)
+                break;
+        };
+    }
+
+
+    inline
+    void context::_teardown() noexcept
+    {
+        if(_hook)
+            _loop.remove_hook(_hook);
+
+        if(_event >= 0)
+        {
+            _loop.unwatch(_event);
+
+            close(_event);
+
+            _event = -1;
+        };
+
+        if(_sqes)
+            munmap(_sqes, _sqes_size);
+        if(_cq_ptr && _cq_ptr != _sq_ptr)
+            munmap(_cq_ptr, _cq_size);
+        if(_sq_ptr)
+            munmap(_sq_ptr, _sq_size);
+        if(_ring >= 0)
+            close(_ring);
+
+        _sqes = nullptr;
+        _cq_ptr = _sq_ptr = nullptr;
+        _ring = -1;
+    }
+
+
+    inline
+    long context::_enter() noexcept
+    {
+        if(!_queued)
+            return 0;
+
+        _impl::ref(_sq_tail).store(_tail, std::memory_order::release);
+
+        long r;
+
+        do
+            r = syscall(__NR_io_uring_enter, _ring, _queued, 0, 0, nullptr, 0);
+        while(r < 0 && errno == EINTR);
+
+        if(r < 0)
+            return -errno;
+
+        // not submitted entries stay in ring for the next flush
+        _queued -= static_cast<unsigned>(r);
+
+        return r;
+    }
+
+
+    inline
+    void context::_reject_queued(int error) noexcept
+    {
+        // kernel takes entries from head, so the rest is at the tail
+        for(; _queued; --_queued)
+        {
+            const auto& sqe = _sqes[--_tail & _sq_mask];
+
+            if(!sqe.user_data)
+                continue;
+
+            promise_private::type d{ reinterpret_cast<promise_private*>(sqe.user_data) };
+
+            d->_ref.deref();
+            d->local_fulfill(std::any{error}, rejected);
+
+            --_in_flight;
+        };
+
+        _impl::ref(_sq_tail).store(_tail, std::memory_order::release);
+    }
+
+
+    inline
+    io_uring_sqe* context::_next_sqe() noexcept
+    {
+        // ring is full: kernel consumes submitted entries synchronously, but may take only part
+        while(_tail - _impl::ref(_sq_head).load(std::memory_order::acquire) >= _sq_entries)
+        {
+            const auto r = _enter();
+
+            if(r < 0)
+                _reject_queued(static_cast<int>(r));
+            else if(!r)
+                return nullptr;
+        };
+
+        const auto index = _tail & _sq_mask;
+
+        _sq_array[index] = index;
+
+        ++_tail;
+        ++_queued;
+
+        return &_sqes[index];
+    }
+
+
+    inline
+    void context::_reap() noexcept
+    {
+        auto head = _impl::ref(_cq_head).load(std::memory_order::relaxed);
+        const auto tail = _impl::ref(_cq_tail).load(std::memory_order::acquire);
+
+        for(; head != tail; ++head)
+        {
+            const auto& cqe = _cqes[head & _cq_mask];
+
+            if(!cqe.user_data)
+                continue;
+
+            --_in_flight;
+
+            // take reference back from submit()
+            promise_private::type d{ reinterpret_cast<promise_private*>(cqe.user_data) };
+
+            d->_ref.deref();
+
+            // reaping happens inside loop, so no need to go through handler
+            d->local_fulfill(std::any{cqe.res}, cqe.res < 0 ? rejected : resolved);
+        };
+
+        _impl::ref(_cq_head).store(head, std::memory_order::release);
+    }
+
+
+
+    namespace _impl
+    {
+        struct rw_args
+        {
+            int         fd;
+            void*       buf;
+            unsigned    size;
+            int64_t     offset;
+            int         index;
+        };
+
+        struct open_args
+        {
+            int         dirfd;
+            const char* path;
+            int         flags;
+            mode_t      mode;
+        };
+
+        struct fsync_args
+        {
+            int         fd;
+            bool        data_only;
+        };
+
+        struct statx_args
+        {
+            int             dirfd;
+            const char*     path;
+            int             flags;
+            unsigned        mask;
+            struct ::statx* result;
+        };
+
+        inline
+        void prepare_rw(io_uring_sqe& sqe, uint8_t op, const rw_args& a) noexcept
+        {
+            sqe.opcode = op;
+            sqe.fd = a.fd;
+            sqe.addr = reinterpret_cast<uint64_t>(a.buf);
+            sqe.len = a.size;
+            sqe.off = static_cast<uint64_t>(a.offset);
+            sqe.buf_index = static_cast<uint16_t>(a.index);
+        }
+    }
+
+
+    inline
+    promise read(context& ctx, int fd, void* buf, unsigned size, int64_t offset)
+    {
+        return ctx.submit(
+            _impl::rw_args{ fd, buf, size, offset, 0 },
+            [](io_uring_sqe& sqe, const void* a) { _impl::prepare_rw(sqe, IORING_OP_READ, *static_cast<const _impl::rw_args*>(a)); },
+            [](const void* a)
+            {
+                const auto& args = *static_cast<const _impl::rw_args*>(a);
+
+                return _impl::check(pread(args.fd, args.buf, args.size, args.offset));
+            }
+        );
+    }
+
+
+    inline
+    promise write(context& ctx, int fd, const void* buf, unsigned size, int64_t offset)
+    {
+        return ctx.submit(
+            _impl::rw_args{ fd, const_cast<void*>(buf), size, offset, 0 },
+            [](io_uring_sqe& sqe, const void* a) { _impl::prepare_rw(sqe, IORING_OP_WRITE, *static_cast<const _impl::rw_args*>(a)); },
+            [](const void* a)
+            {
+                const auto& args = *static_cast<const _impl::rw_args*>(a);
+
+                return _impl::check(pwrite(args.fd, args.buf, args.size, args.offset));
+            }
+        );
+    }
+
+
+    inline
+    promise read_fixed(context& ctx, int fd, void* buf, unsigned size, int64_t offset, int index)
+    {
+        return ctx.submit(
+            _impl::rw_args{ fd, buf, size, offset, index },
+            [](io_uring_sqe& sqe, const void* a) { _impl::prepare_rw(sqe, IORING_OP_READ_FIXED, *static_cast<const _impl::rw_args*>(a)); },
+            [](const void* a)
+            {
+                const auto& args = *static_cast<const _impl::rw_args*>(a);
+
+                return _impl::check(pread(args.fd, args.buf, args.size, args.offset));
+            }
+        );
+    }
+
+
+    inline
+    promise write_fixed(context& ctx, int fd, const void* buf, unsigned size, int64_t offset, int index)
+    {
+        return ctx.submit(
+            _impl::rw_args{ fd, const_cast<void*>(buf), size, offset, index },
+            [](io_uring_sqe& sqe, const void* a) { _impl::prepare_rw(sqe, IORING_OP_WRITE_FIXED, *static_cast<const _impl::rw_args*>(a)); },
+            [](const void* a)
+            {
+                const auto& args = *static_cast<const _impl::rw_args*>(a);
+
+                return _impl::check(pwrite(args.fd, args.buf, args.size, args.offset));
+            }
+        );
+    }
+
+
+    inline
+    promise openat(context& ctx, int dirfd, const char* path, int flags, mode_t mode)
+    {
+        return ctx.submit(
+            _impl::open_args{ dirfd, path, flags, mode },
+            [](io_uring_sqe& sqe, const void* a)
+            {
+                const auto& args = *static_cast<const _impl::open_args*>(a);
+
+                sqe.opcode = IORING_OP_OPENAT;
+                sqe.fd = args.dirfd;
+                sqe.addr = reinterpret_cast<uint64_t>(args.path);
+                sqe.len = args.mode;
+                sqe.open_flags = static_cast<uint32_t>(args.flags);
+            },
+            [](const void* a)
+            {
+                const auto& args = *static_cast<const _impl::open_args*>(a);
+
+                return _impl::check(::openat(args.dirfd, args.path, args.flags, args.mode));
+            }
+        );
+    }
+
+
+    inline
+    promise fsync(context& ctx, int fd, bool data_only)
+    {
+        return ctx.submit(
+            _impl::fsync_args{ fd, data_only },
+            [](io_uring_sqe& sqe, const void* a)
+            {
+                const auto& args = *static_cast<const _impl::fsync_args*>(a);
+
+                sqe.opcode = IORING_OP_FSYNC;
+                sqe.fd = args.fd;
+                sqe.fsync_flags = args.data_only ? IORING_FSYNC_DATASYNC : 0;
+            },
+            [](const void* a)
+            {
+                const auto& args = *static_cast<const _impl::fsync_args*>(a);
+
+                return _impl::check(args.data_only ? ::fdatasync(args.fd) : ::fsync(args.fd));
+            }
+        );
+    }
+
+
+    inline
+    promise statx(context& ctx, int dirfd, const char* path, int flags, unsigned mask, struct ::statx* result)
+    {
+        return ctx.submit(
+            _impl::statx_args{ dirfd, path, flags, mask, result },
+            [](io_uring_sqe& sqe, const void* a)
+            {
+                const auto& args = *static_cast<const _impl::statx_args*>(a);
+
+                sqe.opcode = IORING_OP_STATX;
+                sqe.fd = args.dirfd;
+                sqe.addr = reinterpret_cast<uint64_t>(args.path);
+                sqe.len = args.mask;
+                sqe.off = reinterpret_cast<uint64_t>(args.result);
+                sqe.statx_flags = static_cast<uint32_t>(args.flags);
+            },
+            [](const void* a)
+            {
+                const auto& args = *static_cast<const _impl::statx_args*>(a);
+
+                return _impl::check(::statx(args.dirfd, args.path, args.flags, args.mask, args.result));
+            }
+        );
+    }
+}
+
+
+CGULL_NAMESPACE_END
+
+#endif
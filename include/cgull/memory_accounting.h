@@ -0,0 +1,597 @@
+#pragma once
+
+#include "config.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+
+CGULL_NAMESPACE_START
+
+
+CGULL_GUTS_NAMESPACE_START
+class memory_charge;
+CGULL_GUTS_NAMESPACE_END
+
+
+//! Bytes held by promises, grouped by what holds them.
+//!
+//! Available only if cgull is built with \a CGULL_MEMORY_ACCOUNTING defined, otherwise
+//! nothing is charged. Each promise charges its own size, size of its callback's captures,
+//! \a any_list it holds as result and \a cgull::async store entry waiting for it. Bytes are
+//! accounted by handler which owns promise and by user tag: promise takes tag of
+//! \a tag_scope it's created in, promises chained to it without own tag inherit it, so
+//! whole chain is accounted to one subsystem.
+//!
+//! Soft limits call \a on_soft_limit() callback from the thread which went over the limit,
+//! once until usage drops below the limit again.
+//!
+//! \code
+//! auto& m = cgull::memory_accounting::instance();
+//! const auto ingest = m.register_tag("ingest");
+//!
+//! m.set_tag_soft_limit(ingest, 512 << 20);
+//! m.on_soft_limit([](const auto& e) { shed_load(e.index); });
+//!
+//! cgull::memory_accounting::tag_scope scope{ ingest };
+//! fetch().then(parse).then(store);
+//! \endcode
+//!
+//! \note Thread-safe.
+class memory_accounting
+{
+    CGULL_DISABLE_COPY(memory_accounting);
+    CGULL_DISABLE_MOVE(memory_accounting);
+
+    friend class guts::memory_charge;
+
+public:
+    enum category : uint8_t
+    {
+        //! \a promise_private itself.
+        promises = 0,
+        //! Captures of \a then() / \a rescue() callbacks.
+        finishers,
+        //! \a any_list results of waiting for many inners.
+        results,
+        //! Entries of \a cgull::async callback store.
+        async_store,
+
+        category_count
+    };
+
+    enum limit_kind : uint8_t
+    {
+        total_limit = 0,
+        handler_limit,
+        tag_limit
+    };
+
+    struct usage
+    {
+        int64_t bytes;
+        int64_t high_water;
+    };
+
+    struct limit_event
+    {
+        limit_kind  kind;
+        //! Handler slot or tag, 0 for total.
+        uint32_t    index;
+        int64_t     bytes;
+        int64_t     limit;
+    };
+
+    using limit_callback = std::function<void(const limit_event&)>;
+
+    //! Handlers over it share slot 0 with context-local promises.
+    static constexpr uint32_t max_handlers = 64;
+    //! Tag 0 is for promises created outside of \a tag_scope.
+    static constexpr uint32_t max_tags = 64;
+
+
+    //! Promises created by calling thread while scope lives are accounted to \a tag.
+    class tag_scope
+    {
+        CGULL_DISABLE_COPY(tag_scope);
+        CGULL_DISABLE_MOVE(tag_scope);
+
+    public:
+        explicit
+        tag_scope(uint32_t tag) noexcept;
+        ~tag_scope();
+
+
+    private:
+        const uint32_t _previous;
+
+    };
+
+
+    static memory_accounting& instance();
+
+    //! \return Tag for \a tag_scope, 0 if all are taken.
+    uint32_t register_tag(std::string name);
+    [[nodiscard]]
+    std::string tag_name(uint32_t tag) const;
+    //! Tag of calling thread's \a tag_scope.
+    static uint32_t current_tag() noexcept;
+
+    //! \return Slot for handler, 0 if all are taken.
+    uint32_t register_handler();
+    void     unregister_handler(uint32_t slot);
+
+    [[nodiscard]]
+    usage total() const noexcept;
+    [[nodiscard]]
+    usage of(category c) const noexcept;
+    [[nodiscard]]
+    usage of_handler(uint32_t slot) const noexcept;
+    [[nodiscard]]
+    usage of_tag(uint32_t tag) const noexcept;
+    //! Sets high-water marks to current usage.
+    void     reset_high_water() noexcept;
+
+    //! 0 removes limit.
+    void     set_soft_limit(int64_t bytes) noexcept;
+    void     set_handler_soft_limit(uint32_t slot, int64_t bytes) noexcept;
+    void     set_tag_soft_limit(uint32_t tag, int64_t bytes) noexcept;
+    //! Callback shouldn't block: it's called inside of promise operations.
+    void     on_soft_limit(limit_callback callback);
+
+
+private:
+    struct _counter
+    {
+        std::atomic<int64_t>    bytes = 0;
+        std::atomic<int64_t>    high_water = 0;
+        std::atomic<int64_t>    limit = 0;
+        std::atomic<bool>       over = false;
+    };
+
+    _counter                    _total;
+    _counter                    _categories[category_count];
+    _counter                    _handlers[max_handlers];
+    _counter                    _tags[max_tags];
+
+    mutable std::mutex          _mutex;
+    bool                        _handler_used[max_handlers] = {};
+    std::string                 _tag_names[max_tags];
+    uint32_t                    _tag_count = 1;
+    std::shared_ptr<limit_callback>
+                                _callback;
+
+
+    memory_accounting() = default;
+
+    void     _charge(uint32_t handler_slot, uint32_t tag, category c, int64_t delta) noexcept;
+    //! Moves \a bytes between handlers and tags, total and categories stay the same.
+    void     _move(uint32_t from_slot, uint32_t from_tag, uint32_t to_slot, uint32_t to_tag, int64_t bytes) noexcept;
+    //! \return Bytes after adding \a delta.
+    static int64_t _add(_counter& counter, int64_t delta) noexcept;
+    void     _check_limit(_counter& counter, int64_t bytes, limit_kind kind, uint32_t index) noexcept;
+    void     _notify(const limit_event& e) noexcept;
+
+    static usage _usage(const _counter& counter) noexcept;
+    static uint32_t& _local_tag() noexcept;
+
+};
+
+
+CGULL_GUTS_NAMESPACE_START
+
+
+//! Bytes charged by one promise, released when it dies.
+//!
+//! \note Context-local like the rest of \a promise_private.
+class memory_charge
+{
+    CGULL_DISABLE_COPY(memory_charge);
+    CGULL_DISABLE_MOVE(memory_charge);
+
+public:
+    memory_charge() noexcept : _tag(memory_accounting::current_tag()) { }
+    ~memory_charge();
+
+    //! Sets bytes held of category \a c.
+    void set(memory_accounting::category c, int64_t bytes) noexcept;
+    //! Moves charged bytes to handler \a slot.
+    void set_handler(uint32_t slot) noexcept;
+    //! Takes tag of \a inner if this promise has none.
+    void inherit(const memory_charge& inner) noexcept;
+
+
+private:
+    uint32_t    _handler = 0;
+    //! Read by outers inheriting it from other threads.
+    std::atomic<uint32_t>
+                _tag;
+    int64_t     _bytes[memory_accounting::category_count] = {};
+
+
+    void _move(uint32_t handler_slot, uint32_t tag) noexcept;
+
+};
+
+
+//! Handler's registration in \a memory_accounting.
+class memory_slot
+{
+    CGULL_DISABLE_COPY(memory_slot);
+    CGULL_DISABLE_MOVE(memory_slot);
+
+public:
+    memory_slot() : _slot(memory_accounting::instance().register_handler()) { }
+    ~memory_slot() { memory_accounting::instance().unregister_handler(_slot); }
+
+    operator uint32_t() const noexcept { return _slot; }
+
+
+private:
+    const uint32_t _slot;
+
+};
+
+
+CGULL_GUTS_NAMESPACE_END
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+inline
+memory_accounting::tag_scope::tag_scope(uint32_t tag) noexcept
+    : _previous(std::exchange(_local_tag(), tag < max_tags ? tag : 0))
+{ }
+
+
+inline
+memory_accounting::tag_scope::~tag_scope()
+{
+    _local_tag() = _previous;
+}
+
+
+inline
+memory_accounting& memory_accounting::instance()
+{
+    // never destroyed: promises of static services may die after it
+    static const auto m = new memory_accounting;
+
+    return *m;
+}
+
+
+inline
+uint32_t memory_accounting::register_tag(std::string name)
+{
+    std::lock_guard lock{ _mutex };
+
+    if(_tag_count >= max_tags)
+        return 0;
+
+    _tag_names[_tag_count] = std::move(name);
+
+    return _tag_count++;
+}
+
+
+inline
+std::string memory_accounting::tag_name(uint32_t tag) const
+{
+    if(tag >= max_tags)
+        return {};
+
+    std::lock_guard lock{ _mutex };
+
+    return _tag_names[tag];
+}
+
+
+inline
+uint32_t memory_accounting::current_tag() noexcept
+{
+    return _local_tag();
+}
+
+
+inline
+uint32_t memory_accounting::register_handler()
+{
+    std::lock_guard lock{ _mutex };
+
+    for(uint32_t i = 1; i < max_handlers; ++i)
+    {
+        // promises of the previous owner still hold bytes of busy slot
+        if(_handler_used[i] || _handlers[i].bytes.load(std::memory_order::relaxed))
+            continue;
+
+        _handler_used[i] = true;
+        _handlers[i].high_water.store(0, std::memory_order::relaxed);
+        _handlers[i].limit.store(0, std::memory_order::relaxed);
+
+        return i;
+    };
+
+    return 0;
+}
+
+
+inline
+void memory_accounting::unregister_handler(uint32_t slot)
+{
+    if(!slot || slot >= max_handlers)
+        return;
+
+    std::lock_guard lock{ _mutex };
+
+    _handler_used[slot] = false;
+}
+
+
+inline
+memory_accounting::usage memory_accounting::total() const noexcept
+{
+    return _usage(_total);
+}
+
+
+inline
+memory_accounting::usage memory_accounting::of(category c) const noexcept
+{
+    return c < category_count ? _usage(_categories[c]) : usage{};
+}
+
+
+inline
+memory_accounting::usage memory_accounting::of_handler(uint32_t slot) const noexcept
+{
+    return slot < max_handlers ? _usage(_handlers[slot]) : usage{};
+}
+
+
+inline
+memory_accounting::usage memory_accounting::of_tag(uint32_t tag) const noexcept
+{
+    return tag < max_tags ? _usage(_tags[tag]) : usage{};
+}
+
+
+inline
+void memory_accounting::reset_high_water() noexcept
+{
+    const auto reset = [](_counter& c) { c.high_water.store(c.bytes.load(std::memory_order::relaxed), std::memory_order::relaxed); };
+
+    reset(_total);
+
+    for(auto& c : _categories)
+        reset(c);
+
+    for(auto& c : _handlers)
+        reset(c);
+
+    for(auto& c : _tags)
+        reset(c);
+}
+
+
+inline
+void memory_accounting::set_soft_limit(int64_t bytes) noexcept
+{
+    _total.limit.store(bytes, std::memory_order::relaxed);
+}
+
+
+inline
+void memory_accounting::set_handler_soft_limit(uint32_t slot, int64_t bytes) noexcept
+{
+    if(slot < max_handlers)
+        _handlers[slot].limit.store(bytes, std::memory_order::relaxed);
+}
+
+
+inline
+void memory_accounting::set_tag_soft_limit(uint32_t tag, int64_t bytes) noexcept
+{
+    if(tag < max_tags)
+        _tags[tag].limit.store(bytes, std::memory_order::relaxed);
+}
+
+
+inline
+void memory_accounting::on_soft_limit(limit_callback callback)
+{
+    auto p = callback ? std::make_shared<limit_callback>(std::move(callback)) : nullptr;
+
+    std::lock_guard lock{ _mutex };
+
+    _callback = std::move(p);
+}
+
+
+inline
+void memory_accounting::_charge(uint32_t handler_slot, uint32_t tag, category c, int64_t delta) noexcept
+{
+    if(!delta)
+        return;
+
+    handler_slot = handler_slot < max_handlers ? handler_slot : 0;
+    tag = tag < max_tags ? tag : 0;
+
+    _add(_categories[c], delta);
+
+    _check_limit(_handlers[handler_slot], _add(_handlers[handler_slot], delta), handler_limit, handler_slot);
+    _check_limit(_tags[tag], _add(_tags[tag], delta), tag_limit, tag);
+    _check_limit(_total, _add(_total, delta), total_limit, 0);
+}
+
+
+inline
+void memory_accounting::_move(uint32_t from_slot, uint32_t from_tag, uint32_t to_slot, uint32_t to_tag, int64_t bytes) noexcept
+{
+    if(!bytes)
+        return;
+
+    from_slot = from_slot < max_handlers ? from_slot : 0;
+    to_slot = to_slot < max_handlers ? to_slot : 0;
+    from_tag = from_tag < max_tags ? from_tag : 0;
+    to_tag = to_tag < max_tags ? to_tag : 0;
+
+    if(from_slot != to_slot)
+    {
+        _check_limit(_handlers[from_slot], _add(_handlers[from_slot], -bytes), handler_limit, from_slot);
+        _check_limit(_handlers[to_slot], _add(_handlers[to_slot], bytes), handler_limit, to_slot);
+    };
+
+    if(from_tag != to_tag)
+    {
+        _check_limit(_tags[from_tag], _add(_tags[from_tag], -bytes), tag_limit, from_tag);
+        _check_limit(_tags[to_tag], _add(_tags[to_tag], bytes), tag_limit, to_tag);
+    };
+}
+
+
+inline
+int64_t memory_accounting::_add(_counter& counter, int64_t delta) noexcept
+{
+    const auto bytes = counter.bytes.fetch_add(delta, std::memory_order::relaxed) + delta;
+
+    auto hw = counter.high_water.load(std::memory_order::relaxed);
+
+    while(bytes > hw && !counter.high_water.compare_exchange_weak(hw, bytes, std::memory_order::relaxed))
+        ;
+
+    return bytes;
+}
+
+
+inline
+void memory_accounting::_check_limit(_counter& counter, int64_t bytes, limit_kind kind, uint32_t index) noexcept
+{
+    const auto limit = counter.limit.load(std::memory_order::relaxed);
+
+    if(!limit)
+        return;
+
+    if(bytes >= limit)
+    {
+        if(!counter.over.exchange(true, std::memory_order::relaxed))
+            _notify({ kind, index, bytes, limit });
+    }
+    else if(counter.over.load(std::memory_order::relaxed))
+        counter.over.store(false, std::memory_order::relaxed);
+}
+
+
+inline
+void memory_accounting::_notify(const limit_event& e) noexcept
+{
+    // promises created by callback must not call it again
+    static thread_local bool notifying = false;
+
+    if(notifying)
+        return;
+
+    std::shared_ptr<limit_callback> callback;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        callback = _callback;
+    };
+
+    if(!callback)
+        return;
+
+    notifying = true;
+
+    try
+    {
+        (*callback)(e);
+    }
+    catch(...)
+    { };
+
+    notifying = false;
+}
+
+
+inline
+memory_accounting::usage memory_accounting::_usage(const _counter& counter) noexcept
+{
+    return { counter.bytes.load(std::memory_order::relaxed), counter.high_water.load(std::memory_order::relaxed) };
+}
+
+
+inline
+uint32_t& memory_accounting::_local_tag() noexcept
+{
+    static thread_local uint32_t tag = 0;
+
+    return tag;
+}
+
+
+CGULL_GUTS_NAMESPACE_START
+
+
+inline
+memory_charge::~memory_charge()
+{
+    auto& m = memory_accounting::instance();
+
+    for(size_t c = 0; c < memory_accounting::category_count; ++c)
+        m._charge(_handler, _tag.load(std::memory_order::relaxed), memory_accounting::category(c), -_bytes[c]);
+}
+
+
+inline
+void memory_charge::set(memory_accounting::category c, int64_t bytes) noexcept
+{
+    memory_accounting::instance()._charge(_handler, _tag.load(std::memory_order::relaxed), c, bytes - _bytes[c]);
+
+    _bytes[c] = bytes;
+}
+
+
+inline
+void memory_charge::set_handler(uint32_t slot) noexcept
+{
+    if(slot != _handler)
+        _move(slot, _tag.load(std::memory_order::relaxed));
+}
+
+
+inline
+void memory_charge::inherit(const memory_charge& inner) noexcept
+{
+    const auto tag = inner._tag.load(std::memory_order::relaxed);
+
+    if(tag && !_tag.load(std::memory_order::relaxed))
+        _move(_handler, tag);
+}
+
+
+inline
+void memory_charge::_move(uint32_t handler_slot, uint32_t tag) noexcept
+{
+    int64_t bytes = 0;
+
+    for(const auto b : _bytes)
+        bytes += b;
+
+    memory_accounting::instance()._move(_handler, _tag.load(std::memory_order::relaxed), handler_slot, tag, bytes);
+
+    _handler = handler_slot;
+    _tag.store(tag, std::memory_order::relaxed);
+}
+
+
+CGULL_GUTS_NAMESPACE_END
+CGULL_NAMESPACE_END
@@ -0,0 +1,597 @@
+#pragma once
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if __has_include(<sys/un.h>)
+#   include <poll.h>
+#   include <sys/socket.h>
+#   include <sys/un.h>
+#   include <unistd.h>
+#   define CGULL_METRICS_UNIX_SOCKET
+#endif
+
+
+CGULL_NAMESPACE_START
+
+
+//! Runtime metrics of cgull itself.
+//!
+//! Available only if cgull is built with \a CGULL_METRICS defined, otherwise nothing is
+//! counted. Each thread increments its own slab of counters with plain relaxed stores, so
+//! increment is a couple of instructions without atomic read-modify-write or shared cache
+//! lines. Slabs are summed on read, slab of exited thread is folded into retired totals.
+//!
+//! Handlers get a slot on construction for per-handler operation counters, queue depth and
+//! name. Continuation latency is time between enqueueing operation to handler and running it.
+//!
+//! \code
+//! auto& m = cgull::metrics::instance();
+//!
+//! m.set_handler_name(pool.metrics_slot(), "workers");
+//! m.serve("/run/app/cgull.sock"); // curl --unix-socket /run/app/cgull.sock http://localhost/
+//! m.write_prometheus("/var/lib/node_exporter/cgull.prom");
+//! \endcode
+//!
+//! \note Thread-safe.
+class metrics
+{
+    CGULL_DISABLE_COPY(metrics);
+    CGULL_DISABLE_MOVE(metrics);
+
+public:
+    enum counter : uint8_t
+    {
+        promises_created = 0,
+        promises_destroyed,
+        promises_resolved,
+        promises_rejected,
+        promises_aborted,
+        continuations_run,
+        //! Promises placed into block of \a promise_private::allocate_block().
+        block_allocations,
+        //! Promises allocated one by one.
+        heap_allocations,
+        async_store_added,
+        async_store_removed,
+
+        counter_count
+    };
+
+    enum handler_counter : uint8_t
+    {
+        operations_enqueued = 0,
+        operations_run,
+
+        handler_counter_count
+    };
+
+    //! Handlers over it share slot 0.
+    static constexpr uint32_t max_handlers = 64;
+    //! Log2 buckets of latency in nanoseconds.
+    static constexpr size_t   latency_buckets = 40;
+
+
+    static metrics& instance();
+
+    static void add(counter c, uint64_t n = 1) noexcept;
+    static void add(uint32_t handler_slot, handler_counter c, uint64_t n = 1) noexcept;
+    static void observe_latency(uint64_t ns) noexcept;
+    static uint64_t now() noexcept;
+
+    //! \return Slot for handler, 0 if all are taken.
+    uint32_t register_handler();
+    void     unregister_handler(uint32_t slot);
+    void     set_handler_name(uint32_t slot, std::string name);
+
+    //! Sum over all threads.
+    [[nodiscard]]
+    uint64_t value(counter c) const;
+    //! Sum over all threads since handler took the slot.
+    [[nodiscard]]
+    uint64_t value(uint32_t handler_slot, handler_counter c) const;
+
+    //! Prometheus text exposition format.
+    [[nodiscard]]
+    std::string prometheus() const;
+    //! Writes \a prometheus() to temporary file and renames it to \a path, so readers never
+    //! see partial file.
+    bool    write_prometheus(const std::string& path) const;
+    //! Serves \a prometheus() on UNIX-domain socket \a path from background thread. Answer is
+    //! HTTP/1.0 response, so Prometheus and curl can scrape it.
+    bool    serve(const std::string& path);
+    void    stop_serving();
+
+
+private:
+    struct _slab
+    {
+        std::atomic<uint64_t>   counters[counter_count] = {};
+        std::atomic<uint64_t>   handlers[max_handlers][handler_counter_count] = {};
+        std::atomic<uint64_t>   latency[latency_buckets] = {};
+        std::atomic<uint64_t>   latency_sum = 0;
+    };
+
+    struct _local_slab
+    {
+        std::unique_ptr<_slab>  slab;
+
+        ~_local_slab();
+    };
+
+    struct _handler
+    {
+        bool                    used = false;
+        std::string             name;
+        //! Totals when slot was taken.
+        uint64_t                base[handler_counter_count] = {};
+    };
+
+    mutable std::mutex          _mutex;
+    std::vector<_slab*>         _slabs;
+    //! Totals of exited threads.
+    _slab                       _retired;
+    _handler                    _handlers[max_handlers];
+
+    std::mutex                  _serve_mutex;
+    std::thread                 _server;
+    std::atomic<bool>           _serving = false;
+    int                         _socket = -1;
+    std::string                 _socket_path;
+
+
+    metrics() = default;
+
+    static _slab& _local() noexcept;
+    static void   _bump(std::atomic<uint64_t>& v, uint64_t n) noexcept;
+
+    //! Sum of \a field over slabs. Must be called under lock.
+    template< typename _Field >
+    uint64_t _sum(_Field&& field) const;
+    void     _serve();
+
+};
+
+
+CGULL_GUTS_NAMESPACE_START
+
+
+//! Handler's registration in \a metrics.
+class metrics_slot
+{
+    CGULL_DISABLE_COPY(metrics_slot);
+    CGULL_DISABLE_MOVE(metrics_slot);
+
+public:
+    metrics_slot() : _slot(metrics::instance().register_handler()) { }
+    ~metrics_slot() { metrics::instance().unregister_handler(_slot); }
+
+    operator uint32_t() const noexcept { return _slot; }
+
+
+private:
+    const uint32_t _slot;
+
+};
+
+
+CGULL_GUTS_NAMESPACE_END
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+inline
+metrics& metrics::instance()
+{
+    // never destroyed: threads and handlers of static services may outlive it
+    static const auto m = new metrics;
+
+    return *m;
+}
+
+
+inline
+void metrics::add(counter c, uint64_t n) noexcept
+{
+    _bump(_local().counters[c], n);
+}
+
+
+inline
+void metrics::add(uint32_t handler_slot, handler_counter c, uint64_t n) noexcept
+{
+    _bump(_local().handlers[handler_slot < max_handlers ? handler_slot : 0][c], n);
+}
+
+
+inline
+void metrics::observe_latency(uint64_t ns) noexcept
+{
+    size_t b = 0;
+
+    for(auto v = ns; v; v >>= 1)
+        ++b;
+
+    auto& slab = _local();
+
+    _bump(slab.latency[std::min(b, latency_buckets - 1)], 1);
+    _bump(slab.latency_sum, ns);
+}
+
+
+inline
+uint64_t metrics::now() noexcept
+{
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count());
+}
+
+
+inline
+uint32_t metrics::register_handler()
+{
+    std::lock_guard lock{ _mutex };
+
+    for(uint32_t i = 1; i < max_handlers; ++i)
+    {
+        auto& h = _handlers[i];
+
+        if(h.used)
+            continue;
+
+        h.used = true;
+        h.name = "handler" + std::to_string(i);
+
+        // slot may be reused, counters go on from totals of the previous owner
+        for(size_t c = 0; c < handler_counter_count; ++c)
+            h.base[c] = _sum([&](const _slab& s) -> auto& { return s.handlers[i][c]; });
+
+        return i;
+    };
+
+    return 0;
+}
+
+
+inline
+void metrics::unregister_handler(uint32_t slot)
+{
+    if(!slot || slot >= max_handlers)
+        return;
+
+    std::lock_guard lock{ _mutex };
+
+    _handlers[slot].used = false;
+}
+
+
+inline
+void metrics::set_handler_name(uint32_t slot, std::string name)
+{
+    if(slot >= max_handlers)
+        return;
+
+    std::lock_guard lock{ _mutex };
+
+    _handlers[slot].name = std::move(name);
+}
+
+
+inline
+uint64_t metrics::value(counter c) const
+{
+    std::lock_guard lock{ _mutex };
+
+    return _sum([c](const _slab& s) -> auto& { return s.counters[c]; });
+}
+
+
+inline
+uint64_t metrics::value(uint32_t handler_slot, handler_counter c) const
+{
+    if(handler_slot >= max_handlers)
+        return 0;
+
+    std::lock_guard lock{ _mutex };
+
+    return _sum([&](const _slab& s) -> auto& { return s.handlers[handler_slot][c]; }) - _handlers[handler_slot].base[c];
+}
+
+
+inline
+std::string metrics::prometheus() const
+{
+    static constexpr const char* names[counter_count] = {
+        "promises_created", "promises_destroyed", "promises_resolved", "promises_rejected",
+        "promises_aborted", "continuations_run", "block_allocations", "heap_allocations",
+        "async_store_added", "async_store_removed",
+    };
+
+    std::lock_guard lock{ _mutex };
+
+    std::string out;
+    char line[256];
+
+    const auto emit = [&](const char* fmt, auto... args)
+    {
+        const auto n = snprintf(line, sizeof(line), fmt, args...);
+
+        if(n > 0)
+            out.append(line, std::min<size_t>(n, sizeof(line) - 1));
+    };
+
+    uint64_t totals[counter_count];
+
+    for(size_t c = 0; c < counter_count; ++c)
+    {
+        totals[c] = _sum([c](const _slab& s) -> auto& { return s.counters[c]; });
+
+        emit("# TYPE cgull_%s_total counter\ncgull_%s_total %llu\n", names[c], names[c], (unsigned long long)totals[c]);
+    };
+
+    // gauges are differences of counters, which are read one by one
+    const auto diff = [](uint64_t a, uint64_t b) { return a > b ? a - b : 0; };
+
+    emit("# TYPE cgull_promises_live gauge\ncgull_promises_live %llu\n",
+        (unsigned long long)diff(totals[promises_created], totals[promises_destroyed]));
+    emit("# TYPE cgull_async_store_size gauge\ncgull_async_store_size %llu\n",
+        (unsigned long long)diff(totals[async_store_added], totals[async_store_removed]));
+
+    const auto allocations = totals[block_allocations] + totals[heap_allocations];
+
+    emit("# TYPE cgull_block_allocation_ratio gauge\ncgull_block_allocation_ratio %.6f\n",
+        allocations ? double(totals[block_allocations]) / allocations : 0.0);
+
+    out += "# TYPE cgull_handler_operations_enqueued_total counter\n"
+           "# TYPE cgull_handler_operations_run_total counter\n"
+           "# TYPE cgull_handler_queue_depth gauge\n";
+
+    for(uint32_t i = 0; i < max_handlers; ++i)
+    {
+        const auto& h = _handlers[i];
+
+        // slot 0 is shared by handlers which didn't get their own
+        if(!h.used && i)
+            continue;
+
+        const auto enqueued = _sum([i](const _slab& s) -> auto& { return s.handlers[i][operations_enqueued]; }) - h.base[operations_enqueued];
+        const auto run = _sum([i](const _slab& s) -> auto& { return s.handlers[i][operations_run]; }) - h.base[operations_run];
+
+        const auto name = i ? h.name.c_str() : "other";
+
+        emit("cgull_handler_operations_enqueued_total{handler=\"%s\"} %llu\n", name, (unsigned long long)enqueued);
+        emit("cgull_handler_operations_run_total{handler=\"%s\"} %llu\n", name, (unsigned long long)run);
+        emit("cgull_handler_queue_depth{handler=\"%s\"} %llu\n", name, (unsigned long long)diff(enqueued, run));
+    };
+
+    out += "# TYPE cgull_continuation_latency_seconds histogram\n";
+
+    uint64_t cumulative = 0;
+
+    for(size_t b = 0; b < latency_buckets - 1; ++b)
+    {
+        cumulative += _sum([b](const _slab& s) -> auto& { return s.latency[b]; });
+
+        // bucket b holds [2^(b-1), 2^b) ns
+        emit("cgull_continuation_latency_seconds_bucket{le=\"%.9g\"} %llu\n", double((uint64_t(1) << b) - 1) * 1e-9, (unsigned long long)cumulative);
+    };
+
+    cumulative += _sum([](const _slab& s) -> auto& { return s.latency[latency_buckets - 1]; });
+
+    emit("cgull_continuation_latency_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)cumulative);
+    emit("cgull_continuation_latency_seconds_sum %.9f\n", _sum([](const _slab& s) -> auto& { return s.latency_sum; }) * 1e-9);
+    emit("cgull_continuation_latency_seconds_count %llu\n", (unsigned long long)cumulative);
+
+    return out;
+}
+
+
+inline
+bool metrics::write_prometheus(const std::string& path) const
+{
+    const auto text = prometheus();
+    const auto temporary = path + ".tmp";
+
+    const auto f = fopen(temporary.c_str(), "wb");
+
+    if(!f)
+        return false;
+
+    const auto written = fwrite(text.data(), 1, text.size(), f) == text.size();
+
+    if(fclose(f) || !written)
+    {
+        remove(temporary.c_str());
+
+        return false;
+    };
+
+    return !rename(temporary.c_str(), path.c_str());
+}
+
+
+inline
+bool metrics::serve([[maybe_unused]] const std::string& path)
+{
+#if defined(CGULL_METRICS_UNIX_SOCKET)
+    stop_serving();
+
+    std::lock_guard lock{ _serve_mutex };
+
+    sockaddr_un address{};
+
+    if(path.size() >= sizeof(address.sun_path))
+        return false;
+
+    address.sun_family = AF_UNIX;
+    path.copy(address.sun_path, path.size());
+
+    const auto fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(fd < 0)
+        return false;
+
+    ::unlink(path.c_str());
+
+    if(::bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) || ::listen(fd, 16))
+    {
+        ::close(fd);
+
+        return false;
+    };
+
+    _socket = fd;
+    _socket_path = path;
+    _serving = true;
+    _server = std::thread{ &metrics::_serve, this };
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+inline
+void metrics::stop_serving()
+{
+#if defined(CGULL_METRICS_UNIX_SOCKET)
+    std::lock_guard lock{ _serve_mutex };
+
+    if(!_server.joinable())
+        return;
+
+    _serving = false;
+    _server.join();
+
+    ::close(_socket);
+    ::unlink(_socket_path.c_str());
+
+    _socket = -1;
+#endif
+}
+
+
+inline
+metrics::_local_slab::~_local_slab()
+{
+    auto& m = instance();
+
+    std::lock_guard lock{ m._mutex };
+
+    for(size_t c = 0; c < counter_count; ++c)
+        _bump(m._retired.counters[c], slab->counters[c].load(std::memory_order::relaxed));
+
+    for(size_t h = 0; h < max_handlers; ++h)
+        for(size_t c = 0; c < handler_counter_count; ++c)
+            _bump(m._retired.handlers[h][c], slab->handlers[h][c].load(std::memory_order::relaxed));
+
+    for(size_t b = 0; b < latency_buckets; ++b)
+        _bump(m._retired.latency[b], slab->latency[b].load(std::memory_order::relaxed));
+
+    _bump(m._retired.latency_sum, slab->latency_sum.load(std::memory_order::relaxed));
+
+    m._slabs.erase(std::find(m._slabs.begin(), m._slabs.end(), slab.get()));
+}
+
+
+inline
+metrics::_slab& metrics::_local() noexcept
+{
+    static thread_local _local_slab local;
+
+    if(!local.slab) [[unlikely]]
+    {
+        local.slab = std::make_unique<_slab>();
+
+        auto& m = instance();
+
+        std::lock_guard lock{ m._mutex };
+
+        m._slabs.push_back(local.slab.get());
+    };
+
+    return *local.slab;
+}
+
+
+inline
+void metrics::_bump(std::atomic<uint64_t>& v, uint64_t n) noexcept
+{
+    // single writer: no read-modify-write needed, readers see torn-free values
+    v.store(v.load(std::memory_order::relaxed) + n, std::memory_order::relaxed);
+}
+
+
+template< typename _Field > inline
+uint64_t metrics::_sum(_Field&& field) const
+{
+    auto result = field(_retired).load(std::memory_order::relaxed);
+
+    for(const auto s : _slabs)
+        result += field(*s).load(std::memory_order::relaxed);
+
+    return result;
+}
+
+
+inline
+void metrics::_serve()
+{
+#if defined(CGULL_METRICS_UNIX_SOCKET)
+    while(_serving)
+    {
+        pollfd p{ _socket, POLLIN, 0 };
+
+        if(::poll(&p, 1, 100) <= 0)
+            continue;
+
+        const auto client = ::accept4(_socket, nullptr, nullptr, SOCK_CLOEXEC);
+
+        if(client < 0)
+            continue;
+
+        // request isn't parsed, everyone gets the same page
+        pollfd c{ client, POLLIN, 0 };
+        char request[1024];
+
+        if(::poll(&c, 1, 100) > 0)
+        {
+            [[maybe_unused]] const auto r = ::recv(client, request, sizeof(request), MSG_DONTWAIT);
+        };
+
+        const auto body = prometheus();
+        const auto response =
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+            + std::to_string(body.size()) + "\r\n\r\n" + body;
+
+        for(size_t sent = 0; sent < response.size(); )
+        {
+            const auto n = ::send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+
+            if(n <= 0)
+                break;
+
+            sent += size_t(n);
+        };
+
+        ::close(client);
+    };
+#endif
+}
+
+
+CGULL_NAMESPACE_END
@@ -0,0 +1,750 @@
+#pragma once
+
+#include "config.h"
+
+#if defined(CGULL_OS_LINUX)
+
+#include "promise_private.h"
+#include "handler.h"
+#include "guts/pool_worker.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+
+
+CGULL_NAMESPACE_START
+
+
+//! CPUs of the machine grouped by NUMA node.
+struct numa_topology
+{
+    struct node
+    {
+        //! Node number of the OS.
+        int                 id = 0;
+        std::vector<int>    cpus;
+    };
+
+    std::vector<node>       nodes;
+
+
+    //! Reads /sys/devices/system/node keeping only CPUs process is allowed to run on and nodes
+    //! which have any of them. Without NUMA info it's a single node of all allowed CPUs.
+    static numa_topology detect();
+    //! Parses kernel's cpu list format, e.g. "0-3,8,10-11". Malformed entries are skipped.
+    static std::vector<int> parse_cpu_list(std::string_view list);
+};
+
+
+CGULL_GUTS_NAMESPACE_START
+
+
+//! Upstream of node's allocation pool: whole pages with memory policy preferring \a node.
+//! Policy is only a hint, so if kernel refuses it pages are placed by first touch.
+class numa_memory_resource : public std::pmr::memory_resource
+{
+public:
+    explicit
+    numa_memory_resource(int node) noexcept : _node(node) { }
+
+
+protected:
+    void*   do_allocate(size_t bytes, size_t alignment) override;
+    void    do_deallocate(void* ptr, size_t bytes, size_t alignment) override;
+    bool    do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+
+private:
+    const int   _node;
+
+
+    static size_t _round(size_t bytes) noexcept;
+
+};
+
+
+//! Node-local pools of promise blocks. Shared by \a numa_pool_handler with blocks allocated
+//! from it, so it lives until the last of them is freed.
+class numa_block_allocator : public block_allocator
+{
+    CGULL_DISABLE_COPY(numa_block_allocator);
+    CGULL_DISABLE_MOVE(numa_block_allocator);
+
+public:
+    //! \a ids are OS numbers of nodes, \a cpu_nodes maps CPU to index in \a ids or -1.
+    numa_block_allocator(const std::vector<int>& ids, std::vector<int16_t> cpu_nodes);
+
+    //! Takes memory from pool of calling thread's node.
+    void*   allocate(size_t bytes, int& node) override;
+    void    deallocate(void* ptr, size_t bytes, int node) noexcept override;
+
+
+private:
+    struct _pool
+    {
+        int                                     id;
+        numa_memory_resource                    upstream;
+        std::pmr::synchronized_pool_resource    pool{ &upstream };
+
+        explicit _pool(int i) : id(i), upstream(i) { }
+    };
+
+    std::vector<std::unique_ptr<_pool>>     _pools;
+    const std::vector<int16_t>              _cpu_nodes;
+    std::atomic<size_t>                     _next = 0;
+
+
+    //! Pool of node with OS number \a id, unknown numbers are folded onto known pools.
+    _pool&  _of(int id) noexcept;
+
+};
+
+
+CGULL_GUTS_NAMESPACE_END
+
+
+//! Handler which runs operations on workers pinned to CPUs and grouped by NUMA node.
+//!
+//! Promise remembers node of the thread which created it (see \a promise_private::home_node()),
+//! its operations go to worker of that node chosen by promise address, so continuations run
+//! next to promise's memory and promise stays context-local to one thread. Promises of unknown
+//! node are spread over all workers. Blocks of \a promise_private::allocate_block() given
+//! \a allocator() take memory from pool of the calling worker's node.
+//!
+//! Tasks go to shared queue of the posting thread's node and are taken by any worker of it.
+//! Worker which has nothing to do on its own node steals tasks of other nodes, and idle
+//! workers of other nodes are woken up for task only when its node has none.
+//!
+//! \code
+//! cgull::numa_pool_handler pool;
+//!
+//! pool.post([&]{ start_session(pool).then([](reply r) { ... }); });
+//! \endcode
+//!
+//! \note Operations run inside \a priority_scope of their promise. Worker serves own operations
+//!       by priority like \a thread_pool_handler, but shared tasks of node are FIFO.
+class numa_pool_handler : public handler
+{
+    CGULL_DISABLE_COPY(numa_pool_handler);
+    CGULL_DISABLE_MOVE(numa_pool_handler);
+
+public:
+    //! Starts \a threads_per_node workers per node, all CPUs of node if 0. With \a pin workers
+    //! are bound to their CPUs; pinning which is not permitted is silently skipped.
+    explicit
+    numa_pool_handler(numa_topology topology = numa_topology::detect(), size_t threads_per_node = 0, bool pin = true);
+    //! Runs everything posted before and joins workers.
+    ~numa_pool_handler() override;
+
+    void fulfill(private_type target, std::any&& value, fulfillment_state_t state) override;
+    void try_finish(private_type target) override;
+    void post(task_type&& task) override;
+    void bind_outer(private_type target, private_type outer) override;
+    //! Groups \a ops by worker, each touched worker is locked and woken up once.
+    void dispatch(operation_list&& ops) override;
+
+    //! Runs \a task on node \a index (not OS number), other nodes take it only when idle.
+    void post_to_node(size_t index, task_type&& task);
+
+    [[nodiscard]]
+    size_t size() const noexcept                    { return _workers.size(); }
+    [[nodiscard]]
+    size_t node_count() const noexcept              { return _nodes.size(); }
+    //! OS number of node \a index.
+    [[nodiscard]]
+    int    node_id(size_t index) const noexcept     { return _nodes[index]->id; }
+    //! Index of node with OS number \a id. Unknown numbers are folded onto known nodes.
+    [[nodiscard]]
+    size_t node_index(int id) const noexcept;
+    //! Node index of \a worker.
+    [[nodiscard]]
+    size_t node_of_worker(size_t worker) const noexcept { return _workers[worker]->node; }
+    //! CPU \a worker runs on if pinned.
+    [[nodiscard]]
+    int    cpu_of_worker(size_t worker) const noexcept  { return _workers[worker]->cpu; }
+    //! Worker which owns \a target.
+    [[nodiscard]]
+    size_t worker_of(const promise_private* target) const noexcept;
+    //! Index of current worker of this pool or -1 if called outside of pool.
+    [[nodiscard]]
+    ptrdiff_t current_worker() const noexcept;
+    //! Node-local memory for \a promise_private::allocate_block(). Outlives the pool while
+    //! blocks taken from it live.
+    [[nodiscard]]
+    std::shared_ptr<block_allocator> allocator() const noexcept { return _allocator; }
+    //! Tasks taken by workers of other nodes.
+    [[nodiscard]]
+    size_t stolen() const noexcept                  { return _stolen.load(std::memory_order::relaxed); }
+
+
+private:
+    using _op = guts::handler_op;
+
+    //! Own queue holds operations of promises owned by worker.
+    struct _worker : guts::pool_worker
+    {
+        size_t                  node = 0;
+        int                     cpu = -1;
+    };
+
+    struct _node
+    {
+        int                     id;
+        std::vector<size_t>     workers;
+        std::mutex              mutex;
+        std::deque<_op>         tasks;
+        //! Tasks count readable without lock, changed under it.
+        std::atomic<size_t>     pending = 0;
+
+        explicit _node(int i) : id(i) { }
+    };
+
+    std::vector<std::unique_ptr<_node>>
+                                _nodes;
+    std::vector<std::unique_ptr<_worker>>
+                                _workers;
+    //! Node index by CPU, -1 for CPUs outside of pool.
+    std::vector<int16_t>        _cpu_nodes;
+    mutable std::atomic<size_t> _next = 0;
+    std::atomic<size_t>         _stolen = 0;
+    const bool                  _pin;
+    std::shared_ptr<guts::numa_block_allocator>
+                                _allocator;
+
+
+    void _enqueue(size_t index, _op&& op);
+    //! Node of calling thread: its worker's or its CPU's.
+    size_t _local_node() const noexcept;
+    //! Wakes idle worker of node \a index or, if there is none, of any other node.
+    void _wake_for_task(size_t index);
+    //! Takes task of own node, then task of other node.
+    bool _take_shared(const _worker& w, _op& op);
+    bool _take_task(_node& n, _op& op);
+    bool _has_tasks() const noexcept;
+    void _run(size_t index);
+
+    static thread_local const numa_pool_handler*    _current_pool;
+    static thread_local size_t                      _current_index;
+
+};
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+inline
+numa_topology numa_topology::detect()
+{
+    numa_topology result;
+
+    cpu_set_t allowed;
+    const bool known = !sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    const auto usable = [&](int cpu)
+    {
+        return !known || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed));
+    };
+
+    if(const auto dir = opendir("/sys/devices/system/node"))
+    {
+        while(const auto entry = readdir(dir))
+        {
+            int id = 0;
+            char tail = 0;
+
+            if(sscanf(entry->d_name, "node%d%c", &id, &tail) != 1)
+                continue;
+
+            std::ifstream file{ std::string{ "/sys/devices/system/node/" } + entry->d_name + "/cpulist" };
+            std::string line;
+
+            std::getline(file, line);
+
+            node n{ id, {} };
+
+            for(const auto cpu : parse_cpu_list(line))
+                if(usable(cpu))
+                    n.cpus.push_back(cpu);
+
+            // memory-only nodes have nothing to run
+            if(!n.cpus.empty())
+                result.nodes.push_back(std::move(n));
+        };
+
+        closedir(dir);
+    };
+
+    std::sort(result.nodes.begin(), result.nodes.end(), [](const auto& a, const auto& b) { return a.id < b.id; });
+
+    if(result.nodes.empty())
+    {
+        node n;
+
+        for(int cpu = 0; known && cpu < CPU_SETSIZE; ++cpu)
+            if(CPU_ISSET(cpu, &allowed))
+                n.cpus.push_back(cpu);
+
+        for(int cpu = 0; n.cpus.empty() && cpu < int(std::max(1u, std::thread::hardware_concurrency())); ++cpu)
+            n.cpus.push_back(cpu);
+
+        result.nodes.push_back(std::move(n));
+    };
+
+    return result;
+}
+
+
+inline
+std::vector<int> numa_topology::parse_cpu_list(std::string_view list)
+{
+    std::vector<int> result;
+
+    const auto number = [](std::string_view s, int& value)
+    {
+        while(!s.empty() && (s.front() == ' ' || s.front() == '\n'))
+            s.remove_prefix(1);
+
+        while(!s.empty() && (s.back() == ' ' || s.back() == '\n'))
+            s.remove_suffix(1);
+
+        const auto [end, error] = std::from_chars(s.data(), s.data() + s.size(), value);
+
+        return !s.empty() && error == std::errc{} && end == s.data() + s.size() && value >= 0;
+    };
+
+    while(!list.empty())
+    {
+        const auto comma = list.find(',');
+        const auto item = list.substr(0, comma);
+
+        list.remove_prefix(comma == list.npos ? list.size() : comma + 1);
+
+        const auto dash = item.find('-');
+        int first = 0;
+        int last = 0;
+
+        if(dash == item.npos)
+        {
+            if(number(item, first))
+                result.push_back(first);
+        }
+        else if(number(item.substr(0, dash), first) && number(item.substr(dash + 1), last))
+        {
+            for(int cpu = first; cpu <= last; ++cpu)
+                result.push_back(cpu);
+        };
+    };
+
+    return result;
+}
+
+
+CGULL_GUTS_NAMESPACE_START
+
+
+inline
+void* numa_memory_resource::do_allocate(size_t bytes, size_t alignment)
+{
+    const auto length = _round(bytes);
+
+    if(alignment > size_t(sysconf(_SC_PAGESIZE)))
+        throw std::bad_alloc{};
+
+    const auto ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(ptr == MAP_FAILED)
+        throw std::bad_alloc{};
+
+#if defined(SYS_mbind)
+    unsigned long mask[16] = {};
+    constexpr auto bits = sizeof(mask[0]) * 8;
+
+    if(_node >= 0 && size_t(_node) < bits * std::size(mask))
+    {
+        mask[_node / bits] |= 1ul << (_node % bits);
+
+        // kernel reads maxnode - 1 bits
+        syscall(SYS_mbind, ptr, length, MPOL_PREFERRED, mask, bits * std::size(mask) + 1, 0);
+    };
+#endif
+
+    return ptr;
+}
+
+
+inline
+void numa_memory_resource::do_deallocate(void* ptr, size_t bytes, [[maybe_unused]] size_t alignment)
+{
+    munmap(ptr, _round(bytes));
+}
+
+
+inline
+size_t numa_memory_resource::_round(size_t bytes) noexcept
+{
+    const auto page = size_t(sysconf(_SC_PAGESIZE));
+
+    return (std::max<size_t>(bytes, 1) + page - 1) / page * page;
+}
+
+
+inline
+numa_block_allocator::numa_block_allocator(const std::vector<int>& ids, std::vector<int16_t> cpu_nodes)
+    : _cpu_nodes(std::move(cpu_nodes))
+{
+    for(const auto id : ids)
+        _pools.push_back(std::make_unique<_pool>(id));
+}
+
+
+inline
+void* numa_block_allocator::allocate(size_t bytes, int& node)
+{
+    // workers of pool tell their node, other threads go by CPU they run on
+    auto id = promise_private::thread_node();
+
+    if(id < 0)
+    {
+        const auto cpu = sched_getcpu();
+
+        if(cpu >= 0 && size_t(cpu) < _cpu_nodes.size() && _cpu_nodes[cpu] >= 0)
+            id = _pools[_cpu_nodes[cpu]]->id;
+        else
+            id = _pools[_next.fetch_add(1, std::memory_order::relaxed) % _pools.size()]->id;
+    };
+
+    auto& p = _of(id);
+
+    node = p.id;
+
+    return p.pool.allocate(bytes, alignof(std::max_align_t));
+}
+
+
+inline
+void numa_block_allocator::deallocate(void* ptr, size_t bytes, int node) noexcept
+{
+    _of(node).pool.deallocate(ptr, bytes, alignof(std::max_align_t));
+}
+
+
+inline
+numa_block_allocator::_pool& numa_block_allocator::_of(int id) noexcept
+{
+    for(auto& p : _pools)
+        if(p->id == id)
+            return *p;
+
+    return *_pools[static_cast<size_t>(id < 0 ? 0 : id) % _pools.size()];
+}
+
+
+CGULL_GUTS_NAMESPACE_END
+
+
+inline thread_local const numa_pool_handler*    numa_pool_handler::_current_pool = nullptr;
+inline thread_local size_t                      numa_pool_handler::_current_index = 0;
+
+
+inline
+numa_pool_handler::numa_pool_handler(numa_topology topology, size_t threads_per_node, bool pin)
+    : _pin(pin)
+{
+    if(topology.nodes.empty())
+        topology = numa_topology::detect();
+
+    for(auto& n : topology.nodes)
+    {
+        if(n.cpus.empty())
+            continue;
+
+        const auto index = _nodes.size();
+        auto& node = *_nodes.emplace_back(std::make_unique<_node>(n.id));
+        const auto count = threads_per_node ? threads_per_node : n.cpus.size();
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            auto& w = *_workers.emplace_back(std::make_unique<_worker>());
+
+            w.node = index;
+            w.cpu = n.cpus[i % n.cpus.size()];
+
+            node.workers.push_back(_workers.size() - 1);
+
+            if(size_t(w.cpu) >= _cpu_nodes.size())
+                _cpu_nodes.resize(w.cpu + 1, -1);
+
+            // CPU listed by several nodes belongs to the first one
+            if(_cpu_nodes[w.cpu] < 0)
+                _cpu_nodes[w.cpu] = static_cast<int16_t>(index);
+        };
+    };
+
+    std::vector<int> ids;
+
+    for(const auto& n : _nodes)
+        ids.push_back(n->id);
+
+    _allocator = std::make_shared<guts::numa_block_allocator>(ids, _cpu_nodes);
+
+    for(size_t i = 0; i < _workers.size(); ++i)
+        _workers[i]->thread = std::thread{ &numa_pool_handler::_run, this, i };
+}
+
+
+inline
+numa_pool_handler::~numa_pool_handler()
+{
+    _worker::join(_workers);
+}
+
+
+inline
+void numa_pool_handler::fulfill(private_type target, std::any&& value, fulfillment_state_t state)
+{
+    const auto index = worker_of(target.data());
+
+    _enqueue(index, _op{ std::move(target), std::forward<decltype(value)>(value), state });
+}
+
+
+inline
+void numa_pool_handler::try_finish(private_type target)
+{
+    const auto index = worker_of(target.data());
+
+    _enqueue(index, _op{ std::move(target) });
+}
+
+
+inline
+void numa_pool_handler::post(task_type&& task)
+{
+    post_to_node(_local_node(), std::forward<decltype(task)>(task));
+}
+
+
+inline
+void numa_pool_handler::bind_outer(private_type target, private_type outer)
+{
+    const auto index = worker_of(target.data());
+
+    _enqueue(index, _op{ std::move(target), std::move(outer) });
+}
+
+
+inline
+void numa_pool_handler::dispatch(operation_list&& ops)
+{
+    CGULL_METRICS_PROBE(metrics::add(_metrics_slot, metrics::operations_enqueued, ops.size());)
+
+    _worker::dispatch(_workers, std::forward<decltype(ops)>(ops), [this](const promise_private* target) { return worker_of(target); });
+}
+
+
+inline
+void numa_pool_handler::post_to_node(size_t index, task_type&& task)
+{
+    index %= _nodes.size();
+
+    auto& n = *_nodes[index];
+    _op op{ std::forward<decltype(task)>(task) };
+
+    CGULL_METRICS_PROBE(metrics::add(_metrics_slot, metrics::operations_enqueued);)
+
+    {
+        std::lock_guard lock{ n.mutex };
+
+        n.tasks.push_back(std::move(op));
+        // pairs with worker publishing idle before its last look at queues
+        n.pending.fetch_add(1, std::memory_order::seq_cst);
+    }
+
+    _wake_for_task(index);
+}
+
+
+inline
+size_t numa_pool_handler::node_index(int id) const noexcept
+{
+    for(size_t i = 0; i < _nodes.size(); ++i)
+        if(_nodes[i]->id == id)
+            return i;
+
+    return static_cast<size_t>(id < 0 ? 0 : id) % _nodes.size();
+}
+
+
+inline
+size_t numa_pool_handler::worker_of(const promise_private* target) const noexcept
+{
+    // drop alignment bits and mix the rest
+    const auto h = static_cast<size_t>(((reinterpret_cast<uintptr_t>(target) >> 4) * 0x9E3779B97F4A7C15ull) >> 32);
+    const auto home = target->home_node();
+
+    if(home < 0 || _nodes.size() == 1)
+        return h % _workers.size();
+
+    const auto& workers = _nodes[node_index(home)]->workers;
+
+    return workers[h % workers.size()];
+}
+
+
+inline
+ptrdiff_t numa_pool_handler::current_worker() const noexcept
+{
+    return _current_pool == this ? static_cast<ptrdiff_t>(_current_index) : -1;
+}
+
+
+inline
+void numa_pool_handler::_enqueue(size_t index, _op&& op)
+{
+    CGULL_METRICS_PROBE(metrics::add(_metrics_slot, metrics::operations_enqueued);)
+
+    _workers[index]->enqueue(std::forward<decltype(op)>(op));
+}
+
+
+inline
+size_t numa_pool_handler::_local_node() const noexcept
+{
+    if(_current_pool == this)
+        return _workers[_current_index]->node;
+
+    const auto cpu = sched_getcpu();
+
+    if(cpu >= 0 && size_t(cpu) < _cpu_nodes.size() && _cpu_nodes[cpu] >= 0)
+        return static_cast<size_t>(_cpu_nodes[cpu]);
+
+    // thread outside of pool's CPUs
+    return _next.fetch_add(1, std::memory_order::relaxed) % _nodes.size();
+}
+
+
+inline
+void numa_pool_handler::_wake_for_task(size_t index)
+{
+    const auto wake = [this](size_t node)
+    {
+        for(const auto i : _nodes[node]->workers)
+            if(_workers[i]->claim())
+                return true;
+
+        return false;
+    };
+
+    if(wake(index))
+        return;
+
+    for(size_t i = 1; i < _nodes.size(); ++i)
+        if(wake((index + i) % _nodes.size()))
+            return;
+}
+
+
+inline
+bool numa_pool_handler::_take_shared(const _worker& w, _op& op)
+{
+    if(_take_task(*_nodes[w.node], op))
+        return true;
+
+    // the last resort
+    for(size_t i = 1; i < _nodes.size(); ++i)
+    {
+        if(_take_task(*_nodes[(w.node + i) % _nodes.size()], op))
+        {
+            _stolen.fetch_add(1, std::memory_order::relaxed);
+
+            return true;
+        };
+    };
+
+    return false;
+}
+
+
+inline
+bool numa_pool_handler::_take_task(_node& n, _op& op)
+{
+    if(!n.pending.load(std::memory_order::seq_cst))
+        return false;
+
+    std::lock_guard lock{ n.mutex };
+
+    if(n.tasks.empty())
+        return false;
+
+    op = std::move(n.tasks.front());
+    n.tasks.pop_front();
+    n.pending.fetch_sub(1, std::memory_order::relaxed);
+
+    return true;
+}
+
+
+inline
+bool numa_pool_handler::_has_tasks() const noexcept
+{
+    for(const auto& n : _nodes)
+        if(n->pending.load(std::memory_order::seq_cst))
+            return true;
+
+    return false;
+}
+
+
+inline
+void numa_pool_handler::_run(size_t index)
+{
+    auto& w = *_workers[index];
+
+    _current_pool = this;
+    _current_index = index;
+
+    if(_pin)
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(w.cpu, &set);
+
+        // e.g. CPU was taken away from container, worker runs unpinned then
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    };
+
+    promise_private::set_thread_node(_nodes[w.node]->id);
+
+    w.run(*this, [this, &w](_op& op) { return _take_shared(w, op); }, [this]{ return _has_tasks(); });
+}
+
+
+CGULL_NAMESPACE_END
+
+
+#endif
@@ -0,0 +1,515 @@
+#pragma once
+
+#include "config.h"
+#include "guts/ring_buffer.h"
+#include "guts/thread_rings.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+
+CGULL_NAMESPACE_START
+
+
+//! Timestamps of one promise, in nanoseconds of \a std::chrono::steady_clock.
+//!
+//! Zero means event didn't happen, e.g. resolver promise has no finisher.
+struct profile_record
+{
+    uint64_t    id = 0;
+    //! Inner whose fulfillment finished this promise. 0 for promise fulfilled directly.
+    uint64_t    cause = 0;
+
+    uint64_t    created = 0;
+    //! The last time inners were found ready.
+    uint64_t    woken = 0;
+    uint64_t    finish_started = 0;
+    //! Callback returned. If it returned promise, fulfillment comes later.
+    uint64_t    finish_ended = 0;
+    uint64_t    fulfilled = 0;
+
+    //! \a profiler::thread_index() of thread which fulfilled promise.
+    uint32_t    thread = 0;
+    //! \a profiler::thread_index() of thread which ran callback.
+    uint32_t    finish_thread = 0;
+};
+
+
+//! Log2 histogram of latencies in nanoseconds.
+class latency_histogram
+{
+public:
+    static constexpr size_t bucket_count = 64;
+
+
+    void        add(uint64_t ns) noexcept;
+    void        merge(const latency_histogram& other) noexcept;
+
+    [[nodiscard]]
+    uint64_t    count() const noexcept      { return _count; }
+    [[nodiscard]]
+    uint64_t    min() const noexcept        { return _count ? _min : 0; }
+    [[nodiscard]]
+    uint64_t    max() const noexcept        { return _max; }
+    [[nodiscard]]
+    uint64_t    mean() const noexcept       { return _count ? _sum / _count : 0; }
+    //! \return Upper bound of bucket holding \a p quantile, \a p in [0, 1].
+    [[nodiscard]]
+    uint64_t    percentile(double p) const noexcept;
+    //! Samples in [2^(i-1), 2^i) ns, bucket 0 holds zeros.
+    [[nodiscard]]
+    uint64_t    bucket(size_t i) const noexcept { return i < bucket_count ? _buckets[i] : 0; }
+
+
+private:
+    uint64_t    _buckets[bucket_count] = {};
+    uint64_t    _count = 0;
+    uint64_t    _sum = 0;
+    uint64_t    _min = UINT64_MAX;
+    uint64_t    _max = 0;
+
+};
+
+
+//! Per-stage latencies of promises.
+struct profile_stages
+{
+    //! From creation to fulfillment.
+    latency_histogram   settle;
+    //! From fulfillment of the cause to the moment promise noticed it, i.e. handler hop.
+    latency_histogram   schedule;
+    //! Callback execution.
+    latency_histogram   run;
+};
+
+
+//! Collector of \a profile_record of fulfilled promises.
+//!
+//! Available only if cgull is built with \a CGULL_PROFILE defined, otherwise promises have
+//! no probes at all. Each thread pushes records into its own lock-free ring, rings are
+//! drained by \a snapshot(), \a drain() or a background consumer like \a chrome_trace, so
+//! fulfillment never takes a lock. Record is dropped if thread's ring is full.
+//!
+//! In sampled mode only 1 of \a N chains is recorded: root promise decides and promises
+//! chained to it inherit the decision, so recorded chains are always complete.
+//!
+//! \code
+//! auto last = fetch().then(parse).then(store);
+//! ...
+//! for(const auto& r : cgull::profiler::critical_path(cgull::profiler::instance().snapshot(), last.profile_id()))
+//!     ...
+//! \endcode
+//!
+//! \note Thread-safe.
+class profiler
+{
+    CGULL_DISABLE_COPY(profiler);
+    CGULL_DISABLE_MOVE(profiler);
+
+public:
+    //! Ids taken by thread at once.
+    static constexpr size_t batch = 256;
+    //! Records per thread's ring.
+    static constexpr size_t ring_capacity = 4096;
+
+
+    static profiler& instance();
+
+    //! Collection is enabled by default.
+    void    enable(bool on) noexcept;
+    [[nodiscard]]
+    bool    is_enabled() const noexcept;
+    //! Records 1 of \a n chains, 1 records all.
+    void    set_sampling(uint32_t n) noexcept;
+    //! \return If chain started by calling thread now should be recorded.
+    [[nodiscard]]
+    bool    sample() noexcept;
+    //! Kept records over \a n are dropped. 1M by default.
+    void    set_capacity(size_t n);
+    [[nodiscard]]
+    size_t  dropped() const noexcept;
+
+    void    collect(const profile_record& r) noexcept;
+    //! Drains rings and copies all kept records.
+    [[nodiscard]]
+    std::vector<profile_record> snapshot();
+    //! Drains rings and moves all records out.
+    [[nodiscard]]
+    std::vector<profile_record> drain();
+    void    clear();
+
+    //! Walks causes back from \a last. \return Path from root to \a last, empty if \a last
+    //!         isn't in \a records.
+    static std::vector<profile_record> critical_path(const std::vector<profile_record>& records, uint64_t last);
+    static profile_stages stages(const std::vector<profile_record>& records);
+
+    //! \return Unique id, never 0.
+    static uint64_t next_id() noexcept;
+    static uint64_t now() noexcept;
+    //! Small number of calling thread, starting from 1.
+    static uint32_t thread_index() noexcept;
+
+
+private:
+    std::atomic<bool>               _enabled = true;
+    std::atomic<uint32_t>           _sampling = 1;
+    guts::thread_rings<guts::ring_buffer<profile_record>>
+                                    _rings{ ring_capacity };
+    //! Guards kept records and their capacity.
+    std::mutex                      _mutex;
+    std::vector<profile_record>     _records;
+    size_t                          _capacity = size_t(1) << 20;
+    std::atomic<size_t>             _dropped = 0;
+
+
+    profiler() = default;
+
+    //! Moves records from rings into \a _records. Must be called under lock.
+    void    _drain_rings();
+
+};
+
+
+CGULL_GUTS_NAMESPACE_START
+
+
+//! Probe embedded into \a promise_private.
+struct profile_probe : profile_record
+{
+    //! -1 until decided.
+    std::atomic<int8_t> sampling = -1;
+    //! Sampling is inherited from the first inner only.
+    bool                chained = false;
+
+
+    profile_probe() noexcept
+    {
+        id = profiler::next_id();
+        created = profiler::now();
+    }
+
+    //! Decides sampling on the first call if it's not inherited.
+    bool        sampled() noexcept;
+    void        inherit(profile_probe& inner) noexcept;
+    //! \return Timestamp or 0 if promise isn't sampled.
+    uint64_t    now() noexcept      { return sampled() ? profiler::now() : 0; }
+};
+
+
+CGULL_GUTS_NAMESPACE_END
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+inline
+void latency_histogram::add(uint64_t ns) noexcept
+{
+    size_t b = 0;
+
+    for(auto v = ns; v; v >>= 1)
+        ++b;
+
+    ++_buckets[std::min(b, bucket_count - 1)];
+    ++_count;
+    _sum += ns;
+    _min = std::min(_min, ns);
+    _max = std::max(_max, ns);
+}
+
+
+inline
+void latency_histogram::merge(const latency_histogram& other) noexcept
+{
+    for(size_t i = 0; i < bucket_count; ++i)
+        _buckets[i] += other._buckets[i];
+
+    _count += other._count;
+    _sum += other._sum;
+    _min = std::min(_min, other._min);
+    _max = std::max(_max, other._max);
+}
+
+
+inline
+uint64_t latency_histogram::percentile(double p) const noexcept
+{
+    if(!_count)
+        return 0;
+
+    const auto rank = std::max<uint64_t>(1, uint64_t(std::clamp(p, 0.0, 1.0) * _count + 0.5));
+
+    uint64_t seen = 0;
+
+    for(size_t i = 0; i < bucket_count; ++i)
+    {
+        seen += _buckets[i];
+
+        if(seen >= rank)
+            return std::min(_max, i ? (uint64_t(1) << std::min<size_t>(i, 63)) - 1 : 0);
+    };
+
+    return _max;
+}
+
+
+inline
+profiler& profiler::instance()
+{
+    // never destroyed: threads of static services flush their buffers at exit after statics
+    static const auto p = new profiler;
+
+    return *p;
+}
+
+
+inline
+void profiler::enable(bool on) noexcept
+{
+    _enabled.store(on, std::memory_order::relaxed);
+}
+
+
+inline
+bool profiler::is_enabled() const noexcept
+{
+    return _enabled.load(std::memory_order::relaxed);
+}
+
+
+inline
+void profiler::set_sampling(uint32_t n) noexcept
+{
+    _sampling.store(n ? n : 1, std::memory_order::relaxed);
+}
+
+
+inline
+bool profiler::sample() noexcept
+{
+    static thread_local uint32_t counter = 0;
+
+    const auto n = _sampling.load(std::memory_order::relaxed);
+
+    return n == 1 || !(counter++ % n);
+}
+
+
+inline
+void profiler::set_capacity(size_t n)
+{
+    std::lock_guard lock{ _mutex };
+
+    _capacity = n;
+}
+
+
+inline
+size_t profiler::dropped() const noexcept
+{
+    return _dropped.load(std::memory_order::relaxed);
+}
+
+
+inline
+void profiler::collect(const profile_record& r) noexcept
+{
+    if(!is_enabled())
+        return;
+
+    auto copy = r;
+    const auto ring = _rings.local();
+
+    if(!ring || !ring->try_push(copy))
+        _dropped.fetch_add(1, std::memory_order::relaxed);
+}
+
+
+inline
+std::vector<profile_record> profiler::snapshot()
+{
+    std::lock_guard lock{ _mutex };
+
+    _drain_rings();
+
+    return _records;
+}
+
+
+inline
+std::vector<profile_record> profiler::drain()
+{
+    std::lock_guard lock{ _mutex };
+
+    _drain_rings();
+
+    return std::exchange(_records, {});
+}
+
+
+inline
+void profiler::clear()
+{
+    std::lock_guard lock{ _mutex };
+
+    _drain_rings();
+
+    _records.clear();
+    _dropped.store(0, std::memory_order::relaxed);
+}
+
+
+inline
+std::vector<profile_record> profiler::critical_path(const std::vector<profile_record>& records, uint64_t last)
+{
+    std::unordered_map<uint64_t, size_t> index;
+
+    index.reserve(records.size());
+
+    for(size_t i = 0; i < records.size(); ++i)
+        index[records[i].id] = i;
+
+    std::vector<profile_record> path;
+
+    // bounded by records count in case of garbage
+    for(auto it = index.find(last); it != index.end() && path.size() < records.size(); )
+    {
+        const auto& r = records[it->second];
+
+        path.push_back(r);
+
+        if(!r.cause)
+            break;
+
+        it = index.find(r.cause);
+    };
+
+    std::reverse(path.begin(), path.end());
+
+    return path;
+}
+
+
+inline
+profile_stages profiler::stages(const std::vector<profile_record>& records)
+{
+    std::unordered_map<uint64_t, uint64_t> fulfilled;
+
+    fulfilled.reserve(records.size());
+
+    for(const auto& r : records)
+        fulfilled[r.id] = r.fulfilled;
+
+    profile_stages result;
+
+    for(const auto& r : records)
+    {
+        if(r.fulfilled >= r.created)
+            result.settle.add(r.fulfilled - r.created);
+
+        if(r.finish_started && r.finish_ended >= r.finish_started)
+            result.run.add(r.finish_ended - r.finish_started);
+
+        if(!r.cause || !r.woken)
+            continue;
+
+        if(const auto it = fulfilled.find(r.cause); it != fulfilled.end() && r.woken >= it->second)
+            result.schedule.add(r.woken - it->second);
+    };
+
+    return result;
+}
+
+
+inline
+uint64_t profiler::next_id() noexcept
+{
+    static std::atomic<uint64_t> next = 1;
+
+    // ranges are taken per thread, so creation doesn't contend on one counter
+    static thread_local uint64_t current = 0, end = 0;
+
+    if(current == end)
+    {
+        current = next.fetch_add(batch, std::memory_order::relaxed);
+        end = current + batch;
+    };
+
+    return current++;
+}
+
+
+inline
+uint64_t profiler::now() noexcept
+{
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count());
+}
+
+
+inline
+uint32_t profiler::thread_index() noexcept
+{
+    return guts::thread_index();
+}
+
+
+inline
+void profiler::_drain_rings()
+{
+    _rings.drain([this](auto& ring)
+    {
+        while(auto r = ring.try_pop())
+        {
+            if(_records.size() < _capacity)
+                _records.push_back(*r);
+            else
+                _dropped.fetch_add(1, std::memory_order::relaxed);
+        };
+    });
+}
+
+
+CGULL_GUTS_NAMESPACE_START
+
+
+inline
+bool profile_probe::sampled() noexcept
+{
+    auto s = sampling.load(std::memory_order::relaxed);
+
+    if(s >= 0)
+        return s;
+
+    const int8_t decided = profiler::instance().sample();
+
+    // someone may decide concurrently, the first decision wins
+    if(!sampling.compare_exchange_strong(s, decided, std::memory_order::relaxed))
+        return s;
+
+    return decided;
+}
+
+
+inline
+void profile_probe::inherit(profile_probe& inner) noexcept
+{
+    if(chained)
+        return;
+
+    chained = true;
+    sampling.store(inner.sampled(), std::memory_order::relaxed);
+}
+
+
+CGULL_GUTS_NAMESPACE_END
+
+CGULL_NAMESPACE_END
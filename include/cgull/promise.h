@@ -3,11 +3,41 @@
 #include "config.h"
 #include "promise_private.h"
 #include "handler.h"
+#include "guts/function_traits.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
 
 
 CGULL_NAMESPACE_START
 
 
+//! Thrown by \a promise::get() of aborted promise.
+class promise_aborted : public std::runtime_error
+{
+public:
+    promise_aborted()
+        : std::runtime_error("cgull: promise is aborted")
+    { }
+};
+
+
+class promise;
+
+
+CGULL_GUTS_NAMESPACE_START
+
+//! Internals of \a p for library's own primitives.
+promise_private::type private_of(const promise& p) noexcept;
+
+CGULL_GUTS_NAMESPACE_END
+
+
 class promise
 {
 public:
@@ -16,8 +46,23 @@ public:
     using private_type = typename promise_private::type;
 
 
-    promise()
-        : _d(new promise_private{})
+    promise(guts::creation_site site = {})
+        : _d(new promise_private{ site })
+    { }
+
+    //! Creates promise owned by handler \a h.
+    explicit
+    promise(CGULL_NAMESPACE::handler* h, guts::creation_site site = {})
+        : _d(new promise_private{ site })
+    {
+        _d->handler = h;
+
+        CGULL_MEMORY_PROBE(_d->account_handler();)
+    }
+
+    explicit
+    promise(private_type d)
+        : _d(std::move(d))
     { }
 
     const std::any& value() const { return _d->result; }
@@ -31,6 +76,10 @@ public:
     promise& reject(std::any&& value);
     promise& reject();
 
+    //! Fulfills promise as \a aborted. Continuations aren't called, chains bound to it are
+    //! aborted too. Producer may check \a is_aborted() to stop work nobody waits for.
+    promise& abort();
+
     fulfillment_state_t   fulfillment() const
     {
         return _d->fulfillment_state;
@@ -38,6 +87,68 @@ public:
 
     bool    is_resolved() const { return fulfillment() == resolved; }
     bool    is_rejected() const { return fulfillment() == rejected; }
+    bool    is_aborted() const  { return fulfillment() == aborted; }
+
+    //! Blocks calling thread until promise is fulfilled. Spins briefly, then sleeps on futex
+    //! of the promise itself, no mutex or condition variable is made.
+    //! \warning Deadlocks if promise may be fulfilled only by the calling thread, e.g. when
+    //!          called from the thread of promise's event loop.
+    //! \return Fulfillment state.
+    fulfillment_state_t wait() const  { return _d->wait_fulfilled(); }
+    //! \return false if promise isn't fulfilled in \a d.
+    bool    wait_for(std::chrono::steady_clock::duration d) const;
+    //! \return false if promise isn't fulfilled at \a tp.
+    bool    wait_until(std::chrono::steady_clock::time_point tp) const;
+    //! Waits for promise and returns its value.
+    //! \throw Value of rejected promise: \a std::exception_ptr is rethrown, anything else is
+    //!        thrown as \a std::any. \a promise_aborted for aborted one.
+    std::any get() const;
+    //! \throw std::bad_any_cast if value isn't \a _T.
+    template< typename _T >
+    _T      get() const             { return std::any_cast<_T>(get()); }
+
+    //! Handler which owns this promise. nullptr for context-local promises.
+    CGULL_NAMESPACE::handler* handler() const { return _d->handler; }
+
+    //! Priority of promise's operations in handlers which support it. Promises chained by
+    //! \a then() / \a rescue() afterwards inherit it. Defaults to \a priority_scope::current().
+    priority_t priority() const     { return _d->priority(); }
+    promise&   set_priority(priority_t p) { _d->set_priority(p); return *this; }
+
+#if defined(CGULL_PROFILE)
+    //! Id of promise in \a profiler records.
+    uint64_t profile_id() const { return _d->_probe.id; }
+#endif
+
+    //! Chains \a callback which will be called on resolve. Rejection is passed through.
+    //!
+    //! Callback may take nothing, \a std::any or exact type of result and may return void,
+    //! \a std::any, \a promise (result is awaited then) or anything else. Throwing result
+    //! type, \a std::any or \a const char* rejects returned promise with thrown value, other
+    //! exceptions are passed as \a std::exception_ptr.
+    //!
+    //! \return Promise owned by the same handler.
+    template< typename _Callback >
+    promise then(_Callback&& callback, guts::creation_site site = {}) const;
+    //! \return Promise owned by handler \a h.
+    template< typename _Callback >
+    promise then(CGULL_NAMESPACE::handler* h, _Callback&& callback, guts::creation_site site = {}) const;
+
+    //! Chains \a callback which will be called on reject. Resolution is passed through.
+    //! \sa then()
+    template< typename _Callback >
+    promise rescue(_Callback&& callback, guts::creation_site site = {}) const;
+    template< typename _Callback >
+    promise rescue(CGULL_NAMESPACE::handler* h, _Callback&& callback, guts::creation_site site = {}) const;
+
+    //! Returns promise fulfilled as this one or rejected with \a timeout_error after \a d.
+    //! It's owned by \a h or, if none, by this promise's handler. Context-local promise
+    //! needs \a h, since timer fires on its own thread.
+    //! \note Defined in timer_service.h.
+    promise timeout(std::chrono::steady_clock::duration d, CGULL_NAMESPACE::handler* h = nullptr) const;
+    //! Returns promise fulfilled as this one or rejected with \a timeout_error at \a tp.
+    //! \sa timeout()
+    promise deadline(std::chrono::steady_clock::time_point tp, CGULL_NAMESPACE::handler* h = nullptr) const;
 
 
 #if defined(CGULL_DEBUG_GUTS)
@@ -45,14 +156,74 @@ public:
 #endif
 
 private:
+    friend private_type guts::private_of(const promise& p) noexcept;
+
     private_type _d;
 
     void _fulfill(std::any&& value, bool is_resolve);
     void _fulfill(const std::any& value, bool is_resolve);
 
+    template< typename _Callback >
+    promise _then(CGULL_NAMESPACE::handler* h, _Callback&& callback, bool is_resolve, guts::creation_site site) const;
+
+    template< typename _Callback >
+    static void _run_finisher(promise_private* d, _Callback& callback, std::any&& inners_result) noexcept;
+    template< typename _Callback >
+    static void _run_finisher(promise_private* d, _Callback& callback, std::any&& inners_result, guts::return_void_tag);
+    template< typename _Callback >
+    static void _run_finisher(promise_private* d, _Callback& callback, std::any&& inners_result, guts::return_any_tag);
+    template< typename _Callback >
+    static void _run_finisher(promise_private* d, _Callback& callback, std::any&& inners_result, guts::return_promise_tag);
+    template< typename _Callback >
+    static void _run_finisher(promise_private* d, _Callback& callback, std::any&& inners_result, guts::return_auto_tag);
+
+    template< typename _Callback >
+    static auto _call(_Callback& callback, std::any&& inners_result, guts::args_count_0);
+    template< typename _Callback >
+    static auto _call(_Callback& callback, std::any&& inners_result, guts::args_count_1_any);
+    template< typename _Callback >
+    static auto _call(_Callback& callback, std::any&& inners_result, guts::args_count_1_auto);
+
 };
 
 
+//! Resolves \a promises[i] with copy of \a values[i] inside single \a fulfill_scope, so every
+//! handler gets one wakeup for the whole batch.
+//! \sa resolve_batch_move()
+template< typename _T >
+void resolve_batch(std::span<promise> promises, std::span<_T> values);
+//! Same as \a resolve_batch(), but moves \a values[i] out.
+template< typename _T >
+void resolve_batch_move(std::span<promise> promises, std::span<_T> values);
+//! Rejects \a promises[i] with copy of \a values[i].
+//! \sa resolve_batch()
+template< typename _T >
+void reject_batch(std::span<promise> promises, std::span<_T> values);
+//! Same as \a reject_batch(), but moves \a values[i] out.
+template< typename _T >
+void reject_batch_move(std::span<promise> promises, std::span<_T> values);
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+CGULL_GUTS_NAMESPACE_START
+
+
+template<>
+struct function_return_value_traits< promise >
+{ using tag = return_promise_tag; };
+
+
+inline
+promise_private::type private_of(const promise& p) noexcept
+{
+    return p._d;
+}
+
+
+CGULL_GUTS_NAMESPACE_END
 CGULL_NAMESPACE_END
 
 
@@ -71,7 +242,7 @@ promise& promise::resolve(const std::any& value)
 inline
 promise& promise::resolve(std::any&& value)
 {
-    _fulfill(value, true);
+    _fulfill(std::move(value), true);
 
     return *this;
 }
@@ -98,7 +269,7 @@ promise& promise::reject(const std::any& value)
 inline
 promise& promise::reject(std::any&& value)
 {
-    _fulfill(value, false);
+    _fulfill(std::move(value), false);
 
     return *this;
 }
@@ -114,29 +285,289 @@ promise& promise::reject()
 
 
 inline
-void promise::_fulfill(std::any&& value, bool is_resolve)
+promise& promise::abort()
 {
-    _cgull_d;
+    _d->fulfill(std::any{}, aborted);
 
-    _cgull_context_local
-        ->local_fulfill(std::forward<decltype(value)>(value), is_resolve ? resolved : rejected);
-    _cgull_async
-        ->fulfill(std::forward<decltype(value)>(value), is_resolve);
+    return *this;
 }
 
 
 inline
-void promise::_fulfill(const std::any& value, bool is_resolve)
+bool promise::wait_for(std::chrono::steady_clock::duration d) const
 {
-    _cgull_d;
+    return wait_until(std::chrono::steady_clock::now() + d);
+}
+
+
+inline
+bool promise::wait_until(std::chrono::steady_clock::time_point tp) const
+{
+    return _d->wait_fulfilled_until(tp) != not_fulfilled;
+}
+
+
+inline
+std::any promise::get() const
+{
+    const auto state = wait();
+
+    if(state == aborted)
+        throw promise_aborted{};
+
+    if(state == resolved)
+        return value();
+
+    if(const auto e = std::any_cast<std::exception_ptr>(&value()))
+        std::rethrow_exception(*e);
+
+    throw value();
+}
+
+
+inline
+void promise::_fulfill(std::any&& value, bool is_resolve)
+{
+    _d->fulfill(std::forward<decltype(value)>(value), is_resolve ? resolved : rejected);
+}
+
 
+inline
+void promise::_fulfill(const std::any& value, bool is_resolve)
+{
     // Copy value here cause we will use it in other ctx or copy it to save in promise a/w.
-    _cgull_context_local
-        ->local_fulfill(std::any{value}, is_resolve ? resolved : rejected);
-    _cgull_async
-        ->fulfill(std::any{value}, is_resolve);
+    _d->fulfill(std::any{value}, is_resolve ? resolved : rejected);
 }
 
 
+template< typename _T > inline
+void resolve_batch(std::span<promise> promises, std::span<_T> values)
+{
+    assert(promises.size() == values.size() && "cgull: promises and values count mismatch");
+
+    fulfill_scope scope;
+
+    const auto count = std::min(promises.size(), values.size());
+
+    for(size_t i = 0; i < count; ++i)
+        promises[i].resolve(std::any{values[i]});
+}
+
+
+template< typename _T > inline
+void resolve_batch_move(std::span<promise> promises, std::span<_T> values)
+{
+    static_assert(!std::is_const_v<_T>, "cgull: can't move from const values");
+    assert(promises.size() == values.size() && "cgull: promises and values count mismatch");
+
+    fulfill_scope scope;
+
+    const auto count = std::min(promises.size(), values.size());
+
+    for(size_t i = 0; i < count; ++i)
+        promises[i].resolve(std::any{std::move(values[i])});
+}
+
+
+template< typename _T > inline
+void reject_batch(std::span<promise> promises, std::span<_T> values)
+{
+    assert(promises.size() == values.size() && "cgull: promises and values count mismatch");
+
+    fulfill_scope scope;
+
+    const auto count = std::min(promises.size(), values.size());
+
+    for(size_t i = 0; i < count; ++i)
+        promises[i].reject(std::any{values[i]});
+}
+
+
+template< typename _T > inline
+void reject_batch_move(std::span<promise> promises, std::span<_T> values)
+{
+    static_assert(!std::is_const_v<_T>, "cgull: can't move from const values");
+    assert(promises.size() == values.size() && "cgull: promises and values count mismatch");
+
+    fulfill_scope scope;
+
+    const auto count = std::min(promises.size(), values.size());
+
+    for(size_t i = 0; i < count; ++i)
+        promises[i].reject(std::any{std::move(values[i])});
+}
+
+
+
+template< typename _Callback > inline
+promise promise::then(_Callback&& callback, guts::creation_site site) const
+{
+    return _then(_d->handler, std::forward<_Callback>(callback), true, site);
+}
+
+
+template< typename _Callback > inline
+promise promise::then(CGULL_NAMESPACE::handler* h, _Callback&& callback, guts::creation_site site) const
+{
+    return _then(h, std::forward<_Callback>(callback), true, site);
+}
+
+
+template< typename _Callback > inline
+promise promise::rescue(_Callback&& callback, guts::creation_site site) const
+{
+    return _then(_d->handler, std::forward<_Callback>(callback), false, site);
+}
+
+
+template< typename _Callback > inline
+promise promise::rescue(CGULL_NAMESPACE::handler* h, _Callback&& callback, guts::creation_site site) const
+{
+    return _then(h, std::forward<_Callback>(callback), false, site);
+}
+
+
+template< typename _Callback > inline
+promise promise::_then(CGULL_NAMESPACE::handler* h, _Callback&& callback, bool is_resolve, guts::creation_site site) const
+{
+    // chained outer
+    promise next{ h, site };
+
+    const auto nd = next._d.data();
+
+    nd->set_priority(_d->priority());
+
+    // continuation runs next to data of its source
+    if(_d->home_node() >= 0)
+        nd->set_home_node(_d->home_node());
+
+    // finisher is owned by 'next', so raw pointer is enough
+    nd->local_set_finisher(
+        [nd, callback = std::forward<_Callback>(callback)](bool is_abort, std::any&& inners_result) mutable
+        {
+            if(!is_abort)
+                _run_finisher(nd, callback, std::forward<decltype(inners_result)>(inners_result));
+        },
+        is_resolve
+    );
+
+    CGULL_MEMORY_PROBE(nd->account(memory_accounting::finishers, sizeof(std::decay_t<_Callback>));)
+
+    // we don't need to call handler cause 'next' was just created
+    nd->local_bind_inner(_d, last_bound);
+
+    // async bind 'next' as 'outer' to 'this' cause this thread might not be the thread of 'this'.
+    _d->bind_outer(next._d);
+
+    return next;
+}
+
+
+template< typename _Callback > inline
+void promise::_run_finisher(promise_private* d, _Callback& callback, std::any&& inners_result) noexcept
+{
+    try
+    {
+        _run_finisher(d, callback, std::forward<decltype(inners_result)>(inners_result), typename guts::function_traits<_Callback>::result_tag{});
+    }
+    catch(std::any& e)
+    {
+        d->local_finish(std::move(e), rejected);
+    }
+    catch(const char* e)
+    {
+        d->local_finish(std::any{e}, rejected);
+    }
+    catch(...)
+    {
+        d->local_finish(std::any{std::current_exception()}, rejected);
+    };
+}
+
+
+//! \note lambda [](...) -> void
+template< typename _Callback > inline
+void promise::_run_finisher(promise_private* d, _Callback& callback, std::any&& inners_result, guts::return_void_tag)
+{
+    _call(callback, std::forward<decltype(inners_result)>(inners_result), typename guts::function_traits<_Callback>::args_tag{});
+
+    d->local_finish(std::any{}, resolved);
+}
+
+
+//! \note lambda [](...) -> std::any
+template< typename _Callback > inline
+void promise::_run_finisher(promise_private* d, _Callback& callback, std::any&& inners_result, guts::return_any_tag)
+{
+    d->local_finish(
+        _call(callback, std::forward<decltype(inners_result)>(inners_result), typename guts::function_traits<_Callback>::args_tag{}),
+        resolved
+    );
+}
+
+
+//! \note lambda [](...) -> promise
+template< typename _Callback > inline
+void promise::_run_finisher(promise_private* d, _Callback& callback, std::any&& inners_result, guts::return_promise_tag)
+{
+    promise inner = _call(callback, std::forward<decltype(inners_result)>(inners_result), typename guts::function_traits<_Callback>::args_tag{});
+
+    // wait for inner and take its result
+    d->finish_state = d->resolve_finisher ? thenned : rescued;
+    d->_unbind_inners();
+    d->local_bind_inner(inner._d, last_bound);
+
+    CGULL_PROFILE_PROBE(d->_probe.finish_ended = d->_probe.now();)
+
+    inner._d->bind_outer(private_type{d});
+}
+
+
+//! \note lambda [](...) -> auto
+template< typename _Callback > inline
+void promise::_run_finisher(promise_private* d, _Callback& callback, std::any&& inners_result, guts::return_auto_tag)
+{
+    using result_type = typename guts::function_traits<_Callback>::result_type;
+
+    try
+    {
+        d->local_finish(
+            std::make_any<result_type>(_call(callback, std::forward<decltype(inners_result)>(inners_result), typename guts::function_traits<_Callback>::args_tag{})),
+            resolved
+        );
+    }
+    catch(result_type& e)
+    {
+        d->local_finish(std::any{std::move(e)}, rejected);
+    };
+}
+
+
+//! \note lambda [](void) -> auto
+template< typename _Callback > inline
+auto promise::_call(_Callback& callback, std::any&&, guts::args_count_0)
+{
+    return callback();
+}
+
+
+//! \note lambda [](std::any) -> auto
+template< typename _Callback > inline
+auto promise::_call(_Callback& callback, std::any&& inners_result, guts::args_count_1_any)
+{
+    return callback(std::forward<decltype(inners_result)>(inners_result));
+}
+
+
+//! \note lambda [](auto) -> auto
+//! \note Throws \a std::bad_any_cast if result has other type.
+template< typename _Callback > inline
+auto promise::_call(_Callback& callback, std::any&& inners_result, guts::args_count_1_auto)
+{
+    using arg_type = std::decay_t< typename guts::function_traits<_Callback>::template arg<0>::type >;
+
+    return callback(std::any_cast<arg_type&&>(std::move(inners_result)));
+}
+
 
 CGULL_NAMESPACE_END
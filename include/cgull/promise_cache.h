@@ -0,0 +1,464 @@
+#pragma once
+
+#include "config.h"
+#include "promise.h"
+#include "handler.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <any>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+CGULL_NAMESPACE_START
+
+
+struct promise_cache_options
+{
+    using duration = std::chrono::steady_clock::duration;
+
+    //! Number of independently locked LRU lists.
+    size_t      shards = 16;
+    //! Limit of summary size of resolved values. Split evenly between shards.
+    size_t      max_bytes = 64 << 20;
+    //! How long resolved value is fresh.
+    duration    ttl = std::chrono::seconds{60};
+    //! How long rejection is cached. Zero disables negative caching.
+    duration    negative_ttl = std::chrono::seconds{1};
+    //! How long after \a ttl stale value is still returned while it's being reloaded in
+    //! background. Zero disables stale-while-revalidate.
+    duration    stale_ttl = duration::zero();
+    //! Handler which owns cached promises. If not set, they are context-local.
+    CGULL_NAMESPACE::handler* handler = nullptr;
+};
+
+
+//! Cache of promises keyed by \a _Key.
+//!
+//! Keeps both in-flight and fulfilled promises, so concurrent misses for the same key make
+//! single load and hits return already fulfilled promise: continuation chained to it is
+//! called right in place with no allocation for result.
+//!
+//! Entries are kept in \a options.shards LRU lists, each with its own lock. Resolved entries
+//! live for \a options.ttl and are evicted in LRU order when shard goes above its part of
+//! \a options.max_bytes. Value size is given by \a sizer (\a sizeof(_Value) by default).
+//!
+//! \note Must outlive all loads started by \a get().
+template< typename _Key, typename _Value, typename _Hash = std::hash<_Key> >
+class promise_cache
+{
+    CGULL_DISABLE_COPY(promise_cache);
+    CGULL_DISABLE_MOVE(promise_cache);
+
+public:
+    using clock         = std::chrono::steady_clock;
+    using time_point    = clock::time_point;
+    using sizer_type    = std::function<size_t(const _Key& key, const _Value& value)>;
+
+    struct statistics
+    {
+        uint64_t    hits = 0;
+        //! Hits returned stale value and started reload.
+        uint64_t    stale_hits = 0;
+        uint64_t    misses = 0;
+        //! Entries dropped by size limit.
+        uint64_t    evictions = 0;
+        //! Entries dropped by expiration.
+        uint64_t    expirations = 0;
+    };
+
+
+    explicit
+    promise_cache(promise_cache_options options = {}, sizer_type sizer = {});
+
+    //! Returns cached promise for \a key or calls \a load(key), which must return \a promise
+    //! resolved with \a _Value, and caches result.
+    //! \note Exception thrown by \a load rejects returned promise with \a std::exception_ptr.
+    template< typename _Load >
+    promise get(const _Key& key, _Load&& load);
+
+    //! Stores resolved \a value for \a key.
+    void put(const _Key& key, _Value value);
+    void erase(const _Key& key);
+    void clear();
+
+    //! Entries count including in-flight ones.
+    [[nodiscard]]
+    size_t size() const;
+    //! Summary size of cached values.
+    [[nodiscard]]
+    size_t bytes() const;
+    [[nodiscard]]
+    statistics stats() const;
+
+
+private:
+    struct _entry
+    {
+        _Key        key;
+        promise     value;
+        time_point  expires = time_point::max();
+        time_point  stale_until = time_point::max();
+        size_t      bytes = 0;
+        bool        reloading = false;
+    };
+
+    using _lru_list = std::list<_entry>;
+
+    struct _shard
+    {
+        mutable std::mutex  mutex;
+        _lru_list           lru;
+        std::unordered_map<_Key, typename _lru_list::iterator, _Hash>
+                            index;
+        size_t              bytes = 0;
+    };
+
+    promise_cache_options       _options;
+    sizer_type                  _sizer;
+    size_t                      _shard_bytes;
+    std::vector<std::unique_ptr<_shard>>
+                                _shards;
+
+    std::atomic<uint64_t>       _hits = 0;
+    std::atomic<uint64_t>       _stale_hits = 0;
+    std::atomic<uint64_t>       _misses = 0;
+    std::atomic<uint64_t>       _evictions = 0;
+    std::atomic<uint64_t>       _expirations = 0;
+
+
+    _shard& _shard_of(const _Key& key) const noexcept;
+
+    template< typename _Load >
+    void _load(const _Key& key, promise target, _Load& load, bool reload);
+    void _complete(const _Key& key, promise target, std::any&& value, bool resolved, bool reload);
+    void _store(_shard& s, typename _lru_list::iterator it, promise&& value, size_t bytes, time_point now);
+    void _drop(_shard& s, typename _lru_list::iterator it) noexcept;
+    void _evict(_shard& s) noexcept;
+
+};
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+template< typename _Key, typename _Value, typename _Hash > inline
+promise_cache<_Key, _Value, _Hash>::promise_cache(promise_cache_options options, sizer_type sizer)
+    : _options(options)
+    , _sizer(std::move(sizer))
+{
+    if(!_options.shards)
+        _options.shards = 1;
+
+    if(!_sizer)
+        _sizer = [](const _Key&, const _Value&) { return sizeof(_Key) + sizeof(_Value); };
+
+    _shard_bytes = std::max<size_t>(1, _options.max_bytes / _options.shards);
+
+    _shards.reserve(_options.shards);
+
+    for(size_t i = 0; i < _options.shards; ++i)
+        _shards.push_back(std::make_unique<_shard>());
+}
+
+
+template< typename _Key, typename _Value, typename _Hash >
+template< typename _Load > inline
+promise promise_cache<_Key, _Value, _Hash>::get(const _Key& key, _Load&& load)
+{
+    static_assert(
+        std::is_same_v<std::decay_t<std::invoke_result_t<_Load&, const _Key&>>, promise>,
+        "cgull: promise_cache load function must return promise"
+    );
+
+    auto& s = _shard_of(key);
+    const auto now = clock::now();
+
+    promise result;
+    bool reload = false;
+
+    {
+        std::lock_guard lock{ s.mutex };
+
+        const auto found = s.index.find(key);
+
+        if(found != s.index.end())
+        {
+            auto it = found->second;
+
+            // in-flight entries never expire
+            if(now < it->expires)
+            {
+                s.lru.splice(s.lru.begin(), s.lru, it);
+
+                ++_hits;
+
+                return it->value;
+            }
+            else if(now < it->stale_until && it->value.is_resolved())
+            {
+                s.lru.splice(s.lru.begin(), s.lru, it);
+
+                ++_stale_hits;
+
+                if(it->reloading)
+                    return it->value;
+
+                it->reloading = true;
+                reload = true;
+                result = it->value;
+            }
+            else
+            {
+                ++_expirations;
+
+                _drop(s, it);
+            };
+        };
+
+        if(!reload)
+        {
+            ++_misses;
+
+            result = promise{ _options.handler };
+
+            s.lru.push_front({ key, result });
+            s.index.emplace(key, s.lru.begin());
+        };
+    };
+
+    // entry is published before load, so concurrent misses attach to it
+    _load(key, reload ? promise{ _options.handler } : result, load, reload);
+
+    return result;
+}
+
+
+template< typename _Key, typename _Value, typename _Hash > inline
+void promise_cache<_Key, _Value, _Hash>::put(const _Key& key, _Value value)
+{
+    auto& s = _shard_of(key);
+    const auto bytes = _sizer(key, value);
+
+    promise p{ _options.handler };
+
+    p.resolve(std::any{std::move(value)});
+
+    std::lock_guard lock{ s.mutex };
+
+    auto found = s.index.find(key);
+
+    if(found == s.index.end())
+    {
+        s.lru.push_front({ key, promise{} });
+        found = s.index.emplace(key, s.lru.begin()).first;
+    };
+
+    _store(s, found->second, std::move(p), bytes, clock::now());
+}
+
+
+template< typename _Key, typename _Value, typename _Hash > inline
+void promise_cache<_Key, _Value, _Hash>::erase(const _Key& key)
+{
+    auto& s = _shard_of(key);
+
+    std::lock_guard lock{ s.mutex };
+
+    const auto found = s.index.find(key);
+
+    if(found != s.index.end())
+        _drop(s, found->second);
+}
+
+
+template< typename _Key, typename _Value, typename _Hash > inline
+void promise_cache<_Key, _Value, _Hash>::clear()
+{
+    for(auto& s : _shards)
+    {
+        std::lock_guard lock{ s->mutex };
+
+        s->index.clear();
+        s->lru.clear();
+        s->bytes = 0;
+    };
+}
+
+
+template< typename _Key, typename _Value, typename _Hash > inline
+size_t promise_cache<_Key, _Value, _Hash>::size() const
+{
+    size_t result = 0;
+
+    for(const auto& s : _shards)
+    {
+        std::lock_guard lock{ s->mutex };
+
+        result += s->lru.size();
+    };
+
+    return result;
+}
+
+
+template< typename _Key, typename _Value, typename _Hash > inline
+size_t promise_cache<_Key, _Value, _Hash>::bytes() const
+{
+    size_t result = 0;
+
+    for(const auto& s : _shards)
+    {
+        std::lock_guard lock{ s->mutex };
+
+        result += s->bytes;
+    };
+
+    return result;
+}
+
+
+template< typename _Key, typename _Value, typename _Hash > inline
+typename promise_cache<_Key, _Value, _Hash>::statistics promise_cache<_Key, _Value, _Hash>::stats() const
+{
+    return { _hits, _stale_hits, _misses, _evictions, _expirations };
+}
+
+
+template< typename _Key, typename _Value, typename _Hash > inline
+typename promise_cache<_Key, _Value, _Hash>::_shard& promise_cache<_Key, _Value, _Hash>::_shard_of(const _Key& key) const noexcept
+{
+    return *_shards[_Hash{}(key) % _shards.size()];
+}
+
+
+template< typename _Key, typename _Value, typename _Hash >
+template< typename _Load > inline
+void promise_cache<_Key, _Value, _Hash>::_load(const _Key& key, promise target, _Load& load, bool reload)
+{
+    try
+    {
+        std::invoke(load, key)
+            .then([this, key, target, reload](std::any value)
+            {
+                _complete(key, target, std::move(value), true, reload);
+            })
+            .rescue([this, key, target, reload](std::any error)
+            {
+                _complete(key, target, std::move(error), false, reload);
+            });
+    }
+    catch(...)
+    {
+        _complete(key, target, std::any{std::current_exception()}, false, reload);
+    };
+}
+
+
+template< typename _Key, typename _Value, typename _Hash > inline
+void promise_cache<_Key, _Value, _Hash>::_complete(const _Key& key, promise target, std::any&& value, bool resolved, bool reload)
+{
+    auto& s = _shard_of(key);
+    const auto now = clock::now();
+    const auto bytes = resolved ? _sizer(key, std::any_cast<const _Value&>(value)) : 0;
+
+    {
+        std::lock_guard lock{ s.mutex };
+
+        const auto found = s.index.find(key);
+
+        // entry must still be ours: it could be erased or replaced meanwhile
+        const bool owned = found != s.index.end() && (reload || guts::private_of(found->second->value) == guts::private_of(target));
+
+        if(owned && reload)
+        {
+            found->second->reloading = false;
+
+            // keep stale value on failed reload
+            if(resolved)
+                _store(s, found->second, promise{ target }, bytes, now);
+        }
+        else if(owned && resolved)
+        {
+            _store(s, found->second, promise{ target }, bytes, now);
+        }
+        else if(owned && _options.negative_ttl > promise_cache_options::duration::zero())
+        {
+            found->second->expires = now + _options.negative_ttl;
+            found->second->stale_until = found->second->expires;
+        }
+        else if(owned)
+        {
+            _drop(s, found->second);
+        };
+    };
+
+    // waiters are released outside of lock
+    if(resolved)
+        target.resolve(std::move(value));
+    else
+        target.reject(std::move(value));
+}
+
+
+template< typename _Key, typename _Value, typename _Hash > inline
+void promise_cache<_Key, _Value, _Hash>::_store(_shard& s, typename _lru_list::iterator it, promise&& value, size_t bytes, time_point now)
+{
+    s.bytes -= it->bytes;
+    s.bytes += bytes;
+
+    it->value = std::move(value);
+    it->bytes = bytes;
+    it->expires = now + _options.ttl;
+    it->stale_until = it->expires + _options.stale_ttl;
+
+    _evict(s);
+}
+
+
+template< typename _Key, typename _Value, typename _Hash > inline
+void promise_cache<_Key, _Value, _Hash>::_drop(_shard& s, typename _lru_list::iterator it) noexcept
+{
+    s.bytes -= it->bytes;
+    s.index.erase(it->key);
+    s.lru.erase(it);
+}
+
+
+template< typename _Key, typename _Value, typename _Hash > inline
+void promise_cache<_Key, _Value, _Hash>::_evict(_shard& s) noexcept
+{
+    // the most recent entry always stays, even if it's alone over limit
+    while(s.bytes > _shard_bytes && s.lru.size() > 1)
+    {
+        auto it = std::prev(s.lru.end());
+
+        // skip in-flight tail entries: they are not counted anyway
+        while(it != s.lru.begin() && !it->bytes)
+            --it;
+
+        if(it == s.lru.begin())
+            break;
+
+        ++_evictions;
+
+        _drop(s, it);
+    };
+}
+
+
+CGULL_NAMESPACE_END
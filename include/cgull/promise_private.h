@@ -3,12 +3,34 @@
 #include "config.h"
 #include "common.h"
 #include "guts/shared_data.h"
+#include "guts/parking.h"
+
+#if defined(CGULL_PROFILE)
+#   include "profiler.h"
+#endif
+
+#if defined(CGULL_DEBUG_GUTS)
+#   include "registry.h"
+#endif
+
+#if defined(CGULL_METRICS)
+#   include "metrics.h"
+#endif
+
+#if defined(CGULL_MEMORY_ACCOUNTING)
+#   include "memory_accounting.h"
+#endif
 
 #include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <new>
 #include <vector>
 #include <any>
 #include <tuple>
 #include <stdexcept>
+#include <thread>
 
 
 CGULL_NAMESPACE_START
@@ -16,6 +38,37 @@ CGULL_NAMESPACE_START
 
 class handler;
 
+CGULL_GUTS_NAMESPACE_START
+class waiter_queue;
+
+
+//! Primitive which hands something to waiters of \a waiter_queue: ownership, units or value.
+class waiter_owner
+{
+public:
+    //! Takes back what was granted to waiter fulfilled otherwise before grant reached it,
+    //! e.g. aborted by its owner. Called inside waiter's context.
+    virtual void refund(std::any&& value, size_t weight) noexcept = 0;
+
+protected:
+    ~waiter_owner() = default;
+};
+CGULL_GUTS_NAMESPACE_END
+
+
+//! Memory of \a promise_private::allocate_block() given by caller, e.g. node-local pool of
+//! \a numa_pool_handler. Each block keeps its allocator alive until block is freed.
+class block_allocator
+{
+public:
+    virtual ~block_allocator() = default;
+
+    //! \a node is set to NUMA node memory belongs to or -1 if unknown.
+    virtual void* allocate(size_t bytes, int& node) = 0;
+    //! May be called from any thread.
+    virtual void  deallocate(void* ptr, size_t bytes, int node) noexcept = 0;
+};
+
 
 class promise_private : public guts::shared_data
 {
@@ -23,6 +76,7 @@ class promise_private : public guts::shared_data
     CGULL_DISABLE_MOVE(promise_private);
 
     friend class promise;
+    friend class guts::waiter_queue;
 
 public:
     using type = guts::shared_data_ptr<promise_private>;
@@ -32,12 +86,40 @@ public:
     using finisher_type = std::function<finisher_t>;
 
 
-    promise_private() = default;
+    //! \a site is kept by \a promise_registry if \a CGULL_DEBUG_GUTS is defined.
+    promise_private(guts::creation_site site = {}) noexcept;
     promise_private(wait_t wait);
 
+    //! Not inlined together with \a operator delete(void*), so compilers pair them and not
+    //! global operators inside.
+    static void* operator new(size_t size);
+    //! Frees standalone promise, directly only if constructor throws.
+    static void operator delete(void* ptr) noexcept;
+    //! Destroys promise and frees either its own memory or its share of block.
+    static void operator delete(promise_private* ptr, std::destroying_delete_t) noexcept;
+
+    //! Creates \a count promises owned by handler \a h in one contiguous allocation, which is
+    //! freed when the last of them dies. Memory comes from \a allocator if given, global
+    //! operator new otherwise.
+    static std::vector<type> allocate_block(size_t count, CGULL_NAMESPACE::handler* h = nullptr, std::shared_ptr<block_allocator> allocator = nullptr);
+
+    //! NUMA node recorded by promises created on calling thread, -1 if unknown.
+    static int  thread_node() noexcept { return _thread_node(); }
+    //! Set by handlers which pin their threads to nodes, e.g. \a numa_pool_handler.
+    static void set_thread_node(int node) noexcept { _thread_node() = static_cast<int16_t>(node); }
+
+    //! Fulfills promise inside its handler's context or right here if promise is context-local.
+    void fulfill(std::any&& value, fulfillment_state_t state) noexcept;
+    //! Tries to finish promise inside its handler's context or right here if promise is context-local.
+    void try_finish() noexcept;
+    //! Binds outer inside promise's handler context or right here if promise is context-local.
+    void bind_outer(type outer) noexcept;
+
     void local_fulfill(std::any&& value, fulfillment_state_t state) noexcept;
     void local_set_finisher(finisher_type&& callback, bool is_resolver) noexcept;
     void local_try_finish() noexcept;
+    //! Must be called by finisher to complete promise with callback's result.
+    void local_finish(std::any&& value, fulfillment_state_t state) noexcept;
     void local_abort() noexcept;
     void local_bind_inner(type inner, wait_t new_wait_type) noexcept;
     void local_bind_outer(type outer) noexcept;
@@ -50,6 +132,29 @@ public:
     finish_state_t      finish() const noexcept;
     [[nodiscard]]
     wait_t              wait() const noexcept;
+    [[nodiscard]]
+    priority_t          priority() const noexcept { return _priority.load(std::memory_order::relaxed); }
+    void                set_priority(priority_t p) noexcept { _priority.store(p, std::memory_order::relaxed); }
+    //! Blocks calling thread until promise is fulfilled, see \a promise::wait().
+    fulfillment_state_t wait_fulfilled() noexcept;
+    //! \return \a not_fulfilled if \a deadline passed first.
+    fulfillment_state_t wait_fulfilled_until(std::chrono::steady_clock::time_point deadline) noexcept;
+    //! NUMA node promise was allocated on, -1 if unknown.
+    [[nodiscard]]
+    int                 home_node() const noexcept { return _home_node; }
+    //! \note Only before promise is given to handler, which may route by it.
+    void                set_home_node(int node) noexcept { _home_node = static_cast<int16_t>(node); }
+
+#if defined(CGULL_DEBUG_GUTS)
+    //! Tells \a promise_registry what holds promise. \a note must be static string.
+    void debug_note(const char* note) noexcept { _hook.set_note(note); }
+#endif
+#if defined(CGULL_MEMORY_ACCOUNTING)
+    //! Sets bytes promise holds of category \a c.
+    void account(memory_accounting::category c, int64_t bytes) noexcept { _charge.set(c, bytes); }
+    //! Moves promise's bytes to its handler. Called when handler is set.
+    void account_handler() noexcept;
+#endif
 
 
 protected:
@@ -79,15 +184,72 @@ protected:
     //! Async operations handler.
     //! \note If not set, then promise will be context-local.
     //! \note Context-local.
-    handler*                    handler = nullptr;
+    CGULL_NAMESPACE::handler*   handler = nullptr;
 
 
 private:
+    struct _block
+    {
+        std::atomic<size_t>         alive;
+        //! nullptr for global operator new.
+        std::shared_ptr<block_allocator>
+                                    allocator;
+        size_t                      bytes;
+        int                         node;
+    };
+
+    //! Block this promise was allocated in. nullptr for standalone allocation.
+    _block*                     _owner_block = nullptr;
+
+    //! Intrusive link of \a guts::waiter_queue promise is waiting in.
+    promise_private*            _next_waiter = nullptr;
+    //! Units waiter asked for, e.g. semaphore count.
+    size_t                      _waiter_weight = 0;
+    //! Set by \a guts::waiter_queue::grant_all(), refunded if grant comes too late.
+    std::atomic<guts::waiter_owner*>
+                                _waiter_owner = nullptr;
+    //! Read by handlers when operation is enqueued.
+    std::atomic<priority_t>     _priority = priority_scope::current();
+    //! Not changed once used, so handlers routing by node keep promise on one thread.
+    int16_t                     _home_node = _thread_node();
+    //! Futex word of threads blocked in \a wait_fulfilled(): their count and \a _fulfilled_bit.
+    std::atomic<uint32_t>       _parked = 0;
+
+#if defined(CGULL_PROFILE)
+    guts::profile_probe         _probe;
+#endif
+#if defined(CGULL_MEMORY_ACCOUNTING)
+    guts::memory_charge         _charge;
+#endif
+#if defined(CGULL_DEBUG_GUTS)
+    //! The last member, so promise leaves registry before the rest is destroyed.
+    guts::registry_hook         _hook;
+#endif
+
+
     std::tuple<fulfillment_state_t, std::any> _check_inners_fulfillment() noexcept;
     //! Called only when finished and fulfilled.
     void _propagate() noexcept;
     void _unbind_inners() noexcept;
     void _unbind_outers() noexcept;
+#if defined(CGULL_PROFILE)
+    //! Stamps wake up and picks inner which finished this promise.
+    void _profile_wake(fulfillment_state_t state) noexcept;
+#endif
+
+    //! Set on fulfill if anybody is parked, so sleeping waiter sees the word changed.
+    static constexpr uint32_t   _fulfilled_bit = 1u << 31;
+    //! Checks of state before waiter parks.
+    static constexpr int        _spin_count = 128;
+
+    fulfillment_state_t _park(const std::chrono::steady_clock::time_point* deadline) noexcept;
+
+    static int16_t& _thread_node() noexcept
+    {
+        static thread_local int16_t node = -1;
+
+        return node;
+    }
 
 };
 
@@ -96,11 +258,179 @@ CGULL_NAMESPACE_END
 
 
 #include "handler.h"
+#include "fulfill_scope.h"
 
 
 CGULL_NAMESPACE_START
 
 
+inline
+void handler::bind_outer(private_type target, private_type outer)
+{
+    post([target = std::move(target), outer = std::move(outer)]() { target->local_bind_outer(outer); });
+}
+
+
+inline
+void handler::dispatch(operation_list&& ops)
+{
+    for(auto& op : ops)
+    {
+        switch(op.kind)
+        {
+        case operation::fulfill_op:
+            fulfill(std::move(op.target), std::move(op.value), op.state);
+            break;
+        case operation::try_finish_op:
+            try_finish(std::move(op.target));
+            break;
+        case operation::bind_outer_op:
+            bind_outer(std::move(op.target), std::move(op.outer));
+            break;
+        };
+    };
+}
+
+
+inline
+promise_private::promise_private([[maybe_unused]] guts::creation_site site) noexcept
+{
+    CGULL_DEBUG_GUTS_PROBE(_hook.attach(fulfillment_state, site.location);)
+    CGULL_METRICS_PROBE(metrics::add(metrics::promises_created);)
+    CGULL_MEMORY_PROBE(_charge.set(memory_accounting::promises, sizeof(promise_private));)
+}
+
+
+#if defined(CGULL_MEMORY_ACCOUNTING)
+inline
+void promise_private::account_handler() noexcept
+{
+    _charge.set_handler(handler ? handler->memory_slot() : 0);
+}
+#endif
+
+
+CGULL_NOINLINE inline
+void* promise_private::operator new(size_t size)
+{
+    CGULL_METRICS_PROBE(metrics::add(metrics::heap_allocations);)
+
+    return ::operator new(size);
+}
+
+
+CGULL_NOINLINE inline
+void promise_private::operator delete(void* ptr) noexcept
+{
+    ::operator delete(ptr);
+}
+
+
+inline
+void promise_private::operator delete(promise_private* ptr, std::destroying_delete_t) noexcept
+{
+    const auto block = ptr->_owner_block;
+
+    ptr->~promise_private();
+
+    CGULL_METRICS_PROBE(metrics::add(metrics::promises_destroyed);)
+
+    // through the pair of operator new, so allocation and deallocation match
+    if(!block)
+        promise_private::operator delete(static_cast<void*>(ptr));
+    else if(block->alive.fetch_sub(1, std::memory_order::acq_rel) == 1)
+    {
+        // block may be the last owner of allocator
+        const auto allocator = std::move(block->allocator);
+        const auto bytes = block->bytes;
+        const auto node = block->node;
+
+        block->~_block();
+
+        if(allocator)
+            allocator->deallocate(block, bytes, node);
+        else
+            ::operator delete(block);
+    };
+}
+
+
+inline
+std::vector<promise_private::type> promise_private::allocate_block(size_t count, CGULL_NAMESPACE::handler* h, std::shared_ptr<block_allocator> allocator)
+{
+    std::vector<type> result;
+
+    if(!count)
+        return result;
+
+    result.reserve(count);
+
+    CGULL_METRICS_PROBE(metrics::add(metrics::block_allocations, count);)
+
+    constexpr auto header = (sizeof(_block) + alignof(promise_private) - 1) / alignof(promise_private) * alignof(promise_private);
+
+    const auto bytes = header + count * sizeof(promise_private);
+    int node = -1;
+
+    const auto raw = static_cast<char*>(allocator ? allocator->allocate(bytes, node) : ::operator new(bytes));
+    const auto block = ::new(raw) _block{ count, std::move(allocator), bytes, node };
+    const auto first = reinterpret_cast<promise_private*>(raw + header);
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        const auto p = ::new(first + i) promise_private{};
+
+        p->handler = h;
+        p->_owner_block = block;
+
+        if(node >= 0)
+            p->_home_node = static_cast<int16_t>(node);
+
+        CGULL_MEMORY_PROBE(p->account_handler();)
+
+        result.emplace_back(p);
+    };
+
+    return result;
+}
+
+
+inline
+void promise_private::fulfill(std::any&& value, fulfillment_state_t state) noexcept
+{
+    if(!handler)
+        local_fulfill(std::forward<decltype(value)>(value), state);
+    else if(fulfill_scope::active())
+        fulfill_scope::capture(handler, { .kind = handler::operation::fulfill_op, .target = type{this}, .value = std::move(value), .state = state });
+    else
+        handler->fulfill(type{this}, std::forward<decltype(value)>(value), state);
+}
+
+
+inline
+void promise_private::try_finish() noexcept
+{
+    if(!handler)
+        local_try_finish();
+    else if(fulfill_scope::active())
+        fulfill_scope::capture(handler, { .kind = handler::operation::try_finish_op, .target = type{this} });
+    else
+        handler->try_finish(type{this});
+}
+
+
+inline
+void promise_private::bind_outer(type outer) noexcept
+{
+    if(!handler)
+        local_bind_outer(std::move(outer));
+    else if(fulfill_scope::active())
+        fulfill_scope::capture(handler, { handler::operation::bind_outer_op, type{this}, {}, not_fulfilled, std::move(outer) });
+    else
+        handler->bind_outer(type{this}, std::move(outer));
+}
+
+
 inline
 void promise_private::local_fulfill(std::any&& value, fulfillment_state_t state) noexcept
 {
@@ -110,11 +440,48 @@ void promise_private::local_fulfill(std::any&& value, fulfillment_state_t state)
         nff, fulfilling_now,
         std::memory_order::acquire, std::memory_order::relaxed
     ))
+    {
+        // grant of sync primitive lost to waiter's own abort, so it's given back
+        if(state == resolved)
+            if(const auto owner = _waiter_owner.exchange(nullptr, std::memory_order::acquire))
+                owner->refund(std::forward<decltype(value)>(value), _waiter_weight);
+
         return;
+    };
 
     result = std::forward<decltype(value)>(value);
 
-    fulfillment_state.store(state, std::memory_order::release);
+    CGULL_MEMORY_PROBE(
+        if(const auto list = std::any_cast<any_list>(&result))
+            _charge.set(memory_accounting::results, int64_t(sizeof(any_list) + list->capacity() * sizeof(std::any)));
+    )
+
+    CGULL_PROFILE_PROBE(
+        _probe.fulfilled = _probe.now();
+        _probe.thread = profiler::thread_index();
+    )
+
+    // pairs with waiter counting itself before its last look at state
+    fulfillment_state.store(state, std::memory_order::seq_cst);
+
+    if(_parked.load(std::memory_order::seq_cst))
+    {
+        _parked.fetch_or(_fulfilled_bit, std::memory_order::release);
+
+        guts::unpark_all(_parked);
+    };
+
+    // probe isn't changed anymore, so it's read outside of fulfilling_now window
+    CGULL_PROFILE_PROBE(
+        if(_probe.fulfilled)
+            profiler::instance().collect(_probe);
+    )
+
+    CGULL_METRICS_PROBE(
+        metrics::add(state == resolved ? metrics::promises_resolved : state == rejected ? metrics::promises_rejected : metrics::promises_aborted);
+    )
+
+    _propagate();
 }
 
 
@@ -158,13 +525,30 @@ void promise_private::local_try_finish() noexcept
     if(ins_state < resolved)
         return;
 
-    // finish or try propagate to outer. skip if chain is also skipped.
-    if( fn_state == awaiting && (ins_state == resolved || ins_state == rejected) )
+    CGULL_PROFILE_PROBE(_profile_wake(ins_state);)
+
+    // finish or try propagate to outer. skip if chain is also skipped or finisher
+    // doesn't handle this kind of fulfillment (i.e. resolver on rejected inners).
+    if( fn_state == awaiting && ins_state == (resolve_finisher ? resolved : rejected) )
     {
         assert(!!finisher && "cgull:try_finish() can't be called without callback set.");
 
-        finisher(execute, std::move(ins_result)); // not async
+        // finisher may re-enter through inners bound inside it
+        auto fn = std::move(finisher);
         finisher = nullptr;
+
+        CGULL_MEMORY_PROBE(_charge.set(memory_accounting::finishers, 0);)
+
+        CGULL_PROFILE_PROBE(
+            _probe.finish_started = _probe.now();
+            _probe.finish_thread = profiler::thread_index();
+        )
+        CGULL_METRICS_PROBE(metrics::add(metrics::continuations_run);)
+
+        // promises created by callback belong to the same chain
+        const priority_scope scope{ priority() };
+
+        fn(execute, std::move(ins_result)); // not async
     }
     else
     {
@@ -176,13 +560,30 @@ void promise_private::local_try_finish() noexcept
 }
 
 
+inline
+void promise_private::local_finish(std::any&& value, fulfillment_state_t state) noexcept
+{
+    finish_state = resolve_finisher ? thenned : rescued;
+
+    CGULL_PROFILE_PROBE(_probe.finish_ended = _probe.now();)
+
+    _unbind_inners();
+
+    local_fulfill(std::forward<decltype(value)>(value), state);
+}
+
+
 inline
 void promise_private::local_abort() noexcept
 {
     if(finisher)
     {
-        finisher(abort, std::any{});
+        auto fn = std::move(finisher);
         finisher = nullptr;
+
+        CGULL_MEMORY_PROBE(_charge.set(memory_accounting::finishers, 0);)
+
+        fn(abort, std::any{});
     };
 
     if(finish() < thenned)
@@ -196,6 +597,10 @@ void promise_private::local_abort() noexcept
 inline
 void promise_private::local_bind_inner(type inner, wait_t new_wait_type) noexcept
 {
+    CGULL_PROFILE_PROBE(_probe.inherit(inner->_probe);)
+    CGULL_DEBUG_GUTS_PROBE(_hook.set_wait(new_wait_type);)
+    CGULL_MEMORY_PROBE(_charge.inherit(inner->_charge);)
+
     inners.push_back(inner);
     wait_type = new_wait_type;
 }
@@ -204,14 +609,27 @@ void promise_private::local_bind_inner(type inner, wait_t new_wait_type) noexcep
 inline
 void promise_private::local_bind_outer(type outer) noexcept
 {
-
     if(is_fulfilled())
-        outer->handler->try_finish();
+        outer->try_finish();
     else
         outers.push_back(outer);
 }
 
 
+inline
+fulfillment_state_t promise_private::wait_fulfilled() noexcept
+{
+    return _park(nullptr);
+}
+
+
+inline
+fulfillment_state_t promise_private::wait_fulfilled_until(std::chrono::steady_clock::time_point deadline) noexcept
+{
+    return _park(&deadline);
+}
+
+
 inline
 fulfillment_state_t promise_private::fulfillment() const noexcept
 {
@@ -240,6 +658,49 @@ wait_t promise_private::wait() const noexcept
 }
 
 
+inline
+fulfillment_state_t promise_private::_park(const std::chrono::steady_clock::time_point* deadline) noexcept
+{
+    // fulfiller on other core is usually close, spinning is cheaper than sleep and wake up
+    static const int spins = std::thread::hardware_concurrency() > 1 ? _spin_count : 1;
+
+    for(int i = 0; i < spins; ++i)
+    {
+        const auto state = fulfillment_state.load(std::memory_order::acquire);
+
+        if(state >= resolved)
+            return state;
+
+        guts::cpu_relax();
+    };
+
+    _parked.fetch_add(1, std::memory_order::seq_cst);
+
+    auto state = not_fulfilled;
+
+    while(true)
+    {
+        const auto word = _parked.load(std::memory_order::acquire);
+
+        state = fulfillment_state.load(std::memory_order::seq_cst);
+
+        if(state >= resolved)
+            break;
+
+        // word read before state, so fulfill in between changes it and park returns at once
+        if(!guts::park(_parked, word, deadline))
+        {
+            state = fulfillment_state.load(std::memory_order::acquire);
+            break;
+        };
+    };
+
+    _parked.fetch_sub(1, std::memory_order::relaxed);
+
+    return state >= resolved ? state : not_fulfilled;
+}
+
+
 inline
 std::tuple<fulfillment_state_t, std::any> promise_private::_check_inners_fulfillment() noexcept
 {
@@ -324,16 +785,48 @@ std::tuple<fulfillment_state_t, std::any> promise_private::_check_inners_fulfill
 inline
 void promise_private::_propagate() noexcept
 {
-    for(const auto& outer : outers)
-    {
-        if(outer->handler)
-            outer->handler->try_finish();
-        else
-            outer->local_try_finish();
-    };
+    // outers may be bound again by continuations
+    const auto outs = std::move(outers);
 
     _unbind_outers();
+
+    for(const auto& outer : outs)
+        outer->try_finish();
+}
+
+
+#if defined(CGULL_PROFILE)
+inline
+void promise_private::_profile_wake(fulfillment_state_t state) noexcept
+{
+    if(!_probe.sampled())
+        return;
+
+    _probe.woken = profiler::now();
+
+    const auto wt = wait();
+    // waiting for every inner ends with the latest one, otherwise with the earliest matching
+    const bool every = (wt == all && state == resolved) || (wt == any && state == rejected);
+
+    const promise_private* cause = wt == last_bound ? inners.back().data() : nullptr;
+
+    if(!cause)
+        for(const auto& inn : inners)
+        {
+            if(!inn->is_fulfilled() || (!every && inn->fulfillment() != state))
+                continue;
+
+            if(!cause || (every ? inn->_probe.fulfilled > cause->_probe.fulfilled : inn->_probe.fulfilled < cause->_probe.fulfilled))
+                cause = inn.data();
+        };
+
+    // promise returned by callback which was ready already didn't delay anything
+    if(!cause || (_probe.finish_started && cause->_probe.fulfilled <= _probe.finish_started))
+        return;
+
+    _probe.cause = cause->_probe.id;
 }
+#endif
 
 
 inline
@@ -0,0 +1,324 @@
+#pragma once
+
+#include "config.h"
+#include "common.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <source_location>
+#include <thread>
+#include <vector>
+
+
+CGULL_NAMESPACE_START
+
+
+class promise_registry;
+
+
+//! Live promise as seen by \a promise_registry.
+struct live_promise
+{
+    std::chrono::nanoseconds    age;
+    fulfillment_state_t         state;
+    wait_t                      wait;
+    //! Where promise was created: constructor call or \a then() / \a rescue().
+    std::source_location        site;
+    //! What holds promise, e.g. \a cgull::async store. nullptr if nothing special.
+    const char*                 note;
+};
+
+
+CGULL_GUTS_NAMESPACE_START
+
+
+//! Registry entry embedded into \a promise_private.
+class registry_hook
+{
+    CGULL_DISABLE_COPY(registry_hook);
+    CGULL_DISABLE_MOVE(registry_hook);
+
+    friend class CGULL_NAMESPACE::promise_registry;
+
+public:
+    registry_hook() noexcept = default;
+    ~registry_hook();
+
+    //! Adds hook to calling thread's shard.
+    void attach(const atomic_fulfillment_state& state, const std::source_location& site) noexcept;
+    void set_wait(wait_t w) noexcept    { _wait.store(w, std::memory_order::relaxed); }
+    //! \a note must be static string.
+    void set_note(const char* note) noexcept { _note.store(note, std::memory_order::relaxed); }
+
+
+private:
+    registry_hook*                  _prev = nullptr;
+    registry_hook*                  _next = nullptr;
+    uint32_t                        _shard = 0;
+    bool                            _attached = false;
+
+    std::chrono::steady_clock::time_point
+                                    _created;
+    std::source_location            _site;
+    const atomic_fulfillment_state* _state = nullptr;
+    std::atomic<wait_t>             _wait = any;
+    std::atomic<const char*>        _note = nullptr;
+
+};
+
+
+CGULL_GUTS_NAMESPACE_END
+
+
+//! Registry of live promises for leak and stall detection.
+//!
+//! Available only if cgull is built with \a CGULL_DEBUG_GUTS defined, otherwise promises
+//! aren't registered at all. Each promise is linked into intrusive list of shard picked by
+//! creating thread, so threads creating promises don't contend on one lock.
+//!
+//! \code
+//! cgull::promise_registry::instance().start_watchdog(10s, 1min, [](const auto& stalled)
+//! {
+//!     for(const auto& p : stalled)
+//!         log("pending for {}: {}:{}", p.age, p.site.file_name(), p.site.line());
+//! });
+//! \endcode
+//!
+//! \note Thread-safe.
+class promise_registry
+{
+    CGULL_DISABLE_COPY(promise_registry);
+    CGULL_DISABLE_MOVE(promise_registry);
+
+    friend class guts::registry_hook;
+
+public:
+    using stall_callback = std::function<void(const std::vector<live_promise>&)>;
+
+    static constexpr uint32_t shard_count = 16;
+
+
+    static promise_registry& instance();
+
+    //! Live promises count.
+    [[nodiscard]]
+    size_t  size() const noexcept;
+    [[nodiscard]]
+    std::vector<live_promise> snapshot() const;
+    //! \return Promises still not fulfilled after \a threshold.
+    [[nodiscard]]
+    std::vector<live_promise> stalled(std::chrono::nanoseconds threshold) const;
+
+    //! Scans registry every \a period and calls \a on_stall from its thread if there are
+    //! promises pending longer than \a threshold. Replaces running watchdog.
+    void    start_watchdog(std::chrono::milliseconds period, std::chrono::nanoseconds threshold, stall_callback on_stall);
+    void    stop_watchdog();
+
+
+private:
+    struct alignas(64) _shard
+    {
+        mutable std::mutex      mutex;
+        guts::registry_hook*    head = nullptr;
+        std::atomic<size_t>     size = 0;
+    };
+
+    _shard                      _shards[shard_count];
+
+    std::mutex                  _watchdog_mutex;
+    std::condition_variable     _watchdog_cv;
+    std::thread                 _watchdog;
+    bool                        _watchdog_stop = false;
+
+
+    promise_registry() = default;
+
+    template< typename _Filter >
+    std::vector<live_promise> _collect(_Filter&& filter) const;
+    void    _watch(std::chrono::milliseconds period, std::chrono::nanoseconds threshold, stall_callback on_stall);
+
+    static uint32_t _local_shard() noexcept;
+
+};
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+CGULL_GUTS_NAMESPACE_START
+
+
+inline
+registry_hook::~registry_hook()
+{
+    if(!_attached)
+        return;
+
+    auto& shard = promise_registry::instance()._shards[_shard];
+
+    std::lock_guard lock{ shard.mutex };
+
+    (_prev ? _prev->_next : shard.head) = _next;
+
+    if(_next)
+        _next->_prev = _prev;
+
+    shard.size.fetch_sub(1, std::memory_order::relaxed);
+}
+
+
+inline
+void registry_hook::attach(const atomic_fulfillment_state& state, const std::source_location& site) noexcept
+{
+    _created = std::chrono::steady_clock::now();
+    _site = site;
+    _state = &state;
+    _shard = promise_registry::_local_shard();
+
+    auto& shard = promise_registry::instance()._shards[_shard];
+
+    std::lock_guard lock{ shard.mutex };
+
+    _next = shard.head;
+
+    if(_next)
+        _next->_prev = this;
+
+    shard.head = this;
+    shard.size.fetch_add(1, std::memory_order::relaxed);
+
+    _attached = true;
+}
+
+
+CGULL_GUTS_NAMESPACE_END
+
+
+inline
+promise_registry& promise_registry::instance()
+{
+    // never destroyed: static promises may die after it
+    static const auto r = new promise_registry;
+
+    return *r;
+}
+
+
+inline
+size_t promise_registry::size() const noexcept
+{
+    size_t result = 0;
+
+    for(const auto& s : _shards)
+        result += s.size.load(std::memory_order::relaxed);
+
+    return result;
+}
+
+
+inline
+std::vector<live_promise> promise_registry::snapshot() const
+{
+    return _collect([](const live_promise&) { return true; });
+}
+
+
+inline
+std::vector<live_promise> promise_registry::stalled(std::chrono::nanoseconds threshold) const
+{
+    return _collect([threshold](const live_promise& p) { return p.state == not_fulfilled && p.age >= threshold; });
+}
+
+
+inline
+void promise_registry::start_watchdog(std::chrono::milliseconds period, std::chrono::nanoseconds threshold, stall_callback on_stall)
+{
+    stop_watchdog();
+
+    std::lock_guard lock{ _watchdog_mutex };
+
+    _watchdog_stop = false;
+    _watchdog = std::thread{ &promise_registry::_watch, this, period, threshold, std::move(on_stall) };
+}
+
+
+inline
+void promise_registry::stop_watchdog()
+{
+    {
+        std::lock_guard lock{ _watchdog_mutex };
+
+        if(!_watchdog.joinable())
+            return;
+
+        _watchdog_stop = true;
+    };
+
+    _watchdog_cv.notify_one();
+    _watchdog.join();
+}
+
+
+template< typename _Filter > inline
+std::vector<live_promise> promise_registry::_collect(_Filter&& filter) const
+{
+    std::vector<live_promise> result;
+
+    const auto now = std::chrono::steady_clock::now();
+
+    for(const auto& s : _shards)
+    {
+        std::lock_guard lock{ s.mutex };
+
+        for(auto h = s.head; h; h = h->_next)
+        {
+            live_promise p{
+                now - h->_created,
+                h->_state->load(std::memory_order::relaxed),
+                h->_wait.load(std::memory_order::relaxed),
+                h->_site,
+                h->_note.load(std::memory_order::relaxed)
+            };
+
+            if(filter(p))
+                result.push_back(p);
+        };
+    };
+
+    return result;
+}
+
+
+inline
+void promise_registry::_watch(std::chrono::milliseconds period, std::chrono::nanoseconds threshold, stall_callback on_stall)
+{
+    std::unique_lock lock{ _watchdog_mutex };
+
+    while(!_watchdog_cv.wait_for(lock, period, [this]{ return _watchdog_stop; }))
+    {
+        lock.unlock();
+
+        if(auto s = stalled(threshold); !s.empty())
+            on_stall(s);
+
+        lock.lock();
+    };
+}
+
+
+inline
+uint32_t promise_registry::_local_shard() noexcept
+{
+    static std::atomic<uint32_t> next = 0;
+    static thread_local const uint32_t shard = next.fetch_add(1, std::memory_order::relaxed) % shard_count;
+
+    return shard;
+}
+
+
+CGULL_NAMESPACE_END
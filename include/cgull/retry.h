@@ -0,0 +1,240 @@
+#pragma once
+
+#include "config.h"
+#include "promise.h"
+#include "handler.h"
+#include "timer_service.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <algorithm>
+#include <any>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <random>
+#include <type_traits>
+#include <utility>
+
+
+CGULL_NAMESPACE_START
+
+
+//! Outcome of one \a retry() attempt.
+struct retry_attempt
+{
+    using duration = std::chrono::steady_clock::duration;
+
+    //! 1-based attempt number.
+    size_t      number = 0;
+    //! Time from call to fulfillment of this attempt.
+    duration    elapsed = duration::zero();
+    //! Time since the first attempt started.
+    duration    total = duration::zero();
+    bool        succeeded = false;
+    //! Delay before the next attempt. Zero if there will be no next attempt.
+    duration    next_delay = duration::zero();
+    //! Rejection value of failed attempt.
+    std::any    error;
+};
+
+
+struct retry_policy
+{
+    using duration = std::chrono::steady_clock::duration;
+
+    //! Attempts count including the first one.
+    size_t      max_attempts = 3;
+    //! Delay before the second attempt.
+    duration    initial_delay = std::chrono::milliseconds{100};
+    //! Each next delay is multiplied by this.
+    double      multiplier = 2.0;
+    duration    max_delay = std::chrono::seconds{10};
+    //! Part of delay which is randomized: delay is taken from [d * (1 - jitter), d].
+    //! 1 gives "full jitter", 0 disables randomization.
+    double      jitter = 0.2;
+    //! Time limit for all attempts and delays. Retry isn't scheduled if it would start after
+    //! budget is spent. Zero means no limit.
+    duration    budget = duration::zero();
+    //! Tells if rejection with \a error is worth retrying. All rejections are if not set.
+    std::function<bool(const std::any& error, size_t attempt)>
+                retryable;
+    //! Called after every attempt.
+    std::function<void(const retry_attempt& attempt)>
+                on_attempt;
+};
+
+
+//! Calls \a fn (returning \a promise) until it resolves, according to \a policy.
+//!
+//! Returned promise is created once and is fulfilled by the last attempt: resolved with its
+//! value or rejected with its rejection. Delays between attempts are made with
+//! \a timer_service and grow exponentially with jitter.
+//!
+//! Returned promise is owned by \a h and retries are started inside it. Timers fire on
+//! service's own thread, so \a h is required: \a fn never runs there.
+//!
+//! \note Exception thrown by \a fn counts as rejection with \a std::exception_ptr.
+template< typename _Fn >
+promise retry(_Fn&& fn, CGULL_NAMESPACE::handler* h, retry_policy policy = {});
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+CGULL_GUTS_NAMESPACE_START
+
+
+template< typename _Fn >
+class retry_state : public std::enable_shared_from_this<retry_state<_Fn>>
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+
+    retry_state(_Fn&& fn, CGULL_NAMESPACE::handler* h, retry_policy&& policy)
+        : _fn(std::move(fn))
+        , _policy(std::move(policy))
+        , _handler(h)
+        , _result(h)
+        , _started(clock::now())
+    { }
+
+    promise start()
+    {
+        _attempt();
+
+        return _result;
+    }
+
+
+private:
+    _Fn                 _fn;
+    retry_policy        _policy;
+    CGULL_NAMESPACE::handler*
+                        _handler;
+    promise             _result;
+    clock::time_point   _started;
+    clock::time_point   _attempt_started;
+    size_t              _number = 0;
+    timer_call          _timer;
+
+
+    void _attempt()
+    {
+        ++_number;
+        _attempt_started = clock::now();
+
+        auto self = this->shared_from_this();
+
+        try
+        {
+            std::invoke(_fn)
+                .then([self](std::any value) { self->_succeeded(std::move(value)); })
+                .rescue([self](std::any error) { self->_failed(std::move(error)); });
+        }
+        catch(...)
+        {
+            _failed(std::any{std::current_exception()});
+        };
+    }
+
+    void _succeeded(std::any&& value)
+    {
+        _report(true, {}, std::any{});
+
+        _result.resolve(std::move(value));
+    }
+
+    void _failed(std::any&& error)
+    {
+        const auto next = _next_delay(error);
+
+        _report(false, next, error);
+
+        if(next < clock::duration::zero())
+            return (void)_result.reject(std::move(error));
+
+        // attempts are made inside handler, whatever context has rejected this one
+        _timer.arm(_handler, clock::now() + next, [self = this->shared_from_this()]{ self->_attempt(); });
+    }
+
+    //! \return Negative if there will be no more attempts.
+    clock::duration _next_delay(const std::any& error) const
+    {
+        if(_number >= _policy.max_attempts)
+            return clock::duration{-1};
+
+        if(_policy.retryable && !_policy.retryable(error, _number))
+            return clock::duration{-1};
+
+        auto d = std::chrono::duration<double>(_policy.initial_delay);
+
+        for(size_t i = 1; i < _number && d < _policy.max_delay; ++i)
+            d *= _policy.multiplier;
+
+        d = std::min<std::chrono::duration<double>>(d, _policy.max_delay);
+
+        if(_policy.jitter > 0)
+        {
+            thread_local std::minstd_rand rng{ std::random_device{}() };
+
+            const auto jitter = std::clamp(_policy.jitter, 0.0, 1.0);
+
+            d *= 1.0 - jitter * std::uniform_real_distribution<double>{ 0.0, 1.0 }(rng);
+        };
+
+        const auto result = std::chrono::duration_cast<clock::duration>(d);
+
+        if(_policy.budget > clock::duration::zero() && clock::now() + result - _started > _policy.budget)
+            return clock::duration{-1};
+
+        return result;
+    }
+
+    void _report(bool succeeded, clock::duration next, const std::any& error)
+    {
+        if(!_policy.on_attempt)
+            return;
+
+        const auto now = clock::now();
+
+        _policy.on_attempt({
+            _number,
+            now - _attempt_started,
+            now - _started,
+            succeeded,
+            std::max(next, clock::duration::zero()),
+            error
+        });
+    }
+
+};
+
+
+CGULL_GUTS_NAMESPACE_END
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+template< typename _Fn > inline
+promise retry(_Fn&& fn, CGULL_NAMESPACE::handler* h, retry_policy policy)
+{
+    static_assert(
+        std::is_same_v<std::decay_t<std::invoke_result_t<std::decay_t<_Fn>&>>, promise>,
+        "cgull: retry function must return promise"
+    );
+
+    assert(h && "cgull: retry needs handler, timer fires on its own thread");
+
+    return std::make_shared<guts::retry_state<std::decay_t<_Fn>>>(
+        std::decay_t<_Fn>{std::forward<_Fn>(fn)}, h, std::move(policy)
+    )->start();
+}
+
+
+CGULL_NAMESPACE_END
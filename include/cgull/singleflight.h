@@ -0,0 +1,171 @@
+#pragma once
+
+#include "config.h"
+#include "promise.h"
+#include "handler.h"
+
+#include <any>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+
+CGULL_NAMESPACE_START
+
+
+//! De-duplicates concurrent calls with equal keys.
+//!
+//! The first call with a key invokes function and remembers returned promise until it is
+//! fulfilled. Calls with the same key made meanwhile don't invoke anything and get that very
+//! promise, so function runs once per flight.
+//!
+//! Result is stored once, but every continuation attached by waiters gets its own copy of it.
+//! Make function resolve with \a std::shared_ptr<const T> if value is expensive to copy.
+//!
+//! \code
+//! cgull::singleflight<std::string> loads;
+//!
+//! cgull::promise load(const std::string& key)
+//! {
+//!     return loads(key, [&]{ return backend_get(key); });
+//! }
+//! \endcode
+//!
+//! \note Shared promises are owned by handler passed to constructor. If it isn't set, they
+//!       are context-local and all calls must be made in the same context.
+//! \note Must outlive all in-flight calls.
+template< typename _Key, typename _Hash = std::hash<_Key>, typename _Equal = std::equal_to<_Key> >
+class singleflight
+{
+    CGULL_DISABLE_COPY(singleflight);
+    CGULL_DISABLE_MOVE(singleflight);
+
+public:
+    explicit
+    singleflight(handler* h = nullptr);
+
+    //! Returns in-flight promise for \a key or calls \a fn (which must return \a promise) and
+    //! returns promise fulfilled as its result. Exception thrown by \a fn rejects promise with
+    //! \a std::exception_ptr.
+    template< typename _Fn >
+    promise operator()(const _Key& key, _Fn&& fn);
+
+    //! Number of keys in flight.
+    [[nodiscard]]
+    size_t size() const;
+    //! Number of calls served by already in-flight promise.
+    [[nodiscard]]
+    size_t shared_count() const;
+
+
+private:
+    handler*                                        _handler;
+    mutable std::mutex                              _mutex;
+    std::unordered_map<_Key, promise, _Hash, _Equal> _calls;
+    size_t                                          _shared = 0;
+
+
+    void _forget(const _Key& key, const promise& p);
+
+};
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+template< typename _Key, typename _Hash, typename _Equal > inline
+singleflight<_Key, _Hash, _Equal>::singleflight(handler* h)
+    : _handler(h)
+{ }
+
+
+template< typename _Key, typename _Hash, typename _Equal >
+template< typename _Fn > inline
+promise singleflight<_Key, _Hash, _Equal>::operator()(const _Key& key, _Fn&& fn)
+{
+    static_assert(
+        std::is_same_v<std::decay_t<std::invoke_result_t<_Fn&>>, promise>,
+        "cgull: singleflight function must return promise"
+    );
+
+    promise shared{ _handler };
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        const auto [it, inserted] = _calls.try_emplace(key, shared);
+
+        if(!inserted)
+        {
+            ++_shared;
+
+            return it->second;
+        };
+    };
+
+    // placeholder is published before call, so recursive and concurrent calls attach to it
+    try
+    {
+        std::invoke(fn)
+            .then([this, key, shared](std::any value) mutable
+            {
+                _forget(key, shared);
+
+                shared.resolve(std::move(value));
+            })
+            .rescue([this, key, shared](std::any error) mutable
+            {
+                _forget(key, shared);
+
+                shared.reject(std::move(error));
+            });
+    }
+    catch(...)
+    {
+        _forget(key, shared);
+
+        shared.reject(std::any{std::current_exception()});
+    };
+
+    return shared;
+}
+
+
+template< typename _Key, typename _Hash, typename _Equal > inline
+size_t singleflight<_Key, _Hash, _Equal>::size() const
+{
+    std::lock_guard lock{ _mutex };
+
+    return _calls.size();
+}
+
+
+template< typename _Key, typename _Hash, typename _Equal > inline
+size_t singleflight<_Key, _Hash, _Equal>::shared_count() const
+{
+    std::lock_guard lock{ _mutex };
+
+    return _shared;
+}
+
+
+template< typename _Key, typename _Hash, typename _Equal > inline
+void singleflight<_Key, _Hash, _Equal>::_forget(const _Key& key, const promise& p)
+{
+    std::lock_guard lock{ _mutex };
+
+    const auto it = _calls.find(key);
+
+    // key may already belong to the next flight
+    if(it != _calls.end() && guts::private_of(it->second) == guts::private_of(p))
+        _calls.erase(it);
+}
+
+
+CGULL_NAMESPACE_END
@@ -0,0 +1,235 @@
+#pragma once
+
+#include "config.h"
+#include "promise_private.h"
+#include "handler.h"
+#include "guts/mpsc_queue.h"
+#include "guts/handler_op.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <utility>
+
+
+CGULL_NAMESPACE_START
+
+
+//! Handler which runs its operations one at a time and in order on top of another handler.
+//!
+//! Operations go to lock-free MPSC queue. Producer which makes queue non-empty posts drain
+//! task to target handler, drain runs everything queued by then and posts itself again if more
+//! came meanwhile, so at most one drain exists at any moment and no thread ever waits for
+//! strand. Thousands of strands may share one \a thread_pool_handler: each holds worker only
+//! while it has work and gives it back after every batch.
+//!
+//! \code
+//! cgull::thread_pool_handler pool;
+//! cgull::strand connection{ pool };
+//!
+//! read().then(&connection, [&](buffer b) { state.feed(b); });
+//! \endcode
+//!
+//! Context is the strand itself: promises owned by it are never touched concurrently, though
+//! each drain may run on different thread of target.
+//!
+//! \note Target handler must outlive strand, strand must outlive promises owned by it.
+class strand : public handler
+{
+    CGULL_DISABLE_COPY(strand);
+    CGULL_DISABLE_MOVE(strand);
+
+public:
+    explicit
+    strand(CGULL_NAMESPACE::handler& target);
+    ~strand() override;
+
+    void fulfill(private_type target, std::any&& value, fulfillment_state_t state) override;
+    void try_finish(private_type target) override;
+    void post(task_type&& task) override;
+    void bind_outer(private_type target, private_type outer) override;
+    //! Enqueues all \a ops at once with at most one drain posted.
+    void dispatch(operation_list&& ops) override;
+
+    [[nodiscard]]
+    CGULL_NAMESPACE::handler& target() const noexcept { return _core->target; }
+    //! \return true if called from strand's drain.
+    [[nodiscard]]
+    bool running_in_this_thread() const noexcept;
+
+
+private:
+    using _op = guts::handler_op;
+
+    //! Shared with posted drain, so drain finishing after strand's destruction is safe.
+    struct _shared
+    {
+        CGULL_NAMESPACE::handler&   target;
+        guts::mpsc_queue<_op>       queue;
+        //! Operations counted before they are pushed, so queue may lag behind. Drain is
+        //! posted by the producer which moves it from zero.
+        std::atomic<size_t>         pending = 0;
+#if defined(CGULL_METRICS)
+        uint32_t                    metrics_slot = 0;
+#endif
+
+        explicit _shared(CGULL_NAMESPACE::handler& t) : target(t) { }
+        ~_shared();
+    };
+
+    std::shared_ptr<_shared>        _core;
+
+
+    void _enqueue(_op* first, size_t count);
+
+    static void _drain(std::shared_ptr<_shared> core) noexcept;
+
+    static thread_local const _shared* _current;
+
+};
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+inline thread_local const strand::_shared* strand::_current = nullptr;
+
+
+inline
+strand::strand(CGULL_NAMESPACE::handler& target)
+    : _core(std::make_shared<_shared>(target))
+{
+    CGULL_METRICS_PROBE(_core->metrics_slot = _metrics_slot;)
+}
+
+
+inline
+strand::~strand() = default;
+
+
+inline
+void strand::fulfill(private_type target, std::any&& value, fulfillment_state_t state)
+{
+    _enqueue(new _op{ std::move(target), std::forward<decltype(value)>(value), state }, 1);
+}
+
+
+inline
+void strand::try_finish(private_type target)
+{
+    _enqueue(new _op{ std::move(target) }, 1);
+}
+
+
+inline
+void strand::post(task_type&& task)
+{
+    _enqueue(new _op{ std::forward<decltype(task)>(task) }, 1);
+}
+
+
+inline
+void strand::bind_outer(private_type target, private_type outer)
+{
+    _enqueue(new _op{ std::move(target), std::move(outer) }, 1);
+}
+
+
+inline
+void strand::dispatch(operation_list&& ops)
+{
+    _op* first = nullptr;
+    _op* last = nullptr;
+
+    for(auto& o : ops)
+    {
+        auto op = new _op{ std::move(o) };
+
+        (last ? last->next : first) = op;
+        last = op;
+    };
+
+    _enqueue(first, ops.size());
+}
+
+
+inline
+bool strand::running_in_this_thread() const noexcept
+{
+    return _current == _core.get();
+}
+
+
+inline
+strand::_shared::~_shared()
+{
+    // drop unhandled operations
+    for(auto op = queue.pop_all(); op; )
+    {
+        auto next = op->next;
+
+        delete op;
+        op = next;
+    };
+}
+
+
+inline
+void strand::_enqueue(_op* first, size_t count)
+{
+    if(!first)
+        return;
+
+    CGULL_METRICS_PROBE(metrics::add(_metrics_slot, metrics::operations_enqueued, count);)
+
+    const bool idle = !_core->pending.fetch_add(count, std::memory_order::acq_rel);
+
+    if(first->next)
+        _core->queue.push_list(first);
+    else
+        _core->queue.push(first);
+
+    if(idle)
+        _core->target.post([core = _core]() mutable { _drain(std::move(core)); });
+}
+
+
+inline
+void strand::_drain(std::shared_ptr<_shared> core) noexcept
+{
+    const auto previous = std::exchange(_current, core.get());
+
+    // producers may have counted operations they haven't pushed yet
+    auto op = core->queue.pop_all();
+    size_t done = 0;
+
+    while(op)
+    {
+        CGULL_METRICS_PROBE(metrics::add(core->metrics_slot, metrics::operations_run);)
+
+        op->run();
+
+        auto next = op->next;
+
+        delete op;
+        op = next;
+
+        ++done;
+    };
+
+    _current = previous;
+
+    // the rest is drained by the next task, so strand doesn't hold worker for long
+    if(core->pending.fetch_sub(done, std::memory_order::acq_rel) != done)
+    {
+        auto& target = core->target;
+
+        target.post([core = std::move(core)]() mutable { _drain(std::move(core)); });
+    };
+}
+
+
+CGULL_NAMESPACE_END
@@ -0,0 +1,578 @@
+#pragma once
+
+#include "config.h"
+#include "promise.h"
+#include "handler.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <any>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+CGULL_NAMESPACE_START
+
+
+template< typename _T >
+class async_stream;
+
+
+CGULL_GUTS_NAMESPACE_START
+
+
+//! State shared by all copies of \a async_stream.
+//!
+//! Source is asked for chunks of values which are kept in buffer and handed out to requests
+//! in order. The same state serves every element, so per-element cost is a buffer slot, not
+//! a promise.
+template< typename _T >
+class stream_state : public std::enable_shared_from_this<stream_state<_T>>
+{
+    CGULL_DISABLE_COPY(stream_state);
+    CGULL_DISABLE_MOVE(stream_state);
+
+public:
+    using chunk_type    = std::vector<_T>;
+    using source_type   = std::function<promise(size_t max)>;
+    using each_type     = std::function<void(_T&&)>;
+
+    enum request_kind : uint8_t
+    {
+        //! Resolved with \a std::optional<_T>.
+        value_request,
+        //! Resolved with \a chunk_type, empty at the end.
+        chunk_request,
+        //! Resolved with \a chunk_type or with nothing at the end. Source of operators.
+        source_request,
+        //! Calls function for every value, resolved at the end.
+        each_request,
+    };
+
+
+    stream_state(source_type&& source, size_t chunk, CGULL_NAMESPACE::handler* h);
+
+    promise request(request_kind kind, size_t max = 0, each_type&& each = {});
+
+    [[nodiscard]]
+    bool is_over() const noexcept;
+    [[nodiscard]]
+    size_t chunk_size() const noexcept  { return _chunk; }
+    [[nodiscard]]
+    CGULL_NAMESPACE::handler* handler() const noexcept { return _handler; }
+
+
+private:
+    struct _request
+    {
+        request_kind    kind;
+        size_t          max;
+        promise         result;
+        each_type       each;
+    };
+
+    source_type                 _source;
+    size_t                      _chunk;
+    CGULL_NAMESPACE::handler*   _handler;
+
+    chunk_type                  _buffer;
+    //! Index of the first value in buffer which isn't handed out yet.
+    size_t                      _pos = 0;
+    std::deque<_request>        _requests;
+
+    bool                        _ended = false;
+    bool                        _pulling = false;
+    bool                        _serving = false;
+    std::any                    _error;
+    bool                        _failed = false;
+
+
+    //! Serves requests in loop until buffer is drained and source is pending. Reentrant
+    //! calls (e.g. from continuations of served requests) only queue requests.
+    void _serve();
+    //! \return true if front request is done and removed.
+    bool _serve_front();
+    void _on_chunk(std::any&& chunk);
+    void _on_error(std::any&& error);
+
+    [[nodiscard]]
+    size_t _buffered() const noexcept   { return _buffer.size() - _pos; }
+    chunk_type _take(size_t max);
+
+};
+
+
+CGULL_GUTS_NAMESPACE_END
+
+
+//! Pull-based asynchronous stream of values.
+//!
+//! Values are produced by source function in chunks: it is called with maximal chunk size
+//! and returns promise resolved with \a std::vector<_T> (possibly empty) or with nothing
+//! when stream is over. Rejection ends stream with error.
+//!
+//! Consumer pulls values with \a next(), \a next_chunk() or drives whole stream with
+//! \a for_each(), which doesn't create any promise per element. Operators (\a map(),
+//! \a filter(), \a take(), \a buffer()) transform whole chunks at once.
+//!
+//! \code
+//! cgull::async_stream<page> pages{ [&](size_t) { return fetch_next_page(); } };
+//!
+//! pages
+//!     .filter([](const page& p){ return !p.empty(); })
+//!     .take(10)
+//!     .for_each([](page&& p){ render(p); });
+//! \endcode
+//!
+//! Copies share the same state, like \a promise does.
+//!
+//! \note Context-local: stream must be used in one context. If handler is set, source's
+//!       results are processed inside it and promises returned by stream are owned by it.
+template< typename _T >
+class async_stream
+{
+public:
+    using value_type    = _T;
+    using chunk_type    = std::vector<_T>;
+    using source_type   = typename guts::stream_state<_T>::source_type;
+
+    static constexpr size_t default_chunk = 64;
+
+
+    explicit
+    async_stream(source_type source, size_t chunk = default_chunk, CGULL_NAMESPACE::handler* h = nullptr);
+
+    //! Stream of \a values.
+    static async_stream from(chunk_type values, size_t chunk = default_chunk);
+
+    //! \return Promise resolved with \a std::optional<_T>, \a std::nullopt at the end.
+    promise next();
+    //! \return Promise resolved with \a chunk_type of up to \a max values (chunk size if zero),
+    //!         empty at the end.
+    promise next_chunk(size_t max = 0);
+    //! Calls \a fn with every value.
+    //! \return Promise resolved at the end, or rejected with stream's error or exception
+    //!         thrown by \a fn.
+    template< typename _Fn >
+    promise for_each(_Fn&& fn);
+    //! \return Promise resolved with \a chunk_type of all remaining values.
+    promise collect();
+
+    //! \return Stream of \a fn results.
+    template< typename _Fn >
+    auto map(_Fn&& fn) const -> async_stream<std::decay_t<std::invoke_result_t<_Fn&, _T&&>>>;
+    //! \return Stream of values for which \a pred returns true.
+    template< typename _Pred >
+    async_stream filter(_Pred&& pred) const;
+    //! \return Stream of up to \a n first values. Source isn't pulled after them.
+    async_stream take(size_t n) const;
+    //! \return Stream which prefetches next chunk of up to \a n values while current is
+    //!         consumed.
+    async_stream buffer(size_t n) const;
+
+    //! True if stream is over and all its values are consumed.
+    [[nodiscard]]
+    bool is_over() const noexcept;
+
+
+private:
+    std::shared_ptr<guts::stream_state<_T>> _d;
+
+
+    //! Chunk promise for operators: resolved with nothing at the end.
+    promise _pull(size_t max) const;
+
+};
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+CGULL_GUTS_NAMESPACE_START
+
+
+template< typename _T > inline
+stream_state<_T>::stream_state(source_type&& source, size_t chunk, CGULL_NAMESPACE::handler* h)
+    : _source(std::move(source))
+    , _chunk(chunk ? chunk : 1)
+    , _handler(h)
+{ }
+
+
+template< typename _T > inline
+promise stream_state<_T>::request(request_kind kind, size_t max, each_type&& each)
+{
+    promise result{ _handler };
+
+    _requests.push_back({ kind, max ? max : _chunk, result, std::move(each) });
+
+    _serve();
+
+    return result;
+}
+
+
+template< typename _T > inline
+bool stream_state<_T>::is_over() const noexcept
+{
+    return _ended && !_buffered();
+}
+
+
+template< typename _T > inline
+void stream_state<_T>::_serve()
+{
+    if(_serving)
+        return;
+
+    _serving = true;
+
+    while(!_requests.empty())
+    {
+        if(_serve_front())
+            continue;
+
+        if(_pulling)
+            break;
+
+        _pulling = true;
+
+        promise chunk;
+
+        try
+        {
+            chunk = _source(_requests.front().max);
+        }
+        catch(...)
+        {
+            chunk = promise{}.reject(std::any{std::current_exception()});
+        };
+
+        // already fulfilled chunk calls back right here, the loop goes on then
+        chunk
+            .then(_handler, [self = this->shared_from_this()](std::any c)
+            {
+                self->_pulling = false;
+                self->_on_chunk(std::move(c));
+                self->_serve();
+            })
+            .rescue(_handler, [self = this->shared_from_this()](std::any e)
+            {
+                self->_pulling = false;
+                self->_on_error(std::move(e));
+                self->_serve();
+            });
+
+        if(_pulling)
+            break;
+    };
+
+    _serving = false;
+}
+
+
+template< typename _T > inline
+bool stream_state<_T>::_serve_front()
+{
+    auto& r = _requests.front();
+
+    if(!_buffered() && !_ended)
+        return false;
+
+    auto finish = [this](std::any&& value, fulfillment_state_t state)
+    {
+        // continuations may queue more requests, so request is removed before fulfilling
+        auto result = std::move(_requests.front().result);
+
+        _requests.pop_front();
+
+        state == resolved ? result.resolve(std::move(value)) : result.reject(std::move(value));
+
+        return true;
+    };
+
+    if(_failed && !_buffered())
+        return finish(std::any{_error}, rejected);
+
+    switch(r.kind)
+    {
+    case value_request:
+        if(!_buffered())
+            return finish(std::any{std::optional<_T>{}}, resolved);
+
+        return finish(std::any{std::optional<_T>{std::move(_buffer[_pos++])}}, resolved);
+
+    case chunk_request:
+        return finish(std::any{_take(r.max)}, resolved);
+
+    case source_request:
+        if(!_buffered())
+            return finish(std::any{}, resolved);
+
+        return finish(std::any{_take(r.max)}, resolved);
+
+    case each_request:
+        try
+        {
+            while(_buffered())
+                r.each(std::move(_buffer[_pos++]));
+        }
+        catch(...)
+        {
+            return finish(std::any{std::current_exception()}, rejected);
+        };
+
+        if(!_ended)
+            return false;
+
+        return finish(_failed ? std::any{_error} : std::any{}, _failed ? rejected : resolved);
+    };
+
+    return false;
+}
+
+
+template< typename _T > inline
+void stream_state<_T>::_on_chunk(std::any&& chunk)
+{
+    if(!chunk.has_value())
+    {
+        _ended = true;
+
+        return;
+    };
+
+    auto values = std::any_cast<chunk_type>(&chunk);
+
+    if(!values)
+        return _on_error(std::any{std::make_exception_ptr(std::invalid_argument("cgull: stream source must resolve with std::vector<_T>"))});
+
+    if(!_buffered())
+    {
+        _buffer = std::move(*values);
+        _pos = 0;
+    }
+    else
+        _buffer.insert(_buffer.end(), std::make_move_iterator(values->begin()), std::make_move_iterator(values->end()));
+}
+
+
+template< typename _T > inline
+void stream_state<_T>::_on_error(std::any&& error)
+{
+    _ended = true;
+    _failed = true;
+    _error = std::move(error);
+}
+
+
+template< typename _T > inline
+typename stream_state<_T>::chunk_type stream_state<_T>::_take(size_t max)
+{
+    chunk_type result;
+
+    // whole buffer is handed out without copying
+    if(!_pos && _buffer.size() <= max)
+    {
+        result.swap(_buffer);
+
+        return result;
+    };
+
+    const auto count = std::min(max, _buffered());
+
+    result.reserve(count);
+    result.insert(result.end(), std::make_move_iterator(_buffer.begin() + _pos), std::make_move_iterator(_buffer.begin() + _pos + count));
+
+    _pos += count;
+
+    return result;
+}
+
+
+CGULL_GUTS_NAMESPACE_END
+
+
+template< typename _T > inline
+async_stream<_T>::async_stream(source_type source, size_t chunk, CGULL_NAMESPACE::handler* h)
+    : _d(std::make_shared<guts::stream_state<_T>>(std::move(source), chunk, h))
+{ }
+
+
+template< typename _T > inline
+async_stream<_T> async_stream<_T>::from(chunk_type values, size_t chunk)
+{
+    return async_stream{
+        [values = std::make_shared<chunk_type>(std::move(values)), pos = size_t{0}](size_t max) mutable
+        {
+            if(pos == values->size())
+                return promise{}.resolve();
+
+            const auto count = std::min(max, values->size() - pos);
+
+            chunk_type result{ std::make_move_iterator(values->begin() + pos), std::make_move_iterator(values->begin() + pos + count) };
+
+            pos += count;
+
+            return promise{}.resolve(std::any{std::move(result)});
+        },
+        chunk
+    };
+}
+
+
+template< typename _T > inline
+promise async_stream<_T>::next()
+{
+    return _d->request(guts::stream_state<_T>::value_request);
+}
+
+
+template< typename _T > inline
+promise async_stream<_T>::next_chunk(size_t max)
+{
+    return _d->request(guts::stream_state<_T>::chunk_request, max);
+}
+
+
+template< typename _T >
+template< typename _Fn > inline
+promise async_stream<_T>::for_each(_Fn&& fn)
+{
+    return _d->request(guts::stream_state<_T>::each_request, 0, std::forward<_Fn>(fn));
+}
+
+
+template< typename _T > inline
+promise async_stream<_T>::collect()
+{
+    auto all = std::make_shared<chunk_type>();
+
+    return for_each([all](_T&& v){ all->push_back(std::move(v)); })
+        .then([all]{ return std::any{std::move(*all)}; });
+}
+
+
+template< typename _T >
+template< typename _Fn > inline
+auto async_stream<_T>::map(_Fn&& fn) const -> async_stream<std::decay_t<std::invoke_result_t<_Fn&, _T&&>>>
+{
+    using result_type = std::decay_t<std::invoke_result_t<_Fn&, _T&&>>;
+
+    return async_stream<result_type>{
+        [up = *this, fn = std::make_shared<std::decay_t<_Fn>>(std::forward<_Fn>(fn))](size_t max)
+        {
+            return up._pull(max).then([fn](std::any chunk)
+            {
+                if(!chunk.has_value())
+                    return std::any{};
+
+                auto& values = std::any_cast<chunk_type&>(chunk);
+
+                std::vector<result_type> result;
+
+                result.reserve(values.size());
+
+                for(auto& v : values)
+                    result.push_back(std::invoke(*fn, std::move(v)));
+
+                return std::any{std::move(result)};
+            });
+        },
+        _d->chunk_size(),
+        _d->handler()
+    };
+}
+
+
+template< typename _T >
+template< typename _Pred > inline
+async_stream<_T> async_stream<_T>::filter(_Pred&& pred) const
+{
+    return async_stream{
+        [up = *this, pred = std::make_shared<std::decay_t<_Pred>>(std::forward<_Pred>(pred))](size_t max)
+        {
+            // chunk may become empty, stream just asks for the next one then
+            return up._pull(max).then([pred](std::any chunk)
+            {
+                if(chunk.has_value())
+                {
+                    auto& values = std::any_cast<chunk_type&>(chunk);
+
+                    values.erase(std::remove_if(values.begin(), values.end(), [&](const _T& v){ return !std::invoke(*pred, v); }), values.end());
+                };
+
+                return chunk;
+            });
+        },
+        _d->chunk_size(),
+        _d->handler()
+    };
+}
+
+
+template< typename _T > inline
+async_stream<_T> async_stream<_T>::take(size_t n) const
+{
+    return async_stream{
+        [up = *this, left = std::make_shared<size_t>(n)](size_t max)
+        {
+            if(!*left)
+                return promise{}.resolve();
+
+            return up._pull(std::min(max, *left)).then([left](std::any chunk)
+            {
+                if(chunk.has_value())
+                    *left -= std::any_cast<chunk_type&>(chunk).size();
+
+                return chunk;
+            });
+        },
+        _d->chunk_size(),
+        _d->handler()
+    };
+}
+
+
+template< typename _T > inline
+async_stream<_T> async_stream<_T>::buffer(size_t n) const
+{
+    return async_stream{
+        [up = *this, n, ahead = std::make_shared<std::optional<promise>>()](size_t)
+        {
+            auto current = *ahead ? **ahead : up._pull(n);
+
+            // upstream serves requests in order, so prefetch is queued right behind current
+            *ahead = up._pull(n);
+
+            return current;
+        },
+        n,
+        _d->handler()
+    };
+}
+
+
+template< typename _T > inline
+bool async_stream<_T>::is_over() const noexcept
+{
+    return _d->is_over();
+}
+
+
+template< typename _T > inline
+promise async_stream<_T>::_pull(size_t max) const
+{
+    return _d->request(guts::stream_state<_T>::source_request, max);
+}
+
+
+CGULL_NAMESPACE_END
@@ -0,0 +1,609 @@
+#pragma once
+
+#include "config.h"
+#include "promise.h"
+#include "handler.h"
+#include "guts/waiter_queue.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <any>
+#include <mutex>
+#include <utility>
+
+
+CGULL_NAMESPACE_START
+
+
+//! Promise-based synchronization primitives.
+//!
+//! Waiting never blocks a thread: it returns promise which is resolved when waiter may go on.
+//! Waiters are queued intrusively in FIFO order. Waiter promise is owned by handler passed
+//! to the call or, if none, to the primitive's constructor, so it's resumed inside that
+//! handler and not on the thread which released it. Waiters without any handler are
+//! context-local and are resumed right inside releasing call.
+//!
+//! Waiter which is aborted with \a promise::abort() before it's released is skipped. If abort
+//! is still on its way to waiter's handler, whatever was handed to that waiter is taken back
+//! once the handler sees it. Waiters left when primitive is destroyed are aborted.
+//!
+//! \note All primitives are thread-safe. User code is never called under their locks.
+
+
+//! Asynchronous mutual exclusion.
+//!
+//! \code
+//! mutex.lock()
+//!     .then([&]{ return write_record(); })
+//!     .then([&]{ mutex.unlock(); });
+//! \endcode
+//!
+//! \note Unlock hands ownership to the next waiter directly, so later \a try_lock() can't
+//!       barge in before it.
+class async_mutex : private guts::waiter_owner
+{
+    CGULL_DISABLE_COPY(async_mutex);
+    CGULL_DISABLE_MOVE(async_mutex);
+
+public:
+    explicit
+    async_mutex(CGULL_NAMESPACE::handler* h = nullptr);
+
+    //! \return Promise resolved when mutex is owned by caller.
+    promise lock(CGULL_NAMESPACE::handler* h = nullptr);
+    bool    try_lock();
+    void    unlock();
+
+    [[nodiscard]]
+    bool    is_locked() const;
+
+
+private:
+    CGULL_NAMESPACE::handler*   _handler;
+    mutable std::mutex          _mutex;
+    guts::waiter_queue          _waiters;
+    bool                        _locked = false;
+
+
+    //! Waiter missed ownership, so it goes to the next one.
+    void    refund(std::any&& value, size_t weight) noexcept override;
+
+};
+
+
+//! Asynchronous counting semaphore.
+//!
+//! Waiters are served strictly in order: large \a acquire() at the front is not bypassed by
+//! smaller ones behind it.
+class async_semaphore : private guts::waiter_owner
+{
+    CGULL_DISABLE_COPY(async_semaphore);
+    CGULL_DISABLE_MOVE(async_semaphore);
+
+public:
+    explicit
+    async_semaphore(size_t count, CGULL_NAMESPACE::handler* h = nullptr);
+
+    //! \return Promise resolved when \a n units are taken by caller.
+    promise acquire(size_t n = 1, CGULL_NAMESPACE::handler* h = nullptr);
+    bool    try_acquire(size_t n = 1);
+    void    release(size_t n = 1);
+
+    [[nodiscard]]
+    size_t  available() const;
+
+
+private:
+    CGULL_NAMESPACE::handler*   _handler;
+    mutable std::mutex          _mutex;
+    guts::waiter_queue          _waiters;
+    size_t                      _available;
+
+
+    void    refund(std::any&& value, size_t weight) noexcept override;
+
+};
+
+
+//! Single-use countdown. Waiters are released when counter reaches zero.
+class async_latch
+{
+    CGULL_DISABLE_COPY(async_latch);
+    CGULL_DISABLE_MOVE(async_latch);
+
+public:
+    explicit
+    async_latch(size_t count, CGULL_NAMESPACE::handler* h = nullptr);
+
+    void    count_down(size_t n = 1);
+    //! \return Promise resolved when counter is zero.
+    promise wait(CGULL_NAMESPACE::handler* h = nullptr);
+    //! \return Promise resolved when counter is zero after this call's \a n.
+    promise arrive_and_wait(size_t n = 1, CGULL_NAMESPACE::handler* h = nullptr);
+
+    [[nodiscard]]
+    bool    try_wait() const;
+
+
+private:
+    CGULL_NAMESPACE::handler*   _handler;
+    mutable std::mutex          _mutex;
+    guts::waiter_queue          _waiters;
+    size_t                      _count;
+
+};
+
+
+//! Reusable barrier for \a count participants.
+//!
+//! Promise of each arrival is resolved with \a uint64_t number of completed phase when the
+//! last participant arrives. Then barrier starts next phase.
+class async_barrier
+{
+    CGULL_DISABLE_COPY(async_barrier);
+    CGULL_DISABLE_MOVE(async_barrier);
+
+public:
+    explicit
+    async_barrier(size_t count, CGULL_NAMESPACE::handler* h = nullptr);
+
+    promise arrive_and_wait(CGULL_NAMESPACE::handler* h = nullptr);
+    //! Arrives and leaves: next phases expect one participant less.
+    void    arrive_and_drop();
+
+    [[nodiscard]]
+    uint64_t phase() const;
+
+
+private:
+    CGULL_NAMESPACE::handler*   _handler;
+    mutable std::mutex          _mutex;
+    guts::waiter_queue          _waiters;
+    size_t                      _expected;
+    size_t                      _arrived = 0;
+    uint64_t                    _phase = 0;
+
+
+    //! Completes phase if everyone arrived. Must be called under lock.
+    guts::waiter_queue _try_complete();
+
+};
+
+
+//! Asynchronous event.
+//!
+//! Manual-reset event releases all waiters and stays set until \a reset(). Auto-reset event
+//! releases one waiter per \a set(), or, if nobody waits, stays set until the next \a wait().
+class async_event : private guts::waiter_owner
+{
+    CGULL_DISABLE_COPY(async_event);
+    CGULL_DISABLE_MOVE(async_event);
+
+public:
+    enum reset_mode : uint8_t
+    {
+        manual_reset,
+        auto_reset,
+    };
+
+
+    explicit
+    async_event(reset_mode mode = manual_reset, bool set = false, CGULL_NAMESPACE::handler* h = nullptr);
+
+    promise wait(CGULL_NAMESPACE::handler* h = nullptr);
+    void    set();
+    void    reset();
+
+    [[nodiscard]]
+    bool    is_set() const;
+
+
+private:
+    CGULL_NAMESPACE::handler*   _handler;
+    mutable std::mutex          _mutex;
+    guts::waiter_queue          _waiters;
+    reset_mode                  _mode;
+    bool                        _set;
+
+
+    //! Auto-reset event sets itself again for the next waiter.
+    void    refund(std::any&& value, size_t weight) noexcept override;
+
+};
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+inline
+async_mutex::async_mutex(CGULL_NAMESPACE::handler* h)
+    : _handler(h)
+{ }
+
+
+inline
+promise async_mutex::lock(CGULL_NAMESPACE::handler* h)
+{
+    if(!h)
+        h = _handler;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        if(_locked)
+            return _waiters.push(h);
+
+        _locked = true;
+    };
+
+    return promise{ h }.resolve();
+}
+
+
+inline
+bool async_mutex::try_lock()
+{
+    std::lock_guard lock{ _mutex };
+
+    return !std::exchange(_locked, true);
+}
+
+
+inline
+void async_mutex::unlock()
+{
+    guts::waiter_queue next;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        _waiters.prune();
+
+        // ownership is passed to the next waiter, mutex stays locked
+        if(_waiters.empty())
+            _locked = false;
+        else
+            _waiters.move_front(next);
+    };
+
+    next.grant_all(std::any{}, this);
+}
+
+
+inline
+bool async_mutex::is_locked() const
+{
+    std::lock_guard lock{ _mutex };
+
+    return _locked;
+}
+
+
+inline
+void async_mutex::refund(std::any&&, size_t) noexcept
+{
+    unlock();
+}
+
+
+inline
+async_semaphore::async_semaphore(size_t count, CGULL_NAMESPACE::handler* h)
+    : _handler(h)
+    , _available(count)
+{ }
+
+
+inline
+promise async_semaphore::acquire(size_t n, CGULL_NAMESPACE::handler* h)
+{
+    if(!h)
+        h = _handler;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        _waiters.prune();
+
+        if(!_waiters.empty() || _available < n)
+            return _waiters.push(h, n);
+
+        _available -= n;
+    };
+
+    return promise{ h }.resolve();
+}
+
+
+inline
+bool async_semaphore::try_acquire(size_t n)
+{
+    std::lock_guard lock{ _mutex };
+
+    _waiters.prune();
+
+    if(!_waiters.empty() || _available < n)
+        return false;
+
+    _available -= n;
+
+    return true;
+}
+
+
+inline
+void async_semaphore::release(size_t n)
+{
+    guts::waiter_queue ready;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        _available += n;
+
+        for(_waiters.prune(); !_waiters.empty() && _waiters.front_weight() <= _available; _waiters.prune())
+        {
+            _available -= _waiters.front_weight();
+            _waiters.move_front(ready);
+        };
+    };
+
+    ready.grant_all(std::any{}, this);
+}
+
+
+inline
+size_t async_semaphore::available() const
+{
+    std::lock_guard lock{ _mutex };
+
+    return _available;
+}
+
+
+inline
+void async_semaphore::refund(std::any&&, size_t weight) noexcept
+{
+    release(weight);
+}
+
+
+inline
+async_latch::async_latch(size_t count, CGULL_NAMESPACE::handler* h)
+    : _handler(h)
+    , _count(count)
+{ }
+
+
+inline
+void async_latch::count_down(size_t n)
+{
+    guts::waiter_queue ready;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        if(!_count)
+            return;
+
+        _count -= std::min(n, _count);
+
+        if(!_count)
+            _waiters.splice(ready);
+    };
+
+    ready.fulfill_all(std::any{}, resolved);
+}
+
+
+inline
+promise async_latch::wait(CGULL_NAMESPACE::handler* h)
+{
+    return arrive_and_wait(0, h);
+}
+
+
+inline
+promise async_latch::arrive_and_wait(size_t n, CGULL_NAMESPACE::handler* h)
+{
+    if(!h)
+        h = _handler;
+
+    promise result;
+    guts::waiter_queue ready;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        _count -= std::min(n, _count);
+
+        if(!_count)
+        {
+            _waiters.splice(ready);
+
+            result = promise{ h };
+        }
+        else
+            return _waiters.push(h);
+    };
+
+    ready.fulfill_all(std::any{}, resolved);
+
+    return result.resolve();
+}
+
+
+inline
+bool async_latch::try_wait() const
+{
+    std::lock_guard lock{ _mutex };
+
+    return !_count;
+}
+
+
+inline
+async_barrier::async_barrier(size_t count, CGULL_NAMESPACE::handler* h)
+    : _handler(h)
+    , _expected(count)
+{ }
+
+
+inline
+promise async_barrier::arrive_and_wait(CGULL_NAMESPACE::handler* h)
+{
+    if(!h)
+        h = _handler;
+
+    promise result;
+    guts::waiter_queue ready;
+    uint64_t completed;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        // waiter is queued even if it's the last one, so the whole phase is released at once
+        result = _waiters.push(h);
+
+        ++_arrived;
+
+        completed = _phase;
+        ready = _try_complete();
+    };
+
+    ready.fulfill_all(std::any{completed}, resolved);
+
+    return result;
+}
+
+
+inline
+void async_barrier::arrive_and_drop()
+{
+    guts::waiter_queue ready;
+    uint64_t completed;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        if(_expected)
+            --_expected;
+
+        completed = _phase;
+        ready = _try_complete();
+    };
+
+    ready.fulfill_all(std::any{completed}, resolved);
+}
+
+
+inline
+uint64_t async_barrier::phase() const
+{
+    std::lock_guard lock{ _mutex };
+
+    return _phase;
+}
+
+
+inline
+guts::waiter_queue async_barrier::_try_complete()
+{
+    guts::waiter_queue ready;
+
+    if(!_arrived || _arrived < _expected)
+        return ready;
+
+    _waiters.splice(ready);
+    _arrived = 0;
+    ++_phase;
+
+    return ready;
+}
+
+
+inline
+async_event::async_event(reset_mode mode, bool set, CGULL_NAMESPACE::handler* h)
+    : _handler(h)
+    , _mode(mode)
+    , _set(set)
+{ }
+
+
+inline
+promise async_event::wait(CGULL_NAMESPACE::handler* h)
+{
+    if(!h)
+        h = _handler;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        if(!_set)
+            return _waiters.push(h);
+
+        if(_mode == auto_reset)
+            _set = false;
+    };
+
+    return promise{ h }.resolve();
+}
+
+
+inline
+void async_event::set()
+{
+    guts::waiter_queue ready;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        _waiters.prune();
+
+        if(_mode == manual_reset)
+        {
+            _set = true;
+            _waiters.splice(ready);
+        }
+        else if(_waiters.empty())
+            _set = true;
+        else
+            _waiters.move_front(ready);
+    };
+
+    // manual-reset event stays set, nothing to give back
+    if(_mode == manual_reset)
+        ready.fulfill_all(std::any{}, resolved);
+    else
+        ready.grant_all(std::any{}, this);
+}
+
+
+inline
+void async_event::reset()
+{
+    std::lock_guard lock{ _mutex };
+
+    _set = false;
+}
+
+
+inline
+bool async_event::is_set() const
+{
+    std::lock_guard lock{ _mutex };
+
+    return _set;
+}
+
+
+inline
+void async_event::refund(std::any&&, size_t) noexcept
+{
+    set();
+}
+
+
+CGULL_NAMESPACE_END
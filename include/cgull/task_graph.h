@@ -0,0 +1,390 @@
+#pragma once
+
+#include "config.h"
+#include "promise.h"
+#include "thread_pool_handler.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <any>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+CGULL_NAMESPACE_START
+
+
+//! Graph of tasks with explicit dependencies, executed on \a thread_pool_handler.
+//!
+//! Task starts when all its predecessors are done. Each node has atomic counter of pending
+//! predecessors. Worker which finishes a task runs its first ready successor right away,
+//! so chains stay on one hot thread, and posts other ready successors to the pool.
+//!
+//! Task is \a void() or \a promise() function. In the latter case node is done when returned
+//! promise is fulfilled. Exception or rejection fails run: tasks which aren't started yet
+//! are skipped and run is rejected with the first error.
+//!
+//! Graph can be run many times. Adjacency is compiled once after nodes or edges change, so
+//! the next runs only reset counters without allocations.
+//!
+//! \code
+//! cgull::task_graph g;
+//!
+//! const auto compile = g.add_node([]{ ... });
+//! const auto link = g.add_node([]{ ... });
+//!
+//! g.add_edge(compile, link);
+//! g.run(pool).then([]{ ... });
+//! \endcode
+//!
+//! \note Graph must not be changed or destroyed while it runs. Only one run at a time.
+class task_graph
+{
+    CGULL_DISABLE_COPY(task_graph);
+    CGULL_DISABLE_MOVE(task_graph);
+
+public:
+    using node_id = uint32_t;
+
+
+    task_graph() = default;
+
+    //! Adds node running \a fn.
+    template< typename _Fn >
+    node_id add_node(_Fn&& fn);
+    //! \a to starts only after \a from is done.
+    void    add_edge(node_id from, node_id to);
+    void    reserve(size_t nodes, size_t edges);
+
+    //! \return Promise owned by \a pool, resolved when every task is done or rejected with the
+    //!         first error. Rejected with \a std::logic_error if graph has cycle or is already
+    //!         running.
+    promise run(thread_pool_handler& pool);
+
+    [[nodiscard]]
+    size_t  size() const noexcept;
+    [[nodiscard]]
+    size_t  edge_count() const noexcept;
+    [[nodiscard]]
+    bool    is_running() const noexcept;
+
+
+private:
+    static constexpr node_id _none = std::numeric_limits<node_id>::max();
+
+    struct _node
+    {
+        std::function<void()>       task;
+        std::function<promise()>    async_task;
+        //! Predecessors count.
+        uint32_t                    dependencies = 0;
+    };
+
+    std::vector<_node>              _nodes;
+    std::vector<std::pair<node_id, node_id>>
+                                    _edges;
+
+    //! Compiled adjacency: successors of node \a i are \a _successors[_offsets[i] .. _offsets[i + 1]).
+    std::vector<uint32_t>           _offsets;
+    std::vector<node_id>            _successors;
+    std::vector<node_id>            _roots;
+    std::unique_ptr<std::atomic<uint32_t>[]>
+                                    _pending;
+    bool                            _compiled = false;
+    bool                            _acyclic = false;
+
+    //! Current run.
+    std::atomic<bool>               _running = false;
+    thread_pool_handler*            _pool = nullptr;
+    promise                         _result;
+    std::atomic<size_t>             _remaining = 0;
+    std::atomic<bool>               _failed = false;
+    std::any                        _error;
+
+
+    void    _compile();
+    //! Runs \a id and then its ready successors in loop.
+    void    _execute(node_id id) noexcept;
+    //! Marks \a id done. \return One of successors which became ready or \a _none.
+    node_id _release(node_id id) noexcept;
+    void    _fail(std::any&& error) noexcept;
+    void    _post(node_id id);
+
+};
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+template< typename _Fn > inline
+task_graph::node_id task_graph::add_node(_Fn&& fn)
+{
+    using result_type = std::invoke_result_t<std::decay_t<_Fn>&>;
+
+    static_assert(
+        std::is_void_v<result_type> || std::is_same_v<std::decay_t<result_type>, promise>,
+        "cgull: task must return void or promise"
+    );
+
+    _node n;
+
+    if constexpr(std::is_void_v<result_type>)
+        n.task = std::forward<_Fn>(fn);
+    else
+        n.async_task = std::forward<_Fn>(fn);
+
+    _nodes.push_back(std::move(n));
+    _compiled = false;
+
+    return static_cast<node_id>(_nodes.size() - 1);
+}
+
+
+inline
+void task_graph::add_edge(node_id from, node_id to)
+{
+    if(from >= _nodes.size() || to >= _nodes.size())
+        throw std::out_of_range("cgull: task graph node doesn't exist");
+
+    _edges.emplace_back(from, to);
+    _compiled = false;
+}
+
+
+inline
+void task_graph::reserve(size_t nodes, size_t edges)
+{
+    _nodes.reserve(nodes);
+    _edges.reserve(edges);
+}
+
+
+inline
+promise task_graph::run(thread_pool_handler& pool)
+{
+    if(_running.exchange(true, std::memory_order::acq_rel))
+        return promise{ &pool }.reject(std::any{std::make_exception_ptr(std::logic_error("cgull: task graph is already running"))});
+
+    if(!_compiled)
+        _compile();
+
+    if(!_acyclic)
+    {
+        _running = false;
+
+        return promise{ &pool }.reject(std::any{std::make_exception_ptr(std::logic_error("cgull: task graph has cycle"))});
+    };
+
+    auto result = promise{ &pool };
+
+    if(_nodes.empty())
+    {
+        _running = false;
+
+        return result.resolve();
+    };
+
+    _pool = &pool;
+    _result = result;
+    _error.reset();
+    _failed.store(false, std::memory_order::relaxed);
+    _remaining.store(_nodes.size(), std::memory_order::relaxed);
+
+    for(size_t i = 0; i < _nodes.size(); ++i)
+        _pending[i].store(_nodes[i].dependencies, std::memory_order::relaxed);
+
+    // roots are split into one strided slice per worker instead of one post per root
+    const auto roots = _roots.size();
+    const auto slices = std::min(pool.size(), roots);
+
+    // graph may be run again right after its last node, so slice doesn't read it after that
+    for(size_t s = 0; s < slices; ++s)
+        pool.post(s, [this, s, slices, roots]
+        {
+            for(size_t i = s; i < roots; i += slices)
+                _execute(_roots[i]);
+        });
+
+    return result;
+}
+
+
+inline
+size_t task_graph::size() const noexcept
+{
+    return _nodes.size();
+}
+
+
+inline
+size_t task_graph::edge_count() const noexcept
+{
+    return _edges.size();
+}
+
+
+inline
+bool task_graph::is_running() const noexcept
+{
+    return _running.load(std::memory_order::acquire);
+}
+
+
+inline
+void task_graph::_compile()
+{
+    const auto count = _nodes.size();
+
+    _offsets.assign(count + 1, 0);
+    _successors.resize(_edges.size());
+    _roots.clear();
+    _pending.reset(new std::atomic<uint32_t>[count]);
+
+    for(auto& n : _nodes)
+        n.dependencies = 0;
+
+    for(const auto& [from, to] : _edges)
+    {
+        ++_offsets[from + 1];
+        ++_nodes[to].dependencies;
+    };
+
+    for(size_t i = 0; i < count; ++i)
+        _offsets[i + 1] += _offsets[i];
+
+    {
+        std::vector<uint32_t> fill(_offsets.begin(), _offsets.end() - 1);
+
+        for(const auto& [from, to] : _edges)
+            _successors[fill[from]++] = to;
+    };
+
+    for(size_t i = 0; i < count; ++i)
+        if(!_nodes[i].dependencies)
+            _roots.push_back(static_cast<node_id>(i));
+
+    // Kahn's walk: every node is reached only if there is no cycle
+    std::vector<uint32_t> left(count);
+    std::vector<node_id> queue(_roots);
+
+    for(size_t i = 0; i < count; ++i)
+        left[i] = _nodes[i].dependencies;
+
+    for(size_t i = 0; i < queue.size(); ++i)
+        for(auto k = _offsets[queue[i]]; k < _offsets[queue[i] + 1]; ++k)
+            if(!--left[_successors[k]])
+                queue.push_back(_successors[k]);
+
+    _acyclic = queue.size() == count;
+    _compiled = true;
+}
+
+
+inline
+void task_graph::_execute(node_id id) noexcept
+{
+    while(id != _none)
+    {
+        auto& n = _nodes[id];
+
+        if(!_failed.load(std::memory_order::relaxed))
+        {
+            try
+            {
+                if(n.task)
+                    n.task();
+                else if(n.async_task)
+                {
+                    // node is released when promise is fulfilled
+                    n.async_task()
+                        .then([this, id]
+                        {
+                            if(const auto next = _release(id); next != _none)
+                                _post(next);
+                        })
+                        .rescue([this, id](std::any error)
+                        {
+                            _fail(std::move(error));
+
+                            if(const auto next = _release(id); next != _none)
+                                _post(next);
+                        });
+
+                    return;
+                };
+            }
+            catch(...)
+            {
+                _fail(std::any{std::current_exception()});
+            };
+        };
+
+        id = _release(id);
+    };
+}
+
+
+inline
+task_graph::node_id task_graph::_release(node_id id) noexcept
+{
+    auto next = _none;
+
+    for(auto k = _offsets[id]; k < _offsets[id + 1]; ++k)
+    {
+        const auto s = _successors[k];
+
+        if(_pending[s].fetch_sub(1, std::memory_order::acq_rel) != 1)
+            continue;
+
+        // the first ready successor is run by this thread, the rest go to other workers
+        if(next == _none)
+            next = s;
+        else
+            _post(s);
+    };
+
+    if(_remaining.fetch_sub(1, std::memory_order::acq_rel) == 1)
+    {
+        auto result = std::move(_result);
+        auto error = std::move(_error);
+        const auto failed = _failed.load(std::memory_order::acquire);
+
+        // graph may be run again right after this
+        _running.store(false, std::memory_order::release);
+
+        failed ? result.reject(std::move(error)) : result.resolve();
+    };
+
+    return next;
+}
+
+
+inline
+void task_graph::_fail(std::any&& error) noexcept
+{
+    // only the first error is kept, release of its node publishes it
+    if(_failed.exchange(true, std::memory_order::acq_rel))
+        return;
+
+    _error = std::move(error);
+}
+
+
+inline
+void task_graph::_post(node_id id)
+{
+    _pool->post([this, id]{ _execute(id); });
+}
+
+
+CGULL_NAMESPACE_END
@@ -0,0 +1,208 @@
+#pragma once
+
+#include "config.h"
+#include "promise_private.h"
+#include "handler.h"
+#include "guts/pool_worker.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+
+CGULL_NAMESPACE_START
+
+
+//! Handler which runs operations on a fixed set of worker threads.
+//!
+//! Each worker has its own queue. Operations on promise always go to the same worker (chosen
+//! by promise address), so every promise stays context-local to one thread while different
+//! promises are handled in parallel. Plain tasks are spread round-robin.
+//!
+//! Worker keeps queue per \a priority_t and takes from the highest non-empty one, so under
+//! saturation latency-critical chains go first. Operation of promise has promise's priority,
+//! task has \a priority_scope::current() of the thread which posted it. Lower queue which had
+//! work while \a starvation_limit operations in a row were taken from higher ones is served
+//! next, so background work slows down but never stops.
+class thread_pool_handler : public handler
+{
+    CGULL_DISABLE_COPY(thread_pool_handler);
+    CGULL_DISABLE_MOVE(thread_pool_handler);
+
+public:
+    //! Operations taken from higher queues before waiting lower one is served.
+    static constexpr uint32_t starvation_limit = guts::pool_worker::starvation_limit;
+
+
+    explicit
+    thread_pool_handler(size_t threads = std::max(1u, std::thread::hardware_concurrency()));
+    //! Runs everything posted before and joins workers.
+    ~thread_pool_handler() override;
+
+    void fulfill(private_type target, std::any&& value, fulfillment_state_t state) override;
+    void try_finish(private_type target) override;
+    void post(task_type&& task) override;
+    void bind_outer(private_type target, private_type outer) override;
+    //! Groups \a ops by worker, each touched worker is locked and woken up once.
+    void dispatch(operation_list&& ops) override;
+
+    //! Runs \a task on worker \a index.
+    void post(size_t index, task_type&& task);
+
+    [[nodiscard]]
+    size_t size() const noexcept;
+    //! Worker which owns \a target.
+    [[nodiscard]]
+    size_t worker_of(const promise_private* target) const noexcept;
+    //! Index of current worker of this pool or -1 if called outside of pool.
+    [[nodiscard]]
+    ptrdiff_t current_worker() const noexcept;
+
+
+private:
+    using _op = guts::handler_op;
+    using _worker = guts::pool_worker;
+
+    std::vector<std::unique_ptr<_worker>>
+                                _workers;
+    std::atomic<size_t>         _next = 0;
+
+
+    void _enqueue(size_t index, _op&& op);
+    void _run(size_t index);
+
+    static thread_local const thread_pool_handler*  _current_pool;
+    static thread_local size_t                      _current_index;
+
+};
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+inline thread_local const thread_pool_handler*  thread_pool_handler::_current_pool = nullptr;
+inline thread_local size_t                      thread_pool_handler::_current_index = 0;
+
+
+inline
+thread_pool_handler::thread_pool_handler(size_t threads)
+{
+    threads = std::max<size_t>(1, threads);
+
+    _workers.reserve(threads);
+
+    for(size_t i = 0; i < threads; ++i)
+        _workers.push_back(std::make_unique<_worker>());
+
+    for(size_t i = 0; i < threads; ++i)
+        _workers[i]->thread = std::thread{ &thread_pool_handler::_run, this, i };
+}
+
+
+inline
+thread_pool_handler::~thread_pool_handler()
+{
+    _worker::join(_workers);
+}
+
+
+inline
+void thread_pool_handler::fulfill(private_type target, std::any&& value, fulfillment_state_t state)
+{
+    const auto index = worker_of(target.data());
+
+    _enqueue(index, _op{ std::move(target), std::forward<decltype(value)>(value), state });
+}
+
+
+inline
+void thread_pool_handler::try_finish(private_type target)
+{
+    const auto index = worker_of(target.data());
+
+    _enqueue(index, _op{ std::move(target) });
+}
+
+
+inline
+void thread_pool_handler::post(task_type&& task)
+{
+    post(_next.fetch_add(1, std::memory_order::relaxed) % _workers.size(), std::forward<decltype(task)>(task));
+}
+
+
+inline
+void thread_pool_handler::bind_outer(private_type target, private_type outer)
+{
+    const auto index = worker_of(target.data());
+
+    _enqueue(index, _op{ std::move(target), std::move(outer) });
+}
+
+
+inline
+void thread_pool_handler::dispatch(operation_list&& ops)
+{
+    CGULL_METRICS_PROBE(metrics::add(_metrics_slot, metrics::operations_enqueued, ops.size());)
+
+    _worker::dispatch(_workers, std::forward<decltype(ops)>(ops), [this](const promise_private* target) { return worker_of(target); });
+}
+
+
+inline
+void thread_pool_handler::post(size_t index, task_type&& task)
+{
+    _enqueue(index % _workers.size(), _op{ std::forward<decltype(task)>(task) });
+}
+
+
+inline
+size_t thread_pool_handler::size() const noexcept
+{
+    return _workers.size();
+}
+
+
+inline
+size_t thread_pool_handler::worker_of(const promise_private* target) const noexcept
+{
+    // drop alignment bits and mix the rest
+    const auto h = (reinterpret_cast<uintptr_t>(target) >> 4) * 0x9E3779B97F4A7C15ull;
+
+    return static_cast<size_t>(h >> 32) % _workers.size();
+}
+
+
+inline
+ptrdiff_t thread_pool_handler::current_worker() const noexcept
+{
+    return _current_pool == this ? static_cast<ptrdiff_t>(_current_index) : -1;
+}
+
+
+inline
+void thread_pool_handler::_enqueue(size_t index, _op&& op)
+{
+    CGULL_METRICS_PROBE(metrics::add(_metrics_slot, metrics::operations_enqueued);)
+
+    _workers[index]->enqueue(std::forward<decltype(op)>(op));
+}
+
+
+inline
+void thread_pool_handler::_run(size_t index)
+{
+    _current_pool = this;
+    _current_index = index;
+
+    _workers[index]->run(*this, [](_op&) { return false; }, []{ return false; });
+}
+
+
+CGULL_NAMESPACE_END
@@ -0,0 +1,679 @@
+#pragma once
+
+#include "config.h"
+#include "promise.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#if defined(CGULL_OS_LINUX)
+#   include <sys/timerfd.h>
+#   include <unistd.h>
+#else
+#   include <condition_variable>
+#endif
+
+
+CGULL_NAMESPACE_START
+
+
+//! Rejection value of \a promise::timeout() and \a promise::deadline().
+class timeout_error : public std::runtime_error
+{
+public:
+    timeout_error()
+        : std::runtime_error("cgull: promise timed out")
+    { }
+};
+
+
+//! Hierarchical timing wheel driven by \a timerfd.
+//!
+//! Each of \a level_count levels has \a slot_count slots and covers \a slot_count times more
+//! ticks than the previous one. Timers are kept in intrusive lists, so arm and cancel are O(1).
+//! Expired timers are fulfilled with \a promise_private::fulfill(), i.e. by target's handler
+//! if it is set or right inside service's thread otherwise.
+class timer_service
+{
+    CGULL_DISABLE_COPY(timer_service);
+    CGULL_DISABLE_MOVE(timer_service);
+
+public:
+    using clock         = std::chrono::steady_clock;
+    using duration      = clock::duration;
+    using time_point    = clock::time_point;
+
+    //! Timer handle. Stays valid (but does nothing) after timer expiration or cancel.
+    struct timer_id
+    {
+        void*       entry = nullptr;
+        uint32_t    generation = 0;
+    };
+
+    static constexpr int        level_bits = 6;
+    static constexpr int        level_count = 4;
+    static constexpr uint64_t   slot_count = 1ull << level_bits;
+    //! Max ticks that wheel can hold without re-cascading of top level.
+    static constexpr uint64_t   max_span = 1ull << (level_bits * level_count);
+
+
+    explicit
+    timer_service(duration tick = std::chrono::milliseconds{1});
+    ~timer_service();
+
+    //! Process-wide service used by \a delay(), \a promise::timeout() etc.
+    static timer_service& instance();
+
+    //! Fulfills \a target with \a value and \a state at \a tp.
+    timer_id arm(promise_private::type target, time_point tp, std::any&& value, fulfillment_state_t state);
+    //! Prepares timer without starting it. Lets bind timer's handle before it can expire.
+    //! \sa schedule()
+    timer_id create(promise_private::type target, std::any&& value, fulfillment_state_t state);
+    //! Starts timer prepared by \a create(). Does nothing if timer was cancelled already.
+    void     schedule(timer_id id, time_point tp);
+    //! Cancels timer. Returns false if timer already expired or was cancelled.
+    bool     cancel(timer_id id) noexcept;
+
+    [[nodiscard]]
+    size_t      size() const noexcept;
+    [[nodiscard]]
+    duration    tick() const noexcept;
+
+
+private:
+    struct _link
+    {
+        _link*  prev = this;
+        _link*  next = this;
+    };
+
+    struct _entry : _link
+    {
+        uint64_t                expires = 0;
+        uint32_t                generation = 0;
+        bool                    scheduled = false;
+        promise_private::type   target;
+        std::any                value;
+        fulfillment_state_t     state = rejected;
+    };
+
+    struct _expired
+    {
+        promise_private::type   target;
+        std::any                value;
+        fulfillment_state_t     state;
+    };
+
+    static constexpr size_t _chunk_size = 1024;
+
+    const duration          _tick;
+    const time_point        _epoch = clock::now();
+
+    mutable std::mutex      _mutex;
+    std::array<std::array<_link, slot_count>, level_count>
+                            _wheel;
+    uint64_t                _current = 0;
+    size_t                  _count = 0;
+
+    std::vector<std::unique_ptr<_entry[]>>
+                            _chunks;
+    _entry*                 _free = nullptr;
+
+    std::atomic<bool>       _stop = false;
+#if defined(CGULL_OS_LINUX)
+    int                     _fd = -1;
+#else
+    std::condition_variable _cv;
+#endif
+    std::thread             _thread;
+
+
+    uint64_t _ticks_at(time_point tp) const noexcept;
+    uint64_t _ticks_passed() const noexcept;
+    _entry*  _acquire();
+    void     _release(_entry* e) noexcept;
+    void     _insert(_entry* e) noexcept;
+    void     _cascade(int level, std::vector<_expired>& expired) noexcept;
+    void     _advance(uint64_t to, std::vector<_expired>& expired);
+    void     _set_ticking(bool on) noexcept;
+    void     _wait() noexcept;
+    void     _run();
+
+    static void _unlink(_link* l) noexcept;
+    static void _push(_link* head, _link* l) noexcept;
+
+};
+
+
+//! Returns promise owned by \a h resolved after \a d.
+//! \note Timer fires on service's thread, so promise needs handler to be fulfilled in.
+promise delay(timer_service::duration d, CGULL_NAMESPACE::handler* h);
+//! Returns promise owned by \a h resolved at \a tp.
+promise delay_until(timer_service::time_point tp, CGULL_NAMESPACE::handler* h);
+
+
+CGULL_GUTS_NAMESPACE_START
+
+
+//! Callback called inside handler by timer.
+//!
+//! Timer's promise belongs to handler, but \a arm() may be called from another context (i.e.
+//! continuation of promise owned by someone else), so callback is bound before timer is armed.
+//! \note Not thread-safe, owner serializes calls.
+class timer_call
+{
+public:
+    //! Calls \a fn inside \a h at \a tp. Timer armed before is cancelled.
+    template< typename _Fn >
+    void arm(CGULL_NAMESPACE::handler* h, timer_service::time_point tp, _Fn&& fn);
+    //! Cancels timer and aborts its promise, so \a fn is released with everything it captured.
+    //! Otherwise promise and its continuation would keep each other alive forever.
+    void cancel() noexcept;
+
+
+private:
+    promise_private::type       _target;
+    timer_service::timer_id     _id;
+
+};
+
+
+CGULL_GUTS_NAMESPACE_END
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+inline
+timer_service::timer_service(duration tick)
+    : _tick(tick.count() > 0 ? tick : duration{1})
+{
+#if defined(CGULL_OS_LINUX)
+    _fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+    if(_fd < 0)
+        throw std::runtime_error("cgull: timerfd_create() failed");
+#endif
+
+    _thread = std::thread{ &timer_service::_run, this };
+}
+
+
+inline
+timer_service::~timer_service()
+{
+    {
+        std::lock_guard lock{ _mutex };
+
+        _stop = true;
+    }
+
+#if defined(CGULL_OS_LINUX)
+    // wake up right now
+    itimerspec spec{};
+
+    spec.it_value.tv_nsec = 1;
+
+    timerfd_settime(_fd, 0, &spec, nullptr);
+#else
+    _cv.notify_all();
+#endif
+
+    _thread.join();
+
+#if defined(CGULL_OS_LINUX)
+    close(_fd);
+#endif
+}
+
+
+inline
+timer_service& timer_service::instance()
+{
+    static timer_service service;
+
+    return service;
+}
+
+
+inline
+timer_service::timer_id timer_service::arm(promise_private::type target, time_point tp, std::any&& value, fulfillment_state_t state)
+{
+    const auto id = create(std::move(target), std::forward<decltype(value)>(value), state);
+
+    schedule(id, tp);
+
+    return id;
+}
+
+
+inline
+timer_service::timer_id timer_service::create(promise_private::type target, std::any&& value, fulfillment_state_t state)
+{
+    std::lock_guard lock{ _mutex };
+
+    auto e = _acquire();
+
+    e->target = std::move(target);
+    e->value = std::forward<decltype(value)>(value);
+    e->state = state;
+
+    return { e, e->generation };
+}
+
+
+inline
+void timer_service::schedule(timer_id id, time_point tp)
+{
+    const auto ticks = _ticks_at(tp);
+
+    std::lock_guard lock{ _mutex };
+
+    auto e = static_cast<_entry*>(id.entry);
+
+    if(!e || e->generation != id.generation || e->scheduled)
+        return;
+
+    // nothing to expire, so just catch up with clock
+    if(!_count)
+        _current = std::max(_current, _ticks_passed());
+
+    e->expires = ticks;
+    e->scheduled = true;
+
+    _insert(e);
+
+    if(!_count++)
+        _set_ticking(true);
+}
+
+
+inline
+bool timer_service::cancel(timer_id id) noexcept
+{
+    promise_private::type target;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        auto e = static_cast<_entry*>(id.entry);
+
+        if(!e || e->generation != id.generation)
+            return false;
+
+        if(e->scheduled)
+        {
+            _unlink(e);
+
+            if(!--_count)
+                _set_ticking(false);
+        };
+
+        // target must die outside of lock
+        target = std::move(e->target);
+
+        _release(e);
+    }
+
+    return true;
+}
+
+
+inline
+size_t timer_service::size() const noexcept
+{
+    std::lock_guard lock{ _mutex };
+
+    return _count;
+}
+
+
+inline
+timer_service::duration timer_service::tick() const noexcept
+{
+    return _tick;
+}
+
+
+inline
+uint64_t timer_service::_ticks_at(time_point tp) const noexcept
+{
+    if(tp <= _epoch)
+        return 0;
+
+    // round up: timer must never expire earlier than asked
+    return static_cast<uint64_t>((tp - _epoch + _tick - duration{1}) / _tick);
+}
+
+
+inline
+uint64_t timer_service::_ticks_passed() const noexcept
+{
+    return static_cast<uint64_t>((clock::now() - _epoch) / _tick);
+}
+
+
+inline
+timer_service::_entry* timer_service::_acquire()
+{
+    if(!_free)
+    {
+        auto chunk = std::make_unique<_entry[]>(_chunk_size);
+
+        for(size_t i = 0; i < _chunk_size; ++i)
+        {
+            chunk[i].next = _free;
+            _free = &chunk[i];
+        };
+
+        _chunks.push_back(std::move(chunk));
+    };
+
+    auto e = _free;
+
+    _free = static_cast<_entry*>(e->next);
+
+    e->prev = e->next = e;
+
+    return e;
+}
+
+
+inline
+void timer_service::_release(_entry* e) noexcept
+{
+    ++e->generation;
+
+    e->scheduled = false;
+    e->target.reset();
+    e->value.reset();
+
+    e->next = _free;
+    _free = e;
+}
+
+
+inline
+void timer_service::_insert(_entry* e) noexcept
+{
+    // expired already: fire at the nearest tick
+    const auto expires = std::max(e->expires, _current + 1);
+    const auto delta = std::min(expires - _current, max_span - 1);
+
+    int level = 0;
+
+    while(delta >= (1ull << (level_bits * (level + 1))))
+        ++level;
+
+    // too far timers are parked at the end of top level and re-cascaded later
+    const auto at = _current + delta;
+    const auto slot = (at >> (level_bits * level)) & (slot_count - 1);
+
+    _push(&_wheel[level][slot], e);
+}
+
+
+inline
+void timer_service::_cascade(int level, std::vector<_expired>& expired) noexcept
+{
+    auto& head = _wheel[level][(_current >> (level_bits * level)) & (slot_count - 1)];
+
+    while(head.next != &head)
+    {
+        auto e = static_cast<_entry*>(head.next);
+
+        _unlink(e);
+
+        if(level || e->expires > _current)
+        {
+            _insert(e);
+            continue;
+        };
+
+        expired.push_back({ std::move(e->target), std::move(e->value), e->state });
+
+        --_count;
+
+        _release(e);
+    };
+}
+
+
+inline
+void timer_service::_advance(uint64_t to, std::vector<_expired>& expired)
+{
+    while(_count && _current < to)
+    {
+        ++_current;
+
+        // cascade from the highest level whose slot boundary was just crossed
+        int level = 0;
+
+        while(level + 1 < level_count && !(_current & ((1ull << (level_bits * (level + 1))) - 1)))
+            ++level;
+
+        for(; level >= 0; --level)
+            _cascade(level, expired);
+    };
+
+    if(_current < to)
+        _current = to;
+
+    if(!_count)
+        _set_ticking(false);
+}
+
+
+inline
+void timer_service::_set_ticking(bool on) noexcept
+{
+#if defined(CGULL_OS_LINUX)
+    itimerspec spec{};
+
+    if(on)
+    {
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(_tick).count();
+
+        spec.it_interval.tv_sec = ns / 1000000000;
+        spec.it_interval.tv_nsec = ns % 1000000000;
+        spec.it_value = spec.it_interval;
+
+        if(!spec.it_value.tv_sec && !spec.it_value.tv_nsec)
+            spec.it_value.tv_nsec = 1;
+    };
+
+    timerfd_settime(_fd, 0, &spec, nullptr);
+#else
+    if(on)
+        _cv.notify_all();
+#endif
+}
+
+
+inline
+void timer_service::_wait() noexcept
+{
+#if defined(CGULL_OS_LINUX)
+    uint64_t expirations;
+
+    // actual amount of ticks is taken from clock
+    [[maybe_unused]] const auto r = read(_fd, &expirations, sizeof(expirations));
+#else
+    std::unique_lock lock{ _mutex };
+
+    if(_count)
+        _cv.wait_for(lock, _tick);
+    else
+        _cv.wait(lock, [this]{ return _count || _stop; });
+#endif
+}
+
+
+inline
+void timer_service::_run()
+{
+    std::vector<_expired> expired;
+
+    while(!_stop)
+    {
+        _wait();
+
+        {
+            std::lock_guard lock{ _mutex };
+
+            if(_stop)
+                break;
+
+            _advance(_ticks_passed(), expired);
+        }
+
+        // user code must not be called under lock
+        for(auto& x : expired)
+            x.target->fulfill(std::move(x.value), x.state);
+
+        expired.clear();
+    };
+}
+
+
+inline
+void timer_service::_unlink(_link* l) noexcept
+{
+    l->prev->next = l->next;
+    l->next->prev = l->prev;
+    l->prev = l->next = l;
+}
+
+
+inline
+void timer_service::_push(_link* head, _link* l) noexcept
+{
+    l->prev = head->prev;
+    l->next = head;
+    head->prev->next = l;
+    head->prev = l;
+}
+
+
+
+inline
+promise delay(timer_service::duration d, CGULL_NAMESPACE::handler* h)
+{
+    return delay_until(timer_service::clock::now() + d, h);
+}
+
+
+inline
+promise delay_until(timer_service::time_point tp, CGULL_NAMESPACE::handler* h)
+{
+    assert(h && "cgull: delay needs handler, timer fires on its own thread");
+
+    promise result{ h };
+
+    timer_service::instance().arm(guts::private_of(result), tp, std::any{}, resolved);
+
+    return result;
+}
+
+
+CGULL_GUTS_NAMESPACE_START
+
+
+template< typename _Fn > inline
+void timer_call::arm(CGULL_NAMESPACE::handler* h, timer_service::time_point tp, _Fn&& fn)
+{
+    assert(h && "cgull: timer call needs handler, timer fires on its own thread");
+
+    cancel();
+
+    promise timer{ h };
+
+    timer.then(std::forward<_Fn>(fn));
+
+    _target = private_of(timer);
+    _id = timer_service::instance().arm(_target, tp, std::any{}, resolved);
+}
+
+
+inline
+void timer_call::cancel() noexcept
+{
+    if(timer_service::instance().cancel(_id))
+        _target->fulfill(std::any{}, aborted);
+
+    _target.reset();
+}
+
+
+CGULL_GUTS_NAMESPACE_END
+
+
+inline
+promise promise::timeout(std::chrono::steady_clock::duration d, CGULL_NAMESPACE::handler* h) const
+{
+    return deadline(timer_service::clock::now() + d, h);
+}
+
+
+inline
+promise promise::deadline(std::chrono::steady_clock::time_point tp, CGULL_NAMESPACE::handler* h) const
+{
+    if(_d->is_fulfilled())
+        return *this;
+
+    if(!h)
+        h = _d->handler;
+
+    assert(h && "cgull: deadline of context-local promise needs handler, timer fires on its own thread");
+
+    auto& service = timer_service::instance();
+
+    promise_private::type next{ new promise_private{} };
+    promise_private::type timer{ new promise_private{} };
+
+    next->handler = h;
+    timer->handler = h;
+
+    CGULL_MEMORY_PROBE(
+        next->account_handler();
+        timer->account_handler();
+    )
+
+    const auto id = service.create(timer, std::any{timeout_error{}}, rejected);
+
+    // resolver: rejections of this promise and timeout itself are passed through by skipping
+    next->local_set_finisher(
+        [self = next.data(), id](bool is_abort, std::any&& inners_result)
+        {
+            timer_service::instance().cancel(id);
+
+            if(!is_abort)
+                self->local_finish(std::forward<decltype(inners_result)>(inners_result), resolved);
+        },
+        true
+    );
+
+    next->local_bind_inner(_d, first);
+    next->local_bind_inner(timer, first);
+
+    timer->local_bind_outer(next);
+    _d->bind_outer(next);
+
+    service.schedule(id, tp);
+
+    return promise{ next };
+}
+
+
+CGULL_NAMESPACE_END
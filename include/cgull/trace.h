@@ -0,0 +1,235 @@
+#pragma once
+
+#include "config.h"
+#include "profiler.h"
+#include "guts/thread_rings.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+CGULL_NAMESPACE_START
+
+
+//! Writer of \a profiler records in Chrome Trace Event JSON, which is opened by
+//! chrome://tracing and ui.perfetto.dev.
+//!
+//! Promise lifetime is async slice from creation to fulfillment, callback is complete slice
+//! on thread which ran it and each hop from inner to promise it finished is flow arrow.
+//!
+//! \code
+//! std::ofstream file{ "cgull.json" };
+//! cgull::chrome_trace trace{ file };
+//!
+//! cgull::profiler::instance().set_sampling(100);
+//! trace.start();
+//! ...
+//! trace.stop();
+//! \endcode
+//!
+//! Background thread drains profiler's per-thread rings every interval, so they don't
+//! overflow and promises' threads never wait for output.
+//!
+//! \note Requires \a CGULL_PROFILE, otherwise there is nothing to write.
+//! \note Records are moved out of \a profiler, so trace shouldn't run together with other
+//!       consumers of \a profiler::drain().
+class chrome_trace
+{
+    CGULL_DISABLE_COPY(chrome_trace);
+    CGULL_DISABLE_MOVE(chrome_trace);
+
+public:
+    //! Writes document header. \a out must outlive trace.
+    explicit
+    chrome_trace(std::ostream& out);
+    //! Stops and writes document footer.
+    ~chrome_trace();
+
+    //! Starts background thread draining profiler every \a interval.
+    void    start(std::chrono::milliseconds interval = std::chrono::milliseconds{ 100 });
+    //! Stops background thread and writes the rest.
+    void    stop();
+    //! Drains profiler and writes its records right now.
+    void    flush();
+
+    //! Writes \a records as one document.
+    static void write(std::ostream& out, std::vector<profile_record> records);
+
+
+private:
+    struct _point
+    {
+        uint64_t    ts;
+        uint32_t    thread;
+    };
+
+    std::ostream&               _out;
+    //! Guards output and cause lookup.
+    std::mutex                  _write_mutex;
+    bool                        _first = true;
+    //! Fulfillment of promises written by this and the previous batch. Cause is fulfilled
+    //! before its outer is woken, so it's drained by the same batch or earlier.
+    std::unordered_map<uint64_t, _point>
+                                _current;
+    std::unordered_map<uint64_t, _point>
+                                _previous;
+
+    guts::drain_thread          _drainer;
+
+
+    //! Must be called under \a _write_mutex.
+    void    _write(std::vector<profile_record>& records);
+    void    _event(const char* fmt, ...);
+
+};
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+inline
+chrome_trace::chrome_trace(std::ostream& out)
+    : _out(out)
+{
+    _out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+}
+
+
+inline
+chrome_trace::~chrome_trace()
+{
+    stop();
+
+    _out << "\n]}\n";
+    _out.flush();
+}
+
+
+inline
+void chrome_trace::start(std::chrono::milliseconds interval)
+{
+    _drainer.start(interval, [this]{ flush(); });
+}
+
+
+inline
+void chrome_trace::stop()
+{
+    _drainer.stop();
+}
+
+
+inline
+void chrome_trace::flush()
+{
+    auto records = profiler::instance().drain();
+
+    std::lock_guard lock{ _write_mutex };
+
+    _write(records);
+}
+
+
+inline
+void chrome_trace::write(std::ostream& out, std::vector<profile_record> records)
+{
+    chrome_trace trace{ out };
+
+    std::lock_guard lock{ trace._write_mutex };
+
+    trace._write(records);
+}
+
+
+inline
+void chrome_trace::_write(std::vector<profile_record>& records)
+{
+    if(records.empty())
+        return;
+
+    // rings are drained one by one, so causes come first only after sorting
+    std::sort(records.begin(), records.end(), [](const auto& a, const auto& b) { return a.fulfilled < b.fulfilled; });
+
+    _previous = std::exchange(_current, {});
+
+    for(const auto& r : records)
+        _current[r.id] = { r.fulfilled, r.thread };
+
+    constexpr auto us = 1000.0;
+
+    for(const auto& r : records)
+    {
+        _event(
+            "{\"name\":\"promise\",\"cat\":\"cgull\",\"ph\":\"b\",\"id\":\"0x%llx\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+            (unsigned long long)r.id, r.created / us, r.thread
+        );
+        _event(
+            "{\"name\":\"promise\",\"cat\":\"cgull\",\"ph\":\"e\",\"id\":\"0x%llx\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+            (unsigned long long)r.id, r.fulfilled / us, r.thread
+        );
+
+        if(r.finish_started)
+            _event(
+                "{\"name\":\"callback\",\"cat\":\"cgull\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"promise\":\"0x%llx\"}}",
+                r.finish_started / us, (std::max(r.finish_ended, r.finish_started) - r.finish_started) / us,
+                r.finish_thread, (unsigned long long)r.id
+            );
+
+        if(!r.cause || !r.woken)
+            continue;
+
+        auto from = _current.find(r.cause);
+
+        if(from == _current.end() && (from = _previous.find(r.cause)) == _previous.end())
+            continue;
+
+        const auto to_thread = r.finish_started ? r.finish_thread : r.thread;
+
+        _event(
+            "{\"name\":\"then\",\"cat\":\"cgull\",\"ph\":\"s\",\"id\":\"0x%llx\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+            (unsigned long long)r.id, from->second.ts / us, from->second.thread
+        );
+        _event(
+            "{\"name\":\"then\",\"cat\":\"cgull\",\"ph\":\"f\",\"bp\":\"e\",\"id\":\"0x%llx\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+            (unsigned long long)r.id, r.woken / us, to_thread
+        );
+    };
+
+    _out.flush();
+}
+
+
+inline
+void chrome_trace::_event(const char* fmt, ...)
+{
+    char buffer[320];
+
+    va_list args;
+    va_start(args, fmt);
+
+    const auto n = vsnprintf(buffer, sizeof(buffer), fmt, args);
+
+    va_end(args);
+
+    if(n <= 0)
+        return;
+
+    _out << (_first ? "\n" : ",\n");
+    _out.write(buffer, std::min<size_t>(n, sizeof(buffer) - 1));
+
+    _first = false;
+}
+
+
+CGULL_NAMESPACE_END
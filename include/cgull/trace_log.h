@@ -0,0 +1,344 @@
+#pragma once
+
+#include "config.h"
+#include "guts/spsc_ring.h"
+#include "guts/thread_rings.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <type_traits>
+#include <vector>
+
+
+CGULL_NAMESPACE_START
+
+
+//! Argument of \a trace_record kept in binary form until it's formatted.
+struct trace_arg
+{
+    enum kind_t : uint8_t
+    {
+        none = 0,
+        signed_int,
+        unsigned_int,
+        floating,
+        boolean,
+        pointer,
+        //! Must outlive formatting, e.g. string literal.
+        string,
+        //! Value of type which can't be kept, printed as "<?>".
+        opaque
+    };
+
+    kind_t          kind = none;
+
+    union
+    {
+        int64_t     i;
+        uint64_t    u;
+        double      d;
+        const void* p;
+        const char* s;
+    };
+
+
+    template< typename _T >
+    static trace_arg of(const _T& value) noexcept;
+};
+
+
+//! Log line as written by thread, formatted only when drained.
+struct trace_record
+{
+    static constexpr size_t max_args = 4;
+
+    //! Nanoseconds since \a trace_log was created.
+    uint64_t        time;
+    //! Must outlive formatting. Each "{}" is replaced by next argument.
+    const char*     format;
+    uint32_t        thread;
+    uint32_t        argc;
+    trace_arg       args[max_args];
+};
+
+
+//! Diagnostic log which doesn't serialize threads writing it.
+//!
+//! Log sites are \a CGULL_LOG(format, args...) and compile to nothing unless cgull is built
+//! with \a CGULL_TRACE_LOG defined. Each thread writes binary \a trace_record into its own
+//! single-producer ring without locks or formatting; text is made later by background
+//! formatter started by \a start() or by \a dump() called post-mortem, e.g. from terminate
+//! handler. Record is dropped if thread's ring is full.
+//!
+//! \code
+//! CGULL_LOG("worker {} took {} tasks", index, count);
+//!
+//! cgull::trace_log::instance().start(std::clog);
+//! ...
+//! std::set_terminate([]{ cgull::trace_log::instance().dump(std::cerr); std::abort(); });
+//! \endcode
+//!
+//! \note Format and string arguments are kept as pointers, so they should be literals.
+//! \note Thread-safe.
+class trace_log
+{
+    CGULL_DISABLE_COPY(trace_log);
+    CGULL_DISABLE_MOVE(trace_log);
+
+public:
+    //! Records per thread's ring.
+    static constexpr size_t ring_capacity = 8192;
+
+
+    static trace_log& instance();
+
+    //! Logging is enabled by default.
+    void    enable(bool on) noexcept;
+    [[nodiscard]]
+    bool    is_enabled() const noexcept;
+    [[nodiscard]]
+    size_t  dropped() const noexcept;
+
+    template< typename ... _Args >
+    static void write(const char* format, const _Args&... args) noexcept;
+
+    //! Drains rings. \return Records ordered by time.
+    [[nodiscard]]
+    std::vector<trace_record> drain();
+    //! Drains rings and writes them as text. \return Records written.
+    size_t  dump(std::ostream& out);
+
+    //! Starts background thread dumping to \a out every \a interval. \a out must outlive it.
+    void    start(std::ostream& out, std::chrono::milliseconds interval = std::chrono::milliseconds{ 100 });
+    //! Stops background thread and dumps the rest.
+    void    stop();
+
+    //! Writes \a r as one text line.
+    static void format(std::ostream& out, const trace_record& r);
+
+
+private:
+    const std::chrono::steady_clock::time_point
+                                    _epoch = std::chrono::steady_clock::now();
+    std::atomic<bool>               _enabled = true;
+    std::atomic<size_t>             _dropped = 0;
+    guts::thread_rings<guts::spsc_ring<trace_record>>
+                                    _rings{ ring_capacity };
+    guts::drain_thread              _drainer;
+
+
+    trace_log() = default;
+
+};
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+template< typename _T > inline
+trace_arg trace_arg::of(const _T& value) noexcept
+{
+    trace_arg result;
+
+    if constexpr(std::is_same_v<_T, bool>)
+    {
+        result.kind = boolean;
+        result.u = value;
+    }
+    else if constexpr(std::is_enum_v<_T>)
+        result = of(static_cast<std::underlying_type_t<_T>>(value));
+    else if constexpr(std::is_integral_v<_T> && std::is_signed_v<_T>)
+    {
+        result.kind = signed_int;
+        result.i = value;
+    }
+    else if constexpr(std::is_integral_v<_T>)
+    {
+        result.kind = unsigned_int;
+        result.u = value;
+    }
+    else if constexpr(std::is_floating_point_v<_T>)
+    {
+        result.kind = floating;
+        result.d = value;
+    }
+    else if constexpr(std::is_convertible_v<const _T&, const char*>)
+    {
+        result.kind = string;
+        result.s = value;
+    }
+    else if constexpr(std::is_pointer_v<_T> || std::is_null_pointer_v<_T>)
+    {
+        result.kind = pointer;
+        result.p = value;
+    }
+    else
+    {
+        result.kind = opaque;
+        result.p = nullptr;
+    };
+
+    return result;
+}
+
+
+inline
+trace_log& trace_log::instance()
+{
+    // never destroyed: threads of static services may log after it
+    static const auto l = new trace_log;
+
+    return *l;
+}
+
+
+inline
+void trace_log::enable(bool on) noexcept
+{
+    _enabled.store(on, std::memory_order::relaxed);
+}
+
+
+inline
+bool trace_log::is_enabled() const noexcept
+{
+    return _enabled.load(std::memory_order::relaxed);
+}
+
+
+inline
+size_t trace_log::dropped() const noexcept
+{
+    return _dropped.load(std::memory_order::relaxed);
+}
+
+
+template< typename ... _Args > inline
+void trace_log::write(const char* format, const _Args&... args) noexcept
+{
+    static_assert(sizeof...(_Args) <= trace_record::max_args, "Too many trace_log arguments");
+
+    auto& log = instance();
+
+    if(!log._enabled.load(std::memory_order::relaxed))
+        return;
+
+    const trace_record r{
+        uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - log._epoch).count()),
+        format,
+        guts::thread_index(),
+        uint32_t(sizeof...(_Args)),
+        { trace_arg::of(args)... }
+    };
+
+    const auto ring = log._rings.local();
+
+    if(!ring || !ring->try_push(r))
+        log._dropped.fetch_add(1, std::memory_order::relaxed);
+}
+
+
+inline
+std::vector<trace_record> trace_log::drain()
+{
+    std::vector<trace_record> result;
+
+    _rings.drain([&result](auto& ring)
+    {
+        for(trace_record r; ring.try_pop(r);)
+            result.push_back(r);
+    });
+
+    // each ring is ordered, merged ones aren't
+    std::stable_sort(result.begin(), result.end(), [](const auto& a, const auto& b) { return a.time < b.time; });
+
+    return result;
+}
+
+
+inline
+size_t trace_log::dump(std::ostream& out)
+{
+    const auto records = drain();
+
+    for(const auto& r : records)
+        format(out, r);
+
+    out.flush();
+
+    return records.size();
+}
+
+
+inline
+void trace_log::start(std::ostream& out, std::chrono::milliseconds interval)
+{
+    _drainer.start(interval, [this, &out]{ dump(out); });
+}
+
+
+inline
+void trace_log::stop()
+{
+    _drainer.stop();
+}
+
+
+inline
+void trace_log::format(std::ostream& out, const trace_record& r)
+{
+    char buffer[512];
+    size_t n = 0;
+
+    const auto put = [&](const char* fmt, auto... values)
+    {
+        if(n >= sizeof(buffer))
+            return;
+
+        const auto written = snprintf(buffer + n, sizeof(buffer) - n, fmt, values...);
+
+        if(written > 0)
+            n = std::min(n + size_t(written), sizeof(buffer) - 1);
+    };
+
+    put("[%llu.%09llu] #%u ", (unsigned long long)(r.time / 1000000000), (unsigned long long)(r.time % 1000000000), r.thread);
+
+    uint32_t next = 0;
+
+    for(auto f = r.format ? r.format : ""; *f; ++f)
+    {
+        if(f[0] != '{' || f[1] != '}' || next >= r.argc)
+        {
+            put("%c", *f);
+            continue;
+        };
+
+        const auto& a = r.args[next++];
+
+        switch(a.kind)
+        {
+        case trace_arg::signed_int:     put("%lld", (long long)a.i); break;
+        case trace_arg::unsigned_int:   put("%llu", (unsigned long long)a.u); break;
+        case trace_arg::floating:       put("%g", a.d); break;
+        case trace_arg::boolean:        put("%s", a.u ? "true" : "false"); break;
+        case trace_arg::pointer:        put("%p", a.p); break;
+        case trace_arg::string:         put("%s", a.s ? a.s : "(null)"); break;
+        default:                        put("<?>"); break;
+        };
+
+        ++f;
+    };
+
+    out.write(buffer, n);
+    out.put('\n');
+}
+
+
+CGULL_NAMESPACE_END
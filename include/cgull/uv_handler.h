@@ -0,0 +1,506 @@
+#pragma once
+
+#include "config.h"
+#include "promise.h"
+#include "handler.h"
+#include "guts/mpsc_queue.h"
+#include "guts/handler_op.h"
+
+#include <stdint.h>
+#include <any>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+
+#include <uv.h>
+
+
+CGULL_NAMESPACE_START
+
+
+//! Handler for libuv loop.
+//!
+//! Operations posted from any thread go to lock-free MPSC queue, only the first operation of
+//! each batch calls \a uv_async_send(). Loop drains the whole queue per wakeup.
+//!
+//! Context is the thread which runs the loop.
+//! \note Async handle is unreferenced, so it doesn't keep \a uv_run() from returning. Only
+//!       operations posted from loop's thread (continuations of fulfilled requests) reference
+//!       it until they are drained, otherwise loop could stop in the middle of a chain.
+class uv_handler : public handler
+{
+    CGULL_DISABLE_COPY(uv_handler);
+    CGULL_DISABLE_MOVE(uv_handler);
+
+public:
+    //! \note Must be created in loop's thread.
+    explicit
+    uv_handler(uv_loop_t* loop);
+    //! \note Must be destroyed in loop's thread. Async handle is closed by next loop iteration.
+    ~uv_handler() override;
+
+    void fulfill(private_type target, std::any&& value, fulfillment_state_t state) override;
+    void try_finish(private_type target) override;
+    void post(task_type&& task) override;
+    void bind_outer(private_type target, private_type outer) override;
+    //! Enqueues all \a ops at once with at most one wakeup.
+    void dispatch(operation_list&& ops) override;
+
+    [[nodiscard]]
+    uv_loop_t* loop() const noexcept;
+
+
+private:
+    using _op = guts::handler_op;
+
+    uv_loop_t*              _loop;
+    uv_async_t*             _async;
+    guts::mpsc_queue<_op>   _queue;
+    const std::thread::id   _thread = std::this_thread::get_id();
+    //! Async handle is referenced, touched in loop's thread only.
+    bool                    _referenced = false;
+
+
+    void _enqueue(_op* op) noexcept;
+    void _enqueue_list(_op* first) noexcept;
+    void _keep_alive() noexcept;
+    void _drain() noexcept;
+
+    static void _on_async(uv_async_t* async);
+
+};
+
+
+//! Ready-made libuv adapters.
+//!
+//! These are plain functions, not \a async wrappers: \a async keeps callbacks in thread-local
+//! map keyed by call argument and has no handler to fulfill through, while here promise is
+//! stored right in \a req->data, so completion doesn't need any lookup. Returned
+//! promises are owned by handler \a h and are fulfilled inside loop's thread: resolved with
+//! \a req->result (\a ssize_t) or rejected with negative libuv error code.
+//! \note \a req must stay alive until promise is fulfilled.
+namespace uv
+{
+    promise fs_open(uv_handler& h, uv_fs_t* req, const char* path, int flags, int mode);
+    promise fs_close(uv_handler& h, uv_fs_t* req, uv_file file);
+    promise fs_read(uv_handler& h, uv_fs_t* req, uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset);
+    promise fs_write(uv_handler& h, uv_fs_t* req, uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset);
+    promise fs_fsync(uv_handler& h, uv_fs_t* req, uv_file file);
+    promise fs_unlink(uv_handler& h, uv_fs_t* req, const char* path);
+    promise fs_mkdir(uv_handler& h, uv_fs_t* req, const char* path, int mode);
+    promise fs_rename(uv_handler& h, uv_fs_t* req, const char* path, const char* new_path);
+    //! Resolved with \a req->statbuf (\a uv_stat_t).
+    promise fs_stat(uv_handler& h, uv_fs_t* req, const char* path);
+
+    //! Runs \a work inside libuv thread pool. Promise is resolved with returned value or
+    //! rejected with thrown \a std::exception_ptr or negative libuv error code.
+    promise queue_work(uv_handler& h, uv_work_t* req, std::function<std::any()>&& work);
+
+    //! Resolved after \a timeout milliseconds.
+    //! \note \a timer must be initialized with \a uv_timer_init().
+    promise timer_start(uv_handler& h, uv_timer_t* timer, uint64_t timeout);
+}
+
+
+CGULL_NAMESPACE_END
+
+
+CGULL_NAMESPACE_START
+
+
+inline
+uv_handler::uv_handler(uv_loop_t* loop)
+    : _loop(loop)
+    , _async(new uv_async_t{})
+{
+    if(uv_async_init(_loop, _async, &uv_handler::_on_async) < 0)
+    {
+        delete _async;
+
+        throw std::runtime_error("cgull: uv_async_init() failed");
+    };
+
+    _async->data = this;
+
+    uv_unref(reinterpret_cast<uv_handle_t*>(_async));
+}
+
+
+inline
+uv_handler::~uv_handler()
+{
+    _async->data = nullptr;
+
+    uv_close(
+        reinterpret_cast<uv_handle_t*>(_async),
+        [](uv_handle_t* handle) { delete reinterpret_cast<uv_async_t*>(handle); }
+    );
+
+    // drop unhandled operations
+    for(auto op = _queue.pop_all(); op; )
+    {
+        auto next = op->next;
+
+        delete op;
+        op = next;
+    };
+}
+
+
+inline
+void uv_handler::fulfill(private_type target, std::any&& value, fulfillment_state_t state)
+{
+    _enqueue(new _op{ std::move(target), std::forward<decltype(value)>(value), state });
+}
+
+
+inline
+void uv_handler::try_finish(private_type target)
+{
+    _enqueue(new _op{ std::move(target) });
+}
+
+
+inline
+void uv_handler::post(task_type&& task)
+{
+    _enqueue(new _op{ std::forward<decltype(task)>(task) });
+}
+
+
+inline
+void uv_handler::bind_outer(private_type target, private_type outer)
+{
+    _enqueue(new _op{ std::move(target), std::move(outer) });
+}
+
+
+inline
+void uv_handler::dispatch(operation_list&& ops)
+{
+    _op* first = nullptr;
+    _op* last = nullptr;
+
+    for(auto& o : ops)
+    {
+        auto op = new _op{ std::move(o) };
+
+        (last ? last->next : first) = op;
+        last = op;
+    };
+
+    _enqueue_list(first);
+}
+
+
+inline
+uv_loop_t* uv_handler::loop() const noexcept
+{
+    return _loop;
+}
+
+
+inline
+void uv_handler::_enqueue(_op* op) noexcept
+{
+    // uv_async_send() is coalesced by libuv too, but still costs a write
+    if(_queue.push(op))
+        uv_async_send(_async);
+
+    _keep_alive();
+}
+
+
+inline
+void uv_handler::_enqueue_list(_op* first) noexcept
+{
+    if(_queue.push_list(first))
+        uv_async_send(_async);
+
+    _keep_alive();
+}
+
+
+inline
+void uv_handler::_keep_alive() noexcept
+{
+    if(_referenced || std::this_thread::get_id() != _thread)
+        return;
+
+    _referenced = true;
+
+    uv_ref(reinterpret_cast<uv_handle_t*>(_async));
+}
+
+
+inline
+void uv_handler::_drain() noexcept
+{
+    if(_referenced)
+    {
+        _referenced = false;
+
+        uv_unref(reinterpret_cast<uv_handle_t*>(_async));
+    };
+
+    // operations posted while draining will trigger new async
+    for(auto op = _queue.pop_all(); op; )
+    {
+        op->run();
+
+        auto next = op->next;
+
+        delete op;
+        op = next;
+    };
+}
+
+
+inline
+void uv_handler::_on_async(uv_async_t* async)
+{
+    if(async->data)
+        static_cast<uv_handler*>(async->data)->_drain();
+}
+
+
+namespace uv
+{
+    namespace _impl
+    {
+        //! Stores promise in \a req->data with extra reference.
+        template< typename _Request > inline
+        promise bind(uv_handler& h, _Request* req)
+        {
+            promise result{ &h };
+
+            auto d = guts::private_of(result);
+
+            d->_ref.ref();
+            req->data = d.data();
+
+            return result;
+        }
+
+        //! Takes promise from \a req->data back.
+        template< typename _Request > inline
+        promise_private::type unbind(_Request* req)
+        {
+            promise_private::type d{ static_cast<promise_private*>(req->data) };
+
+            d->_ref.deref();
+            req->data = nullptr;
+
+            return d;
+        }
+
+        //! Request is cleaned up before fulfillment, because continuations may reuse it.
+        inline
+        void on_fs(uv_fs_t* req)
+        {
+            const auto result = req->result;
+            auto d = unbind(req);
+
+            uv_fs_req_cleanup(req);
+
+            // called inside loop's thread, so no need to go through handler
+            d->local_fulfill(std::any{result}, result < 0 ? rejected : resolved);
+        }
+
+        inline
+        void on_fs_stat(uv_fs_t* req)
+        {
+            const auto result = req->result;
+            const auto statbuf = req->statbuf;
+            auto d = unbind(req);
+
+            uv_fs_req_cleanup(req);
+
+            if(result < 0)
+                d->local_fulfill(std::any{result}, rejected);
+            else
+                d->local_fulfill(std::any{statbuf}, resolved);
+        }
+
+        //! Rejects promise right away if request wasn't started.
+        template< typename _Request > inline
+        promise check(promise&& p, _Request* req, int code)
+        {
+            if(code >= 0)
+                return std::move(p);
+
+            unbind(req)->local_fulfill(std::any{static_cast<ssize_t>(code)}, rejected);
+
+            // callback won't come, so free what request managed to allocate
+            if constexpr(std::is_same_v<_Request, uv_fs_t>)
+                uv_fs_req_cleanup(req);
+
+            return std::move(p);
+        }
+
+        struct work_data
+        {
+            promise_private::type       target;
+            std::function<std::any()>   work;
+            std::any                    result = {};
+            fulfillment_state_t         state = resolved;
+        };
+    }
+
+
+    inline
+    promise fs_open(uv_handler& h, uv_fs_t* req, const char* path, int flags, int mode)
+    {
+        auto p = _impl::bind(h, req);
+
+        return _impl::check(std::move(p), req, uv_fs_open(h.loop(), req, path, flags, mode, &_impl::on_fs));
+    }
+
+
+    inline
+    promise fs_close(uv_handler& h, uv_fs_t* req, uv_file file)
+    {
+        auto p = _impl::bind(h, req);
+
+        return _impl::check(std::move(p), req, uv_fs_close(h.loop(), req, file, &_impl::on_fs));
+    }
+
+
+    inline
+    promise fs_read(uv_handler& h, uv_fs_t* req, uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset)
+    {
+        auto p = _impl::bind(h, req);
+
+        return _impl::check(std::move(p), req, uv_fs_read(h.loop(), req, file, bufs, nbufs, offset, &_impl::on_fs));
+    }
+
+
+    inline
+    promise fs_write(uv_handler& h, uv_fs_t* req, uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset)
+    {
+        auto p = _impl::bind(h, req);
+
+        return _impl::check(std::move(p), req, uv_fs_write(h.loop(), req, file, bufs, nbufs, offset, &_impl::on_fs));
+    }
+
+
+    inline
+    promise fs_fsync(uv_handler& h, uv_fs_t* req, uv_file file)
+    {
+        auto p = _impl::bind(h, req);
+
+        return _impl::check(std::move(p), req, uv_fs_fsync(h.loop(), req, file, &_impl::on_fs));
+    }
+
+
+    inline
+    promise fs_unlink(uv_handler& h, uv_fs_t* req, const char* path)
+    {
+        auto p = _impl::bind(h, req);
+
+        return _impl::check(std::move(p), req, uv_fs_unlink(h.loop(), req, path, &_impl::on_fs));
+    }
+
+
+    inline
+    promise fs_mkdir(uv_handler& h, uv_fs_t* req, const char* path, int mode)
+    {
+        auto p = _impl::bind(h, req);
+
+        return _impl::check(std::move(p), req, uv_fs_mkdir(h.loop(), req, path, mode, &_impl::on_fs));
+    }
+
+
+    inline
+    promise fs_rename(uv_handler& h, uv_fs_t* req, const char* path, const char* new_path)
+    {
+        auto p = _impl::bind(h, req);
+
+        return _impl::check(std::move(p), req, uv_fs_rename(h.loop(), req, path, new_path, &_impl::on_fs));
+    }
+
+
+    inline
+    promise fs_stat(uv_handler& h, uv_fs_t* req, const char* path)
+    {
+        auto p = _impl::bind(h, req);
+
+        return _impl::check(std::move(p), req, uv_fs_stat(h.loop(), req, path, &_impl::on_fs_stat));
+    }
+
+
+    inline
+    promise queue_work(uv_handler& h, uv_work_t* req, std::function<std::any()>&& work)
+    {
+        promise result{ &h };
+
+        auto data = new _impl::work_data{ guts::private_of(result), std::forward<decltype(work)>(work) };
+
+        req->data = data;
+
+        const auto code = uv_queue_work(
+            h.loop(), req,
+            [](uv_work_t* req)
+            {
+                auto data = static_cast<_impl::work_data*>(req->data);
+
+                try
+                {
+                    data->result = data->work();
+                }
+                catch(...)
+                {
+                    data->result = std::current_exception();
+                    data->state = rejected;
+                };
+            },
+            [](uv_work_t* req, int status)
+            {
+                auto data = static_cast<_impl::work_data*>(req->data);
+
+                req->data = nullptr;
+
+                if(status < 0)
+                    data->target->local_fulfill(std::any{static_cast<ssize_t>(status)}, rejected);
+                else
+                    data->target->local_fulfill(std::move(data->result), data->state);
+
+                delete data;
+            }
+        );
+
+        if(code < 0)
+        {
+            req->data = nullptr;
+
+            data->target->local_fulfill(std::any{static_cast<ssize_t>(code)}, rejected);
+
+            delete data;
+        };
+
+        return result;
+    }
+
+
+    inline
+    promise timer_start(uv_handler& h, uv_timer_t* timer, uint64_t timeout)
+    {
+        auto p = _impl::bind(h, timer);
+
+        return _impl::check(
+            std::move(p), timer,
+            uv_timer_start(
+                timer,
+                [](uv_timer_t* timer)
+                {
+                    _impl::unbind(timer)->local_fulfill(std::any{}, resolved);
+                },
+                timeout, 0
+            )
+        );
+    }
+}
+
+
+CGULL_NAMESPACE_END
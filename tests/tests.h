@@ -8,12 +8,18 @@
 
 #include <deque>
 #include <chrono>
+#include <numeric>
+#include <span>
+#include <iostream>
+#include <sstream>
 #include <boost/lockfree/queue.hpp>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #if defined(CGULL_DEBUG_GUTS)
 #   define CHECK_CGULL_PROMISE_GUTS \
-    EXPECT_EQ(0, CGull::guts::_debugPrivateCounter()); \
-    CGull::guts::_debugPrivateCounter().store(0); \
+    EXPECT_EQ(0u, cgull::promise_registry::instance().size()); \
     Log() << '\n';
 #else
 #   define CHECK_CGULL_PROMISE_GUTS
@@ -46,16 +52,14 @@ std::string type_name()
 }
 #endif
 
-#if defined(CGULL_DEBUG_GUTS)
-auto _debugPromiseList = &CGull::guts::_DebugPromiseList::instance();
-#endif
-
 #define WAIT_FOR(s, t) \
     for(int i = 0; i < (s); ++i) { if(t()) break; std::this_thread::sleep_for(std::chrono::milliseconds(1)); }
 
 
 #define CHAINV chain += v
 
+//! Collects line and writes it at once, so lines of threads don't interleave without
+//! global lock.
 class Log
 {
     Log(const Log&) = delete;
@@ -64,25 +68,24 @@ class Log
     Log& operator=(Log&&) = delete;
 
 public:
-    Log()
-    {
-#if defined(CGULL_DEBUG_GUTS)
-        CGull::guts::_debugCoutMutex().lock();
-#endif
-    }
+    Log() = default;
     ~Log()
     {
-#if defined(CGULL_DEBUG_GUTS)
-        CGull::guts::_debugCoutMutex().unlock();
-#endif
+        const auto line = _line.str();
+
+        std::cout.write(line.data(), line.size());
     }
 
     template< typename _T >
     Log& operator<<(const _T& data)
     {
-        std::cout << data;
+        _line << data;
         return *this;
     }
+
+
+private:
+    std::ostringstream _line;
 };
 
 
@@ -1405,3 +1408,2741 @@ TEST(PromiseBase, rescue_compilation)
 
     CHECK_CGULL_PROMISE_GUTS;
 };
+
+
+TEST(timer_service, delay)
+{
+    cgull::event_loop_handler loop;
+
+    const auto started = std::chrono::steady_clock::now();
+
+    auto p = cgull::delay(std::chrono::milliseconds{20}, &loop);
+
+    EXPECT_EQ(cgull::not_fulfilled, p.fulfillment());
+
+    WAIT_FOR(1000, [&]{ loop.poll(); return p.is_resolved(); });
+
+    EXPECT_TRUE(p.is_resolved());
+    EXPECT_LE(std::chrono::milliseconds{20}, std::chrono::steady_clock::now() - started);
+
+    // continuation is chained from this thread while timer thread fires
+    cgull::thread_pool_handler pool{ 2 };
+
+    std::atomic<int> ran = 0;
+
+    for(int i = 0; i < 50; ++i)
+        cgull::delay(std::chrono::milliseconds{1}, &pool).then([&]{ ++ran; });
+
+    WAIT_FOR(2000, [&]{ return ran == 50; });
+
+    EXPECT_EQ(50, ran);
+};
+
+
+TEST(timer_service, timeout)
+{
+    cgull::event_loop_handler loop;
+
+    {
+        cgull::promise p;
+
+        auto t = p.timeout(std::chrono::milliseconds{10}, &loop);
+
+        WAIT_FOR(1000, [&]{ loop.poll(); return t.is_rejected(); });
+
+        EXPECT_TRUE(t.is_rejected());
+        EXPECT_NO_THROW(std::any_cast<cgull::timeout_error>(t.value()));
+        EXPECT_EQ(cgull::not_fulfilled, p.fulfillment());
+    }
+
+    {
+        cgull::promise p{ &loop };
+
+        auto t = p.timeout(std::chrono::seconds{10});
+
+        EXPECT_EQ(1, cgull::timer_service::instance().size());
+
+        p.resolve(5);
+        loop.poll();
+
+        EXPECT_TRUE(t.is_resolved());
+        EXPECT_EQ(5, std::any_cast<int>(t.value()));
+        EXPECT_EQ(0, cgull::timer_service::instance().size());
+    }
+
+    {
+        cgull::promise p{ &loop };
+
+        auto t = p.timeout(std::chrono::seconds{10});
+
+        p.reject(6);
+        loop.poll();
+
+        EXPECT_TRUE(t.is_rejected());
+        EXPECT_EQ(6, std::any_cast<int>(t.value()));
+        EXPECT_EQ(0, cgull::timer_service::instance().size());
+    }
+};
+
+
+TEST(timer_service, wheel_levels)
+{
+    cgull::timer_service service{ std::chrono::microseconds{50} };
+
+    std::vector<cgull::promise> promises(200);
+    std::vector<cgull::timer_service::timer_id> ids;
+
+    const auto now = cgull::timer_service::clock::now();
+
+    // spans first three levels
+    for(size_t i = 0; i < promises.size(); ++i)
+        ids.push_back(service.arm(cgull::guts::private_of(promises[i]), now + std::chrono::microseconds{50 * (i * 37 % 4200)}, std::any{int(i)}, cgull::resolved));
+
+    EXPECT_TRUE(service.cancel(ids.back()));
+    EXPECT_FALSE(service.cancel(ids.back()));
+
+    WAIT_FOR(1000, [&]{ return !service.size(); });
+
+    EXPECT_EQ(0, service.size());
+    EXPECT_EQ(cgull::not_fulfilled, promises.back().fulfillment());
+
+    for(size_t i = 0; i + 1 < promises.size(); ++i)
+    {
+        EXPECT_TRUE(promises[i].is_resolved());
+        EXPECT_EQ(int(i), std::any_cast<int>(promises[i].value()));
+    };
+};
+
+
+TEST(promise, then)
+{
+    {
+        int called = 0;
+
+        auto next = cgull::promise{}.resolve(1)
+            .then([&](int v) { called += v; return v + 1; })
+            .then([&](std::any v) { called += std::any_cast<int>(v); })
+            .then([&]() { ++called; return std::string{"done"}; });
+
+        EXPECT_EQ(4, called);
+        EXPECT_TRUE(next.is_resolved());
+        EXPECT_EQ("done", std::any_cast<std::string>(next.value()));
+    }
+
+    {
+        int called = 0;
+        cgull::promise p;
+
+        auto next = p
+            .then([&](int v) { called += v; })
+            .then([&]() { ++called; });
+
+        EXPECT_EQ(0, called);
+
+        p.resolve(10);
+
+        EXPECT_EQ(11, called);
+        EXPECT_TRUE(next.is_resolved());
+    }
+
+    {
+        cgull::promise inner;
+
+        auto next = cgull::promise{}.resolve(1)
+            .then([&]() { return inner; })
+            .then([](int v) { return v * 2; });
+
+        EXPECT_EQ(cgull::not_fulfilled, next.fulfillment());
+
+        inner.resolve(21);
+
+        EXPECT_EQ(42, std::any_cast<int>(next.value()));
+    }
+};
+
+
+TEST(promise, rescue)
+{
+    {
+        int called = 0;
+
+        auto next = cgull::promise{}.reject(1)
+            .then([&]() { called += 100; })
+            .rescue([&](int v) { called += v; return 5; });
+
+        EXPECT_EQ(1, called);
+        EXPECT_TRUE(next.is_resolved());
+        EXPECT_EQ(5, std::any_cast<int>(next.value()));
+    }
+
+    {
+        auto next = cgull::promise{}.resolve(1)
+            .then([](int v) { throw 3; return v; })
+            .rescue([](int v) { return v; });
+
+        EXPECT_EQ(3, std::any_cast<int>(next.value()));
+    }
+
+    {
+        auto next = cgull::promise{}.resolve(1)
+            .then([](int) { throw std::runtime_error("err"); });
+
+        EXPECT_TRUE(next.is_rejected());
+        EXPECT_THROW(std::rethrow_exception(std::any_cast<std::exception_ptr>(next.value())), std::runtime_error);
+    }
+
+    {
+        bool called = false;
+
+        auto next = cgull::promise{}.resolve(1)
+            .rescue([&]() { called = true; });
+
+        EXPECT_FALSE(called);
+        EXPECT_TRUE(next.is_resolved());
+        EXPECT_EQ(1, std::any_cast<int>(next.value()));
+    }
+};
+
+
+TEST(event_loop_handler, cross_thread_fulfill)
+{
+    cgull::event_loop_handler loop;
+
+    constexpr int count = 1000;
+
+    std::vector<cgull::promise> promises;
+    std::atomic<int> called = 0;
+    std::thread::id loop_thread;
+
+    for(int i = 0; i < count; ++i)
+    {
+        promises.emplace_back(&loop);
+        promises.back().then([&](int v)
+        {
+            loop_thread = std::this_thread::get_id();
+
+            if((called += v) == count)
+                loop.stop();
+        });
+    };
+
+    EXPECT_EQ(count, loop.poll());
+
+    std::thread producer{ [&]
+    {
+        for(auto& p : promises)
+            p.resolve(1);
+    } };
+
+    loop.run();
+    producer.join();
+
+    EXPECT_EQ(count, called);
+    EXPECT_EQ(std::this_thread::get_id(), loop_thread);
+};
+
+
+TEST(event_loop_handler, stop_before_run)
+{
+    cgull::event_loop_handler loop;
+
+    bool posted = false;
+
+    loop.post([&]{ posted = true; });
+    loop.stop();
+
+    // returns without blocking, but handles what is ready
+    loop.run();
+
+    EXPECT_TRUE(posted);
+    EXPECT_FALSE(loop.stopped());
+
+    std::thread stopper{ [&]{ loop.stop(); } };
+
+    loop.run();
+    stopper.join();
+
+    EXPECT_FALSE(loop.stopped());
+};
+
+
+TEST(event_loop_handler, watch)
+{
+    cgull::event_loop_handler loop;
+
+    int fds[2];
+
+    ASSERT_EQ(0, pipe(fds));
+
+    char received = 0;
+
+    loop.watch(fds[0], EPOLLIN, [&](uint32_t) { EXPECT_EQ(1, read(fds[0], &received, 1)); loop.unwatch(fds[0]); });
+
+    EXPECT_EQ(0, loop.poll());
+    EXPECT_EQ(1, write(fds[1], "x", 1));
+    EXPECT_EQ(1, loop.run_once());
+    EXPECT_EQ('x', received);
+
+    close(fds[0]);
+    close(fds[1]);
+};
+
+
+TEST(thread_pool_handler, fulfill)
+{
+    constexpr int count = 1000;
+
+    std::atomic<int> called = 0;
+
+    {
+        cgull::thread_pool_handler pool{ 4 };
+
+        std::vector<cgull::promise> promises;
+
+        for(int i = 0; i < count; ++i)
+        {
+            promises.emplace_back(&pool);
+            promises.back().then([&](int v) { called += v; });
+        };
+
+        for(auto& p : promises)
+            p.resolve(1);
+
+        WAIT_FOR(1000, [&]{ return called == count; });
+    }
+
+    EXPECT_EQ(count, called);
+};
+
+
+class io_context_test : public ::testing::TestWithParam<bool>
+{ };
+
+
+TEST_P(io_context_test, read_write)
+{
+    cgull::event_loop_handler loop;
+    cgull::io::context ctx{ loop, { .force_fallback = GetParam() } };
+
+    char path[] = "/tmp/cgull_io_XXXXXX";
+    const int tmp = mkstemp(path);
+
+    ASSERT_LE(0, tmp);
+    close(tmp);
+
+    const std::string data(100000, 'c');
+    std::string read_back(data.size(), '\0');
+    struct ::statx st{};
+    int fd = -1;
+    bool done = false;
+
+    cgull::io::openat(ctx, AT_FDCWD, path, O_RDWR)
+        .then([&](int f)
+        {
+            fd = f;
+
+            return cgull::io::write(ctx, fd, data.data(), unsigned(data.size()), 0);
+        })
+        .then([&](int written)
+        {
+            EXPECT_EQ(int(data.size()), written);
+
+            return cgull::io::fsync(ctx, fd);
+        })
+        .then([&]()
+        {
+            return cgull::io::statx(ctx, AT_FDCWD, path, 0, STATX_SIZE, &st);
+        })
+        .then([&]()
+        {
+            EXPECT_EQ(data.size(), st.stx_size);
+
+            return cgull::io::read(ctx, fd, read_back.data(), unsigned(read_back.size()), 0);
+        })
+        .then([&](int r)
+        {
+            EXPECT_EQ(int(data.size()), r);
+            EXPECT_EQ(data, read_back);
+
+            done = true;
+            loop.stop();
+        })
+        .rescue([&](int error)
+        {
+            ADD_FAILURE() << "io error " << error;
+
+            loop.stop();
+        });
+
+    loop.run();
+
+    EXPECT_TRUE(done);
+    EXPECT_EQ(!GetParam(), ctx.uses_uring());
+
+    close(fd);
+    unlink(path);
+};
+
+
+TEST_P(io_context_test, errors_and_fixed_buffers)
+{
+    cgull::event_loop_handler loop;
+    cgull::io::context ctx{ loop, { .force_fallback = GetParam() } };
+
+    std::vector<char> buffer(4096);
+    const iovec iov{ buffer.data(), buffer.size() };
+
+    ctx.register_buffers({ &iov, 1 });
+
+    const int fd = open("/proc/self/exe", O_RDONLY);
+
+    ASSERT_LE(0, fd);
+
+    auto missing = cgull::io::openat(ctx, AT_FDCWD, "/nonexistent/cgull", O_RDONLY);
+    auto fixed = cgull::io::read_fixed(ctx, fd, buffer.data(), 4, 0, 0);
+
+    WAIT_FOR(1000, [&]{ loop.poll(); return missing.fulfillment() && fixed.fulfillment(); });
+
+    EXPECT_TRUE(missing.is_rejected());
+    EXPECT_EQ(-ENOENT, std::any_cast<int>(missing.value()));
+    EXPECT_TRUE(fixed.is_resolved());
+    EXPECT_EQ("\x7f" "ELF", std::string(buffer.data(), 4));
+
+    close(fd);
+};
+
+
+TEST_P(io_context_test, full_ring)
+{
+    // fallback has no ring and reads pipe with pread()
+    if(GetParam())
+        GTEST_SKIP();
+
+    cgull::event_loop_handler loop;
+    int fds[2];
+
+    ASSERT_EQ(0, pipe(fds));
+
+    {
+        cgull::io::context ctx{ loop, { .entries = 2 } };
+
+        if(!ctx.uses_uring())
+            GTEST_SKIP();
+
+        // requests beyond ring size push queued ones to kernel
+        char buffer[3];
+        std::vector<cgull::promise> reads;
+
+        for(auto& c : buffer)
+            reads.push_back(cgull::io::read(ctx, fds[0], &c, 1, 0));
+
+        loop.poll();
+
+        ASSERT_EQ(3, write(fds[1], "abc", 3));
+
+        WAIT_FOR(1000, [&]{ loop.poll(); return std::all_of(reads.begin(), reads.end(), [](const auto& r) { return r.is_resolved(); }); });
+
+        for(const auto& r : reads)
+        {
+            ASSERT_TRUE(r.is_resolved());
+            EXPECT_EQ(1, std::any_cast<int>(r.value()));
+        };
+
+        std::sort(std::begin(buffer), std::end(buffer));
+
+        EXPECT_EQ("abc", std::string(buffer, 3));
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+};
+
+
+TEST_P(io_context_test, teardown_cancels_in_flight)
+{
+    // fallback pool would block on read forever
+    if(GetParam())
+        GTEST_SKIP();
+
+    cgull::event_loop_handler loop;
+    int fds[2];
+
+    ASSERT_EQ(0, pipe(fds));
+
+    char buffer[2][16];
+    cgull::promise submitted;
+    cgull::promise queued;
+
+    {
+        cgull::io::context ctx{ loop };
+
+        if(!ctx.uses_uring())
+            GTEST_SKIP();
+
+        submitted = cgull::io::read(ctx, fds[0], buffer[0], sizeof(buffer[0]), 0);
+        ctx.flush();
+
+        queued = cgull::io::read(ctx, fds[0], buffer[1], sizeof(buffer[1]), 0);
+    }
+
+    // nothing is written, so both end up cancelled
+    EXPECT_TRUE(submitted.is_rejected());
+    EXPECT_EQ(-ECANCELED, std::any_cast<int>(submitted.value()));
+    EXPECT_TRUE(queued.is_rejected());
+    EXPECT_EQ(-ECANCELED, std::any_cast<int>(queued.value()));
+
+    close(fds[0]);
+    close(fds[1]);
+};
+
+
+INSTANTIATE_TEST_SUITE_P(io, io_context_test, ::testing::Values(false, true));
+
+
+class recording_handler : public cgull::handler
+{
+public:
+    size_t single_calls = 0;
+    std::vector<operation_list> batches;
+
+    void fulfill(private_type, std::any&&, cgull::fulfillment_state_t) override { ++single_calls; }
+    void try_finish(private_type) override { ++single_calls; }
+    void post(task_type&&) override { ++single_calls; }
+    void dispatch(operation_list&& ops) override { batches.push_back(std::move(ops)); }
+};
+
+
+TEST(fulfill_scope, coalesce)
+{
+    recording_handler first;
+    recording_handler second;
+
+    std::vector<cgull::promise> promises;
+
+    for(int i = 0; i < 30; ++i)
+        promises.emplace_back(i % 3 ? &first : &second);
+
+    {
+        cgull::fulfill_scope scope;
+
+        for(int i = 0; i < 30; ++i)
+            promises[i].resolve(i);
+
+        // continuation of context-local promise is captured too
+        cgull::promise local;
+
+        local.then(&first, []{});
+        local.resolve();
+
+        EXPECT_EQ(31u, scope.size());
+        EXPECT_TRUE(first.batches.empty());
+    }
+
+    EXPECT_EQ(0u, first.single_calls + second.single_calls);
+    ASSERT_EQ(1u, first.batches.size());
+    ASSERT_EQ(1u, second.batches.size());
+    EXPECT_EQ(21u, first.batches[0].size());
+    EXPECT_EQ(10u, second.batches[0].size());
+
+    // order is kept
+    EXPECT_EQ(1, std::any_cast<int>(first.batches[0][0].value));
+    EXPECT_EQ(2, std::any_cast<int>(first.batches[0][1].value));
+    EXPECT_EQ(3, std::any_cast<int>(second.batches[0][1].value));
+
+    // no scope, no batching
+    cgull::guts::private_of(promises[1])->fulfill(std::any{}, cgull::resolved);
+
+    EXPECT_EQ(1u, first.single_calls);
+};
+
+
+TEST(fulfill_scope, resolve_batch)
+{
+    cgull::event_loop_handler loop;
+    cgull::thread_pool_handler pool{ 4 };
+
+    constexpr int count = 1000;
+
+    std::vector<cgull::promise> promises;
+    std::vector<int> values(count);
+    std::atomic<int> sum = 0;
+    std::atomic<int> called = 0;
+
+    for(int i = 0; i < count; ++i)
+    {
+        values[i] = i;
+        promises.emplace_back(i % 2 ? static_cast<cgull::handler*>(&loop) : &pool);
+        promises.back().then([&](int v) { sum += v; ++called; });
+    };
+
+    std::thread producer{ [&]{ cgull::resolve_batch(std::span{promises}, std::span{values}); } };
+
+    WAIT_FOR(2000, [&]{ loop.poll(); return called == count; });
+
+    producer.join();
+
+    EXPECT_EQ(count, called);
+    EXPECT_EQ(count * (count - 1) / 2, sum);
+
+    // caller's values are copied unless moving is asked explicitly
+    std::vector<cgull::promise> copied(2);
+    std::vector<cgull::promise> moved(2);
+    std::vector<std::string> strings{ "first value, long enough to allocate", "second" };
+
+    cgull::resolve_batch(std::span{copied}, std::span{strings});
+
+    EXPECT_EQ("second", strings[1]);
+    EXPECT_EQ("second", std::any_cast<std::string>(copied[1].value()));
+
+    cgull::resolve_batch_move(std::span{moved}, std::span{strings});
+
+    EXPECT_TRUE(strings[0].empty());
+    EXPECT_EQ("first value, long enough to allocate", std::any_cast<std::string>(moved[0].value()));
+
+    std::vector<cgull::promise> rejected(3);
+    const std::vector<std::string> errors{ "a", "b", "c" };
+
+    cgull::reject_batch(std::span{rejected}, std::span{errors});
+
+    EXPECT_TRUE(rejected[2].is_rejected());
+    EXPECT_EQ("c", std::any_cast<std::string>(rejected[2].value()));
+};
+
+
+TEST(collections, map)
+{
+    std::vector<int> input{ 1, 2, 3, 4, 5, 6, 7, 8 };
+    std::vector<cgull::promise> pending;
+    size_t max_pending = 0;
+
+    auto result = cgull::map<int>(
+        input,
+        [&](int v)
+        {
+            pending.emplace_back();
+            max_pending = std::max(max_pending, pending.size());
+
+            return pending.back().then([v]{ return v * 10; });
+        },
+        { .concurrency = 3 }
+    );
+
+    EXPECT_EQ(3u, pending.size());
+
+    // complete in reverse order of start
+    while(!pending.empty())
+    {
+        auto p = pending.back();
+
+        pending.pop_back();
+        p.resolve();
+    };
+
+    ASSERT_TRUE(result.is_resolved());
+    EXPECT_EQ(3u, max_pending);
+    EXPECT_EQ((std::vector<int>{ 10, 20, 30, 40, 50, 60, 70, 80 }), std::any_cast<std::vector<int>>(result.value()));
+
+    // synchronous callback, result type deduced
+    auto squares = cgull::map_series(input, [](int v) { return v * v; });
+
+    ASSERT_TRUE(squares.is_resolved());
+    EXPECT_EQ(64, std::any_cast<std::vector<int>>(squares.value()).back());
+
+    // the first rejection wins, nothing is started after it
+    int started = 0;
+
+    auto failed = cgull::map(
+        input,
+        [&](int v) -> int
+        {
+            ++started;
+
+            if(v == 2)
+                throw std::runtime_error("2");
+
+            return v;
+        },
+        { .concurrency = 1 }
+    );
+
+    EXPECT_TRUE(failed.is_rejected());
+    EXPECT_EQ(2, started);
+};
+
+
+TEST(collections, each_filter_reduce)
+{
+    std::vector<int> input(100);
+
+    std::iota(input.begin(), input.end(), 0);
+
+    std::atomic<int> sum = 0;
+    cgull::thread_pool_handler pool{ 4 };
+
+    auto each = cgull::each(input, [&](int v) { sum += v; }, { .concurrency = 8, .executor = &pool });
+
+    WAIT_FOR(1000, [&]{ return each.is_resolved(); });
+
+    EXPECT_TRUE(each.is_resolved());
+    EXPECT_EQ(4950, sum);
+
+    auto even = cgull::filter(input, [](int v) { return cgull::promise{}.resolve(v % 2 == 0); });
+
+    ASSERT_TRUE(even.is_resolved());
+
+    const auto evens = std::any_cast<std::vector<int>>(even.value());
+
+    EXPECT_EQ(50u, evens.size());
+    EXPECT_EQ(98, evens.back());
+
+    auto total = cgull::reduce(input, [](int acc, int v) { return acc + v; }, 0, { .executor = &pool });
+
+    WAIT_FOR(1000, [&]{ return total.is_resolved(); });
+
+    EXPECT_EQ(4950, std::any_cast<int>(total.value()));
+
+    std::vector<int> empty;
+
+    EXPECT_TRUE(cgull::map(empty, [](int v) { return v; }).is_resolved());
+
+    // result is owned by executor, so it's chained from here while workers complete it
+    std::atomic<int> chained = 0;
+
+    for(int round = 0; round < 20; ++round)
+        cgull::map(input, [](int v) { return v * 2; }, { .concurrency = 4, .executor = &pool })
+            .then([&](const std::vector<int>& doubled) { chained += doubled.back(); });
+
+    WAIT_FOR(2000, [&]{ return chained == 20 * 198; });
+
+    EXPECT_EQ(20 * 198, chained);
+};
+
+
+TEST(singleflight, deduplicate)
+{
+    cgull::singleflight<std::string> flights;
+
+    int calls = 0;
+    cgull::promise backend;
+
+    auto load = [&]
+    {
+        ++calls;
+
+        return backend;
+    };
+
+    auto a = flights("key", load);
+    auto b = flights("key", load);
+    auto other = flights("other", [&]{ ++calls; return cgull::promise{}.resolve(std::string{"x"}); });
+
+    EXPECT_EQ(2, calls);
+    EXPECT_EQ(1u, flights.shared_count());
+    EXPECT_EQ(1u, flights.size());
+    // waiters share the very same state
+    EXPECT_EQ(cgull::guts::private_of(a), cgull::guts::private_of(b));
+    EXPECT_TRUE(other.is_resolved());
+
+    std::vector<std::string> results;
+
+    a.then([&](const std::string& v) { results.push_back(v); });
+    b.then([&](const std::string& v) { results.push_back(v); });
+
+    backend.resolve(std::string{"value"});
+
+    EXPECT_EQ((std::vector<std::string>{ "value", "value" }), results);
+    EXPECT_EQ(0u, flights.size());
+
+    // next call after fulfillment starts new flight, throw rejects
+    auto failed = flights("key", [&]() -> cgull::promise { ++calls; throw std::runtime_error("x"); });
+
+    EXPECT_EQ(3, calls);
+    EXPECT_TRUE(failed.is_rejected());
+    EXPECT_EQ(0u, flights.size());
+};
+
+
+TEST(promise_cache, hit_miss_ttl)
+{
+    using namespace std::chrono_literals;
+
+    cgull::promise_cache<int, std::string> cache{ { .shards = 2, .ttl = 30ms, .negative_ttl = 30ms } };
+
+    int loads = 0;
+    cgull::promise backend;
+
+    auto load = [&](int) { ++loads; return backend; };
+
+    auto a = cache.get(1, load);
+    auto b = cache.get(1, load);
+
+    EXPECT_EQ(1, loads);
+    EXPECT_EQ(cgull::guts::private_of(a), cgull::guts::private_of(b));
+
+    backend.resolve(std::string{"one"});
+
+    ASSERT_TRUE(a.is_resolved());
+
+    // hit returns already fulfilled promise
+    bool called = false;
+
+    cache.get(1, load).then([&](const std::string& v) { called = v == "one"; });
+
+    EXPECT_TRUE(called);
+    EXPECT_EQ(1, loads);
+
+    // rejections are cached too
+    auto failing = [&](int) -> cgull::promise { ++loads; throw std::runtime_error("down"); };
+
+    EXPECT_TRUE(cache.get(2, failing).is_rejected());
+    EXPECT_TRUE(cache.get(2, failing).is_rejected());
+    EXPECT_EQ(2, loads);
+
+    std::this_thread::sleep_for(40ms);
+
+    auto reloaded = cache.get(1, [&](int) { ++loads; return cgull::promise{}.resolve(std::string{"new"}); });
+
+    EXPECT_EQ(3, loads);
+    EXPECT_EQ("new", std::any_cast<std::string>(reloaded.value()));
+
+    const auto stats = cache.stats();
+
+    EXPECT_EQ(3u, stats.hits);
+    EXPECT_EQ(3u, stats.misses);
+    EXPECT_EQ(1u, stats.expirations);
+};
+
+
+TEST(promise_cache, eviction_and_stale)
+{
+    using namespace std::chrono_literals;
+
+    cgull::promise_cache<int, int> cache{
+        { .shards = 1, .max_bytes = 3, .ttl = 20ms, .stale_ttl = 1s },
+        [](int, int) { return size_t{1}; }
+    };
+
+    for(int i = 0; i < 5; ++i)
+        cache.put(i, i);
+
+    EXPECT_EQ(3u, cache.size());
+    EXPECT_EQ(3u, cache.bytes());
+    EXPECT_EQ(2u, cache.stats().evictions);
+
+    std::this_thread::sleep_for(30ms);
+
+    // stale value is returned right away and reloaded in background
+    cgull::promise backend;
+    int loads = 0;
+
+    auto stale = cache.get(4, [&](int) { ++loads; return backend; });
+    auto still_stale = cache.get(4, [&](int) { ++loads; return backend; });
+
+    EXPECT_EQ(4, std::any_cast<int>(stale.value()));
+    EXPECT_EQ(4, std::any_cast<int>(still_stale.value()));
+    EXPECT_EQ(1, loads);
+    EXPECT_EQ(2u, cache.stats().stale_hits);
+
+    backend.resolve(40);
+
+    EXPECT_EQ(40, std::any_cast<int>(cache.get(4, [&](int) { ++loads; return backend; }).value()));
+    EXPECT_EQ(1, loads);
+};
+
+
+TEST(batcher, tick_and_max_batch)
+{
+    cgull::event_loop_handler loop;
+
+    std::vector<std::vector<int>> calls;
+
+    cgull::batcher<int, std::string> users{
+        loop,
+        [&](std::vector<int> keys)
+        {
+            calls.push_back(keys);
+
+            std::vector<std::string> values;
+
+            for(const auto k : keys)
+                values.push_back("user" + std::to_string(k));
+
+            return cgull::promise{}.resolve(std::move(values));
+        },
+        { .max_batch = 3 }
+    };
+
+    std::vector<std::string> results;
+
+    for(int i = 0; i < 5; ++i)
+        users.load(i).then([&](const std::string& v) { results.push_back(v); });
+
+    // the first batch is full already, the rest waits for loop iteration
+    EXPECT_EQ(1u, calls.size());
+    EXPECT_EQ(2u, users.pending());
+
+    WAIT_FOR(1000, [&]{ loop.poll(); return results.size() == 5; });
+
+    ASSERT_EQ(2u, calls.size());
+    EXPECT_EQ((std::vector<int>{ 3, 4 }), calls[1]);
+    EXPECT_EQ((std::vector<std::string>{ "user0", "user1", "user2", "user3", "user4" }), results);
+
+    // rejection goes to every key
+    cgull::batcher<int, int> failing{ loop, [](std::vector<int>) { return cgull::promise{}.reject(std::string{"down"}); } };
+
+    auto a = failing.load(1);
+    auto b = failing.load(2);
+
+    WAIT_FOR(1000, [&]{ loop.poll(); return a.fulfillment() && b.fulfillment(); });
+
+    EXPECT_TRUE(a.is_rejected());
+    EXPECT_EQ("down", std::any_cast<std::string>(b.value()));
+};
+
+
+TEST(batcher, max_delay)
+{
+    using namespace std::chrono_literals;
+
+    cgull::event_loop_handler loop;
+
+    int calls = 0;
+
+    cgull::batcher<int, int> twice{
+        loop,
+        [&](std::vector<int> keys)
+        {
+            ++calls;
+
+            for(auto& k : keys)
+                k *= 2;
+
+            return cgull::promise{}.resolve(std::move(keys));
+        },
+        { .max_delay = 5ms }
+    };
+
+    auto a = twice.load(1);
+
+    loop.poll();
+
+    auto b = twice.load(2);
+
+    EXPECT_EQ(0, calls);
+
+    WAIT_FOR(1000, [&]{ loop.poll(); return a.fulfillment() && b.fulfillment(); });
+
+    EXPECT_EQ(1, calls);
+    EXPECT_EQ(4, std::any_cast<int>(b.value()));
+    EXPECT_EQ(1u, twice.batches());
+};
+
+
+// promise of a key stays valid after batcher and its loop are gone
+TEST(batcher, promise_outlives_loop)
+{
+    cgull::promise result;
+
+    {
+        cgull::event_loop_handler loop;
+        cgull::batcher<int, int> same{ loop, [](std::vector<int> keys) { return cgull::promise{}.resolve(std::move(keys)); } };
+
+        result = same.load(1);
+
+        WAIT_FOR(1000, [&]{ loop.poll(); return result.fulfillment(); });
+    };
+
+    ASSERT_TRUE(result.is_resolved());
+    EXPECT_EQ(1, std::any_cast<int>(result.value()));
+
+    result = {};
+};
+
+
+TEST(retry, backoff)
+{
+    using namespace std::chrono_literals;
+
+    cgull::event_loop_handler loop;
+
+    std::atomic<int> calls = 0;
+    std::atomic<int> off_thread = 0;
+    std::vector<cgull::retry_attempt> attempts;
+    std::mutex attempts_mutex;
+
+    const auto caller = std::this_thread::get_id();
+
+    auto result = cgull::retry(
+        [&]
+        {
+            // retries are started inside the loop, not by timer thread
+            off_thread += std::this_thread::get_id() != caller;
+
+            if(++calls < 3)
+                return cgull::promise{}.reject(std::string{"busy"});
+
+            return cgull::promise{}.resolve(42);
+        },
+        &loop,
+        {
+            .max_attempts = 5,
+            .initial_delay = 2ms,
+            .jitter = 0.5,
+            .on_attempt = [&](const cgull::retry_attempt& a)
+            {
+                std::lock_guard lock{ attempts_mutex };
+
+                attempts.push_back(a);
+            },
+        }
+    );
+
+    WAIT_FOR(1000, [&]{ loop.poll(); return !!result.fulfillment(); });
+
+    ASSERT_TRUE(result.is_resolved());
+    EXPECT_EQ(42, std::any_cast<int>(result.value()));
+    EXPECT_EQ(3, calls);
+    EXPECT_EQ(0, off_thread);
+
+    std::lock_guard lock{ attempts_mutex };
+
+    ASSERT_EQ(3u, attempts.size());
+    EXPECT_FALSE(attempts[0].succeeded);
+    EXPECT_EQ("busy", std::any_cast<std::string>(attempts[0].error));
+    EXPECT_LE(1ms, attempts[0].next_delay);
+    EXPECT_GE(2ms, attempts[0].next_delay);
+    EXPECT_LE(2ms, attempts[1].next_delay);
+    EXPECT_TRUE(attempts[2].succeeded);
+    EXPECT_EQ(3u, attempts[2].number);
+};
+
+
+TEST(retry, gives_up)
+{
+    using namespace std::chrono_literals;
+
+    cgull::event_loop_handler loop;
+
+    int calls = 0;
+
+    // not retryable
+    auto fatal = cgull::retry(
+        [&]() -> cgull::promise { ++calls; throw std::runtime_error("fatal"); },
+        &loop,
+        { .retryable = [](const std::any& e, size_t) { return !e.has_value() || e.type() != typeid(std::exception_ptr); } }
+    );
+
+    loop.poll();
+
+    EXPECT_TRUE(fatal.is_rejected());
+    EXPECT_EQ(1, calls);
+
+    std::atomic<int> attempts = 0;
+
+    auto exhausted = cgull::retry(
+        [&]{ ++attempts; return cgull::promise{}.reject(attempts.load()); },
+        &loop,
+        { .max_attempts = 3, .initial_delay = 1ms, .jitter = 0 }
+    );
+
+    WAIT_FOR(1000, [&]{ loop.poll(); return !!exhausted.fulfillment(); });
+
+    EXPECT_TRUE(exhausted.is_rejected());
+    EXPECT_EQ(3, std::any_cast<int>(exhausted.value()));
+
+    // budget is too small for the first delay
+    auto budget = cgull::retry(
+        []{ return cgull::promise{}.reject(); },
+        &loop,
+        { .initial_delay = 100ms, .jitter = 0, .budget = 10ms }
+    );
+
+    loop.poll();
+
+    EXPECT_TRUE(budget.is_rejected());
+};
+
+
+TEST(hedge, slow_primary)
+{
+    using namespace std::chrono_literals;
+
+    cgull::event_loop_handler loop;
+    cgull::hedger hedger{ &loop, { .delay = 2ms, .max_hedges = 2 } };
+
+    std::vector<cgull::promise> attempts;
+    std::mutex attempts_mutex;
+
+    auto result = hedger(
+        [&]
+        {
+            std::lock_guard lock{ attempts_mutex };
+
+            // the first attempt hangs, the hedge answers right away
+            attempts.push_back(attempts.empty() ? cgull::promise{} : cgull::promise{}.resolve(42));
+
+            return attempts.back();
+        }
+    );
+
+    WAIT_FOR(1000, [&]{ loop.poll(); return !!result.fulfillment(); });
+
+    ASSERT_TRUE(result.is_resolved());
+    EXPECT_EQ(42, std::any_cast<int>(result.value()));
+
+    std::lock_guard lock{ attempts_mutex };
+
+    ASSERT_EQ(2u, attempts.size());
+    EXPECT_TRUE(attempts[0].is_aborted());
+
+    const auto s = hedger.stats();
+
+    EXPECT_EQ(1u, s.calls);
+    EXPECT_EQ(1u, s.hedged);
+    EXPECT_EQ(1u, s.hedges);
+    EXPECT_EQ(1u, s.hedge_wins);
+    EXPECT_EQ(0u, s.failures);
+
+    // fast primary isn't hedged
+    auto fast = hedger([]{ return cgull::promise{}.resolve(1); });
+
+    loop.poll();
+
+    EXPECT_TRUE(fast.is_resolved());
+    EXPECT_EQ(2u, hedger.stats().calls);
+    EXPECT_EQ(1u, hedger.stats().hedged);
+};
+
+
+TEST(hedge, failures)
+{
+    using namespace std::chrono_literals;
+
+    cgull::event_loop_handler loop;
+
+    // rejection starts the next attempt without waiting for delay
+    std::atomic<int> calls = 0;
+
+    auto second = cgull::hedge(
+        [&]{ return ++calls == 1 ? cgull::promise{}.reject() : cgull::promise{}.resolve(calls.load()); },
+        &loop,
+        { .delay = 1h }
+    );
+
+    loop.poll();
+
+    EXPECT_TRUE(second.is_resolved());
+    EXPECT_EQ(2, std::any_cast<int>(second.value()));
+
+    cgull::hedger hedger{ &loop, { .delay = 1h, .max_hedges = 2 } };
+
+    calls = 0;
+
+    auto failed = hedger([&]() -> cgull::promise { throw std::runtime_error(std::to_string(++calls)); });
+
+    loop.poll();
+
+    ASSERT_TRUE(failed.is_rejected());
+    EXPECT_EQ(3, calls);
+    EXPECT_EQ(1u, hedger.stats().failures);
+    EXPECT_EQ(0u, hedger.stats().hedge_wins);
+};
+
+
+TEST(hedge, adaptive_delay)
+{
+    using namespace std::chrono_literals;
+
+    cgull::event_loop_handler loop;
+    cgull::hedger hedger{ &loop, { .delay = 1s, .adaptive = true } };
+
+    EXPECT_EQ(1s, hedger.current_delay());
+
+    for(int i = 0; i < 64; ++i)
+    {
+        auto call = hedger([]{ return cgull::promise{}.resolve(); });
+
+        loop.poll();
+
+        EXPECT_TRUE(call.is_resolved());
+    };
+
+    // immediate answers make delay tiny
+    EXPECT_GT(1ms, hedger.current_delay());
+    EXPECT_EQ(0u, hedger.stats().hedged);
+};
+
+
+TEST(hedge, cancelled_timers_are_released)
+{
+    using namespace std::chrono_literals;
+
+    cgull::event_loop_handler loop;
+
+    {
+        cgull::hedger hedger{ &loop, { .delay = 1h, .max_hedges = 2 } };
+
+        std::vector<cgull::promise> results;
+        int calls = 0;
+
+        // attempts are fulfilled through the loop, so timers are armed before they win
+        for(int i = 0; i < 10; ++i)
+            results.push_back(hedger([&]{ return cgull::promise{ &loop }.resolve(1); }));
+
+        // timer is re-armed by rejection, then cancelled by win
+        results.push_back(hedger([&]{ return ++calls == 1 ? cgull::promise{ &loop }.reject() : cgull::promise{ &loop }.resolve(2); }));
+
+        WAIT_FOR(1000, [&]{ loop.poll(); return std::all_of(results.begin(), results.end(), [](const auto& r) { return r.is_resolved(); }); });
+
+        for(const auto& r : results)
+            EXPECT_TRUE(r.is_resolved());
+
+        EXPECT_EQ(2, calls);
+    }
+
+    loop.poll();
+
+    CHECK_CGULL_PROMISE_GUTS;
+};
+
+
+TEST(sync, mutex_and_semaphore)
+{
+    cgull::thread_pool_handler pool{ 4 };
+
+    constexpr int count = 200;
+
+    cgull::async_mutex mutex{ &pool };
+    std::atomic<int> inside = 0;
+    std::atomic<int> overlaps = 0;
+    std::atomic<int> done = 0;
+
+    for(int i = 0; i < count; ++i)
+        mutex.lock().then([&]
+        {
+            if(++inside > 1)
+                ++overlaps;
+
+            --inside;
+            ++done;
+
+            mutex.unlock();
+        });
+
+    WAIT_FOR(2000, [&]{ return done == count; });
+
+    EXPECT_EQ(count, done);
+    EXPECT_EQ(0, overlaps);
+    EXPECT_FALSE(mutex.is_locked());
+
+    // in order: acquire(2) at the front isn't bypassed by acquire(1)
+    cgull::async_semaphore semaphore{ 1 };
+
+    auto big = semaphore.acquire(2);
+    auto small = semaphore.acquire(1);
+
+    EXPECT_FALSE(big.fulfillment());
+    EXPECT_FALSE(semaphore.try_acquire());
+
+    semaphore.release();
+
+    EXPECT_TRUE(big.is_resolved());
+    EXPECT_FALSE(small.fulfillment());
+
+    // aborted waiter is skipped
+    auto aborted = semaphore.acquire(1);
+
+    aborted.abort();
+    semaphore.release(2);
+
+    EXPECT_TRUE(small.is_resolved());
+    EXPECT_EQ(1u, semaphore.available());
+};
+
+
+TEST(sync, latch_barrier_event)
+{
+    cgull::event_loop_handler loop;
+
+    // waiters are resumed inside their handler, not by count_down()
+    cgull::async_latch latch{ 2, &loop };
+
+    auto waiter = latch.wait();
+
+    latch.count_down();
+    latch.count_down();
+
+    EXPECT_TRUE(latch.try_wait());
+    EXPECT_FALSE(waiter.fulfillment());
+
+    loop.poll();
+
+    EXPECT_TRUE(waiter.is_resolved());
+
+    auto late = latch.wait();
+
+    loop.poll();
+
+    EXPECT_TRUE(late.is_resolved());
+
+    // barrier is reused by phases
+    cgull::async_barrier barrier{ 3 };
+
+    std::vector<cgull::promise> arrivals;
+
+    for(int i = 0; i < 6; ++i)
+        arrivals.push_back(barrier.arrive_and_wait());
+
+    EXPECT_EQ(2u, barrier.phase());
+
+    for(int i = 0; i < 6; ++i)
+        EXPECT_EQ(uint64_t(i / 3), std::any_cast<uint64_t>(arrivals[i].value()));
+
+    auto left = barrier.arrive_and_wait();
+
+    barrier.arrive_and_drop();
+
+    EXPECT_FALSE(left.fulfillment());
+
+    auto last = barrier.arrive_and_wait();
+
+    EXPECT_TRUE(left.is_resolved());
+    EXPECT_TRUE(last.is_resolved());
+
+    // manual event releases everyone and stays set
+    cgull::async_event manual;
+
+    auto a = manual.wait();
+    auto b = manual.wait();
+
+    manual.set();
+
+    EXPECT_TRUE(a.is_resolved() && b.is_resolved());
+    EXPECT_TRUE(manual.wait().is_resolved());
+
+    manual.reset();
+
+    EXPECT_FALSE(manual.wait().fulfillment());
+
+    // auto event releases one waiter per set
+    cgull::async_event autoreset{ cgull::async_event::auto_reset };
+
+    auto c = autoreset.wait();
+    auto d = autoreset.wait();
+
+    autoreset.set();
+
+    EXPECT_TRUE(c.is_resolved());
+    EXPECT_FALSE(d.fulfillment());
+
+    autoreset.set();
+    autoreset.set();
+
+    EXPECT_TRUE(d.is_resolved());
+    EXPECT_TRUE(autoreset.is_set());
+    EXPECT_TRUE(autoreset.wait().is_resolved());
+    EXPECT_FALSE(autoreset.is_set());
+};
+
+
+// abort queued to handler before hand-off doesn't swallow what was handed over
+TEST(sync, abort_racing_release)
+{
+    cgull::event_loop_handler loop;
+
+    cgull::async_mutex mutex;
+
+    ASSERT_TRUE(mutex.try_lock());
+
+    auto w = mutex.lock(&loop);
+
+    w.abort();
+    mutex.unlock();
+    loop.poll();
+
+    EXPECT_TRUE(w.is_aborted());
+    EXPECT_FALSE(mutex.is_locked());
+    EXPECT_TRUE(mutex.try_lock());
+
+    // ownership goes on to the next waiter
+    auto lost = mutex.lock(&loop);
+    auto next = mutex.lock(&loop);
+
+    lost.abort();
+    mutex.unlock();
+    loop.poll();
+    loop.poll();
+
+    EXPECT_TRUE(next.is_resolved());
+    EXPECT_TRUE(mutex.is_locked());
+
+    cgull::async_semaphore semaphore{ 0 };
+
+    auto s = semaphore.acquire(2, &loop);
+
+    s.abort();
+    semaphore.release(2);
+    loop.poll();
+
+    EXPECT_EQ(2u, semaphore.available());
+
+    cgull::async_event event{ cgull::async_event::auto_reset };
+
+    auto e = event.wait(&loop);
+
+    e.abort();
+    event.set();
+    loop.poll();
+
+    EXPECT_TRUE(event.is_set());
+};
+
+
+TEST(channel, backpressure_and_close)
+{
+    cgull::channel<int> ch{ 2 };
+
+    auto a = ch.send(0);
+    auto b = ch.send(1);
+    auto c = ch.send(2);
+
+    EXPECT_TRUE(a.is_resolved() && b.is_resolved());
+    EXPECT_FALSE(c.fulfillment());
+    EXPECT_EQ(2u, ch.size());
+
+    // receiving frees space for pending sender
+    auto many = ch.receive_many(10);
+
+    ASSERT_TRUE(many.is_resolved());
+    EXPECT_EQ((std::vector<int>{0, 1}), std::any_cast<std::vector<int>>(many.value()));
+    EXPECT_TRUE(c.is_resolved());
+    EXPECT_EQ(2, *ch.try_receive());
+
+    // pending receiver gets the next value
+    auto r = ch.receive();
+
+    EXPECT_FALSE(r.fulfillment());
+
+    int v = 3;
+
+    EXPECT_TRUE(ch.try_send(v));
+    EXPECT_EQ(3, std::any_cast<int>(r.value()));
+
+    // values sent before close are drained, then receivers are rejected
+    ch.send(4);
+    ch.close();
+
+    EXPECT_TRUE(ch.send(5).is_rejected());
+    EXPECT_EQ(4, std::any_cast<int>(ch.receive().value()));
+
+    auto closed = ch.receive();
+
+    ASSERT_TRUE(closed.is_rejected());
+    EXPECT_EQ(typeid(cgull::channel_closed), closed.value().type());
+};
+
+
+TEST(channel, producer_consumer)
+{
+    cgull::thread_pool_handler pool{ 4 };
+
+    constexpr int count = 5000;
+    constexpr size_t capacity = 8;
+
+    cgull::channel<int> ch{ capacity, &pool };
+
+    std::atomic<size_t> max_size = 0;
+    std::atomic<int> received = 0;
+    std::atomic<bool> in_order = true;
+    std::atomic<bool> finished = false;
+
+    std::function<void(int)> produce = [&](int i)
+    {
+        if(i == count)
+            return ch.close();
+
+        ch.send(i).then([&, i]{ produce(i + 1); });
+    };
+
+    std::function<void()> consume = [&]
+    {
+        ch.receive_many(3)
+            .then([&](std::vector<int> values)
+            {
+                for(auto v : values)
+                    if(v != received++)
+                        in_order = false;
+
+                max_size = std::max<size_t>(max_size, ch.size());
+
+                consume();
+            })
+            .rescue([&]{ finished = true; });
+    };
+
+    consume();
+    produce(0);
+
+    WAIT_FOR(5000, [&]{ return finished.load(); });
+
+    EXPECT_TRUE(finished);
+    EXPECT_EQ(count, received);
+    EXPECT_TRUE(in_order);
+    EXPECT_GE(capacity, max_size);
+};
+
+
+// value handed to receiver whose abort was queued goes back to channel
+TEST(channel, abort_racing_send)
+{
+    cgull::event_loop_handler loop;
+
+    cgull::channel<int> ch{ 2 };
+
+    auto r = ch.receive(&loop);
+
+    r.abort();
+    ch.send(5);
+    loop.poll();
+
+    EXPECT_TRUE(r.is_aborted());
+    EXPECT_EQ(1u, ch.size());
+    EXPECT_EQ(5, ch.try_receive());
+
+    // value goes behind buffered ones, but before pending sender
+    auto many = ch.receive_many(2, &loop);
+
+    many.abort();
+    ch.send(1);
+    ch.send(2);
+    ch.send(3);
+
+    auto pending = ch.send(4);
+
+    loop.poll();
+
+    EXPECT_FALSE(pending.fulfillment());
+
+    for(const auto expected : { 2, 3, 1, 4 })
+        EXPECT_EQ(expected, ch.try_receive());
+
+    EXPECT_TRUE(pending.is_resolved());
+};
+
+
+TEST(stream, operators)
+{
+    int produced = 0;
+
+    cgull::async_stream<int> numbers{
+        [&](size_t max)
+        {
+            std::vector<int> chunk;
+
+            for(int& i = produced; chunk.size() < max && i < 100; ++i)
+                chunk.push_back(i);
+
+            return chunk.empty() ? cgull::promise{}.resolve() : cgull::promise{}.resolve(std::any{std::move(chunk)});
+        },
+        10
+    };
+
+    auto result = numbers
+        .filter([](int v){ return v % 2 == 0; })
+        .map([](int v){ return std::to_string(v); })
+        .take(7)
+        .collect();
+
+    ASSERT_TRUE(result.is_resolved());
+    EXPECT_EQ((std::vector<std::string>{"0", "2", "4", "6", "8", "10", "12"}), std::any_cast<std::vector<std::string>>(result.value()));
+    // take() doesn't pull more than it needs
+    EXPECT_EQ(13, produced);
+
+    auto s = cgull::async_stream<int>::from({ 1, 2, 3, 4, 5 }, 2);
+
+    EXPECT_EQ(1, std::any_cast<std::optional<int>>(s.next().value()));
+    EXPECT_EQ((std::vector<int>{2}), std::any_cast<std::vector<int>>(s.next_chunk(10).value()));
+    EXPECT_EQ((std::vector<int>{3, 4, 5}), std::any_cast<std::vector<int>>(s.next_chunk(10).value()));
+    EXPECT_FALSE(std::any_cast<std::optional<int>>(s.next().value()));
+    EXPECT_TRUE(s.is_over());
+
+    auto buffered = cgull::async_stream<int>::from({ 1, 2, 3, 4, 5, 6, 7 }, 1).buffer(3).collect();
+
+    EXPECT_EQ((std::vector<int>{1, 2, 3, 4, 5, 6, 7}), std::any_cast<std::vector<int>>(buffered.value()));
+};
+
+
+TEST(stream, async_source)
+{
+    std::vector<cgull::promise> pages;
+
+    cgull::async_stream<int> paged{ [&](size_t) { return pages.emplace_back(); } };
+
+    int sum = 0;
+
+    auto done = paged.for_each([&](int v){ sum += v; });
+
+    ASSERT_EQ(1u, pages.size());
+
+    pages[0].resolve(std::any{std::vector<int>{ 1, 2 }});
+
+    EXPECT_EQ(3, sum);
+    ASSERT_EQ(2u, pages.size());
+
+    // empty pages aren't the end
+    pages[1].resolve(std::any{std::vector<int>{}});
+    ASSERT_EQ(3u, pages.size());
+
+    pages[2].reject(std::string{"broken"});
+
+    ASSERT_TRUE(done.is_rejected());
+    EXPECT_EQ("broken", std::any_cast<std::string>(done.value()));
+};
+
+
+TEST(stream, generator)
+{
+    auto counter = [](int n, cgull::promise gate) -> cgull::async_generator<int>
+    {
+        for(int i = 0; i < n; ++i)
+        {
+            if(i == n / 2)
+                co_await gate;
+
+            co_yield i;
+        };
+    };
+
+    cgull::promise gate;
+    std::vector<int> got;
+
+    auto done = counter(10, gate).stream(4).for_each([&](int v){ got.push_back(v); });
+
+    // values yielded before await are delivered right away
+    EXPECT_EQ((std::vector<int>{0, 1, 2, 3, 4}), got);
+    EXPECT_FALSE(done.fulfillment());
+
+    gate.resolve();
+
+    EXPECT_TRUE(done.is_resolved());
+    EXPECT_EQ(10u, got.size());
+
+    // rejection of awaited promise is thrown inside generator
+    auto failing = [](cgull::promise p) -> cgull::async_generator<int>
+    {
+        co_yield 1;
+
+        int error = 0;
+
+        try
+        {
+            co_await p;
+        }
+        catch(const std::any& e)
+        {
+            error = std::any_cast<int>(e);
+        };
+
+        co_yield error;
+
+        throw std::runtime_error("done");
+    };
+
+    cgull::async_stream<int> failed = failing(cgull::promise{}.reject(2));
+
+    auto all = failed.collect();
+
+    EXPECT_TRUE(all.is_rejected());
+
+    failed = failing(cgull::promise{}.reject(3));
+
+    EXPECT_EQ(1, std::any_cast<std::optional<int>>(failed.next().value()));
+    EXPECT_EQ(3, std::any_cast<std::optional<int>>(failed.next().value()));
+    EXPECT_TRUE(failed.next().is_rejected());
+};
+
+
+TEST(task_graph, dependencies)
+{
+    cgull::thread_pool_handler pool{ 4 };
+    cgull::task_graph graph;
+
+    // layered graph, every node depends on a few nodes of previous layer
+    constexpr size_t layers = 50;
+    constexpr size_t width = 200;
+
+    std::vector<std::atomic<int>> done(layers * width);
+    std::vector<std::vector<size_t>> predecessors(layers * width);
+    std::atomic<int> violations = 0;
+
+    for(size_t i = 0; i < layers * width; ++i)
+        graph.add_node([&, i]
+        {
+            for(auto p : predecessors[i])
+                if(!done[p].load())
+                    ++violations;
+
+            ++done[i];
+        });
+
+    for(size_t l = 1; l < layers; ++l)
+        for(size_t w = 0; w < width; ++w)
+            for(size_t k : { w, (w * 7 + l) % width, (w + 1) % width })
+            {
+                const auto from = (l - 1) * width + k;
+                const auto to = l * width + w;
+
+                predecessors[to].push_back(from);
+                graph.add_edge(cgull::task_graph::node_id(from), cgull::task_graph::node_id(to));
+            };
+
+    // graph is reused, runs only reset counters
+    for(int run = 1; run <= 3; ++run)
+    {
+        if(run > 1)
+            for(auto& d : done)
+                d = 0;
+
+        auto result = graph.run(pool);
+
+        WAIT_FOR(5000, [&]{ return result.fulfillment() >= cgull::resolved; });
+
+        ASSERT_TRUE(result.is_resolved());
+        EXPECT_EQ(0, violations);
+        EXPECT_TRUE(std::all_of(done.begin(), done.end(), [](auto& d){ return d == 1; }));
+        EXPECT_FALSE(graph.is_running());
+    };
+};
+
+
+TEST(task_graph, failures_and_async)
+{
+    cgull::thread_pool_handler pool{ 2 };
+
+    // async node is done when its promise is
+    cgull::promise fetched{ &pool };
+    std::atomic<bool> linked = false;
+
+    cgull::task_graph graph;
+
+    const auto fetch = graph.add_node([&]{ return fetched; });
+    const auto link = graph.add_node([&]{ linked = true; });
+
+    graph.add_edge(fetch, link);
+
+    auto result = graph.run(pool);
+
+    // only one run at a time
+    auto again = graph.run(pool);
+
+    WAIT_FOR(1000, [&]{ return again.fulfillment() >= cgull::resolved; });
+
+    EXPECT_TRUE(again.is_rejected());
+
+    EXPECT_FALSE(linked);
+
+    fetched.resolve();
+
+    WAIT_FOR(1000, [&]{ return result.fulfillment() >= cgull::resolved; });
+
+    EXPECT_TRUE(result.is_resolved());
+    EXPECT_TRUE(linked);
+
+    // failed node skips its successors
+    cgull::task_graph failing;
+    std::atomic<bool> skipped = true;
+
+    const auto bad = failing.add_node([]{ throw std::runtime_error("bad"); });
+    const auto after = failing.add_node([&]{ skipped = false; });
+
+    failing.add_edge(bad, after);
+
+    auto failed = failing.run(pool);
+
+    WAIT_FOR(1000, [&]{ return failed.fulfillment() >= cgull::resolved; });
+
+    EXPECT_TRUE(failed.is_rejected());
+    EXPECT_TRUE(skipped);
+
+    // cycle
+    failing.add_edge(after, bad);
+
+    auto cycle = failing.run(pool);
+
+    WAIT_FOR(1000, [&]{ return cycle.fulfillment() >= cgull::resolved; });
+
+    EXPECT_TRUE(cycle.is_rejected());
+};
+
+
+#if defined(CGULL_PROFILE)
+TEST(profiler, critical_path)
+{
+    using namespace std::chrono_literals;
+
+    auto& prof = cgull::profiler::instance();
+
+    prof.clear();
+
+    // returned promise is the last to come
+    cgull::promise first, returned;
+
+    auto returning = first.then([&]{ return returned; });
+    auto last = returning.then([]{ std::this_thread::sleep_for(2ms); });
+
+    first.resolve();
+    returned.resolve();
+
+    ASSERT_TRUE(last.is_resolved());
+
+    auto records = prof.snapshot();
+    auto path = cgull::profiler::critical_path(records, last.profile_id());
+
+    ASSERT_EQ(path.size(), 3u);
+    EXPECT_EQ(path[0].id, returned.profile_id());
+    EXPECT_EQ(path[1].id, returning.profile_id());
+    EXPECT_EQ(path[2].id, last.profile_id());
+
+    const auto stages = cgull::profiler::stages(records);
+
+    EXPECT_EQ(stages.settle.count(), records.size());
+    EXPECT_EQ(stages.run.count(), 2u);
+    EXPECT_GE(stages.run.max(), uint64_t(2'000'000));
+    EXPECT_GE(stages.run.percentile(1.0), stages.run.percentile(0.0));
+
+    // returned promise is ready before callback, so the source is on the path; timeout
+    // waits for the first of source and timer
+    prof.clear();
+
+    cgull::event_loop_handler loop;
+    cgull::promise source, returned2;
+
+    auto limited = source.timeout(10s, &loop);
+    auto last2 = limited.then([&]{ return returned2; }).then([]{});
+
+    returned2.resolve();
+    source.resolve();
+
+    WAIT_FOR(1000, [&]{ loop.poll(); return !!last2.fulfillment(); });
+
+    ASSERT_TRUE(last2.is_resolved());
+
+    path = cgull::profiler::critical_path(prof.snapshot(), last2.profile_id());
+
+    ASSERT_EQ(path.size(), 4u);
+    EXPECT_EQ(path[0].id, source.profile_id());
+    EXPECT_EQ(path[1].id, limited.profile_id());
+    EXPECT_EQ(path[3].id, last2.profile_id());
+
+    // collection can be switched off at runtime
+    prof.clear();
+    prof.enable(false);
+
+    cgull::promise{}.resolve();
+
+    EXPECT_TRUE(prof.snapshot().empty());
+
+    prof.enable(true);
+};
+#endif
+
+
+#if defined(CGULL_PROFILE)
+TEST(profiler, chrome_trace)
+{
+    auto& prof = cgull::profiler::instance();
+
+    prof.clear();
+
+    std::stringstream out;
+
+    {
+        cgull::chrome_trace trace{ out };
+
+        trace.start(std::chrono::milliseconds{ 1 });
+
+        cgull::thread_pool_handler pool{ 2 };
+        cgull::promise root{ &pool };
+        std::atomic<bool> done = false;
+
+        root
+            .then([]{ return 1; })
+            .then([&](int){ done = true; });
+
+        root.resolve();
+
+        WAIT_FOR(1000, [&]{ return done.load(); });
+
+        trace.stop();
+    };
+
+    const auto json = out.str();
+
+    EXPECT_EQ(json.rfind("{\"displayTimeUnit\"", 0), 0u);
+    EXPECT_NE(json.find("\"ph\":\"b\""), std::string::npos);
+    EXPECT_NE(json.find("\"name\":\"callback\""), std::string::npos);
+    EXPECT_NE(json.find("\"ph\":\"s\""), std::string::npos);
+    EXPECT_NE(json.find("\"ph\":\"f\""), std::string::npos);
+    EXPECT_EQ(json.substr(json.size() - 3), "]}\n");
+
+    // pool's last record may come after trace has stopped
+    prof.clear();
+
+    // sampling keeps whole chains
+    prof.set_sampling(2);
+
+    for(int i = 0; i < 4; ++i)
+    {
+        cgull::promise root;
+
+        root.then([]{}).then([]{});
+        root.resolve();
+    };
+
+    prof.set_sampling(1);
+
+    const auto records = prof.drain();
+
+    EXPECT_EQ(records.size(), 6u);
+
+    for(const auto& r : records)
+    {
+        if(r.cause)
+        {
+            EXPECT_NE(std::find_if(records.begin(), records.end(), [&](const auto& c) { return c.id == r.cause; }), records.end());
+        };
+    };
+};
+#endif
+
+
+#if defined(CGULL_DEBUG_GUTS)
+TEST(registry, stalled_promises)
+{
+    using namespace std::chrono_literals;
+
+    auto& registry = cgull::promise_registry::instance();
+
+    const auto before = registry.size();
+    const auto line = std::source_location::current().line();
+
+    cgull::promise pending;
+    auto chained = pending.then([]{});
+
+    EXPECT_EQ(registry.size(), before + 2);
+
+    const auto stalled = registry.stalled(0ns);
+    const auto here = [&](const cgull::live_promise& p, uint_least32_t l)
+    {
+        return p.site.line() == l && std::string_view{ p.site.file_name() } == std::source_location::current().file_name();
+    };
+
+    // creation site of constructor and of then()
+    EXPECT_TRUE(std::any_of(stalled.begin(), stalled.end(), [&](const auto& p) { return here(p, line + 2); }));
+    EXPECT_TRUE(std::any_of(stalled.begin(), stalled.end(), [&](const auto& p) { return here(p, line + 3) && p.wait == cgull::last_bound; }));
+
+    // watchdog reports promises pending longer than threshold
+    std::atomic<int> reports = 0;
+
+    registry.start_watchdog(1ms, 0ns, [&](const auto& s)
+    {
+        if(std::any_of(s.begin(), s.end(), [&](const auto& p) { return here(p, line + 2); }))
+            ++reports;
+    });
+
+    WAIT_FOR(1000, [&]{ return reports > 0; });
+
+    registry.stop_watchdog();
+
+    EXPECT_GT(reports, 0);
+
+    pending.resolve();
+
+    const auto after = registry.stalled(0ns);
+
+    EXPECT_FALSE(std::any_of(after.begin(), after.end(), [&](const auto& p) { return here(p, line + 2) || here(p, line + 3); }));
+
+    {
+        const auto snapshot = registry.snapshot();
+
+        EXPECT_TRUE(std::any_of(snapshot.begin(), snapshot.end(), [&](const auto& p) { return here(p, line + 2) && p.state == cgull::resolved; }));
+    };
+
+    pending = cgull::promise{};
+    chained = cgull::promise{};
+
+    EXPECT_EQ(registry.size(), before + 2);
+};
+#endif
+
+
+#if defined(CGULL_METRICS)
+TEST(metrics, counters_and_export)
+{
+    auto& m = cgull::metrics::instance();
+
+    const auto created = m.value(cgull::metrics::promises_created);
+    const auto resolved = m.value(cgull::metrics::promises_resolved);
+    const auto rejected = m.value(cgull::metrics::promises_rejected);
+    const auto continuations = m.value(cgull::metrics::continuations_run);
+    const auto destroyed = m.value(cgull::metrics::promises_destroyed);
+
+    {
+        cgull::promise a;
+        cgull::promise b;
+        auto c = a.then([]{});
+
+        a.resolve();
+        b.reject();
+    };
+
+    EXPECT_EQ(m.value(cgull::metrics::promises_created), created + 3);
+    EXPECT_EQ(m.value(cgull::metrics::promises_resolved), resolved + 2);
+    EXPECT_EQ(m.value(cgull::metrics::promises_rejected), rejected + 1);
+    EXPECT_EQ(m.value(cgull::metrics::continuations_run), continuations + 1);
+    EXPECT_EQ(m.value(cgull::metrics::promises_destroyed), destroyed + 3);
+
+    // operations of handler are counted in its slot
+    {
+        cgull::thread_pool_handler pool{ 2 };
+        std::atomic<int> done = 0;
+
+        const auto slot = pool.metrics_slot();
+
+        EXPECT_NE(slot, 0u);
+
+        m.set_handler_name(slot, "test_pool");
+
+        for(int i = 0; i < 10; ++i)
+            pool.post([&]{ ++done; });
+
+        WAIT_FOR(1000, [&]{ return done == 10; });
+        WAIT_FOR(1000, [&]{ return m.value(slot, cgull::metrics::operations_run) == 10; });
+
+        EXPECT_EQ(m.value(slot, cgull::metrics::operations_enqueued), 10u);
+        EXPECT_EQ(m.value(slot, cgull::metrics::operations_run), 10u);
+
+        const auto text = m.prometheus();
+
+        EXPECT_NE(text.find("cgull_handler_operations_run_total{handler=\"test_pool\"} 10\n"), std::string::npos);
+        EXPECT_NE(text.find("cgull_handler_queue_depth{handler=\"test_pool\"} 0\n"), std::string::npos);
+        EXPECT_NE(text.find("# TYPE cgull_promises_created_total counter\n"), std::string::npos);
+        EXPECT_NE(text.find("cgull_continuation_latency_seconds_count"), std::string::npos);
+    };
+
+    const auto path = std::string{ "/tmp/cgull_metrics_" } + std::to_string(getpid()) + ".prom";
+
+    ASSERT_TRUE(m.write_prometheus(path));
+
+    {
+        std::string text(1 << 16, '\0');
+
+        const auto fd = open(path.c_str(), O_RDONLY);
+
+        ASSERT_GE(fd, 0);
+
+        text.resize(std::max<ssize_t>(read(fd, text.data(), text.size()), 0));
+        close(fd);
+        unlink(path.c_str());
+
+        EXPECT_NE(text.find("cgull_promises_live "), std::string::npos);
+    };
+
+#if defined(CGULL_METRICS_UNIX_SOCKET)
+    const auto socket_path = std::string{ "/tmp/cgull_metrics_" } + std::to_string(getpid()) + ".sock";
+
+    ASSERT_TRUE(m.serve(socket_path));
+
+    {
+        const auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+        ASSERT_EQ(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+
+        const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+
+        EXPECT_EQ(write(fd, request, sizeof(request) - 1), ssize_t(sizeof(request) - 1));
+
+        std::string answer;
+        char buffer[4096];
+
+        for(ssize_t n; (n = read(fd, buffer, sizeof(buffer))) > 0;)
+            answer.append(buffer, n);
+
+        close(fd);
+
+        EXPECT_EQ(answer.rfind("HTTP/1.0 200 OK\r\n", 0), 0u);
+        EXPECT_NE(answer.find("cgull_promises_created_total "), std::string::npos);
+    };
+
+    m.stop_serving();
+#endif
+};
+#endif
+
+
+TEST(trace_log, threads_and_dump)
+{
+    auto& log = cgull::trace_log::instance();
+
+    (void)log.drain();
+
+    enum class color { red = 3 };
+
+    cgull::trace_log::write("plain {} {} {} {}", -1, 2u, 0.5, true);
+    cgull::trace_log::write("more {} {} {}", "text", color::red, std::string{ "opaque" });
+    cgull::trace_log::write("no args {}");
+
+    {
+        std::vector<std::thread> threads;
+
+        for(int t = 0; t < 4; ++t)
+            threads.emplace_back([t]
+            {
+                for(int i = 0; i < 100; ++i)
+                    cgull::trace_log::write("thread {} line {}", t, i);
+            });
+
+        for(auto& t : threads)
+            t.join();
+    };
+
+    // records of exited threads are kept until drained
+    const auto records = log.drain();
+
+    EXPECT_EQ(records.size(), 403u);
+    EXPECT_TRUE(std::is_sorted(records.begin(), records.end(), [](const auto& a, const auto& b) { return a.time < b.time; }));
+
+    std::stringstream out;
+
+    for(size_t i = 0; i < 3; ++i)
+        cgull::trace_log::format(out, records[i]);
+
+    const auto text = out.str();
+
+    EXPECT_NE(text.find("plain -1 2 0.5 true\n"), std::string::npos);
+    EXPECT_NE(text.find("more text 3 <?>\n"), std::string::npos);
+    EXPECT_NE(text.find("no args {}\n"), std::string::npos);
+
+    // background formatter
+    std::stringstream background;
+
+    log.start(background, std::chrono::milliseconds{ 1 });
+
+    cgull::trace_log::write("background {}", 1);
+    CGULL_LOG("site {}", 2);
+
+    log.stop();
+
+    EXPECT_NE(background.str().find("background 1\n"), std::string::npos);
+#if defined(CGULL_TRACE_LOG)
+    EXPECT_NE(background.str().find("site 2\n"), std::string::npos);
+#else
+    EXPECT_EQ(background.str().find("site 2\n"), std::string::npos);
+#endif
+
+    // full ring drops instead of blocking
+    log.enable(false);
+    cgull::trace_log::write("disabled");
+    log.enable(true);
+
+    const auto dropped = log.dropped();
+
+    for(size_t i = 0; i < cgull::trace_log::ring_capacity + 10; ++i)
+        cgull::trace_log::write("overflow {}", i);
+
+    EXPECT_EQ(log.dropped(), dropped + 10);
+    EXPECT_EQ(log.dump(out), cgull::trace_log::ring_capacity);
+};
+
+
+#if defined(CGULL_MEMORY_ACCOUNTING)
+TEST(memory_accounting, handlers_tags_and_limits)
+{
+    using accounting = cgull::memory_accounting;
+
+    auto& m = accounting::instance();
+
+    const auto before = m.total().bytes;
+    const auto tag = m.register_tag("chain");
+
+    ASSERT_NE(tag, 0u);
+    EXPECT_EQ(m.tag_name(tag), "chain");
+
+    std::vector<accounting::limit_event> events;
+
+    m.on_soft_limit([&](const auto& e) { events.push_back(e); });
+    m.set_tag_soft_limit(tag, 3 * sizeof(cgull::promise_private));
+
+    {
+        cgull::thread_pool_handler pool{ 1 };
+
+        cgull::promise root{ &pool };
+
+        EXPECT_GE(m.of_handler(pool.memory_slot()).bytes, int64_t(sizeof(cgull::promise_private)));
+
+        cgull::promise tagged;
+
+        {
+            accounting::tag_scope scope{ tag };
+
+            tagged = cgull::promise{};
+        };
+
+        EXPECT_EQ(m.of_tag(tag).bytes, int64_t(sizeof(cgull::promise_private)));
+
+        // chained promises are accounted to tag of the chain with their captures
+        std::array<char, 100> capture{};
+
+        auto chained = tagged
+            .then([capture]{ return int(capture.size()); })
+            .then([](int){});
+
+        EXPECT_GE(m.of_tag(tag).bytes, int64_t(3 * sizeof(cgull::promise_private) + sizeof(capture)));
+        EXPECT_GE(m.of(accounting::finishers).bytes, int64_t(sizeof(capture)));
+
+        ASSERT_EQ(events.size(), 1u);
+        EXPECT_EQ(events[0].kind, accounting::tag_limit);
+        EXPECT_EQ(events[0].index, tag);
+
+        tagged.resolve();
+
+        // finishers are released when they run, only promises are left
+        EXPECT_EQ(m.of_tag(tag).bytes % int64_t(sizeof(cgull::promise_private)), 0);
+
+        // results of waiting for many inners
+        cgull::promise a, b;
+        cgull::promise_private::type both{ new cgull::promise_private{} };
+
+        for(const auto& inner : { a, b })
+        {
+            both->local_bind_inner(cgull::guts::private_of(inner), cgull::all);
+            cgull::guts::private_of(inner)->bind_outer(both);
+        };
+
+        a.resolve(1);
+        b.resolve(2);
+
+        EXPECT_EQ(both->fulfillment(), cgull::resolved);
+
+        EXPECT_GE(m.of(accounting::results).bytes, int64_t(2 * sizeof(std::any)));
+    };
+
+    EXPECT_EQ(m.of_tag(tag).bytes, 0);
+    EXPECT_GE(m.of_tag(tag).high_water, int64_t(3 * sizeof(cgull::promise_private) + 100));
+    EXPECT_EQ(m.total().bytes, before);
+
+    m.reset_high_water();
+
+    EXPECT_EQ(m.of_tag(tag).high_water, 0);
+
+    // limit is armed again after usage dropped below it
+    {
+        accounting::tag_scope scope{ tag };
+
+        std::vector<cgull::promise> promises(3);
+
+        EXPECT_EQ(events.size(), 2u);
+    };
+
+    m.on_soft_limit(nullptr);
+    m.set_tag_soft_limit(tag, 0);
+};
+#endif
+
+
+TEST(strand, serialized_fifo_on_shared_pool)
+{
+    constexpr int strands_count = 1000;
+    constexpr int tasks = 50;
+
+    cgull::thread_pool_handler pool{ 4 };
+
+    struct state
+    {
+        std::unique_ptr<cgull::strand> s;
+        std::atomic<int>    inside = 0;
+        bool                overlapped = false;
+        bool                unordered = false;
+        int                 next = 0;
+        //! Last task of each producer.
+        int                 last[2] = { -1, -1 };
+    };
+
+    std::vector<state> states(strands_count);
+    std::atomic<int> done = 0;
+
+    for(auto& st : states)
+        st.s = std::make_unique<cgull::strand>(pool);
+
+    // several producers per strand: each keeps its own order
+    std::vector<std::thread> producers;
+
+    for(int p = 0; p < 2; ++p)
+        producers.emplace_back([&, p]
+        {
+            for(int i = 0; i < tasks; ++i)
+                for(int n = 0; n < strands_count; ++n)
+                {
+                    auto& st = states[n];
+
+                    st.s->post([&st, &done, p, i]
+                    {
+                        if(st.inside.fetch_add(1) != 0)
+                            st.overlapped = true;
+
+                        EXPECT_TRUE(st.s->running_in_this_thread());
+
+                        if(st.last[p] >= i)
+                            st.unordered = true;
+
+                        st.last[p] = i;
+                        ++st.next;
+
+                        st.inside.fetch_sub(1);
+                        ++done;
+                    });
+                };
+        });
+
+    for(auto& p : producers)
+        p.join();
+
+    WAIT_FOR(5000, [&]{ return done == 2 * tasks * strands_count; });
+
+    EXPECT_EQ(done, 2 * tasks * strands_count);
+
+    for(const auto& st : states)
+    {
+        EXPECT_FALSE(st.overlapped);
+        EXPECT_FALSE(st.unordered);
+        EXPECT_EQ(st.next, 2 * tasks);
+    };
+
+    // continuations bound to strand run inside it
+    cgull::strand s{ pool };
+    cgull::promise root;
+    std::vector<int> order;
+    std::atomic<bool> finished = false;
+
+    auto chain = root.then(&s, [&]{ EXPECT_TRUE(s.running_in_this_thread()); order.push_back(1); return 2; });
+
+    for(int i = 0; i < 10; ++i)
+        chain = chain.then([&, i](int v) { order.push_back(v + i); return v; });
+
+    chain.then([&](int) { finished = true; });
+
+    root.resolve();
+
+    WAIT_FOR(1000, [&]{ return finished.load(); });
+
+    ASSERT_TRUE(finished);
+    ASSERT_EQ(order.size(), 11u);
+    EXPECT_EQ(order[10], 11);
+
+    EXPECT_FALSE(s.running_in_this_thread());
+};
+
+
+TEST(thread_pool_handler, priorities)
+{
+    cgull::thread_pool_handler pool{ 1 };
+
+    // chains inherit priority, promises created by continuations take it too
+    {
+        cgull::promise root;
+
+        root.set_priority(cgull::high_priority);
+
+        cgull::priority_t created = cgull::low_priority;
+
+        auto chained = root.then([&]
+        {
+            created = cgull::promise{}.priority();
+        });
+
+        EXPECT_EQ(chained.priority(), cgull::high_priority);
+
+        root.resolve();
+
+        EXPECT_EQ(created, cgull::high_priority);
+        EXPECT_EQ(cgull::promise{}.priority(), cgull::normal_priority);
+
+        cgull::priority_scope scope{ cgull::critical_priority };
+
+        EXPECT_EQ(cgull::promise{}.priority(), cgull::critical_priority);
+    };
+
+    // busy worker takes high priority first without starving low priority
+    std::mutex gate;
+    std::vector<int> order;
+    std::atomic<int> done = 0;
+
+    std::unique_lock hold{ gate };
+    std::atomic<bool> gated = false;
+
+    // worker must be held before anything is queued, so everything is picked by priority
+    pool.post([&]{ gated = true; std::lock_guard lock{ gate }; });
+
+    WAIT_FOR(1000, [&]{ return gated.load(); });
+
+    constexpr int count = 100;
+
+    for(int i = 0; i < count; ++i)
+    {
+        {
+            cgull::priority_scope scope{ cgull::low_priority };
+
+            pool.post([&, i]{ order.push_back(-i - 1); ++done; });
+        };
+
+        cgull::priority_scope scope{ cgull::high_priority };
+
+        pool.post([&, i]{ order.push_back(i + 1); ++done; });
+    };
+
+    hold.unlock();
+
+    WAIT_FOR(2000, [&]{ return done == 2 * count; });
+
+    ASSERT_EQ(order.size(), size_t(2 * count));
+
+    const auto first_low = std::find_if(order.begin(), order.end(), [](int v) { return v < 0; }) - order.begin();
+
+    EXPECT_EQ(first_low, ptrdiff_t(cgull::thread_pool_handler::starvation_limit));
+    EXPECT_EQ(order[first_low], -1);
+    EXPECT_TRUE(std::is_sorted(order.begin(), order.begin() + first_low));
+
+    // high priority chain with continuations in pool
+    std::atomic<bool> high_done = false;
+    std::atomic<int> lows = 0;
+    int lows_before_chain = -1;
+
+    hold.lock();
+    gated = false;
+
+    pool.post([&]{ gated = true; std::lock_guard lock{ gate }; });
+
+    WAIT_FOR(1000, [&]{ return gated.load(); });
+
+    for(int i = 0; i < count; ++i)
+    {
+        cgull::priority_scope scope{ cgull::low_priority };
+
+        pool.post([&]{ ++lows; });
+    };
+
+    cgull::promise root{ &pool };
+
+    root.set_priority(cgull::high_priority)
+        .then([]{})
+        .then([&]{ lows_before_chain = lows; high_done = true; });
+
+    root.resolve();
+
+    hold.unlock();
+
+    WAIT_FOR(2000, [&]{ return high_done.load(); });
+
+    ASSERT_TRUE(high_done);
+    EXPECT_LT(lows_before_chain, count / 2);
+
+    WAIT_FOR(2000, [&]{ return lows == count; });
+};
+
+
+#if defined(CGULL_OS_LINUX)
+TEST(numa_pool_handler, topology_routing_and_stealing)
+{
+    EXPECT_EQ(cgull::numa_topology::parse_cpu_list("0-3,8,10-11\n"), (std::vector<int>{ 0, 1, 2, 3, 8, 10, 11 }));
+    EXPECT_EQ(cgull::numa_topology::parse_cpu_list("x,5,7-"), std::vector<int>{ 5 });
+    EXPECT_TRUE(cgull::numa_topology::parse_cpu_list("").empty());
+
+    const auto detected = cgull::numa_topology::detect();
+
+    ASSERT_FALSE(detected.nodes.empty());
+
+    for(const auto& n : detected.nodes)
+        EXPECT_FALSE(n.cpus.empty());
+
+    // two fake nodes on CPU 0, so the test doesn't depend on the machine
+    cgull::numa_pool_handler pool{ { { { 3, { 0 } }, { 7, { 0 } } } }, 2, false };
+
+    ASSERT_EQ(pool.size(), 4u);
+    ASSERT_EQ(pool.node_count(), 2u);
+    EXPECT_EQ(pool.node_index(7), 1u);
+
+    // block lives on node of worker which allocated it, continuations run there
+    constexpr size_t count = 64;
+
+    std::vector<cgull::promise_private::type> block;
+    std::atomic<bool> allocated = false;
+    size_t home = 0;
+
+    pool.post_to_node(1, [&]
+    {
+        // idle worker of node 0 takes the task if node 1 hasn't started yet
+        home = pool.node_of_worker(size_t(pool.current_worker()));
+
+        EXPECT_EQ(cgull::promise_private::thread_node(), pool.node_id(home));
+
+        block = cgull::promise_private::allocate_block(count, &pool, pool.allocator());
+        allocated = true;
+    });
+
+    WAIT_FOR(1000, [&]{ return allocated.load(); });
+
+    ASSERT_EQ(block.size(), count);
+
+    std::atomic<size_t> on_home = 0;
+    std::atomic<size_t> done = 0;
+    std::vector<cgull::promise> promises;
+
+    for(auto& p : block)
+    {
+        EXPECT_EQ(p->home_node(), pool.node_id(home));
+        EXPECT_EQ(pool.node_of_worker(pool.worker_of(p.data())), home);
+
+        promises.emplace_back(p);
+        promises.back().then([&](int)
+        {
+            const auto w = pool.current_worker();
+
+            on_home += w >= 0 && pool.node_of_worker(size_t(w)) == home;
+            ++done;
+        });
+    };
+
+    block.clear();
+
+    for(auto& p : promises)
+        p.resolve(1);
+
+    WAIT_FOR(2000, [&]{ return done == count; });
+
+    EXPECT_EQ(on_home, count);
+
+    promises.clear();
+
+    // both workers of node 0 are busy, so its task is stolen by node 1
+    std::atomic<size_t> busy = 0;
+    std::atomic<bool> release = false;
+    std::atomic<ptrdiff_t> thief = -1;
+
+    for(int tries = 0; busy < 2 && tries < 1000; ++tries)
+    {
+        // only node 0 workers block, task taken by node 1 is posted again
+        std::atomic<bool> ran = false;
+
+        pool.post_to_node(0, [&]
+        {
+            const auto on_zero = pool.node_of_worker(size_t(pool.current_worker())) == 0;
+
+            busy += on_zero;
+            ran = true;
+
+            if(on_zero)
+                WAIT_FOR(5000, [&]{ return release.load(); });
+        });
+
+        WAIT_FOR(1000, [&]{ return ran.load(); });
+    };
+
+    ASSERT_EQ(busy, 2u);
+
+    pool.post_to_node(0, [&]{ thief = pool.current_worker(); });
+
+    WAIT_FOR(1000, [&]{ return thief >= 0; });
+
+    release = true;
+
+    ASSERT_GE(thief, 0);
+    EXPECT_GE(pool.stolen(), 1u);
+    EXPECT_EQ(pool.node_of_worker(size_t(thief.load())), 1u);
+};
+
+// blocks keep node pools alive after the handler is gone
+TEST(numa_pool_handler, block_outlives_pool)
+{
+    std::vector<cgull::promise> promises;
+
+    {
+        cgull::numa_pool_handler pool{ { { { 0, { 0 } } } }, 1, false };
+
+        for(auto& p : cgull::promise_private::allocate_block(8, nullptr, pool.allocator()))
+            promises.emplace_back(p);
+    };
+
+    for(auto& p : promises)
+        EXPECT_EQ(1, std::any_cast<int>(p.resolve(1).value()));
+
+    promises.clear();
+};
+#endif
+
+
+TEST(promise, blocking_wait_and_get)
+{
+    EXPECT_EQ(cgull::promise{}.resolve(1).get<int>(), 1);
+    EXPECT_THROW(cgull::promise{}.reject(std::any{std::make_exception_ptr(std::logic_error("x"))}).get(), std::logic_error);
+    EXPECT_THROW(cgull::promise{}.reject(2).get(), std::any);
+    EXPECT_THROW(cgull::promise{}.abort().get(), cgull::promise_aborted);
+
+    const auto started = std::chrono::steady_clock::now();
+
+    EXPECT_FALSE(cgull::promise{}.wait_for(std::chrono::milliseconds{ 20 }));
+    EXPECT_GE(std::chrono::steady_clock::now() - started, std::chrono::milliseconds{ 20 });
+
+    cgull::thread_pool_handler pool{ 2 };
+
+    // continuation fulfilled on pool while several threads sleep on it
+    for(int round = 0; round < 100; ++round)
+    {
+        cgull::promise root{ &pool };
+        const auto chained = root.then([](int v) { return v + 1; });
+
+        std::atomic<int> woken = 0;
+        std::vector<std::thread> waiters;
+
+        for(int i = 0; i < 4; ++i)
+            waiters.emplace_back([&]
+            {
+                if(chained.get<int>() == round + 1)
+                    ++woken;
+            });
+
+        if(round % 2)
+            std::this_thread::sleep_for(std::chrono::microseconds{ 200 });
+
+        root.resolve(round);
+
+        EXPECT_EQ(chained.wait(), cgull::resolved);
+        EXPECT_TRUE(chained.wait_for(std::chrono::seconds{ 0 }));
+
+        for(auto& t : waiters)
+            t.join();
+
+        ASSERT_EQ(woken, 4);
+    };
+};
+
+
+#if defined(CGULL_TESTS_LIBUV)
+#include <cgull/uv_handler.h>
+
+
+TEST(uv_handler, fs_round_trip)
+{
+    uv_loop_t loop;
+
+    ASSERT_EQ(0, uv_loop_init(&loop));
+
+    char path[] = "/tmp/cgull_uv_XXXXXX";
+    const int tmp = mkstemp(path);
+
+    ASSERT_LE(0, tmp);
+    close(tmp);
+
+    {
+        cgull::uv_handler h{ &loop };
+
+        uv_fs_t req;
+        std::string data = "cgull";
+        std::string read_back(data.size(), '\0');
+        uv_buf_t write_buf = uv_buf_init(data.data(), unsigned(data.size()));
+        uv_buf_t read_buf = uv_buf_init(read_back.data(), unsigned(read_back.size()));
+        uv_file fd = -1;
+        bool done = false;
+
+        cgull::uv::fs_open(h, &req, path, O_RDWR, 0)
+            .then([&](ssize_t f)
+            {
+                fd = uv_file(f);
+
+                return cgull::uv::fs_write(h, &req, fd, &write_buf, 1, 0);
+            })
+            .then([&](ssize_t written)
+            {
+                EXPECT_EQ(ssize_t(data.size()), written);
+
+                return cgull::uv::fs_read(h, &req, fd, &read_buf, 1, 0);
+            })
+            .then([&](ssize_t r)
+            {
+                EXPECT_EQ(ssize_t(data.size()), r);
+                EXPECT_EQ(data, read_back);
+
+                return cgull::uv::fs_close(h, &req, fd);
+            })
+            .then([&]()
+            {
+                done = true;
+            })
+            .rescue([&](ssize_t error)
+            {
+                ADD_FAILURE() << "uv error " << error;
+
+                done = true;
+            });
+
+        // continuations keep loop alive until the whole chain is done
+        uv_run(&loop, UV_RUN_DEFAULT);
+
+        EXPECT_TRUE(done);
+
+        // request not started is rejected right away
+        auto invalid = cgull::uv::fs_read(h, &req, fd, nullptr, 0, 0);
+
+        EXPECT_TRUE(invalid.is_rejected());
+        EXPECT_EQ(ssize_t(UV_EINVAL), std::any_cast<ssize_t>(invalid.value()));
+    }
+
+    uv_run(&loop, UV_RUN_DEFAULT);
+
+    EXPECT_EQ(0, uv_loop_close(&loop));
+
+    unlink(path);
+};
+
+
+TEST(uv_handler, queue_work)
+{
+    uv_loop_t loop;
+
+    ASSERT_EQ(0, uv_loop_init(&loop));
+
+    {
+        cgull::uv_handler h{ &loop };
+
+        uv_work_t ok_req, failed_req;
+        const auto loop_thread = std::this_thread::get_id();
+        std::thread::id work_thread;
+
+        auto ok = cgull::uv::queue_work(h, &ok_req, [&]() -> std::any
+        {
+            work_thread = std::this_thread::get_id();
+
+            return 42;
+        });
+        auto failed = cgull::uv::queue_work(h, &failed_req, []() -> std::any
+        {
+            throw std::runtime_error("failed");
+        });
+
+        uv_run(&loop, UV_RUN_DEFAULT);
+
+        ASSERT_TRUE(ok.is_resolved());
+        EXPECT_EQ(42, std::any_cast<int>(ok.value()));
+        EXPECT_NE(loop_thread, work_thread);
+        ASSERT_TRUE(failed.is_rejected());
+        EXPECT_TRUE(std::any_cast<std::exception_ptr>(failed.value()));
+    }
+
+    uv_run(&loop, UV_RUN_DEFAULT);
+
+    EXPECT_EQ(0, uv_loop_close(&loop));
+};
+#endif